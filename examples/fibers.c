@@ -0,0 +1,97 @@
+#include <comet.h>
+#include <signal.h>
+
+HttpcResponse* hello_world_handler(void* _s, HttpcRequest* req, UrlParams* _p) {
+    HttpcResponse* res = httpc_response_new("OK", 200);
+    httpc_response_set_body(res, "Hello, world!", 13);
+    httpc_add_header_v(&res->headers, "Content-Type", "text/plain");
+    return res;
+}
+
+// Pretends to wait for slow database - other requests are served in the meantime.
+HttpcResponse* slow_handler(void* _s, HttpcRequest* req, UrlParams* params) {
+    int ms = atoi(params->params[0].value);
+    comet_sleep(ms);
+
+    HttpcResponse* res = httpc_response_new("OK", 200);
+    httpc_add_header_f(&res->headers, "X-Slept-For", "%d", ms);
+    httpc_response_set_body(res, "Done sleeping", 13);
+    httpc_add_header_v(&res->headers, "Content-Type", "text/plain");
+    return res;
+}
+
+// Burns CPU for given time, like thumbnailing would. Runs on the offload pool, not on the network thread.
+HttpcResponse* busy_handler(void* _s, HttpcRequest* req, UrlParams* params) {
+    int ms = atoi(params->params[0].value);
+    uint64_t until = comet_now_ns() + (uint64_t)ms * 1000000;
+    volatile uint64_t spins = 0;
+    while (comet_now_ns() < until) {
+        spins++;
+    }
+
+    HttpcResponse* res = httpc_response_new("OK", 200);
+    httpc_response_set_body(res, "Done working", 12);
+    httpc_add_header_v(&res->headers, "Content-Type", "text/plain");
+    return res;
+}
+
+CometRouter* router;
+
+HttpcResponse* pool_stats_handler(void* _s, HttpcRequest* req, UrlParams* _p) {
+    CometOffloadStats stats = comet_offload_stats(router->offload);
+    uint64_t started = stats.completed + stats.running + stats.expired;
+
+    HttpcResponse* res = httpc_response_new("OK", 200);
+    CometBuffer* body = comet_buffer_new(0);
+    comet_buffer_appendf(body, "{\"threads\":%zu,\"queued\":%zu,\"running\":%zu,\"completed\":%llu,\"rejected\":%llu,"
+                         "\"expired\":%llu,\"avg_wait_ms\":%.3f,\"max_wait_ms\":%.3f}",
+                         stats.threads, stats.queued, stats.running, (unsigned long long)stats.completed,
+                         (unsigned long long)stats.rejected, (unsigned long long)stats.expired,
+                         started ? stats.total_wait_ns / 1e6 / started : 0.0, stats.max_wait_ns / 1e6);
+    comet_response_set_buffer(res, body);
+    httpc_add_header_v(&res->headers, "Content-Type", "application/json");
+    return res;
+}
+
+void sigint_handler(int sig) {
+    router->running = false;
+    puts("");
+    log_message(LOG_INFO, "Shutting down server...");
+}
+
+int main(void) {
+    comet_init(false, false);
+    signal(SIGINT, sigint_handler);
+
+    router = router_init(8080, NULL);
+    if (router == NULL) {
+        log_message(LOG_ERROR, "Failed to initialize router");
+        return 1;
+    }
+
+    router_enable_fibers(router, COMET_FIBER_DEFAULT_CONFIG);
+
+    // requests slower than half a second show up on stderr with per-phase timing
+    CometTraceConfig tracing = COMET_TRACE_DEFAULT_CONFIG;
+    tracing.slow_threshold_ms = 500;
+    router_enable_tracing(router, tracing);
+
+    // many requests share one connection: nghttp http://localhost:8080/sleep/1000 http://localhost:8080/sleep/1000
+    router_enable_h2(router, COMET_H2_DEFAULT_CONFIG);
+
+    router_add_route(router, "/", HTTPC_GET, hello_world_handler);
+    router_add_route(router, "/sleep/{ms}", HTTPC_GET, slow_handler);
+
+    CometOffloadConfig offload = COMET_OFFLOAD_DEFAULT_CONFIG;
+    offload.threads = 4;
+    offload.max_queued = 64;
+    router_enable_offload(router, offload);
+
+    int busy = router_add_route(router, "/busy/{ms}", HTTPC_GET, busy_handler);
+    router_set_route_offload(router, busy, true);
+    router_add_route(router, "/pool", HTTPC_GET, pool_stats_handler);
+
+    router_start(router);
+
+    return 0;
+}
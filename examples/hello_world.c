@@ -1,14 +1,18 @@
 #include <comet.h>
 #include <signal.h>
 
+CometRouter* router;
+
 struct state {
     int hello_count;
     int bye_count;
+    int beta_route;
 };
 
 HttpcResponse* hello_world_handler(void* _s, HttpcRequest* req, UrlParams* _p) {
     HttpcResponse* res = httpc_response_new("OK", 200);
-    httpc_response_set_body(res, "Hello, world!", 13);
+    // static string is sent as is, without copying
+    comet_response_borrow_body(res, "Hello, world!", 13, NULL, NULL);
     httpc_add_header_v(&res->headers, "Content-Type", "text/plain");
     return res;
 }
@@ -17,12 +21,17 @@ HttpcResponse* greeting_handler(void* _s, HttpcRequest* req, UrlParams* params)
     struct state* s = (struct state*)_s;
     HttpcResponse* res = httpc_response_new("OK", 200);
 
-    char* greeting = malloc(strlen(params->params[0].value) + 16);
-    sprintf(greeting, "Hello, %s x%d!", params->params[0].value, ++s->hello_count);
-    httpc_response_set_body(res, greeting, strlen(greeting));
+    // /hello/bob?greeting=Hi%20there
+    char word[64];
+    if (comet_query_get_decoded(req, "greeting", word, sizeof(word)) < 0) {
+        strcpy(word, "Hello");
+    }
+
+    CometBuffer* greeting = comet_buffer_new(0);
+    comet_buffer_appendf(greeting, "%s, %s x%d!", word, params->params[0].value, ++s->hello_count);
+    comet_response_set_buffer(res, greeting);
 
     httpc_add_header_v(&res->headers, "Content-Type", "text/plain");
-    free(greeting);
     return res;
 }
 
@@ -32,10 +41,10 @@ HttpcResponse* farewell_handler(void* _s, HttpcRequest* req, UrlParams* params)
 
     char* farewell = malloc(strlen(params->params[0].value) + 20);
     sprintf(farewell, "Goodbye, %s x%d!", params->params[0].value, ++s->bye_count);
-    httpc_response_set_body(res, farewell, strlen(farewell));
+    // response frees farewell once it is sent
+    comet_response_take_body(res, farewell, strlen(farewell));
 
     httpc_add_header_v(&res->headers, "Content-Type", "text/plain");
-    free(farewell);
     return res;
 }
 
@@ -58,13 +67,47 @@ HttpcResponse* wildcard_handler(void* _s, HttpcRequest* req, UrlParams* params)
     return res;
 }
 
+HttpcResponse* beta_handler(void* _s, HttpcRequest* req, UrlParams* _p) {
+    HttpcResponse* res = httpc_response_new("OK", 200);
+    comet_response_borrow_body(res, "Welcome to the beta!", 20, NULL, NULL);
+    httpc_add_header_v(&res->headers, "Content-Type", "text/plain");
+    return res;
+}
+
+// /admin/beta/on, /admin/beta/off - routes can be switched while the server runs
+HttpcResponse* beta_toggle_handler(void* _s, HttpcRequest* req, UrlParams* params) {
+    struct state* s = (struct state*)_s;
+    bool enable = strcmp(params->params[0].value, "on") == 0;
+    router_set_route_enabled(router, s->beta_route, enable);
+
+    HttpcResponse* res = httpc_response_new("OK", 200);
+    httpc_response_set_body(res, enable ? "beta on" : "beta off", enable ? 7 : 8);
+    httpc_add_header_v(&res->headers, "Content-Type", "text/plain");
+    return res;
+}
+
+// memory held by connections right now, also written to the log
+HttpcResponse* memory_handler(void* _s, HttpcRequest* req, UrlParams* _p) {
+    comet_memory_log(&router->memory);
+
+    const CometMemoryStats* stats = &router->memory.stats;
+    HttpcResponse* res = httpc_response_new("OK", 200);
+    CometBuffer* body = comet_buffer_new(0);
+    comet_buffer_appendf(body, "{\"total\":%zu,\"peak\":%zu,\"open\":%zu", stats->total, stats->peak_total, stats->connections);
+    for (int i = 0; i < COMET_MEM_CATEGORY_COUNT; i++) {
+        comet_buffer_appendf(body, ",\"%s\":%zu", comet_memory_category_name(i), stats->current[i]);
+    }
+    comet_buffer_append_str(body, "}");
+    comet_response_set_buffer(res, body);
+    httpc_add_header_v(&res->headers, "Content-Type", "application/json");
+    return res;
+}
+
 HttpcRequest* logging_middleware(void* _s, HttpcRequest* req, UrlParams* _) {
     log_message(LOG_INFO, "Received %s request for %s", httpc_method_to_string(req->method), req->url);
     return req;
 }
 
-CometRouter* router;
-
 void sigint_handler(int sig) {
     router->running = false;
     puts("");
@@ -75,7 +118,7 @@ int main(void) {
     comet_init(false, false);
     signal(SIGINT, sigint_handler);
 
-    struct state s = {0, 0};
+    struct state s = {0, 0, -1};
     
     router = router_init(8080, &s);
     if (router == NULL) {
@@ -87,12 +130,21 @@ int main(void) {
     cors_config.allowed_methods = "GET";
     router_set_cors_policy(router, cors_config);
 
+    // nothing here takes uploads - refuse anything bigger than 64 KiB, and keep all requests together under 64 MiB
+    CometMemoryConfig memory = COMET_MEMORY_DEFAULT_CONFIG;
+    memory.connection_budget = 64 * 1024;
+    memory.global_budget = 64 * 1024 * 1024;
+    router_set_memory_budget(router, memory);
+
     router_add_route(router, "/", HTTPC_GET, hello_world_handler);
     router_add_route(router, "/hello/{name}", HTTPC_GET, greeting_handler);
     router_add_route(router, "/whoops/*", HTTPC_GET, wildcard_handler);
     router_add_route(router, "/{name}/bye", HTTPC_GET, farewell_handler);
+    s.beta_route = router_add_route_disabled(router, "/beta", HTTPC_GET, beta_handler);
+    router_add_route(router, "/admin/beta/{state}", HTTPC_POST, beta_toggle_handler);
+    router_add_route(router, "/admin/memory", HTTPC_GET, memory_handler);
 
-    for (size_t i = 0; i < router->num_routes; i++) {
+    for (size_t i = 0; i < router->routes->num_routes; i++) {
         router_add_middleware(router, i, logging_middleware);
     }
 
@@ -0,0 +1,76 @@
+#include <comet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Router throughput without the network: requests come from memory, responses are checked and dropped.
+// ./loopback_bench [requests] [fibers]
+
+struct results {
+    size_t ok;
+    size_t failed;
+};
+
+HttpcResponse* hello_world_handler(void* _s, HttpcRequest* req, UrlParams* _p) {
+    HttpcResponse* res = httpc_response_new("OK", 200);
+    comet_response_borrow_body(res, "Hello, world!", 13, NULL, NULL);
+    httpc_add_header_v(&res->headers, "Content-Type", "text/plain");
+    return res;
+}
+
+HttpcResponse* user_handler(void* _s, HttpcRequest* req, UrlParams* params) {
+    HttpcResponse* res = httpc_response_new("OK", 200);
+    CometBuffer* body = comet_buffer_new(0);
+    comet_buffer_appendf(body, "{\"id\":%s}", params->params[0].value);
+    comet_response_set_buffer(res, body);
+    httpc_add_header_v(&res->headers, "Content-Type", "application/json");
+    return res;
+}
+
+void on_response(void* ctx, size_t id, const char* response, size_t len) {
+    struct results* results = ctx;
+    if (len > 12 && memcmp(response, "HTTP/1.1 200", 12) == 0) {
+        results->ok++;
+    } else {
+        results->failed++;
+    }
+}
+
+int main(int argc, char** argv) {
+    size_t requests = argc > 1 ? strtoul(argv[1], NULL, 10) : 200000;
+    bool fibers = argc > 2 && atoi(argv[2]) != 0;
+
+    comet_init(false, false);
+
+    struct results results = {0};
+    NetLoopback* lb = net_loopback_new(on_response, &results);
+
+    static const char HELLO[] = "GET / HTTP/1.1\r\nHost: localhost\r\nUser-Agent: bench\r\n\r\n";
+    static const char USER[] = "GET /users/42?fields=all HTTP/1.1\r\nHost: localhost\r\nAccept: application/json\r\n\r\n";
+    net_loopback_push(lb, HELLO, sizeof(HELLO) - 1, requests / 2);
+    net_loopback_push(lb, USER, sizeof(USER) - 1, requests - requests / 2);
+
+    CometRouter* router = router_init_transport(&NET_LOOPBACK_TRANSPORT, lb, NULL);
+    if (router == NULL) {
+        log_message(LOG_ERROR, "Failed to initialize router");
+        return 1;
+    }
+    if (fibers) {
+        router_enable_fibers(router, COMET_FIBER_DEFAULT_CONFIG);
+    }
+
+    router_add_route(router, "/", HTTPC_GET, hello_world_handler);
+    router_add_route(router, "/users/{id}", HTTPC_GET, user_handler);
+
+    net_loopback_stop_when_done(lb, &router->running);
+
+    uint64_t start = comet_now_ns();
+    router_start(router);
+    double seconds = (comet_now_ns() - start) / 1e9;
+
+    printf("%zu requests (%zu ok, %zu failed) in %.3f s - %.0f req/s\n",
+           requests, results.ok, results.failed, seconds, requests / seconds);
+
+    net_loopback_free(lb);
+    return results.failed == 0 ? 0 : 1;
+}
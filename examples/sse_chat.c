@@ -0,0 +1,51 @@
+#include <comet.h>
+#include <signal.h>
+#include <string.h>
+
+// Body of POST /publish/{topic} goes to every client of GET /events/{topic}:
+//   curl -N localhost:8080/events/news
+//   curl -d 'hello' localhost:8080/publish/news
+HttpcResponse* publish_handler(void* state, HttpcRequest* req, UrlParams* params) {
+    CometSseHub* hub = state;
+
+    char* data = strndup(req->body ? req->body : "", req->body_size);
+    size_t delivered = comet_sse_publish(hub, params->params[0].value, "chat", data);
+    free(data);
+
+    HttpcResponse* res = httpc_response_new("OK", 200);
+    httpc_add_header_f(&res->headers, "X-Delivered-To", "%zu", delivered);
+    return res;
+}
+
+CometRouter* router;
+
+void sigint_handler(int sig) {
+    router->running = false;
+    puts("");
+    log_message(LOG_INFO, "Shutting down server...");
+}
+
+int main(void) {
+    comet_init(false, false);
+    signal(SIGINT, sigint_handler);
+
+    CometSseHub* hub = comet_sse_hub_new(COMET_SSE_DEFAULT_CONFIG);
+    if (hub == NULL) {
+        log_message(LOG_ERROR, "Failed to create SSE hub");
+        return 1;
+    }
+
+    router = router_init(8080, hub);
+    if (router == NULL) {
+        log_message(LOG_ERROR, "Failed to initialize router");
+        comet_sse_hub_free(hub);
+        return 1;
+    }
+
+    router_add_sse(router, "/events/{topic}", hub);
+    router_add_route(router, "/publish/{topic}", HTTPC_POST, publish_handler);
+
+    router_start(router);
+
+    return 0;
+}
@@ -0,0 +1,47 @@
+#include <comet.h>
+#include <signal.h>
+
+void echo_open(CometWebSocket* ws) {
+    log_message(LOG_INFO, "WebSocket client connected");
+}
+
+void echo_message(CometWebSocket* ws, const uint8_t* data, size_t len, bool is_text) {
+    if (is_text) {
+        comet_ws_send_text(ws, (const char*)data, len);
+    } else {
+        comet_ws_send_binary(ws, data, len);
+    }
+}
+
+void echo_close(CometWebSocket* ws, uint16_t code) {
+    log_message(LOG_INFO, "WebSocket client disconnected (%d)", code);
+}
+
+CometRouter* router;
+
+void sigint_handler(int sig) {
+    router->running = false;
+    puts("");
+    log_message(LOG_INFO, "Shutting down server...");
+}
+
+int main(void) {
+    comet_init(false, false);
+    signal(SIGINT, sigint_handler);
+
+    router = router_init(8080, NULL);
+    if (router == NULL) {
+        log_message(LOG_ERROR, "Failed to initialize router");
+        return 1;
+    }
+
+    CometWebSocketConfig echo = COMET_WEBSOCKET_DEFAULT_CONFIG;
+    echo.on_open = echo_open;
+    echo.on_message = echo_message;
+    echo.on_close = echo_close;
+    router_add_websocket(router, "/echo", echo);
+
+    router_start(router);
+
+    return 0;
+}
@@ -2,6 +2,18 @@
 #define _COMET_H
 
 #include "../src/include/router.h"
+#include "../src/include/fiber.h"
+#include "../src/include/proxy.h"
+#include "../src/include/websocket.h"
+#include "../src/include/sse.h"
+#include "../src/include/trace.h"
+#include "../src/include/h2.h"
+#include "../src/include/tls.h"
+#include "../src/include/loopback.h"
+#include "../src/include/offload.h"
+#include "../src/include/memstats.h"
+#include "../src/include/body.h"
+#include "../src/include/query.h"
 #include "../src/include/config.h"
 #include "../src/include/logger.h"
 
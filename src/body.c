@@ -0,0 +1,457 @@
+#include "include/body.h"
+#include "include/fiber.h"
+#include "include/atomics.h"
+#include "include/logger.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#define BUFFER_POOL_MAX 64
+#define BUFFER_POOL_MAX_CAP (64 * 1024)
+#define BUFFER_MIN_CAP 512
+
+// Attached bodies are kept in a registry owned by comet. Response's httpc body holds only a handle - the
+// registry slot and the entry in it - and it counts only if the registry agrees, so bytes a handler put
+// in the body itself, e.g. copied from the request, are never taken for an attached body.
+typedef struct {
+    size_t slot;
+    ResponseBody* entry;
+} BodyHandle;
+
+// Shared by all threads - offloaded handlers attach bodies that the network thread sends.
+static struct {
+    ResponseBody** slots;
+    size_t* free_slots;         // indexes of NULL slots
+    size_t num_free;
+    size_t cap;
+    volatile long lock;
+} registry = {0};
+
+// Per thread, so that handlers on offload workers can build bodies without locking. Buffer goes back
+// to the pool of the thread that frees it, usually the router's, once the response is sent.
+static COMET_THREAD_LOCAL struct {
+    CometBuffer* free_list;
+    size_t count;
+} pool;
+
+static void registry_lock(void) {
+    while (comet_atomic_exchange_long(&registry.lock, 1) != 0) {
+        comet_thread_yield();
+    }
+}
+
+static void registry_unlock(void) {
+    comet_atomic_exchange_long(&registry.lock, 0);
+}
+
+// Caller holds registry lock.
+static bool registry_add(ResponseBody* entry, size_t* out_slot) {
+    if (registry.num_free == 0) {
+        size_t new_cap = registry.cap ? registry.cap * 2 : 64;
+        ResponseBody** slots = realloc(registry.slots, new_cap * sizeof(ResponseBody*));
+        if (slots == NULL) {
+            return false;
+        }
+        registry.slots = slots;
+        size_t* free_slots = realloc(registry.free_slots, new_cap * sizeof(size_t));
+        if (free_slots == NULL) {
+            return false;
+        }
+        registry.free_slots = free_slots;
+
+        // lowest slots on top of the stack
+        for (size_t i = new_cap; i-- > registry.cap;) {
+            registry.slots[i] = NULL;
+            registry.free_slots[registry.num_free++] = i;
+        }
+        registry.cap = new_cap;
+    }
+
+    size_t slot = registry.free_slots[--registry.num_free];
+    registry.slots[slot] = entry;
+    *out_slot = slot;
+    return true;
+}
+
+// Caller holds registry lock.
+static void registry_remove(size_t slot) {
+    registry.slots[slot] = NULL;
+    registry.free_slots[registry.num_free++] = slot;
+}
+
+/**
+ * Detach registry entry of body attached to res. Handle is only compared against the registry, entry
+ * it names is never touched unless the registry holds it for this very response.
+ */
+static ResponseBody* attached_body_detach(HttpcResponse* res) {
+    if (res->body == NULL || res->body_size != sizeof(BodyHandle)) {
+        return NULL;
+    }
+
+    BodyHandle handle;
+    memcpy(&handle, res->body, sizeof(BodyHandle));
+
+    ResponseBody* entry = NULL;
+    registry_lock();
+    if (handle.slot < registry.cap && handle.entry != NULL && registry.slots[handle.slot] == handle.entry &&
+        handle.entry->res == res) {
+        entry = handle.entry;
+        registry_remove(handle.slot);
+    }
+    registry_unlock();
+    return entry;
+}
+
+static bool attach(HttpcResponse* res, const void* data, size_t len, body_release_func release, void* release_ctx, int file_fd, uint64_t file_offset) {
+    ResponseBody previous;
+    if (response_body_take(res, &previous)) {
+        response_body_release(&previous);
+    }
+
+    ResponseBody* entry = malloc(sizeof(ResponseBody));
+    if (entry == NULL) {
+        log_message(LOG_ERROR, "Failed to allocate memory for response body");
+        return false;
+    }
+    entry->res = res;
+    entry->data = data;
+    entry->len = len;
+    entry->release = release;
+    entry->release_ctx = release_ctx;
+    entry->file_fd = file_fd;
+    entry->file_offset = file_offset;
+
+    BodyHandle handle = {0, entry};
+    registry_lock();
+    bool added = registry_add(entry, &handle.slot);
+    registry_unlock();
+    if (!added) {
+        log_message(LOG_ERROR, "Failed to allocate memory for response body");
+        free(entry);
+        return false;
+    }
+
+    httpc_response_set_body(res, &handle, sizeof(BodyHandle));
+    if (res->body_size != sizeof(BodyHandle)) {
+        log_message(LOG_ERROR, "Failed to allocate memory for response body");
+        registry_lock();
+        registry_remove(handle.slot);
+        registry_unlock();
+        free(entry);
+        return false;
+    }
+    return true;
+}
+
+bool response_body_take(HttpcResponse* res, ResponseBody* out) {
+    ResponseBody* entry = attached_body_detach(res);
+    if (entry == NULL) {
+        return false;
+    }
+
+    *out = *entry;
+    free(entry);
+    httpc_response_set_body(res, "", 0);
+    return true;
+}
+
+void comet_response_free(HttpcResponse* res) {
+    if (!res) {
+        return;
+    }
+
+    ResponseBody body;
+    if (response_body_take(res, &body)) {
+        response_body_release(&body);
+    }
+    httpc_response_free(res);
+}
+
+void response_body_release(ResponseBody* body) {
+    if (body->release) {
+        body->release(body->release_ctx, body->data, body->len);
+    }
+}
+
+static void release_malloced(void* ctx, const void* data, size_t len) {
+    free(ctx);
+}
+
+bool comet_response_take_body(HttpcResponse* res, void* data, size_t len) {
+    if (!res) {
+        log_message(LOG_ERROR, "Response is NULL");
+        free(data);
+        return false;
+    }
+
+    if (!attach(res, data, len, release_malloced, data, -1, 0)) {
+        free(data);
+        return false;
+    }
+    return true;
+}
+
+bool comet_response_borrow_body(HttpcResponse* res, const void* data, size_t len, body_release_func release, void* release_ctx) {
+    if (!res || (!data && len > 0)) {
+        log_message(LOG_ERROR, "Invalid arguments to comet_response_borrow_body");
+        if (release) release(release_ctx, data, len);
+        return false;
+    }
+
+    if (!attach(res, data, len, release, release_ctx, -1, 0)) {
+        if (release) release(release_ctx, data, len);
+        return false;
+    }
+    return true;
+}
+
+static void close_file(void* ctx, const void* data, size_t len) {
+#ifdef _WIN32
+    _close((int)(intptr_t)ctx);
+#else
+    close((int)(intptr_t)ctx);
+#endif
+}
+
+bool response_body_load(ResponseBody* body) {
+    if (body->file_fd < 0) {
+        return true;
+    }
+
+    char* data = malloc(body->len ? body->len : 1);
+    if (data == NULL) {
+        log_message(LOG_ERROR, "Failed to allocate memory for file body");
+        return false;
+    }
+
+    size_t loaded = 0;
+    while (loaded < body->len) {
+        ByteCount n = comet_file_read(body->file_fd, data + loaded, body->len - loaded, body->file_offset + loaded);
+        if (n <= 0) {
+            log_message(LOG_ERROR, "Failed to read file body");
+            free(data);
+            return false;
+        }
+        loaded += n;
+    }
+
+    response_body_release(body);
+    body->data = data;
+    body->release = release_malloced;
+    body->release_ctx = data;
+    body->file_fd = -1;
+    return true;
+}
+
+bool comet_response_send_file(HttpcResponse* res, int fd, uint64_t offset, size_t len) {
+    if (!res || fd < 0) {
+        log_message(LOG_ERROR, "Invalid arguments to comet_response_send_file");
+        if (fd >= 0) close_file((void*)(intptr_t)fd, NULL, 0);
+        return false;
+    }
+
+    if (!attach(res, NULL, len, close_file, (void*)(intptr_t)fd, fd, offset)) {
+        close_file((void*)(intptr_t)fd, NULL, 0);
+        return false;
+    }
+    return true;
+}
+
+CometBuffer* comet_buffer_new(size_t size_hint) {
+    CometBuffer* buf = pool.free_list;
+    if (buf) {
+        pool.free_list = buf->next;
+        pool.count--;
+    } else {
+        buf = calloc(1, sizeof(CometBuffer));
+        if (buf == NULL) {
+            log_message(LOG_ERROR, "Failed to allocate memory for buffer");
+            return NULL;
+        }
+    }
+
+    buf->len = 0;
+    buf->failed = false;
+    buf->next = NULL;
+
+    if (size_hint > buf->cap) {
+        char* data = realloc(buf->data, size_hint);
+        if (data == NULL) {
+            log_message(LOG_ERROR, "Failed to allocate memory for buffer");
+            free(buf->data);
+            free(buf);
+            return NULL;
+        }
+        buf->data = data;
+        buf->cap = size_hint;
+    }
+
+    return buf;
+}
+
+void comet_buffer_free(CometBuffer* buf) {
+    if (!buf) {
+        return;
+    }
+
+    // huge buffers would pin memory of one unusual response forever
+    if (pool.count >= BUFFER_POOL_MAX || buf->cap > BUFFER_POOL_MAX_CAP) {
+        free(buf->data);
+        free(buf);
+        return;
+    }
+
+    buf->next = pool.free_list;
+    pool.free_list = buf;
+    pool.count++;
+}
+
+void buffer_pool_clear(void) {
+    while (pool.free_list) {
+        CometBuffer* buf = pool.free_list;
+        pool.free_list = buf->next;
+        free(buf->data);
+        free(buf);
+    }
+    pool.count = 0;
+}
+
+bool comet_buffer_reserve(CometBuffer* buf, size_t extra) {
+    if (buf->failed) {
+        return false;
+    }
+    if (buf->cap - buf->len >= extra) {
+        return true;
+    }
+
+    size_t new_cap = buf->cap ? buf->cap : BUFFER_MIN_CAP;
+    while (new_cap - buf->len < extra) {
+        new_cap *= 2;
+    }
+
+    char* data = realloc(buf->data, new_cap);
+    if (data == NULL) {
+        log_message(LOG_ERROR, "Failed to grow buffer to %zu bytes", new_cap);
+        buf->failed = true;
+        return false;
+    }
+    buf->data = data;
+    buf->cap = new_cap;
+    return true;
+}
+
+bool comet_buffer_append(CometBuffer* buf, const void* data, size_t len) {
+    if (!comet_buffer_reserve(buf, len)) {
+        return false;
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    return true;
+}
+
+bool comet_buffer_append_str(CometBuffer* buf, const char* str) {
+    return comet_buffer_append(buf, str, strlen(str));
+}
+
+bool comet_buffer_vappendf(CometBuffer* buf, const char* fmt, va_list args) {
+    if (buf->failed) {
+        return false;
+    }
+
+    // try to format into space that's already there, grow only if it didn't fit
+    va_list retry;
+    va_copy(retry, args);
+    size_t space = buf->cap - buf->len;
+    int needed = vsnprintf(space ? buf->data + buf->len : NULL, space, fmt, args);
+    if (needed < 0) {
+        va_end(retry);
+        buf->failed = true;
+        return false;
+    }
+
+    if ((size_t)needed >= space) {
+        if (!comet_buffer_reserve(buf, (size_t)needed + 1)) {
+            va_end(retry);
+            return false;
+        }
+        vsnprintf(buf->data + buf->len, buf->cap - buf->len, fmt, retry);
+    }
+    va_end(retry);
+
+    buf->len += needed;
+    return true;
+}
+
+bool comet_buffer_appendf(CometBuffer* buf, const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    bool result = comet_buffer_vappendf(buf, fmt, args);
+    va_end(args);
+    return result;
+}
+
+bool comet_buffer_append_json_string(CometBuffer* buf, const char* str, size_t len) {
+    static const char HEX[] = "0123456789abcdef";
+
+    // worst case every byte becomes \u00XX
+    if (!comet_buffer_reserve(buf, len * 6 + 2)) {
+        return false;
+    }
+
+    char* out = buf->data + buf->len;
+    *out++ = '"';
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = str[i];
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            *out++ = c;
+            continue;
+        }
+
+        *out++ = '\\';
+        switch (c) {
+            case '"':  *out++ = '"'; break;
+            case '\\': *out++ = '\\'; break;
+            case '\n': *out++ = 'n'; break;
+            case '\r': *out++ = 'r'; break;
+            case '\t': *out++ = 't'; break;
+            case '\b': *out++ = 'b'; break;
+            case '\f': *out++ = 'f'; break;
+            default:
+                *out++ = 'u';
+                *out++ = '0';
+                *out++ = '0';
+                *out++ = HEX[c >> 4];
+                *out++ = HEX[c & 0xf];
+        }
+    }
+    *out++ = '"';
+
+    buf->len = out - buf->data;
+    return true;
+}
+
+static void release_buffer(void* ctx, const void* data, size_t len) {
+    comet_buffer_free(ctx);
+}
+
+bool comet_response_set_buffer(HttpcResponse* res, CometBuffer* buf) {
+    if (!res || !buf) {
+        log_message(LOG_ERROR, "Response or buffer is NULL");
+        comet_buffer_free(buf);
+        return false;
+    }
+
+    if (buf->failed) {
+        log_message(LOG_ERROR, "Buffer is incomplete, not attaching it to response");
+        comet_buffer_free(buf);
+        return false;
+    }
+
+    return comet_response_borrow_body(res, buf->data, buf->len, release_buffer, buf);
+}
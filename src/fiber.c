@@ -0,0 +1,691 @@
+#if defined(__APPLE__)
+#define _XOPEN_SOURCE 700 // ucontext
+#define _DARWIN_C_SOURCE  // MAP_ANON with _XOPEN_SOURCE
+#endif
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // MAP_STACK
+#endif
+
+#include "include/fiber.h"
+#include "include/netplat.h"
+#include "include/atomics.h"
+#include "include/logger.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <time.h>
+#else
+#include <io.h>
+#endif
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+const CometFiberConfig COMET_FIBER_DEFAULT_CONFIG = {
+    .stack_size = 64 * 1024,
+    .max_fibers = 4096,
+};
+
+struct CometFiber {
+#ifdef _WIN32
+    LPVOID handle;
+#else
+    ucontext_t context;
+    void* stack;
+    size_t stack_len;
+#endif
+    fiber_func fn;
+    void* arg;
+
+    NetSocket wait_fd;      // SOCKET_ERROR for plain sleep
+    short wait_events;
+    short revents;
+    uint64_t deadline_ms;   // 0 for no deadline
+    size_t wait_index;      // position in sched.waiting, SIZE_MAX when not suspended
+
+    struct CometFiber* next;
+};
+
+// Every thread has its own scheduler. Only the router's thread ever initializes one - on other threads,
+// offload workers included, nothing runs in a fiber and fiber primitives block the calling thread instead.
+static COMET_THREAD_LOCAL struct {
+    bool initialized;
+    CometFiberConfig config;
+#ifdef _WIN32
+    LPVOID main_handle;
+#else
+    ucontext_t main_context;
+#endif
+    CometFiber* current;
+
+    CometFiber* ready_head;
+    CometFiber* ready_tail;
+    CometFiber* free_list;
+
+    // suspended fibers, pollfds[i] belongs to waiting[i]
+    CometFiber** waiting;
+    struct pollfd* pollfds;
+    size_t num_waiting;
+    size_t cap_waiting;
+
+    size_t num_active;
+    size_t num_allocated;
+} sched;
+
+uint64_t comet_now_ms(void) {
+#ifdef _WIN32
+    return GetTickCount64();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+static void switch_to_scheduler(CometFiber* self) {
+#ifdef _WIN32
+    (void)self;
+    SwitchToFiber(sched.main_handle);
+#else
+    swapcontext(&self->context, &sched.main_context);
+#endif
+}
+
+static void switch_to_fiber(CometFiber* fiber) {
+    sched.current = fiber;
+#ifdef _WIN32
+    SwitchToFiber(fiber->handle);
+#else
+    swapcontext(&sched.main_context, &fiber->context);
+#endif
+    sched.current = NULL;
+}
+
+// Fibers never return - after finishing a task they park on the free list
+// and pick up the next one, so stacks and contexts are set up only once.
+#ifdef _WIN32
+static void WINAPI fiber_entry(LPVOID param) {
+    CometFiber* self = param;
+#else
+static void fiber_entry(void) {
+    CometFiber* self = sched.current;
+#endif
+    for (;;) {
+        self->fn(self->arg);
+
+        self->fn = NULL;
+        self->arg = NULL;
+        self->next = sched.free_list;
+        sched.free_list = self;
+        sched.num_active--;
+
+        switch_to_scheduler(self);
+    }
+}
+
+static CometFiber* fiber_create(void) {
+    CometFiber* fiber = calloc(1, sizeof(CometFiber));
+    if (fiber == NULL) {
+        log_message(LOG_ERROR, "Failed to allocate memory for fiber");
+        return NULL;
+    }
+
+#ifdef _WIN32
+    fiber->handle = CreateFiber(sched.config.stack_size, fiber_entry, fiber);
+    if (fiber->handle == NULL) {
+        log_message(LOG_ERROR, "Failed to create fiber: %lu", GetLastError());
+        free(fiber);
+        return NULL;
+    }
+#else
+    // one guard page below the stack turns overflow into a crash instead of silent corruption
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t stack_size = (sched.config.stack_size + page_size - 1) / page_size * page_size;
+    fiber->stack_len = stack_size + page_size;
+
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_STACK
+    flags |= MAP_STACK;
+#endif
+    fiber->stack = mmap(NULL, fiber->stack_len, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (fiber->stack == MAP_FAILED) {
+        log_message(LOG_ERROR, "Failed to allocate fiber stack: %s", strerror(errno));
+        free(fiber);
+        return NULL;
+    }
+    mprotect(fiber->stack, page_size, PROT_NONE);
+
+    getcontext(&fiber->context);
+    fiber->context.uc_stack.ss_sp = (char*)fiber->stack + page_size;
+    fiber->context.uc_stack.ss_size = stack_size;
+    fiber->context.uc_link = NULL;
+    makecontext(&fiber->context, fiber_entry, 0);
+#endif
+
+    sched.num_allocated++;
+    return fiber;
+}
+
+static void fiber_destroy(CometFiber* fiber) {
+#ifdef _WIN32
+    DeleteFiber(fiber->handle);
+#else
+    munmap(fiber->stack, fiber->stack_len);
+#endif
+    free(fiber);
+    sched.num_allocated--;
+}
+
+static void ready_push(CometFiber* fiber) {
+    fiber->next = NULL;
+    if (sched.ready_tail) {
+        sched.ready_tail->next = fiber;
+    } else {
+        sched.ready_head = fiber;
+    }
+    sched.ready_tail = fiber;
+}
+
+static CometFiber* ready_pop(void) {
+    CometFiber* fiber = sched.ready_head;
+    if (fiber) {
+        sched.ready_head = fiber->next;
+        if (sched.ready_head == NULL) {
+            sched.ready_tail = NULL;
+        }
+        fiber->next = NULL;
+    }
+    return fiber;
+}
+
+static bool waiting_push(CometFiber* fiber) {
+    if (sched.num_waiting == sched.cap_waiting) {
+        size_t new_cap = sched.cap_waiting ? sched.cap_waiting * 2 : 64;
+        CometFiber** new_waiting = realloc(sched.waiting, new_cap * sizeof(CometFiber*));
+        if (new_waiting == NULL) {
+            return false;
+        }
+        sched.waiting = new_waiting;
+
+        struct pollfd* new_pollfds = realloc(sched.pollfds, new_cap * sizeof(struct pollfd));
+        if (new_pollfds == NULL) {
+            return false;
+        }
+        sched.pollfds = new_pollfds;
+        sched.cap_waiting = new_cap;
+    }
+
+    fiber->wait_index = sched.num_waiting;
+    sched.waiting[sched.num_waiting] = fiber;
+    sched.pollfds[sched.num_waiting].fd = fiber->wait_fd;
+    sched.pollfds[sched.num_waiting].events = fiber->wait_events;
+    sched.pollfds[sched.num_waiting].revents = 0;
+    sched.num_waiting++;
+    return true;
+}
+
+static void waiting_remove(size_t index) {
+    sched.waiting[index]->wait_index = SIZE_MAX;
+    sched.num_waiting--;
+    if (index != sched.num_waiting) {
+        sched.waiting[index] = sched.waiting[sched.num_waiting];
+        sched.pollfds[index] = sched.pollfds[sched.num_waiting];
+        sched.waiting[index]->wait_index = index;
+    }
+}
+
+bool fiber_scheduler_init(CometFiberConfig config) {
+    if (sched.initialized) {
+        log_message(LOG_WARN, "Fiber scheduler is already initialized");
+        return true;
+    }
+
+    memset(&sched, 0, sizeof(sched));
+    sched.config = config;
+
+#ifdef _WIN32
+    sched.main_handle = ConvertThreadToFiber(NULL);
+    if (sched.main_handle == NULL) {
+        log_message(LOG_ERROR, "Failed to convert thread to fiber: %lu", GetLastError());
+        return false;
+    }
+#endif
+
+    sched.initialized = true;
+    return true;
+}
+
+void fiber_scheduler_deinit(void) {
+    if (!sched.initialized) {
+        return;
+    }
+
+    if (sched.num_active > 0) {
+        log_message(LOG_WARN, "Deinitializing fiber scheduler with %zu fibers still running", sched.num_active);
+    }
+
+    // only parked fibers can be destroyed safely, suspended ones are leaked on purpose
+    while (sched.free_list) {
+        CometFiber* next = sched.free_list->next;
+        fiber_destroy(sched.free_list);
+        sched.free_list = next;
+    }
+
+    free(sched.waiting);
+    free(sched.pollfds);
+#ifdef _WIN32
+    ConvertFiberToThread();
+#endif
+    memset(&sched, 0, sizeof(sched));
+}
+
+bool fiber_spawn(fiber_func fn, void* arg) {
+    if (!sched.initialized) {
+        log_message(LOG_ERROR, "Fiber scheduler is not initialized");
+        return false;
+    }
+
+    if (sched.num_active >= sched.config.max_fibers) {
+        return false;
+    }
+
+    CometFiber* fiber = sched.free_list;
+    if (fiber) {
+        sched.free_list = fiber->next;
+    } else {
+        fiber = fiber_create();
+        if (fiber == NULL) {
+            return false;
+        }
+    }
+
+    fiber->fn = fn;
+    fiber->arg = arg;
+    fiber->wait_index = SIZE_MAX;
+    sched.num_active++;
+    ready_push(fiber);
+    return true;
+}
+
+size_t fiber_active_count(void) {
+    return sched.num_active;
+}
+
+bool comet_in_fiber(void) {
+    return sched.current != NULL;
+}
+
+CometFiber* fiber_self(void) {
+    return sched.current;
+}
+
+void fiber_wake(CometFiber* fiber) {
+    if (fiber == NULL || fiber->wait_index == SIZE_MAX) {
+        return;
+    }
+    if (fiber->wait_index >= sched.num_waiting || sched.waiting[fiber->wait_index] != fiber) {
+        log_message(LOG_ERROR, "Fiber can be woken only from the thread that runs it");
+        return;
+    }
+
+    fiber->revents = 0;
+    waiting_remove(fiber->wait_index);
+    ready_push(fiber);
+}
+
+static void run_ready(void) {
+    // fibers readied while running this batch wait for the next pass, so a fiber that keeps
+    // yielding can't starve the poll below
+    CometFiber* batch_tail = sched.ready_tail;
+    CometFiber* fiber;
+
+    while (batch_tail && (fiber = ready_pop()) != NULL) {
+        bool last = fiber == batch_tail;
+        switch_to_fiber(fiber);
+        if (last) {
+            break;
+        }
+    }
+}
+
+void fiber_scheduler_run_once(int timeout_ms) {
+    run_ready();
+
+    uint64_t now = comet_now_ms();
+    if (sched.ready_head) {
+        timeout_ms = 0;
+    }
+    for (size_t i = 0; i < sched.num_waiting; i++) {
+        uint64_t deadline = sched.waiting[i]->deadline_ms;
+        if (deadline != 0) {
+            int until = deadline > now ? (int)(deadline - now) : 0;
+            if (timeout_ms < 0 || until < timeout_ms) {
+                timeout_ms = until;
+            }
+        }
+    }
+
+    if (sched.num_waiting == 0) {
+        if (timeout_ms > 0 && sched.ready_head == NULL) {
+            comet_sleep(timeout_ms);
+        }
+        return;
+    }
+
+    int ret = POLL_SOCKETS(sched.pollfds, sched.num_waiting, timeout_ms);
+    if (ret == SOCKET_ERROR && GET_ERROR_CODE() != COMET_ERROR_CANCELLED) {
+        log_message(LOG_ERROR, "Failed to poll fiber events: %s", GET_ERROR_STR());
+    }
+
+    now = comet_now_ms();
+    for (size_t i = 0; i < sched.num_waiting;) {
+        CometFiber* fiber = sched.waiting[i];
+        short revents = ret > 0 ? sched.pollfds[i].revents : 0;
+
+        if (revents == 0 && (fiber->deadline_ms == 0 || fiber->deadline_ms > now)) {
+            i++;
+            continue;
+        }
+
+        fiber->revents = revents;
+        waiting_remove(i);
+        ready_push(fiber);
+    }
+
+    run_ready();
+}
+
+short comet_wait_fd(NetSocket fd, short events, int timeout_ms) {
+    CometFiber* self = sched.current;
+
+    if (self == NULL) {
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = events;
+        pfd.revents = 0;
+
+        int ret;
+        do {
+            ret = POLL_SOCKETS(&pfd, 1, timeout_ms);
+        } while (ret == SOCKET_ERROR && GET_ERROR_CODE() == COMET_ERROR_CANCELLED);
+
+        return ret > 0 ? pfd.revents : 0;
+    }
+
+    self->wait_fd = fd;
+    self->wait_events = events;
+    self->revents = 0;
+    self->deadline_ms = timeout_ms >= 0 ? comet_now_ms() + timeout_ms : 0;
+    if (!waiting_push(self)) {
+        log_message(LOG_ERROR, "Failed to allocate memory for fiber wait list");
+        return 0;
+    }
+
+    switch_to_scheduler(self);
+    return self->revents;
+}
+
+void comet_sleep(int ms) {
+    if (sched.current == NULL) {
+#ifdef _WIN32
+        Sleep(ms);
+#else
+        struct timespec ts = {ms / 1000, (long)(ms % 1000) * 1000000};
+        while (nanosleep(&ts, &ts) == -1 && errno == EINTR);
+#endif
+        return;
+    }
+
+    // negative fds are ignored by poll, so sleeping fiber waits only for its deadline
+    comet_wait_fd(SOCKET_ERROR, 0, ms > 0 ? ms : 0);
+}
+
+NetSocket comet_connect(NetAddress addr, int timeout_ms) {
+    struct sockaddr_storage sockaddr;
+    socklen_t sockaddr_len = netaddr_to_sockaddr(addr, &sockaddr);
+    if (sockaddr_len == 0) {
+        return SOCKET_ERROR;
+    }
+
+    NetSocket fd = socket(sockaddr.ss_family, SOCK_STREAM, 0);
+    if (fd == SOCKET_ERROR) {
+        return SOCKET_ERROR;
+    }
+
+#ifdef _WIN32
+    u_long mode = 1;
+    if (ioctlsocket(fd, FIONBIO, &mode) == SOCKET_ERROR) {
+        goto error;
+    }
+#else
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        goto error;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+#endif
+
+    if (addr.family != NETADDR_UNIX) {
+        int nodelay = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (const char*)&nodelay, sizeof(nodelay));
+    }
+
+    if (connect(fd, (struct sockaddr*)&sockaddr, sockaddr_len) == SOCKET_ERROR) {
+        int err = GET_ERROR_CODE();
+        if (err != COMET_ERROR_IN_PROGRESS && !IS_WOULD_BLOCK(err)) {
+            goto error;
+        }
+
+        if (comet_wait_fd(fd, POLLOUT, timeout_ms) == 0) {
+            SET_ERROR_CODE(COMET_ERROR_TIMEOUT);
+            goto error;
+        }
+
+        int so_error = 0;
+        socklen_t so_error_len = sizeof(so_error);
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, (char*)&so_error, &so_error_len) == SOCKET_ERROR || so_error != 0) {
+            SET_ERROR_CODE(so_error);
+            goto error;
+        }
+    }
+
+    return fd;
+error:
+    CLOSE_SOCKET(fd);
+    return SOCKET_ERROR;
+}
+
+ByteCount comet_read(NetSocket fd, void* buf, size_t len, int timeout_ms) {
+    for (;;) {
+        ByteCount received = recv(fd, buf, len, 0);
+        if (received != SOCKET_ERROR) {
+            return received;
+        }
+
+        int err = GET_ERROR_CODE();
+        if (err == COMET_ERROR_CANCELLED) {
+            continue;
+        }
+        if (!IS_WOULD_BLOCK(err)) {
+            return SOCKET_ERROR;
+        }
+        if (comet_wait_fd(fd, POLLIN, timeout_ms) == 0) {
+            SET_ERROR_CODE(COMET_ERROR_TIMEOUT);
+            return SOCKET_ERROR;
+        }
+    }
+}
+
+ByteCount comet_write(NetSocket fd, const void* buf, size_t len, int timeout_ms) {
+    size_t total_sent = 0;
+
+    while (total_sent < len) {
+        ByteCount sent = send(fd, (const char*)buf + total_sent, len - total_sent, SEND_FLAGS);
+        if (sent == SOCKET_ERROR) {
+            int err = GET_ERROR_CODE();
+            if (err == COMET_ERROR_CANCELLED) {
+                continue;
+            }
+            if (!IS_WOULD_BLOCK(err)) {
+                return SOCKET_ERROR;
+            }
+            if (comet_wait_fd(fd, POLLOUT, timeout_ms) == 0) {
+                SET_ERROR_CODE(COMET_ERROR_TIMEOUT);
+                return SOCKET_ERROR;
+            }
+            continue;
+        }
+        total_sent += sent;
+    }
+
+    return total_sent;
+}
+
+#define COMET_WRITEV_MAX 16
+
+ByteCount comet_writev(NetSocket fd, const NetBuffer* bufs, size_t count, int timeout_ms) {
+    size_t total = 0;
+    size_t total_sent = 0;
+    for (size_t i = 0; i < count; i++) {
+        total += bufs[i].len;
+    }
+
+    // index of the first buffer not sent completely and how much of it is already out
+    size_t first = 0;
+    size_t offset = 0;
+
+    while (total_sent < total) {
+        while (bufs[first].len == offset) {
+            first++;
+            offset = 0;
+        }
+
+        size_t n = count - first < COMET_WRITEV_MAX ? count - first : COMET_WRITEV_MAX;
+#ifdef _WIN32
+        WSABUF vec[COMET_WRITEV_MAX];
+        for (size_t i = 0; i < n; i++) {
+            vec[i].buf = (char*)bufs[first + i].data + (i == 0 ? offset : 0);
+            vec[i].len = (ULONG)(bufs[first + i].len - (i == 0 ? offset : 0));
+        }
+        DWORD sent_bytes = 0;
+        ByteCount sent = WSASend(fd, vec, (DWORD)n, &sent_bytes, 0, NULL, NULL) == 0 ? (ByteCount)sent_bytes : SOCKET_ERROR;
+#else
+        struct iovec vec[COMET_WRITEV_MAX];
+        for (size_t i = 0; i < n; i++) {
+            vec[i].iov_base = (char*)bufs[first + i].data + (i == 0 ? offset : 0);
+            vec[i].iov_len = bufs[first + i].len - (i == 0 ? offset : 0);
+        }
+        struct msghdr msg = {0};
+        msg.msg_iov = vec;
+        msg.msg_iovlen = n;
+        ByteCount sent = sendmsg(fd, &msg, SEND_FLAGS);
+#endif
+        if (sent == SOCKET_ERROR) {
+            int err = GET_ERROR_CODE();
+            if (err == COMET_ERROR_CANCELLED) {
+                continue;
+            }
+            if (!IS_WOULD_BLOCK(err)) {
+                return SOCKET_ERROR;
+            }
+            if (comet_wait_fd(fd, POLLOUT, timeout_ms) == 0) {
+                SET_ERROR_CODE(COMET_ERROR_TIMEOUT);
+                return SOCKET_ERROR;
+            }
+            continue;
+        }
+
+        total_sent += sent;
+        while (sent > 0) {
+            size_t left = bufs[first].len - offset;
+            if ((size_t)sent < left) {
+                offset += sent;
+                break;
+            }
+            sent -= left;
+            first++;
+            offset = 0;
+        }
+    }
+
+    return total_sent;
+}
+
+ByteCount comet_file_read(int file_fd, void* buf, size_t len, uint64_t offset) {
+#ifdef _WIN32
+    if (_lseeki64(file_fd, (__int64)offset, SEEK_SET) < 0) {
+        return SOCKET_ERROR;
+    }
+    int n = _read(file_fd, buf, (unsigned)len);
+    return n < 0 ? SOCKET_ERROR : n;
+#else
+    for (;;) {
+        ssize_t n = pread(file_fd, buf, len, (off_t)offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        return n < 0 ? SOCKET_ERROR : n;
+    }
+#endif
+}
+
+#define COMET_SENDFILE_CHUNK (64 * 1024)
+
+ByteCount comet_sendfile(NetSocket fd, int file_fd, uint64_t offset, size_t len, int timeout_ms) {
+    size_t total_sent = 0;
+
+#ifdef __linux__
+    // page cache straight to socket
+    while (total_sent < len) {
+        off_t off = (off_t)(offset + total_sent);
+        ssize_t sent = sendfile(fd, file_fd, &off, len - total_sent);
+        if (sent == 0) {
+            // file is shorter than promised, peer would wait for the rest forever
+            SET_ERROR_CODE(EIO);
+            return SOCKET_ERROR;
+        }
+        if (sent == SOCKET_ERROR) {
+            int err = GET_ERROR_CODE();
+            if (err == COMET_ERROR_CANCELLED) {
+                continue;
+            }
+            if (!IS_WOULD_BLOCK(err)) {
+                return SOCKET_ERROR;
+            }
+            if (comet_wait_fd(fd, POLLOUT, timeout_ms) == 0) {
+                SET_ERROR_CODE(COMET_ERROR_TIMEOUT);
+                return SOCKET_ERROR;
+            }
+            continue;
+        }
+        total_sent += sent;
+    }
+#else
+    char* chunk = malloc(COMET_SENDFILE_CHUNK);
+    if (chunk == NULL) {
+        return SOCKET_ERROR;
+    }
+    while (total_sent < len) {
+        size_t want = len - total_sent < COMET_SENDFILE_CHUNK ? len - total_sent : COMET_SENDFILE_CHUNK;
+        ByteCount n = comet_file_read(file_fd, chunk, want, offset + total_sent);
+        if (n <= 0 || comet_write(fd, chunk, n, timeout_ms) == SOCKET_ERROR) {
+            free(chunk);
+            return SOCKET_ERROR;
+        }
+        total_sent += n;
+    }
+    free(chunk);
+#endif
+
+    return total_sent;
+}
+
+void comet_close(NetSocket fd) {
+    if (fd != SOCKET_ERROR) {
+        CLOSE_SOCKET(fd);
+    }
+}
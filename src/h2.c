@@ -0,0 +1,1121 @@
+#include "include/h2.h"
+#include "include/hpack.h"
+#include "include/body.h"
+#include "include/fiber.h"
+#include "include/httputil.h"
+#include "include/netplat.h"
+#include "include/logger.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+const CometH2Config COMET_H2_DEFAULT_CONFIG = {
+    .max_concurrent_streams = 128,
+    .initial_window_size = 1024 * 1024,
+    .max_frame_size = 16384,
+    .max_header_list_size = 64 * 1024,
+    .max_request_body = 8 * 1024 * 1024,
+    .idle_timeout_ms = 60000,
+};
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN 24
+#define H2_FRAME_HEADER_LEN 9
+#define H2_DEFAULT_WINDOW 65535
+#define H2_DEFAULT_FRAME_SIZE 16384
+#define H2_MAX_WINDOW 0x7fffffff
+
+#define H2_DATA 0x0
+#define H2_HEADERS 0x1
+#define H2_PRIORITY 0x2
+#define H2_RST_STREAM 0x3
+#define H2_SETTINGS 0x4
+#define H2_PUSH_PROMISE 0x5
+#define H2_PING 0x6
+#define H2_GOAWAY 0x7
+#define H2_WINDOW_UPDATE 0x8
+#define H2_CONTINUATION 0x9
+
+#define H2_FLAG_END_STREAM 0x1
+#define H2_FLAG_ACK 0x1
+#define H2_FLAG_END_HEADERS 0x4
+#define H2_FLAG_PADDED 0x8
+#define H2_FLAG_PRIORITY 0x20
+
+#define H2_NO_ERROR 0x0
+#define H2_PROTOCOL_ERROR 0x1
+#define H2_INTERNAL_ERROR 0x2
+#define H2_FLOW_CONTROL_ERROR 0x3
+#define H2_STREAM_CLOSED 0x5
+#define H2_FRAME_SIZE_ERROR 0x6
+#define H2_REFUSED_STREAM 0x7
+#define H2_CANCEL 0x8
+#define H2_COMPRESSION_ERROR 0x9
+
+#define H2_SETTINGS_HEADER_TABLE_SIZE 0x1
+#define H2_SETTINGS_ENABLE_PUSH 0x2
+#define H2_SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define H2_SETTINGS_INITIAL_WINDOW_SIZE 0x4
+#define H2_SETTINGS_MAX_FRAME_SIZE 0x5
+#define H2_SETTINGS_MAX_HEADER_LIST_SIZE 0x6
+
+typedef struct H2Session H2Session;
+
+typedef struct H2Stream {
+    H2Session* session;
+    uint32_t id;
+    bool request_done;          // END_STREAM received, handler fiber owns the stream now
+    bool reset;                 // RST_STREAM received - nothing more is sent on it
+    int error_status;           // respond with this instead of calling handler, 0 if request is fine
+    int64_t send_window;
+    int64_t recv_window;
+    CometFiber* window_waiter;  // handler fiber suspended until peer opens send window
+
+    // request being received, turned into HTTP/1.1 for httpc once complete
+    char* method;
+    char* path;
+    char* authority;
+    bool regular_header_seen;
+    size_t header_list_size;
+    CometBuffer* headers;       // "name: value\r\n" lines
+    CometBuffer* body;
+    HttpcRequest* upgraded;
+
+    struct H2Stream* next;
+} H2Stream;
+
+struct H2Session {
+    const CometH2Config* config;
+    NetConnection* conn;
+    h2_dispatch_func dispatch;
+    void* dispatch_ctx;
+
+    HpackDecoder decoder;
+    HpackEncoder encoder;
+
+    H2Stream* streams;
+    size_t num_streams;
+    size_t num_running;         // handler fibers that still use the session
+    uint32_t last_stream_id;
+
+    int64_t send_window;
+    int64_t recv_window;
+    uint32_t peer_initial_window;
+    uint32_t peer_max_frame_size;
+
+    bool dead;                  // connection is broken or closing
+    bool read_closed;           // client sent all it will, responses in flight still go out
+    bool goaway_received;
+    CometFiber* reader;         // connection fiber, waiting for handlers to finish
+
+    // frames of one header block or DATA frame must not interleave with others
+    bool write_busy;
+    CometFiber** write_waiters;
+    size_t num_write_waiters;
+    size_t cap_write_waiters;
+
+    uint32_t continuation_stream;   // header block in progress, 0 if none
+    bool continuation_end_stream;
+    CometBuffer* header_block;
+
+    uint8_t* rbuf;
+    size_t rlen;
+    size_t rcap;
+};
+
+static uint32_t read_u32(const uint8_t* p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static void write_u32(uint8_t* p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+bool h2_is_preface(const char* data, size_t len) {
+    // head reader stops after "PRI * HTTP/2.0\r\n\r\n", the rest of preface may be still on the way
+    return len >= 18 && memcmp(data, H2_PREFACE, 18) == 0;
+}
+
+bool h2_is_upgrade_request(const char* head, size_t head_len) {
+    const char* value;
+    size_t value_len;
+    return find_raw_header(head, head_len, "Upgrade", &value, &value_len) && header_value_has_token(value, value_len, "h2c")
+        && find_raw_header(head, head_len, "HTTP2-Settings", &value, &value_len);
+}
+
+static void session_lock(H2Session* s) {
+    while (s->write_busy) {
+        if (s->num_write_waiters == s->cap_write_waiters) {
+            size_t new_cap = s->cap_write_waiters ? s->cap_write_waiters * 2 : 8;
+            CometFiber** waiters = realloc(s->write_waiters, new_cap * sizeof(CometFiber*));
+            if (waiters == NULL) {
+                comet_sleep(1);
+                continue;
+            }
+            s->write_waiters = waiters;
+            s->cap_write_waiters = new_cap;
+        }
+        s->write_waiters[s->num_write_waiters++] = fiber_self();
+        comet_wait_fd(SOCKET_ERROR, 0, -1);
+    }
+    s->write_busy = true;
+}
+
+static void session_unlock(H2Session* s) {
+    s->write_busy = false;
+    if (s->num_write_waiters > 0) {
+        CometFiber* next = s->write_waiters[0];
+        s->num_write_waiters--;
+        memmove(s->write_waiters, s->write_waiters + 1, s->num_write_waiters * sizeof(CometFiber*));
+        fiber_wake(next);
+    }
+}
+
+// Caller holds the write lock.
+static bool send_frame(H2Session* s, uint8_t type, uint8_t flags, uint32_t stream_id, const void* payload, size_t len) {
+    if (s->dead) {
+        return false;
+    }
+
+    uint8_t header[H2_FRAME_HEADER_LEN];
+    header[0] = len >> 16;
+    header[1] = len >> 8;
+    header[2] = len;
+    header[3] = type;
+    header[4] = flags;
+    write_u32(header + 5, stream_id & H2_MAX_WINDOW);
+
+    NetBuffer bufs[2] = {{header, sizeof(header)}, {payload, len}};
+    if (netconn_sendv(s->conn, bufs, len > 0 ? 2 : 1) == SOCKET_ERROR) {
+        s->dead = true;
+        return false;
+    }
+    return true;
+}
+
+static bool send_frame_locked(H2Session* s, uint8_t type, uint8_t flags, uint32_t stream_id, const void* payload, size_t len) {
+    session_lock(s);
+    bool result = send_frame(s, type, flags, stream_id, payload, len);
+    session_unlock(s);
+    return result;
+}
+
+static void send_rst_stream(H2Session* s, uint32_t stream_id, uint32_t code) {
+    uint8_t payload[4];
+    write_u32(payload, code);
+    send_frame_locked(s, H2_RST_STREAM, 0, stream_id, payload, sizeof(payload));
+}
+
+static void send_window_update(H2Session* s, uint32_t stream_id, uint32_t increment) {
+    uint8_t payload[4];
+    write_u32(payload, increment);
+    send_frame_locked(s, H2_WINDOW_UPDATE, 0, stream_id, payload, sizeof(payload));
+}
+
+static void send_goaway(H2Session* s, uint32_t code) {
+    uint8_t payload[8];
+    write_u32(payload, s->last_stream_id);
+    write_u32(payload + 4, code);
+    send_frame_locked(s, H2_GOAWAY, 0, 0, payload, sizeof(payload));
+}
+
+static H2Stream* find_stream(H2Session* s, uint32_t id) {
+    for (H2Stream* stream = s->streams; stream; stream = stream->next) {
+        if (stream->id == id) {
+            return stream;
+        }
+    }
+    return NULL;
+}
+
+static H2Stream* stream_new(H2Session* s, uint32_t id) {
+    H2Stream* stream = calloc(1, sizeof(H2Stream));
+    if (stream == NULL) {
+        return NULL;
+    }
+
+    stream->session = s;
+    stream->id = id;
+    stream->send_window = s->peer_initial_window;
+    stream->recv_window = s->config->initial_window_size;
+
+    stream->next = s->streams;
+    s->streams = stream;
+    s->num_streams++;
+    return stream;
+}
+
+static void stream_free(H2Session* s, H2Stream* stream) {
+    for (H2Stream** link = &s->streams; *link; link = &(*link)->next) {
+        if (*link == stream) {
+            *link = stream->next;
+            s->num_streams--;
+            break;
+        }
+    }
+
+    free(stream->method);
+    free(stream->path);
+    free(stream->authority);
+    comet_buffer_free(stream->headers);
+    comet_buffer_free(stream->body);
+    if (stream->upgraded) {
+        httpc_request_free(stream->upgraded);
+    }
+    free(stream);
+}
+
+static void wake_window_waiters(H2Session* s) {
+    for (H2Stream* stream = s->streams; stream; stream = stream->next) {
+        if (stream->window_waiter) {
+            fiber_wake(stream->window_waiter);
+        }
+    }
+}
+
+static HttpcResponse* error_response(int status) {
+    const char* text;
+    switch (status) {
+        case 400: text = "Bad Request"; break;
+        case 413: text = "Payload Too Large"; break;
+        case 431: text = "Request Header Fields Too Large"; break;
+        default: text = "Internal Server Error"; status = 500;
+    }
+
+    HttpcResponse* res = httpc_response_new(text, status);
+    char body[64];
+    int len = snprintf(body, sizeof(body), "%d %s", status, text);
+    httpc_response_set_body(res, body, len);
+    httpc_add_header_v(&res->headers, "Content-Type", "text/plain");
+    return res;
+}
+
+static HttpcRequest* build_request(H2Stream* stream) {
+    if (stream->method == NULL || stream->path == NULL) {
+        return NULL;
+    }
+
+    CometBuffer* raw = comet_buffer_new(256 + (stream->headers ? stream->headers->len : 0) + (stream->body ? stream->body->len : 0));
+    if (raw == NULL) {
+        return NULL;
+    }
+
+    comet_buffer_appendf(raw, "%s %s HTTP/1.1\r\n", stream->method, stream->path);
+    if (stream->authority) {
+        comet_buffer_appendf(raw, "Host: %s\r\n", stream->authority);
+    }
+    if (stream->headers) {
+        comet_buffer_append(raw, stream->headers->data, stream->headers->len);
+    }
+    size_t body_len = stream->body ? stream->body->len : 0;
+    if (body_len > 0) {
+        comet_buffer_appendf(raw, "Content-Length: %zu\r\n", body_len);
+    }
+    comet_buffer_append(raw, "\r\n", 2);
+    if (body_len > 0) {
+        comet_buffer_append(raw, stream->body->data, body_len);
+    }
+
+    HttpcRequest* req = raw->failed ? NULL : httpc_request_from_string(raw->data, raw->len);
+    comet_buffer_free(raw);
+    return req;
+}
+
+static bool is_hop_by_hop(const char* name, size_t len) {
+    static const char* const HOP_BY_HOP[] = {"connection", "keep-alive", "proxy-connection", "transfer-encoding", "upgrade", "content-length"};
+    for (size_t i = 0; i < sizeof(HOP_BY_HOP) / sizeof(HOP_BY_HOP[0]); i++) {
+        if (strlen(HOP_BY_HOP[i]) == len && memcmp(HOP_BY_HOP[i], name, len) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Turn serialized HTTP/1.1 response head into HPACK block. Caller holds the write lock - encoder state
+// has to change in the same order the blocks are sent.
+static bool encode_response_head(H2Session* s, CometBuffer* block, int status, const char* head, size_t head_len, size_t body_len) {
+    char value[32];
+    int value_len = snprintf(value, sizeof(value), "%d", status);
+    hpack_encode(&s->encoder, block, ":status", 7, value, value_len);
+
+    const char* end = head + head_len;
+    const char* line = find_bytes(head, head_len, "\r\n", 2);
+    char name[128];
+
+    while (line != NULL && line + 2 < end) {
+        line += 2;
+        const char* line_end = find_bytes(line, end - line, "\r\n", 2);
+        if (line_end == NULL) {
+            line_end = end;
+        }
+
+        const char* colon = memchr(line, ':', line_end - line);
+        size_t name_len = colon ? (size_t)(colon - line) : 0;
+        if (name_len > 0 && name_len < sizeof(name)) {
+            for (size_t i = 0; i < name_len; i++) {
+                char c = line[i];
+                name[i] = (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+            }
+
+            const char* v = colon + 1;
+            while (v < line_end && (*v == ' ' || *v == '\t')) v++;
+            if (!is_hop_by_hop(name, name_len)) {
+                hpack_encode(&s->encoder, block, name, name_len, v, line_end - v);
+            }
+        }
+
+        line = line_end;
+    }
+
+    value_len = snprintf(value, sizeof(value), "%zu", body_len);
+    hpack_encode(&s->encoder, block, "content-length", 14, value, value_len);
+    return !block->failed;
+}
+
+static void stream_send_response(H2Stream* stream, HttpcResponse* res, bool head_only) {
+    H2Session* s = stream->session;
+
+    ResponseBody attached;
+    bool has_attached = response_body_take(res, &attached);
+    if (has_attached && !response_body_load(&attached)) {
+        // DATA frames carry copies anyway, file bodies can't use sendfile here
+        response_body_release(&attached);
+        send_rst_stream(s, stream->id, H2_INTERNAL_ERROR);
+        return;
+    }
+
+    size_t response_len = 0;
+    char* response_str = httpc_response_to_string(res, &response_len);
+    if (response_str == NULL) {
+        log_message(LOG_ERROR, "Failed to serialize response");
+        if (has_attached) response_body_release(&attached);
+        send_rst_stream(s, stream->id, H2_INTERNAL_ERROR);
+        return;
+    }
+
+    const char* head_end = find_bytes(response_str, response_len, "\r\n\r\n", 4);
+    size_t head_len = head_end ? (size_t)(head_end - response_str) + 2 : response_len;
+    const char* body = has_attached ? attached.data : response_str + (head_end ? head_len + 2 : response_len);
+    size_t body_len = has_attached ? attached.len : response_len - (size_t)(body - response_str);
+    size_t send_len = head_only ? 0 : body_len;
+
+    CometBuffer* block = comet_buffer_new(256);
+    session_lock(s);
+    if (block == NULL || stream->reset || s->dead) {
+        session_unlock(s);
+        goto cleanup;
+    }
+
+    if (!encode_response_head(s, block, res->status_code, response_str, head_len, body_len)) {
+        // encoder state may be out of sync with peer now, connection can't continue
+        s->dead = true;
+        session_unlock(s);
+        goto cleanup;
+    }
+
+    // header block split over HEADERS and CONTINUATION frames, nothing may come between them
+    size_t offset = 0;
+    bool first = true;
+    do {
+        size_t chunk = block->len - offset;
+        if (chunk > s->peer_max_frame_size) {
+            chunk = s->peer_max_frame_size;
+        }
+        bool last = offset + chunk == block->len;
+        uint8_t flags = (last ? H2_FLAG_END_HEADERS : 0) | (first && send_len == 0 ? H2_FLAG_END_STREAM : 0);
+        if (!send_frame(s, first ? H2_HEADERS : H2_CONTINUATION, flags, stream->id, block->data + offset, chunk)) {
+            break;
+        }
+        offset += chunk;
+        first = false;
+    } while (offset < block->len);
+    session_unlock(s);
+
+    size_t sent = 0;
+    uint64_t deadline = 0;
+    while (sent < send_len && !stream->reset && !s->dead) {
+        int64_t window = s->send_window < stream->send_window ? s->send_window : stream->send_window;
+        if (window <= 0) {
+            // client that sent all it will can't open the window anymore
+            if (s->read_closed) {
+                send_rst_stream(s, stream->id, H2_CANCEL);
+                break;
+            }
+            // client stopped reading this stream or connection, give it send timeout to catch up
+            if (deadline == 0) {
+                deadline = comet_now_ms() + s->conn->send_timeout_ms;
+            } else if (comet_now_ms() >= deadline) {
+                send_rst_stream(s, stream->id, H2_CANCEL);
+                break;
+            }
+            stream->window_waiter = fiber_self();
+            comet_wait_fd(SOCKET_ERROR, 0, s->conn->send_timeout_ms);
+            stream->window_waiter = NULL;
+            continue;
+        }
+        deadline = 0;
+
+        size_t chunk = send_len - sent;
+        if ((int64_t)chunk > window) chunk = window;
+        if (chunk > s->peer_max_frame_size) chunk = s->peer_max_frame_size;
+
+        session_lock(s);
+        if (stream->reset) {
+            session_unlock(s);
+            break;
+        }
+        bool last = sent + chunk == send_len;
+        bool ok = send_frame(s, H2_DATA, last ? H2_FLAG_END_STREAM : 0, stream->id, body + sent, chunk);
+        session_unlock(s);
+        if (!ok) {
+            break;
+        }
+
+        s->send_window -= chunk;
+        stream->send_window -= chunk;
+        sent += chunk;
+    }
+
+cleanup:
+    comet_buffer_free(block);
+    if (has_attached) response_body_release(&attached);
+    free(response_str);
+}
+
+static void stream_fiber(void* arg) {
+    H2Stream* stream = arg;
+    H2Session* s = stream->session;
+
+    HttpcResponse* res = NULL;
+    bool head_only = stream->method && strcmp(stream->method, "HEAD") == 0;
+
+    if (stream->error_status == 0) {
+        HttpcRequest* req = stream->upgraded ? stream->upgraded : build_request(stream);
+        stream->upgraded = NULL;
+        if (req == NULL) {
+            stream->error_status = 400;
+        } else {
+            res = s->dispatch(s->dispatch_ctx, &req);
+            httpc_request_free(req);
+        }
+    }
+    if (res == NULL) {
+        res = error_response(stream->error_status);
+    }
+
+    stream_send_response(stream, res, head_only);
+    comet_response_free(res);
+
+    stream_free(s, stream);
+    s->num_running--;
+    if (s->reader && s->num_running == 0) {
+        fiber_wake(s->reader);
+    }
+}
+
+static void stream_request_done(H2Session* s, H2Stream* stream) {
+    stream->request_done = true;
+    s->num_running++;
+    if (!fiber_spawn(stream_fiber, stream)) {
+        s->num_running--;
+        send_rst_stream(s, stream->id, H2_REFUSED_STREAM);
+        stream_free(s, stream);
+    }
+}
+
+static bool store_header(char** field, const char* value, size_t len) {
+    if (*field != NULL) {
+        return false;
+    }
+    *field = malloc(len + 1);
+    if (*field == NULL) {
+        return false;
+    }
+    memcpy(*field, value, len);
+    (*field)[len] = '\0';
+    return true;
+}
+
+// Field value that goes into rebuilt HTTP/1.1 head as is - no CR, LF or NUL that could end the line early,
+// no whitespace around it (RFC 9113 8.2.1).
+static bool is_valid_value(const char* value, size_t len) {
+    if (len > 0 && (value[0] == ' ' || value[0] == '\t' || value[len - 1] == ' ' || value[len - 1] == '\t')) {
+        return false;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (value[i] == '\r' || value[i] == '\n' || value[i] == '\0') {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Value that goes into the request line, or Host - no whitespace or control characters at all.
+static bool is_valid_request_part(const char* value, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)value[i];
+        if (c <= ' ' || c == 0x7f) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool on_request_header(void* ctx, const char* name, size_t name_len, const char* value, size_t value_len) {
+    H2Stream* stream = ctx;
+    if (stream->error_status != 0) {
+        return true;
+    }
+
+    stream->header_list_size += name_len + value_len + 32;
+    if (stream->header_list_size > stream->session->config->max_header_list_size) {
+        stream->error_status = 431;
+        return true;
+    }
+
+    // request is rebuilt as HTTP/1.1 text, anything that could change how that text parses is malformed
+    bool pseudo = name_len > 0 && name[0] == ':';
+    bool valid = is_valid_value(value, value_len) && is_http_token(name + pseudo, name_len - pseudo);
+    for (size_t i = 0; valid && i < name_len; i++) {
+        if (name[i] >= 'A' && name[i] <= 'Z') {
+            valid = false;
+        }
+    }
+    if (!valid) {
+        stream->error_status = 400;
+        return true;
+    }
+
+    if (pseudo) {
+        bool ok;
+        if (stream->regular_header_seen) {
+            ok = false;
+        } else if (name_len == 7 && memcmp(name, ":method", 7) == 0) {
+            ok = is_http_token(value, value_len) && store_header(&stream->method, value, value_len);
+        } else if (name_len == 5 && memcmp(name, ":path", 5) == 0) {
+            ok = value_len > 0 && (value[0] == '/' || (value_len == 1 && value[0] == '*')) &&
+                 is_valid_request_part(value, value_len) && store_header(&stream->path, value, value_len);
+        } else if (name_len == 10 && memcmp(name, ":authority", 10) == 0) {
+            ok = is_valid_request_part(value, value_len) && store_header(&stream->authority, value, value_len);
+        } else {
+            ok = name_len == 7 && memcmp(name, ":scheme", 7) == 0;
+        }
+        if (!ok) {
+            stream->error_status = 400;
+        }
+        return true;
+    }
+
+    stream->regular_header_seen = true;
+    if (is_hop_by_hop(name, name_len) && !(name_len == 14 && memcmp(name, "content-length", 14) == 0)) {
+        stream->error_status = 400;
+        return true;
+    }
+    // body length comes from DATA frames, request line is rebuilt with the real one
+    if (name_len == 14 && memcmp(name, "content-length", 14) == 0) {
+        return true;
+    }
+
+    if (stream->headers == NULL && (stream->headers = comet_buffer_new(512)) == NULL) {
+        stream->error_status = 500;
+        return true;
+    }
+    comet_buffer_append(stream->headers, name, name_len);
+    comet_buffer_append(stream->headers, ": ", 2);
+    comet_buffer_append(stream->headers, value, value_len);
+    comet_buffer_append(stream->headers, "\r\n", 2);
+    return true;
+}
+
+static bool on_ignored_header(void* ctx, const char* name, size_t name_len, const char* value, size_t value_len) {
+    return true;
+}
+
+// Complete header block arrived. Returns connection error code, H2_NO_ERROR if connection can go on.
+static uint32_t handle_header_block(H2Session* s, uint32_t stream_id, bool end_stream) {
+    const uint8_t* block = (const uint8_t*)s->header_block->data;
+    size_t block_len = s->header_block->len;
+    s->header_block->len = 0;
+    s->continuation_stream = 0;
+
+    H2Stream* stream = find_stream(s, stream_id);
+    if (stream != NULL) {
+        // trailers - accepted, but not passed to handler
+        if (!hpack_decode(&s->decoder, block, block_len, on_ignored_header, NULL)) {
+            return H2_COMPRESSION_ERROR;
+        }
+        if (stream->request_done || !end_stream) {
+            return H2_PROTOCOL_ERROR;
+        }
+        stream_request_done(s, stream);
+        return H2_NO_ERROR;
+    }
+
+    if (stream_id % 2 == 0 || stream_id <= s->last_stream_id) {
+        return H2_PROTOCOL_ERROR;
+    }
+    s->last_stream_id = stream_id;
+
+    bool refuse = s->goaway_received || s->num_streams >= s->config->max_concurrent_streams;
+    stream = refuse ? NULL : stream_new(s, stream_id);
+    if (stream == NULL) {
+        // block still has to go through decoder, or its table would get out of sync
+        if (!hpack_decode(&s->decoder, block, block_len, on_ignored_header, NULL)) {
+            return H2_COMPRESSION_ERROR;
+        }
+        send_rst_stream(s, stream_id, H2_REFUSED_STREAM);
+        return H2_NO_ERROR;
+    }
+
+    if (!hpack_decode(&s->decoder, block, block_len, on_request_header, stream)) {
+        return H2_COMPRESSION_ERROR;
+    }
+
+    if (end_stream) {
+        stream_request_done(s, stream);
+    }
+    return H2_NO_ERROR;
+}
+
+static uint32_t handle_headers(H2Session* s, uint8_t flags, uint32_t stream_id, const uint8_t* payload, size_t len) {
+    if (stream_id == 0) {
+        return H2_PROTOCOL_ERROR;
+    }
+
+    if (flags & H2_FLAG_PADDED) {
+        if (len < 1 || payload[0] >= len) {
+            return H2_PROTOCOL_ERROR;
+        }
+        len -= 1 + payload[0];
+        payload++;
+    }
+    if (flags & H2_FLAG_PRIORITY) {
+        if (len < 5) {
+            return H2_PROTOCOL_ERROR;
+        }
+        payload += 5;
+        len -= 5;
+    }
+
+    if (!comet_buffer_append(s->header_block, payload, len)) {
+        return H2_INTERNAL_ERROR;
+    }
+    if (s->header_block->len > s->config->max_header_list_size * 2) {
+        return H2_PROTOCOL_ERROR;
+    }
+
+    s->continuation_stream = stream_id;
+    s->continuation_end_stream = (flags & H2_FLAG_END_STREAM) != 0;
+    if (flags & H2_FLAG_END_HEADERS) {
+        return handle_header_block(s, stream_id, s->continuation_end_stream);
+    }
+    return H2_NO_ERROR;
+}
+
+static uint32_t handle_continuation(H2Session* s, uint8_t flags, uint32_t stream_id, const uint8_t* payload, size_t len) {
+    if (!comet_buffer_append(s->header_block, payload, len)) {
+        return H2_INTERNAL_ERROR;
+    }
+    if (s->header_block->len > s->config->max_header_list_size * 2) {
+        return H2_PROTOCOL_ERROR;
+    }
+    if (flags & H2_FLAG_END_HEADERS) {
+        return handle_header_block(s, stream_id, s->continuation_end_stream);
+    }
+    return H2_NO_ERROR;
+}
+
+static uint32_t handle_data(H2Session* s, uint8_t flags, uint32_t stream_id, const uint8_t* payload, size_t len) {
+    if (stream_id == 0) {
+        return H2_PROTOCOL_ERROR;
+    }
+
+    // whole frame counts against flow control, padding included
+    s->recv_window -= len;
+    if (s->recv_window < 0) {
+        return H2_FLOW_CONTROL_ERROR;
+    }
+    if (s->recv_window < H2_DEFAULT_WINDOW / 2) {
+        send_window_update(s, 0, H2_DEFAULT_WINDOW - s->recv_window);
+        s->recv_window = H2_DEFAULT_WINDOW;
+    }
+
+    size_t frame_len = len;
+    if (flags & H2_FLAG_PADDED) {
+        if (len < 1 || payload[0] >= len) {
+            return H2_PROTOCOL_ERROR;
+        }
+        len -= 1 + payload[0];
+        payload++;
+    }
+
+    H2Stream* stream = find_stream(s, stream_id);
+    if (stream == NULL || stream->request_done) {
+        if (stream_id > s->last_stream_id) {
+            return H2_PROTOCOL_ERROR;
+        }
+        send_rst_stream(s, stream_id, H2_STREAM_CLOSED);
+        return H2_NO_ERROR;
+    }
+
+    stream->recv_window -= frame_len;
+    if (stream->recv_window < 0) {
+        send_rst_stream(s, stream_id, H2_FLOW_CONTROL_ERROR);
+        stream_free(s, stream);
+        return H2_NO_ERROR;
+    }
+
+    if (stream->error_status == 0 && len > 0) {
+        size_t body_len = stream->body ? stream->body->len : 0;
+        if (body_len + len > s->config->max_request_body) {
+            stream->error_status = 413;
+        } else if (stream->body == NULL && (stream->body = comet_buffer_new(len)) == NULL) {
+            stream->error_status = 500;
+        } else if (!comet_buffer_append(stream->body, payload, len)) {
+            stream->error_status = 500;
+        }
+    }
+
+    if (flags & H2_FLAG_END_STREAM) {
+        stream_request_done(s, stream);
+        return H2_NO_ERROR;
+    }
+
+    int64_t initial = s->config->initial_window_size;
+    if (stream->recv_window < initial / 2) {
+        send_window_update(s, stream_id, (uint32_t)(initial - stream->recv_window));
+        stream->recv_window = initial;
+    }
+    return H2_NO_ERROR;
+}
+
+static uint32_t apply_settings(H2Session* s, const uint8_t* payload, size_t len) {
+    for (size_t i = 0; i + 6 <= len; i += 6) {
+        uint16_t id = (uint16_t)(payload[i] << 8 | payload[i + 1]);
+        uint32_t value = read_u32(payload + i + 2);
+
+        switch (id) {
+            case H2_SETTINGS_HEADER_TABLE_SIZE:
+                hpack_encoder_set_max_size(&s->encoder, value);
+                break;
+            case H2_SETTINGS_ENABLE_PUSH:
+                if (value > 1) return H2_PROTOCOL_ERROR;
+                break;
+            case H2_SETTINGS_INITIAL_WINDOW_SIZE: {
+                if (value > H2_MAX_WINDOW) return H2_FLOW_CONTROL_ERROR;
+                int64_t delta = (int64_t)value - s->peer_initial_window;
+                for (H2Stream* stream = s->streams; stream; stream = stream->next) {
+                    stream->send_window += delta;
+                }
+                s->peer_initial_window = value;
+                wake_window_waiters(s);
+                break;
+            }
+            case H2_SETTINGS_MAX_FRAME_SIZE:
+                if (value < H2_DEFAULT_FRAME_SIZE || value > 0xffffff) return H2_PROTOCOL_ERROR;
+                s->peer_max_frame_size = value;
+                break;
+            default:
+                break;
+        }
+    }
+    return H2_NO_ERROR;
+}
+
+static uint32_t handle_frame(H2Session* s, uint8_t type, uint8_t flags, uint32_t stream_id, const uint8_t* payload, size_t len) {
+    if (s->continuation_stream != 0 && (type != H2_CONTINUATION || stream_id != s->continuation_stream)) {
+        return H2_PROTOCOL_ERROR;
+    }
+
+    switch (type) {
+        case H2_DATA:
+            return handle_data(s, flags, stream_id, payload, len);
+        case H2_HEADERS:
+            return handle_headers(s, flags, stream_id, payload, len);
+        case H2_CONTINUATION:
+            if (s->continuation_stream == 0) return H2_PROTOCOL_ERROR;
+            return handle_continuation(s, flags, stream_id, payload, len);
+        case H2_PRIORITY:
+            return len == 5 ? H2_NO_ERROR : H2_FRAME_SIZE_ERROR;
+        case H2_RST_STREAM: {
+            if (len != 4) return H2_FRAME_SIZE_ERROR;
+            if (stream_id == 0) return H2_PROTOCOL_ERROR;
+            H2Stream* stream = find_stream(s, stream_id);
+            if (stream == NULL) {
+                return stream_id > s->last_stream_id ? H2_PROTOCOL_ERROR : H2_NO_ERROR;
+            }
+            if (stream->request_done) {
+                // handler fiber owns it, let it know it can stop sending
+                stream->reset = true;
+                if (stream->window_waiter) fiber_wake(stream->window_waiter);
+            } else {
+                stream_free(s, stream);
+            }
+            return H2_NO_ERROR;
+        }
+        case H2_SETTINGS: {
+            if (stream_id != 0) return H2_PROTOCOL_ERROR;
+            if (flags & H2_FLAG_ACK) return len == 0 ? H2_NO_ERROR : H2_FRAME_SIZE_ERROR;
+            if (len % 6 != 0) return H2_FRAME_SIZE_ERROR;
+            uint32_t err = apply_settings(s, payload, len);
+            if (err != H2_NO_ERROR) return err;
+            send_frame_locked(s, H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0);
+            return H2_NO_ERROR;
+        }
+        case H2_PUSH_PROMISE:
+            return H2_PROTOCOL_ERROR;
+        case H2_PING:
+            if (len != 8) return H2_FRAME_SIZE_ERROR;
+            if (stream_id != 0) return H2_PROTOCOL_ERROR;
+            if (!(flags & H2_FLAG_ACK)) {
+                send_frame_locked(s, H2_PING, H2_FLAG_ACK, 0, payload, 8);
+            }
+            return H2_NO_ERROR;
+        case H2_GOAWAY:
+            if (stream_id != 0) return H2_PROTOCOL_ERROR;
+            s->goaway_received = true;
+            return H2_NO_ERROR;
+        case H2_WINDOW_UPDATE: {
+            if (len != 4) return H2_FRAME_SIZE_ERROR;
+            uint32_t increment = read_u32(payload) & H2_MAX_WINDOW;
+            if (stream_id == 0) {
+                if (increment == 0) return H2_PROTOCOL_ERROR;
+                s->send_window += increment;
+                if (s->send_window > H2_MAX_WINDOW) return H2_FLOW_CONTROL_ERROR;
+                wake_window_waiters(s);
+                return H2_NO_ERROR;
+            }
+            H2Stream* stream = find_stream(s, stream_id);
+            if (stream == NULL) {
+                return H2_NO_ERROR;
+            }
+            stream->send_window += increment;
+            if (increment == 0 || stream->send_window > H2_MAX_WINDOW) {
+                send_rst_stream(s, stream_id, increment == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR);
+                stream->reset = true;
+            }
+            if (stream->window_waiter) fiber_wake(stream->window_waiter);
+            return H2_NO_ERROR;
+        }
+        default:
+            // unknown frame types are ignored
+            return H2_NO_ERROR;
+    }
+}
+
+static size_t base64url_decode(const char* in, size_t len, uint8_t* out) {
+    uint32_t acc = 0;
+    int bits = 0;
+    size_t n = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        char c = in[i];
+        int v;
+        if (c >= 'A' && c <= 'Z') v = c - 'A';
+        else if (c >= 'a' && c <= 'z') v = c - 'a' + 26;
+        else if (c >= '0' && c <= '9') v = c - '0' + 52;
+        else if (c == '-' || c == '+') v = 62;
+        else if (c == '_' || c == '/') v = 63;
+        else continue;
+
+        acc = acc << 6 | v;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            out[n++] = (uint8_t)(acc >> bits);
+        }
+    }
+    return n;
+}
+
+static bool session_reserve(H2Session* s, size_t needed) {
+    if (s->rcap >= needed) {
+        return true;
+    }
+    uint8_t* rbuf = realloc(s->rbuf, needed);
+    if (rbuf == NULL) {
+        log_message(LOG_ERROR, "Failed to allocate memory for HTTP/2 frame");
+        return false;
+    }
+    s->rbuf = rbuf;
+    s->rcap = needed;
+    return true;
+}
+
+static bool session_read_more(H2Session* s) {
+    if (!session_reserve(s, H2_FRAME_HEADER_LEN + s->config->max_frame_size)) {
+        return false;
+    }
+
+    for (;;) {
+        ByteCount received = netconn_recv(s->conn, s->rbuf + s->rlen, s->rcap - s->rlen);
+        if (received > 0) {
+            s->rlen += received;
+            return true;
+        }
+        // long idle connection is fine while its requests are being handled
+        if (received == SOCKET_ERROR && GET_ERROR_CODE() == COMET_ERROR_TIMEOUT && s->num_streams > 0 && !s->dead) {
+            continue;
+        }
+        return false;
+    }
+}
+
+static void session_send_settings(H2Session* s) {
+    uint8_t payload[24];
+    const struct { uint16_t id; uint32_t value; } settings[] = {
+        {H2_SETTINGS_MAX_CONCURRENT_STREAMS, s->config->max_concurrent_streams},
+        {H2_SETTINGS_INITIAL_WINDOW_SIZE, s->config->initial_window_size},
+        {H2_SETTINGS_MAX_FRAME_SIZE, s->config->max_frame_size},
+        {H2_SETTINGS_MAX_HEADER_LIST_SIZE, (uint32_t)s->config->max_header_list_size},
+    };
+
+    for (size_t i = 0; i < 4; i++) {
+        payload[i * 6] = settings[i].id >> 8;
+        payload[i * 6 + 1] = settings[i].id & 0xff;
+        write_u32(payload + i * 6 + 2, settings[i].value);
+    }
+    send_frame_locked(s, H2_SETTINGS, 0, 0, payload, sizeof(payload));
+}
+
+void h2_run_session(const CometH2Config* config, NetConnection* conn, h2_dispatch_func dispatch, void* dispatch_ctx,
+                    const char* initial, size_t initial_len,
+                    HttpcRequest* upgraded, const char* upgrade_head, size_t upgrade_head_len) {
+    H2Session s;
+    memset(&s, 0, sizeof(s));
+    s.config = config;
+    s.conn = conn;
+    s.dispatch = dispatch;
+    s.dispatch_ctx = dispatch_ctx;
+    s.send_window = H2_DEFAULT_WINDOW;
+    s.recv_window = H2_DEFAULT_WINDOW;
+    s.peer_initial_window = H2_DEFAULT_WINDOW;
+    s.peer_max_frame_size = H2_DEFAULT_FRAME_SIZE;
+    hpack_decoder_init(&s.decoder, HPACK_DEFAULT_TABLE_SIZE);
+    hpack_encoder_init(&s.encoder);
+    s.header_block = comet_buffer_new(1024);
+
+    conn->recv_timeout_ms = config->idle_timeout_ms;
+
+    if (s.header_block == NULL || !session_reserve(&s, initial_len) || !session_reserve(&s, H2_FRAME_HEADER_LEN + config->max_frame_size)) {
+        if (upgraded) httpc_request_free(upgraded);
+        goto cleanup;
+    }
+
+    if (upgraded) {
+        static const char SWITCHING_PROTOCOLS[] =
+            "HTTP/1.1 101 Switching Protocols\r\n"
+            "Connection: Upgrade\r\n"
+            "Upgrade: h2c\r\n"
+            "\r\n";
+        if (netconn_send(conn, SWITCHING_PROTOCOLS, sizeof(SWITCHING_PROTOCOLS) - 1) == SOCKET_ERROR) {
+            httpc_request_free(upgraded);
+            goto cleanup;
+        }
+
+        const char* value;
+        size_t value_len;
+        if (find_raw_header(upgrade_head, upgrade_head_len, "HTTP2-Settings", &value, &value_len) && value_len < 1024) {
+            uint8_t settings[768];
+            size_t settings_len = base64url_decode(value, value_len, settings);
+            apply_settings(&s, settings, settings_len - settings_len % 6);
+        }
+    }
+
+    session_send_settings(&s);
+    if (config->initial_window_size > H2_DEFAULT_WINDOW) {
+        // connection window can only be raised by WINDOW_UPDATE
+        send_window_update(&s, 0, config->initial_window_size - H2_DEFAULT_WINDOW);
+        s.recv_window = config->initial_window_size;
+    }
+
+    if (upgraded) {
+        // request that asked for upgrade is answered as stream 1
+        s.last_stream_id = 1;
+        H2Stream* stream = stream_new(&s, 1);
+        if (stream == NULL) {
+            httpc_request_free(upgraded);
+            goto cleanup;
+        }
+        stream->upgraded = upgraded;
+        stream_request_done(&s, stream);
+    }
+
+    if (initial_len > 0) {
+        memcpy(s.rbuf, initial, initial_len);
+    }
+    s.rlen = initial_len;
+
+    while (s.rlen < H2_PREFACE_LEN) {
+        if (!session_read_more(&s)) {
+            goto cleanup;
+        }
+    }
+    if (memcmp(s.rbuf, H2_PREFACE, H2_PREFACE_LEN) != 0) {
+        send_goaway(&s, H2_PROTOCOL_ERROR);
+        s.dead = true;
+        goto cleanup;
+    }
+    size_t pos = H2_PREFACE_LEN;
+
+    uint32_t error = H2_NO_ERROR;
+    while (!s.dead) {
+        while (s.rlen - pos >= H2_FRAME_HEADER_LEN) {
+            const uint8_t* header = s.rbuf + pos;
+            size_t len = (size_t)header[0] << 16 | (size_t)header[1] << 8 | header[2];
+            if (len > config->max_frame_size) {
+                error = H2_FRAME_SIZE_ERROR;
+                break;
+            }
+            if (s.rlen - pos < H2_FRAME_HEADER_LEN + len) {
+                break;
+            }
+
+            error = handle_frame(&s, header[3], header[4], read_u32(header + 5) & H2_MAX_WINDOW, header + H2_FRAME_HEADER_LEN, len);
+            pos += H2_FRAME_HEADER_LEN + len;
+            if (error != H2_NO_ERROR) {
+                break;
+            }
+        }
+        if (error != H2_NO_ERROR) {
+            send_goaway(&s, error);
+            s.dead = true;
+            break;
+        }
+
+        memmove(s.rbuf, s.rbuf + pos, s.rlen - pos);
+        s.rlen -= pos;
+        pos = 0;
+
+        if (!session_read_more(&s)) {
+            if (s.num_streams == 0 && !s.dead && !s.goaway_received) {
+                send_goaway(&s, H2_NO_ERROR);
+            }
+            break;
+        }
+    }
+
+cleanup:
+    // handler fibers still point to the session, wait until they are done with it. Unless the connection
+    // broke, they still send their responses - client may have shut down only its sending side
+    s.read_closed = true;
+    wake_window_waiters(&s);
+    while (s.num_running > 0) {
+        s.reader = fiber_self();
+        comet_wait_fd(SOCKET_ERROR, 0, 100);
+    }
+    s.dead = true;
+
+    while (s.streams) {
+        stream_free(&s, s.streams);
+    }
+    hpack_decoder_free(&s.decoder);
+    hpack_encoder_free(&s.encoder);
+    comet_buffer_free(s.header_block);
+    free(s.write_waiters);
+    free(s.rbuf);
+}
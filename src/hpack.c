@@ -0,0 +1,576 @@
+#include "include/hpack.h"
+#include "include/atomics.h"
+#include "include/logger.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    const char* name;
+    const char* value;
+} StaticEntry;
+
+static const StaticEntry STATIC_TABLE[] = {
+    {":authority", ""}, {":method", "GET"}, {":method", "POST"}, {":path", "/"}, {":path", "/index.html"},
+    {":scheme", "http"}, {":scheme", "https"}, {":status", "200"}, {":status", "204"}, {":status", "206"},
+    {":status", "304"}, {":status", "400"}, {":status", "404"}, {":status", "500"}, {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"}, {"accept-language", ""}, {"accept-ranges", ""}, {"accept", ""},
+    {"access-control-allow-origin", ""}, {"age", ""}, {"allow", ""}, {"authorization", ""}, {"cache-control", ""},
+    {"content-disposition", ""}, {"content-encoding", ""}, {"content-language", ""}, {"content-length", ""},
+    {"content-location", ""}, {"content-range", ""}, {"content-type", ""}, {"cookie", ""}, {"date", ""},
+    {"etag", ""}, {"expect", ""}, {"expires", ""}, {"from", ""}, {"host", ""}, {"if-match", ""},
+    {"if-modified-since", ""}, {"if-none-match", ""}, {"if-range", ""}, {"if-unmodified-since", ""},
+    {"last-modified", ""}, {"link", ""}, {"location", ""}, {"max-forwards", ""}, {"proxy-authenticate", ""},
+    {"proxy-authorization", ""}, {"range", ""}, {"referer", ""}, {"refresh", ""}, {"retry-after", ""},
+    {"server", ""}, {"set-cookie", ""}, {"strict-transport-security", ""}, {"transfer-encoding", ""},
+    {"user-agent", ""}, {"vary", ""}, {"via", ""}, {"www-authenticate", ""},
+};
+
+#define STATIC_TABLE_LEN (sizeof(STATIC_TABLE) / sizeof(STATIC_TABLE[0]))
+#define ENTRY_OVERHEAD 32
+
+typedef struct {
+    uint32_t code;
+    uint8_t bits;
+} HuffmanCode;
+
+// RFC 7541 Appendix B, symbol 256 is EOS
+static const HuffmanCode HUFFMAN_CODES[257] = {
+    {0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28}, {0xfffffe4, 28}, {0xfffffe5, 28},
+    {0xfffffe6, 28}, {0xfffffe7, 28}, {0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28},
+    {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28}, {0xfffffed, 28}, {0xfffffee, 28},
+    {0xfffffef, 28}, {0xffffff0, 28}, {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+    {0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28}, {0xffffff8, 28}, {0xffffff9, 28},
+    {0xffffffa, 28}, {0xffffffb, 28}, {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12},
+    {0x1ff9, 13}, {0x15, 6}, {0xf8, 8}, {0x7fa, 11}, {0x3fa, 10}, {0x3fb, 10},
+    {0xf9, 8}, {0x7fb, 11}, {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6},
+    {0x0, 5}, {0x1, 5}, {0x2, 5}, {0x19, 6}, {0x1a, 6}, {0x1b, 6},
+    {0x1c, 6}, {0x1d, 6}, {0x1e, 6}, {0x1f, 6}, {0x5c, 7}, {0xfb, 8},
+    {0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10}, {0x1ffa, 13}, {0x21, 6},
+    {0x5d, 7}, {0x5e, 7}, {0x5f, 7}, {0x60, 7}, {0x61, 7}, {0x62, 7},
+    {0x63, 7}, {0x64, 7}, {0x65, 7}, {0x66, 7}, {0x67, 7}, {0x68, 7},
+    {0x69, 7}, {0x6a, 7}, {0x6b, 7}, {0x6c, 7}, {0x6d, 7}, {0x6e, 7},
+    {0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7}, {0xfc, 8}, {0x73, 7},
+    {0xfd, 8}, {0x1ffb, 13}, {0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6},
+    {0x7ffd, 15}, {0x3, 5}, {0x23, 6}, {0x4, 5}, {0x24, 6}, {0x5, 5},
+    {0x25, 6}, {0x26, 6}, {0x27, 6}, {0x6, 5}, {0x74, 7}, {0x75, 7},
+    {0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5}, {0x2b, 6}, {0x76, 7},
+    {0x2c, 6}, {0x8, 5}, {0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7},
+    {0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15}, {0x7fc, 11}, {0x3ffd, 14},
+    {0x1ffd, 13}, {0xffffffc, 28}, {0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20},
+    {0x3fffd3, 22}, {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23}, {0x3fffd6, 22}, {0x7fffda, 23},
+    {0x7fffdb, 23}, {0x7fffdc, 23}, {0x7fffdd, 23}, {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23},
+    {0xffffec, 24}, {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23}, {0xffffee, 24}, {0x7fffe1, 23},
+    {0x7fffe2, 23}, {0x7fffe3, 23}, {0x7fffe4, 23}, {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23},
+    {0x3fffd9, 22}, {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24}, {0x3fffda, 22}, {0x1fffdd, 21},
+    {0xfffe9, 20}, {0x3fffdb, 22}, {0x3fffdc, 22}, {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21},
+    {0x7fffea, 23}, {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24}, {0x1fffdf, 21}, {0x3fffdf, 22},
+    {0x7fffeb, 23}, {0x7fffec, 23}, {0x1fffe0, 21}, {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21},
+    {0x7fffed, 23}, {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23}, {0xfffea, 20}, {0x3fffe2, 22},
+    {0x3fffe3, 22}, {0x3fffe4, 22}, {0x7ffff0, 23}, {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23},
+    {0x3ffffe0, 26}, {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19}, {0x3fffe7, 22}, {0x7ffff2, 23},
+    {0x3fffe8, 22}, {0x1ffffec, 25}, {0x3ffffe2, 26}, {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27},
+    {0x7ffffdf, 27}, {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25}, {0x7fff2, 19}, {0x1fffe3, 21},
+    {0x3ffffe6, 26}, {0x7ffffe0, 27}, {0x7ffffe1, 27}, {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24},
+    {0x1fffe4, 21}, {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26}, {0xffffffd, 28}, {0x7ffffe3, 27},
+    {0x7ffffe4, 27}, {0x7ffffe5, 27}, {0xfffec, 20}, {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21},
+    {0x3fffe9, 22}, {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23}, {0x3fffea, 22}, {0x3fffeb, 22},
+    {0x1ffffee, 25}, {0x1ffffef, 25}, {0xfffff4, 24}, {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23},
+    {0x3ffffeb, 26}, {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26}, {0x7ffffe7, 27}, {0x7ffffe8, 27},
+    {0x7ffffe9, 27}, {0x7ffffea, 27}, {0x7ffffeb, 27}, {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27},
+    {0x7ffffee, 27}, {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26}, {0x3fffffff, 30},
+};
+
+#define HUFFMAN_EOS 256
+
+// Decoding tree built from HUFFMAN_CODES on first use. Negative child is a leaf holding -(symbol + 1).
+typedef int16_t HuffmanNode[2];
+
+static HuffmanNode huffman_nodes[256];
+static HuffmanNode* volatile huffman_tree = NULL;   // huffman_nodes once they are built
+static volatile long huffman_lock = 0;
+
+static void huffman_build_tree(HuffmanNode* tree) {
+    int16_t num_nodes = 1;
+    memset(tree, 0, sizeof(huffman_nodes));
+
+    for (int sym = 0; sym <= HUFFMAN_EOS; sym++) {
+        uint32_t code = HUFFMAN_CODES[sym].code;
+        int bits = HUFFMAN_CODES[sym].bits;
+        int16_t node = 0;
+
+        for (int i = bits - 1; i > 0; i--) {
+            int bit = (code >> i) & 1;
+            if (tree[node][bit] == 0) {
+                tree[node][bit] = num_nodes++;
+            }
+            node = tree[node][bit];
+        }
+        tree[node][code & 1] = (int16_t)-(sym + 1);
+    }
+}
+
+// Sessions on different threads (h2c and TLS routers, offload workers) may decode at the same time,
+// first of them builds the tree while the others wait.
+static HuffmanNode* huffman_get_tree(void) {
+    HuffmanNode* tree = comet_atomic_load_ptr((void* volatile*)&huffman_tree);
+    if (tree != NULL) {
+        return tree;
+    }
+
+    while (comet_atomic_exchange_long(&huffman_lock, 1) != 0) {
+        comet_thread_yield();
+    }
+    tree = comet_atomic_load_ptr((void* volatile*)&huffman_tree);
+    if (tree == NULL) {
+        huffman_build_tree(huffman_nodes);
+        tree = huffman_nodes;
+        comet_atomic_store_ptr((void* volatile*)&huffman_tree, tree);
+    }
+    comet_atomic_exchange_long(&huffman_lock, 0);
+
+    return tree;
+}
+
+static bool huffman_decode(const uint8_t* in, size_t len, char* out, size_t* out_len) {
+    HuffmanNode* tree = huffman_get_tree();
+
+    size_t n = 0;
+    int16_t node = 0;
+    int depth = 0;          // bits since last symbol
+    bool all_ones = true;   // those bits could be EOS prefix used as padding
+
+    for (size_t i = 0; i < len; i++) {
+        for (int b = 7; b >= 0; b--) {
+            int bit = (in[i] >> b) & 1;
+            int16_t next = tree[node][bit];
+            depth++;
+            all_ones = all_ones && bit;
+
+            if (next < 0) {
+                int sym = -next - 1;
+                if (sym == HUFFMAN_EOS) {
+                    return false;
+                }
+                out[n++] = (char)sym;
+                node = 0;
+                depth = 0;
+                all_ones = true;
+            } else if (next == 0) {
+                return false;
+            } else {
+                node = next;
+            }
+        }
+    }
+
+    // padding is at most 7 most significant bits of EOS
+    if (depth > 7 || !all_ones) {
+        return false;
+    }
+
+    *out_len = n;
+    return true;
+}
+
+static size_t huffman_encoded_len(const char* str, size_t len) {
+    size_t bits = 0;
+    for (size_t i = 0; i < len; i++) {
+        bits += HUFFMAN_CODES[(uint8_t)str[i]].bits;
+    }
+    return (bits + 7) / 8;
+}
+
+static void huffman_encode(const char* str, size_t len, uint8_t* out) {
+    uint64_t acc = 0;
+    int acc_bits = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        const HuffmanCode* code = &HUFFMAN_CODES[(uint8_t)str[i]];
+        acc = acc << code->bits | code->code;
+        acc_bits += code->bits;
+        while (acc_bits >= 8) {
+            acc_bits -= 8;
+            *out++ = (uint8_t)(acc >> acc_bits);
+        }
+    }
+
+    if (acc_bits > 0) {
+        *out = (uint8_t)(acc << (8 - acc_bits) | (0xff >> acc_bits));
+    }
+}
+
+static void table_init(HpackTable* table, size_t max_size) {
+    memset(table, 0, sizeof(HpackTable));
+    table->max_size = max_size;
+}
+
+static HpackEntry* table_get(HpackTable* table, size_t index) {
+    // index 0 is the newest entry
+    return &table->entries[(table->first + table->count - 1 - index) % table->cap];
+}
+
+static void table_evict_oldest(HpackTable* table) {
+    HpackEntry* entry = &table->entries[table->first];
+    table->size -= entry->name_len + entry->value_len + ENTRY_OVERHEAD;
+    free(entry->name);
+    table->first = (table->first + 1) % table->cap;
+    table->count--;
+}
+
+static void table_set_max_size(HpackTable* table, size_t max_size) {
+    table->max_size = max_size;
+    while (table->size > table->max_size) {
+        table_evict_oldest(table);
+    }
+}
+
+static void table_free(HpackTable* table) {
+    while (table->count > 0) {
+        table_evict_oldest(table);
+    }
+    free(table->entries);
+    memset(table, 0, sizeof(HpackTable));
+}
+
+static bool table_add(HpackTable* table, const char* name, size_t name_len, const char* value, size_t value_len) {
+    size_t entry_size = name_len + value_len + ENTRY_OVERHEAD;
+
+    // copy first - name may point to an entry that is about to be evicted
+    char* data = malloc(name_len + value_len + 1);
+    if (data == NULL) {
+        return false;
+    }
+    memcpy(data, name, name_len);
+    memcpy(data + name_len, value, value_len);
+
+    // entry bigger than the whole table just empties it
+    while (table->count > 0 && table->size + entry_size > table->max_size) {
+        table_evict_oldest(table);
+    }
+    if (entry_size > table->max_size) {
+        free(data);
+        return true;
+    }
+
+    if (table->count == table->cap) {
+        size_t new_cap = table->cap ? table->cap * 2 : 16;
+        HpackEntry* entries = malloc(new_cap * sizeof(HpackEntry));
+        if (entries == NULL) {
+            free(data);
+            return false;
+        }
+        for (size_t i = 0; i < table->count; i++) {
+            entries[i] = table->entries[(table->first + i) % table->cap];
+        }
+        free(table->entries);
+        table->entries = entries;
+        table->first = 0;
+        table->cap = new_cap;
+    }
+
+    HpackEntry* entry = &table->entries[(table->first + table->count) % table->cap];
+    entry->name = data;
+    entry->name_len = name_len;
+    entry->value = data + name_len;
+    entry->value_len = value_len;
+
+    table->count++;
+    table->size += entry_size;
+    return true;
+}
+
+void hpack_decoder_init(HpackDecoder* decoder, size_t max_table_size) {
+    table_init(&decoder->table, max_table_size);
+    decoder->settings_max_size = max_table_size;
+    decoder->scratch = NULL;
+    decoder->scratch_cap = 0;
+}
+
+void hpack_decoder_free(HpackDecoder* decoder) {
+    table_free(&decoder->table);
+    free(decoder->scratch);
+    decoder->scratch = NULL;
+    decoder->scratch_cap = 0;
+}
+
+static bool decode_int(const uint8_t** pos, const uint8_t* end, int prefix_bits, size_t* out) {
+    if (*pos >= end) {
+        return false;
+    }
+
+    size_t max_prefix = (1u << prefix_bits) - 1;
+    size_t value = **pos & max_prefix;
+    (*pos)++;
+    if (value < max_prefix) {
+        *out = value;
+        return true;
+    }
+
+    for (int shift = 0; *pos < end; shift += 7) {
+        if (shift > 28) {
+            return false;
+        }
+        uint8_t byte = **pos;
+        (*pos)++;
+        value += (size_t)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            *out = value;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Decode string literal into scratch at *scratch_used.
+static bool decode_string(HpackDecoder* decoder, const uint8_t** pos, const uint8_t* end,
+                          size_t* scratch_used, const char** out, size_t* out_len) {
+    if (*pos >= end) {
+        return false;
+    }
+
+    bool huffman = (**pos & 0x80) != 0;
+    size_t len;
+    if (!decode_int(pos, end, 7, &len) || len > (size_t)(end - *pos)) {
+        return false;
+    }
+
+    char* dest = decoder->scratch + *scratch_used;
+    if (huffman) {
+        if (!huffman_decode(*pos, len, dest, out_len)) {
+            return false;
+        }
+    } else {
+        memcpy(dest, *pos, len);
+        *out_len = len;
+    }
+
+    *out = dest;
+    *scratch_used += *out_len;
+    *pos += len;
+    return true;
+}
+
+static bool lookup_index(HpackDecoder* decoder, size_t index, const char** name, size_t* name_len, const char** value, size_t* value_len) {
+    if (index == 0) {
+        return false;
+    }
+
+    if (index <= STATIC_TABLE_LEN) {
+        const StaticEntry* entry = &STATIC_TABLE[index - 1];
+        *name = entry->name;
+        *name_len = strlen(entry->name);
+        *value = entry->value;
+        *value_len = strlen(entry->value);
+        return true;
+    }
+
+    index -= STATIC_TABLE_LEN + 1;
+    if (index >= decoder->table.count) {
+        return false;
+    }
+
+    HpackEntry* entry = table_get(&decoder->table, index);
+    *name = entry->name;
+    *name_len = entry->name_len;
+    *value = entry->value;
+    *value_len = entry->value_len;
+    return true;
+}
+
+bool hpack_decode(HpackDecoder* decoder, const uint8_t* block, size_t len, hpack_header_func on_header, void* ctx) {
+    // no string in block decodes to more than 8/5 of its encoded length
+    size_t needed = len * 8 / 5 + 1;
+    if (needed > decoder->scratch_cap) {
+        char* scratch = realloc(decoder->scratch, needed);
+        if (scratch == NULL) {
+            log_message(LOG_ERROR, "Failed to allocate memory for header decoding");
+            return false;
+        }
+        decoder->scratch = scratch;
+        decoder->scratch_cap = needed;
+    }
+
+    const uint8_t* pos = block;
+    const uint8_t* end = block + len;
+    bool headers_seen = false;
+
+    while (pos < end) {
+        uint8_t first = *pos;
+        size_t index;
+        const char *name, *value;
+        size_t name_len, value_len;
+        size_t scratch_used = 0;
+
+        if (first & 0x80) {
+            // indexed header field
+            if (!decode_int(&pos, end, 7, &index) || !lookup_index(decoder, index, &name, &name_len, &value, &value_len)) {
+                return false;
+            }
+        } else if ((first & 0xe0) == 0x20) {
+            // dynamic table size update, allowed only at the beginning of block
+            size_t max_size;
+            if (headers_seen || !decode_int(&pos, end, 5, &max_size) || max_size > decoder->settings_max_size) {
+                return false;
+            }
+            table_set_max_size(&decoder->table, max_size);
+            continue;
+        } else {
+            // literal - with incremental indexing (01), without indexing (0000) or never indexed (0001)
+            bool add_to_table = (first & 0xc0) == 0x40;
+            if (!decode_int(&pos, end, add_to_table ? 6 : 4, &index)) {
+                return false;
+            }
+
+            if (index == 0) {
+                if (!decode_string(decoder, &pos, end, &scratch_used, &name, &name_len)) {
+                    return false;
+                }
+            } else {
+                const char* unused_value;
+                size_t unused_len;
+                if (!lookup_index(decoder, index, &name, &name_len, &unused_value, &unused_len)) {
+                    return false;
+                }
+            }
+
+            if (!decode_string(decoder, &pos, end, &scratch_used, &value, &value_len)) {
+                return false;
+            }
+
+            // name may point into the table - call back before adding, which could evict it
+            if (!on_header(ctx, name, name_len, value, value_len)) {
+                return false;
+            }
+            headers_seen = true;
+
+            if (add_to_table && !table_add(&decoder->table, name, name_len, value, value_len)) {
+                return false;
+            }
+            continue;
+        }
+
+        headers_seen = true;
+        if (!on_header(ctx, name, name_len, value, value_len)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void hpack_encoder_init(HpackEncoder* encoder) {
+    table_init(&encoder->table, HPACK_DEFAULT_TABLE_SIZE);
+    encoder->size_update_pending = false;
+}
+
+void hpack_encoder_free(HpackEncoder* encoder) {
+    table_free(&encoder->table);
+}
+
+void hpack_encoder_set_max_size(HpackEncoder* encoder, size_t max_size) {
+    // we never use more than the default, even if peer allows it
+    if (max_size > HPACK_DEFAULT_TABLE_SIZE) {
+        max_size = HPACK_DEFAULT_TABLE_SIZE;
+    }
+    if (max_size != encoder->table.max_size) {
+        table_set_max_size(&encoder->table, max_size);
+        encoder->size_update_pending = true;
+    }
+}
+
+static bool encode_int(CometBuffer* out, uint8_t first_bits, int prefix_bits, size_t value) {
+    uint8_t bytes[16];
+    size_t n = 0;
+    size_t max_prefix = (1u << prefix_bits) - 1;
+
+    if (value < max_prefix) {
+        bytes[n++] = first_bits | (uint8_t)value;
+    } else {
+        bytes[n++] = first_bits | (uint8_t)max_prefix;
+        value -= max_prefix;
+        while (value >= 0x80) {
+            bytes[n++] = (uint8_t)(value & 0x7f) | 0x80;
+            value >>= 7;
+        }
+        bytes[n++] = (uint8_t)value;
+    }
+
+    return comet_buffer_append(out, bytes, n);
+}
+
+static bool encode_string(CometBuffer* out, const char* str, size_t len) {
+    size_t huffman_len = huffman_encoded_len(str, len);
+    if (huffman_len >= len) {
+        return encode_int(out, 0x00, 7, len) && comet_buffer_append(out, str, len);
+    }
+
+    if (!encode_int(out, 0x80, 7, huffman_len) || !comet_buffer_reserve(out, huffman_len)) {
+        return false;
+    }
+    huffman_encode(str, len, (uint8_t*)out->data + out->len);
+    out->len += huffman_len;
+    return true;
+}
+
+// Headers whose values change with every response would only churn the dynamic table.
+static bool worth_indexing(const char* name, size_t name_len) {
+    static const char* const SKIP[] = {"content-length", "date", "etag", "last-modified", "set-cookie", "authorization"};
+    for (size_t i = 0; i < sizeof(SKIP) / sizeof(SKIP[0]); i++) {
+        if (strlen(SKIP[i]) == name_len && memcmp(SKIP[i], name, name_len) == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool hpack_encode(HpackEncoder* encoder, CometBuffer* out, const char* name, size_t name_len, const char* value, size_t value_len) {
+    if (encoder->size_update_pending) {
+        if (!encode_int(out, 0x20, 5, encoder->table.max_size)) {
+            return false;
+        }
+        encoder->size_update_pending = false;
+    }
+
+    size_t name_index = 0;
+
+    for (size_t i = 0; i < STATIC_TABLE_LEN; i++) {
+        const StaticEntry* entry = &STATIC_TABLE[i];
+        if (strlen(entry->name) != name_len || memcmp(entry->name, name, name_len) != 0) {
+            continue;
+        }
+        if (strlen(entry->value) == value_len && memcmp(entry->value, value, value_len) == 0) {
+            return encode_int(out, 0x80, 7, i + 1);
+        }
+        if (name_index == 0) {
+            name_index = i + 1;
+        }
+    }
+
+    for (size_t i = 0; i < encoder->table.count; i++) {
+        HpackEntry* entry = table_get(&encoder->table, i);
+        if (entry->name_len != name_len || memcmp(entry->name, name, name_len) != 0) {
+            continue;
+        }
+        if (entry->value_len == value_len && memcmp(entry->value, value, value_len) == 0) {
+            return encode_int(out, 0x80, 7, STATIC_TABLE_LEN + 1 + i);
+        }
+        if (name_index == 0) {
+            name_index = STATIC_TABLE_LEN + 1 + i;
+        }
+    }
+
+    bool index = worth_indexing(name, name_len);
+    if (!encode_int(out, index ? 0x40 : 0x00, index ? 6 : 4, name_index)) {
+        return false;
+    }
+    if (name_index == 0 && !encode_string(out, name, name_len)) {
+        return false;
+    }
+    if (!encode_string(out, value, value_len)) {
+        return false;
+    }
+
+    return !index || table_add(&encoder->table, name, name_len, value, value_len);
+}
@@ -0,0 +1,112 @@
+#include "include/httputil.h"
+
+#include <string.h>
+#include <strings.h>
+
+#ifdef _WIN32
+#define strncasecmp _strnicmp
+#endif
+
+const char* find_bytes(const char* haystack, size_t haystack_len, const char* needle, size_t needle_len) {
+    if (needle_len > haystack_len) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i <= haystack_len - needle_len; i++) {
+        if (haystack[i] == needle[0] && memcmp(haystack + i, needle, needle_len) == 0) {
+            return haystack + i;
+        }
+    }
+
+    return NULL;
+}
+
+bool find_raw_header(const char* head, size_t head_len, const char* name, const char** value, size_t* value_len) {
+    size_t name_len = strlen(name);
+    const char* end = head + head_len;
+    const char* line = find_bytes(head, head_len, "\r\n", 2);
+
+    while (line != NULL && line + 2 < end) {
+        line += 2;
+        const char* line_end = find_bytes(line, end - line, "\r\n", 2);
+        if (line_end == NULL) {
+            line_end = end;
+        }
+
+        if ((size_t)(line_end - line) > name_len && line[name_len] == ':' && strncasecmp(line, name, name_len) == 0) {
+            const char* v = line + name_len + 1;
+            while (v < line_end && (*v == ' ' || *v == '\t')) v++;
+            *value = v;
+            *value_len = line_end - v;
+            return true;
+        }
+
+        line = line_end;
+    }
+
+    return false;
+}
+
+size_t remove_raw_header(char* head, size_t head_len, const char* name) {
+    size_t name_len = strlen(name);
+    char* end = head + head_len;
+    char* line = (char*)find_bytes(head, head_len, "\r\n", 2);
+
+    while (line != NULL && line + 2 < end) {
+        line += 2;
+        char* line_end = (char*)find_bytes(line, end - line, "\r\n", 2);
+        if (line_end == NULL) {
+            break;
+        }
+
+        if ((size_t)(line_end - line) > name_len && line[name_len] == ':' && strncasecmp(line, name, name_len) == 0) {
+            // drop the line together with its CRLF, keep looking from the same spot
+            memmove(line, line_end + 2, end - (line_end + 2));
+            end -= line_end + 2 - line;
+            line -= 2;
+            continue;
+        }
+
+        line = line_end;
+    }
+
+    return end - head;
+}
+
+bool is_http_token(const char* str, size_t len) {
+    if (len == 0) {
+        return false;
+    }
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)str[i];
+        bool ok = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+                  (c != 0 && strchr("!#$%&'*+-.^_`|~", c) != NULL);
+        if (!ok) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool header_value_has_token(const char* value, size_t value_len, const char* token) {
+    size_t token_len = strlen(token);
+    const char* end = value + value_len;
+
+    while (value < end) {
+        while (value < end && (*value == ' ' || *value == '\t' || *value == ',')) value++;
+
+        const char* token_end = value;
+        while (token_end < end && *token_end != ',') token_end++;
+
+        const char* trimmed_end = token_end;
+        while (trimmed_end > value && (trimmed_end[-1] == ' ' || trimmed_end[-1] == '\t')) trimmed_end--;
+
+        if ((size_t)(trimmed_end - value) == token_len && strncasecmp(value, token, token_len) == 0) {
+            return true;
+        }
+
+        value = token_end;
+    }
+
+    return false;
+}
@@ -0,0 +1,81 @@
+#ifndef _COMET_ATOMICS_H
+#define _COMET_ATOMICS_H
+
+// Minimal atomics for data shared with other threads, and thread-local storage for data that isn't.
+// Internal - not included by public headers.
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <windows.h>
+
+static inline void* comet_atomic_load_ptr(void* volatile* p) {
+    void* v = *p;
+    MemoryBarrier();
+    return v;
+}
+
+static inline void comet_atomic_store_ptr(void* volatile* p, void* v) {
+    MemoryBarrier();
+    *p = v;
+}
+
+static inline void* comet_atomic_exchange_ptr(void* volatile* p, void* v) {
+    return InterlockedExchangePointer(p, v);
+}
+
+static inline bool comet_atomic_cas_ptr(void* volatile* p, void* expected, void* desired) {
+    return InterlockedCompareExchangePointer(p, desired, expected) == expected;
+}
+
+static inline long comet_atomic_exchange_long(volatile long* p, long v) {
+    return InterlockedExchange(p, v);
+}
+
+static inline void comet_thread_yield(void) {
+    SwitchToThread();
+}
+
+#define COMET_THREAD_LOCAL __declspec(thread)
+
+#else
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sched.h>
+#endif
+
+static inline void* comet_atomic_load_ptr(void* volatile* p) {
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline void comet_atomic_store_ptr(void* volatile* p, void* v) {
+    __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+static inline void* comet_atomic_exchange_ptr(void* volatile* p, void* v) {
+    return __atomic_exchange_n(p, v, __ATOMIC_ACQ_REL);
+}
+
+static inline bool comet_atomic_cas_ptr(void* volatile* p, void* expected, void* desired) {
+    return __atomic_compare_exchange_n(p, &expected, desired, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+static inline long comet_atomic_exchange_long(volatile long* p, long v) {
+    return __atomic_exchange_n(p, v, __ATOMIC_ACQ_REL);
+}
+
+static inline void comet_thread_yield(void) {
+#ifdef _WIN32
+    SwitchToThread();
+#else
+    sched_yield();
+#endif
+}
+
+#define COMET_THREAD_LOCAL __thread
+
+#endif
+
+#endif
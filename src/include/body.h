@@ -0,0 +1,145 @@
+#ifndef _COMET_BODY_H
+#define _COMET_BODY_H
+
+#include <httpc.h>
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Response bodies that are sent without being copied.
+ *
+ * httpc_response_set_body copies the body, and the router copies it again when serializing the response.
+ * Bodies attached with functions below are instead written to the socket straight from the caller's memory,
+ * next to the serialized head. They replace body set with httpc_response_set_body, and the router sets
+ * Content-Length for them.
+ *
+ * Body is tracked by comet and stays attached until the router sends the response - responses returned
+ * from handlers must not be freed by the handler, same as with any other response. Responses that are
+ * thrown away instead, e.g. by middleware, should be freed with comet_response_free, which releases their
+ * body too - httpc_response_free frees the response, but leaves its body unreleased and still tracked.
+ */
+
+typedef void (*body_release_func)(void*, const void*, size_t);
+
+/**
+ * @brief Hand malloc'd buffer over to response, it is freed once the response is sent.
+ * @return true on success, false on error (data is freed in that case too).
+ */
+bool comet_response_take_body(HttpcResponse* res, void* data, size_t len);
+
+/**
+ * @brief Send buffer that outlives the response without copying it.
+ *
+ * @param res The response to attach body to.
+ * @param data Body, must stay valid until release is called.
+ * @param len Length of body.
+ * @param release Called with release_ctx, data and len once response is sent. NULL for static data.
+ * @param release_ctx Passed to release.
+ * @return true on success, false on error (release is still called).
+ */
+bool comet_response_borrow_body(HttpcResponse* res, const void* data, size_t len, body_release_func release, void* release_ctx);
+
+/**
+ * @brief Free response together with body attached to it - release callback is called, file is closed.
+ */
+void comet_response_free(HttpcResponse* res);
+
+/**
+ * @brief Send part of a file as response body.
+ *
+ * Over plain connections, and over TLS once kernel TLS took over encryption, file goes from page cache
+ * to socket with sendfile, without being read into memory.
+ *
+ * @param res The response to attach body to.
+ * @param fd Open file, closed once response is sent (or on error).
+ * @param offset Where body starts in the file.
+ * @param len Length of body, file must have that many bytes after offset.
+ * @return true on success, false on error.
+ */
+bool comet_response_send_file(HttpcResponse* res, int fd, uint64_t offset, size_t len);
+
+/**
+ * @brief Growable buffer for building response bodies.
+ *
+ * Buffers come from a pool and go back to it once the response they were attached to is sent,
+ * so building a body usually doesn't allocate at all.
+ */
+typedef struct CometBuffer {
+    char* data;
+    size_t len;
+    size_t cap;
+    bool failed;                // some append failed to allocate, body is incomplete
+    struct CometBuffer* next;   // pool free list
+} CometBuffer;
+
+/**
+ * @brief Get buffer from pool.
+ * @param size_hint Expected size of body, 0 if unknown.
+ * @return Empty buffer, NULL on error.
+ */
+CometBuffer* comet_buffer_new(size_t size_hint);
+
+/**
+ * @brief Return buffer to pool. Only for buffers that weren't attached to a response.
+ */
+void comet_buffer_free(CometBuffer* buf);
+
+/**
+ * @brief Make sure extra bytes fit after buf->len, for writing into buf->data directly.
+ */
+bool comet_buffer_reserve(CometBuffer* buf, size_t extra);
+
+bool comet_buffer_append(CometBuffer* buf, const void* data, size_t len);
+bool comet_buffer_append_str(CometBuffer* buf, const char* str);
+bool comet_buffer_appendf(CometBuffer* buf, const char* fmt, ...);
+bool comet_buffer_vappendf(CometBuffer* buf, const char* fmt, va_list args);
+
+/**
+ * @brief Append str as JSON string literal - quoted, with quotes, backslashes and control characters escaped.
+ */
+bool comet_buffer_append_json_string(CometBuffer* buf, const char* str, size_t len);
+
+/**
+ * @brief Attach buffer to response as its body. Response owns it from now on, even if this fails.
+ * @return false if buffer is incomplete (some append failed) or on error.
+ */
+bool comet_response_set_buffer(HttpcResponse* res, CometBuffer* buf);
+
+/**
+ * Body detached from response, for the router to send. Internal.
+ */
+typedef struct {
+    HttpcResponse* res;
+    const void* data;           // NULL for file bodies
+    size_t len;
+    body_release_func release;
+    void* release_ctx;
+    int file_fd;                // -1 unless body comes from comet_response_send_file
+    uint64_t file_offset;
+} ResponseBody;
+
+/**
+ * @brief Detach body attached to res, if there is one.
+ */
+bool response_body_take(HttpcResponse* res, ResponseBody* out);
+
+/**
+ * @brief Read file body into memory, for senders that can't use sendfile.
+ * @return false on error, body is unchanged then.
+ */
+bool response_body_load(ResponseBody* body);
+
+/**
+ * @brief Let owner of body know it is no longer needed.
+ */
+void response_body_release(ResponseBody* body);
+
+/**
+ * @brief Free buffers pooled by the calling thread, for threads that are about to exit.
+ */
+void buffer_pool_clear(void);
+
+#endif
@@ -0,0 +1,130 @@
+#ifndef _COMET_FIBER_H
+#define _COMET_FIBER_H
+
+#include "netctx.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Configuration of fiber execution mode.
+ */
+typedef struct {
+    size_t stack_size;  // stack size of every fiber, in bytes
+    size_t max_fibers;  // max requests in flight, new connections wait in accept queue above that
+} CometFiberConfig;
+
+extern const CometFiberConfig COMET_FIBER_DEFAULT_CONFIG;
+
+typedef void (*fiber_func)(void*);
+typedef struct CometFiber CometFiber;
+
+/**
+ * Scheduler used by the router in fiber mode. Single threaded - every function
+ * here has to be called from the thread that called fiber_scheduler_init.
+ */
+bool fiber_scheduler_init(CometFiberConfig config);
+void fiber_scheduler_deinit(void);
+
+/**
+ * @brief Queue fn(arg) to run on a pooled fiber.
+ * @return false if max_fibers are already running or fiber could not be created.
+ */
+bool fiber_spawn(fiber_func fn, void* arg);
+
+/**
+ * @brief Run every ready fiber, then wait up to timeout_ms for fds/timers of suspended ones.
+ */
+void fiber_scheduler_run_once(int timeout_ms);
+
+/**
+ * @brief Number of spawned fibers that did not finish yet.
+ */
+size_t fiber_active_count(void);
+
+/**
+ * @brief Check whether the caller runs on a fiber.
+ */
+bool comet_in_fiber(void);
+
+/**
+ * @brief Fiber the caller runs on, NULL outside of fibers.
+ */
+CometFiber* fiber_self(void);
+
+/**
+ * @brief Milliseconds on monotonic clock, the one fiber timeouts are measured with.
+ */
+uint64_t comet_now_ms(void);
+
+/**
+ * @brief Cut short the wait of a suspended fiber - its comet_wait_fd returns 0 as if it timed out.
+ *
+ * Does nothing if fiber is not waiting, so the woken fiber has to check its condition before waiting again.
+ */
+void fiber_wake(CometFiber* fiber);
+
+/**
+ * Non-blocking primitives for handlers.
+ *
+ * Called from a fiber, they suspend only the calling request and let the event loop serve
+ * other connections in the meantime. Called outside of fiber (synchronous mode) they simply block.
+ * Timeouts are in milliseconds, negative timeout means "wait forever".
+ */
+
+/**
+ * @brief Suspend for ms milliseconds.
+ */
+void comet_sleep(int ms);
+
+/**
+ * @brief Wait until fd is ready for events (POLLIN/POLLOUT).
+ * @return Received poll events, 0 on timeout.
+ */
+short comet_wait_fd(NetSocket fd, short events, int timeout_ms);
+
+/**
+ * @brief Open non-blocking stream connection to addr.
+ * @return Connected socket or SOCKET_ERROR.
+ */
+NetSocket comet_connect(NetAddress addr, int timeout_ms);
+
+/**
+ * @brief Read at most len bytes from non-blocking socket, waiting for data if needed.
+ * @return Bytes read, 0 on EOF, SOCKET_ERROR on error or timeout.
+ */
+ByteCount comet_read(NetSocket fd, void* buf, size_t len, int timeout_ms);
+
+/**
+ * @brief Write whole buffer to non-blocking socket, waiting for it to drain if needed.
+ * @return len on success, SOCKET_ERROR on error or timeout.
+ */
+ByteCount comet_write(NetSocket fd, const void* buf, size_t len, int timeout_ms);
+
+/**
+ * @brief Write all buffers in order, like comet_write, using vectored send.
+ * @return Total length on success, SOCKET_ERROR on error or timeout.
+ */
+ByteCount comet_writev(NetSocket fd, const NetBuffer* bufs, size_t count, int timeout_ms);
+
+/**
+ * @brief Send len bytes of file starting at offset, waiting for socket to drain if needed.
+ *
+ * Uses sendfile where available, so file data doesn't pass through user space.
+ * @return len on success, SOCKET_ERROR on error or timeout.
+ */
+ByteCount comet_sendfile(NetSocket fd, int file_fd, uint64_t offset, size_t len, int timeout_ms);
+
+/**
+ * @brief Read from file at offset, without moving its position.
+ * @return Bytes read, 0 at end of file, SOCKET_ERROR on error.
+ */
+ByteCount comet_file_read(int file_fd, void* buf, size_t len, uint64_t offset);
+
+/**
+ * @brief Close socket opened by comet_connect.
+ */
+void comet_close(NetSocket fd);
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef _COMET_H2_H
+#define _COMET_H2_H
+
+#include "netctx.h"
+#include <httpc.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief A struct to hold the configuration of HTTP/2 connections.
+ */
+typedef struct {
+    uint32_t max_concurrent_streams;    // requests in flight per connection, client is refused more
+    uint32_t initial_window_size;       // request body bytes client may send per stream before we acknowledge them
+    uint32_t max_frame_size;            // biggest frame we accept
+    size_t max_header_list_size;        // bigger request headers get 431
+    size_t max_request_body;            // bigger request bodies get 413
+    int idle_timeout_ms;                // connection without streams is closed after this much silence
+} CometH2Config;
+
+extern const CometH2Config COMET_H2_DEFAULT_CONFIG;
+
+/**
+ * Called for every complete request, on its own fiber. Returned response is freed by the caller,
+ * request too - callback may replace it (middleware can).
+ */
+typedef HttpcResponse* (*h2_dispatch_func)(void*, HttpcRequest**);
+
+/**
+ * @brief Check whether connection starts with HTTP/2 client preface (prior knowledge h2c).
+ */
+bool h2_is_preface(const char* data, size_t len);
+
+/**
+ * @brief Check whether raw request head asks for upgrade to h2c.
+ */
+bool h2_is_upgrade_request(const char* head, size_t head_len);
+
+/**
+ * @brief Serve HTTP/2 connection until client closes it. Used by the router, needs fiber mode.
+ *
+ * @param config The HTTP/2 configuration.
+ * @param conn Client connection.
+ * @param dispatch Called for every request.
+ * @param dispatch_ctx Passed to dispatch.
+ * @param initial Bytes already read from connection - client preface and whatever came after it.
+ * @param initial_len Length of initial.
+ * @param upgraded HTTP/1.1 request that asked for upgrade, it becomes stream 1. NULL for prior knowledge.
+ *                 Session takes ownership of it.
+ * @param upgrade_head Raw head of upgraded request, for its HTTP2-Settings header.
+ * @param upgrade_head_len Length of upgrade_head.
+ */
+void h2_run_session(const CometH2Config* config, NetConnection* conn, h2_dispatch_func dispatch, void* dispatch_ctx,
+                    const char* initial, size_t initial_len,
+                    HttpcRequest* upgraded, const char* upgrade_head, size_t upgrade_head_len);
+
+#endif
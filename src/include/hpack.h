@@ -0,0 +1,76 @@
+#ifndef _COMET_HPACK_H
+#define _COMET_HPACK_H
+
+// HPACK (RFC 7541) header compression for HTTP/2. Internal.
+
+#include "body.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define HPACK_DEFAULT_TABLE_SIZE 4096
+
+typedef struct {
+    char* name;         // name and value share one allocation
+    size_t name_len;
+    char* value;
+    size_t value_len;
+} HpackEntry;
+
+/**
+ * Dynamic table - ring of entries, newest one has the lowest index.
+ */
+typedef struct {
+    HpackEntry* entries;
+    size_t first;       // oldest entry
+    size_t count;
+    size_t cap;
+    size_t size;        // sum of entry sizes as defined by RFC (name + value + 32)
+    size_t max_size;
+} HpackTable;
+
+typedef struct {
+    HpackTable table;
+    size_t settings_max_size;   // what we advertised in SETTINGS_HEADER_TABLE_SIZE
+    char* scratch;              // decoded strings live here until callback returns
+    size_t scratch_cap;
+} HpackDecoder;
+
+typedef struct {
+    HpackTable table;
+    bool size_update_pending;   // peer changed table size, next block has to start with size update
+} HpackEncoder;
+
+/**
+ * Called for every decoded header. Strings are not NUL-terminated, and are valid only during the call.
+ * Returning false stops decoding.
+ */
+typedef bool (*hpack_header_func)(void*, const char*, size_t, const char*, size_t);
+
+void hpack_decoder_init(HpackDecoder* decoder, size_t max_table_size);
+void hpack_decoder_free(HpackDecoder* decoder);
+
+/**
+ * @brief Decode complete header block.
+ * @return false on malformed block (COMPRESSION_ERROR) or when callback stopped decoding.
+ */
+bool hpack_decode(HpackDecoder* decoder, const uint8_t* block, size_t len, hpack_header_func on_header, void* ctx);
+
+void hpack_encoder_init(HpackEncoder* encoder);
+void hpack_encoder_free(HpackEncoder* encoder);
+
+/**
+ * @brief Apply peer's SETTINGS_HEADER_TABLE_SIZE.
+ */
+void hpack_encoder_set_max_size(HpackEncoder* encoder, size_t max_size);
+
+/**
+ * @brief Append header to header block. Name must be lowercase.
+ *
+ * Header found in static or dynamic table is sent as index, others are added to dynamic table,
+ * so headers repeated in every response cost a byte or two after the first one.
+ */
+bool hpack_encode(HpackEncoder* encoder, CometBuffer* out, const char* name, size_t name_len, const char* value, size_t value_len);
+
+#endif
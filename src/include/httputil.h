@@ -0,0 +1,43 @@
+#ifndef _COMET_HTTP_UTIL_H
+#define _COMET_HTTP_UTIL_H
+
+// Helpers for looking at raw HTTP/1.1 messages without parsing them. Internal.
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Raw HTTP message as read from the wire - head followed by body.
+ */
+typedef struct {
+    char* data;
+    size_t len;
+    size_t head_len;
+} RawHttpMessage;
+
+const char* find_bytes(const char* haystack, size_t haystack_len, const char* needle, size_t needle_len);
+
+/**
+ * Look up header value in raw message head, without parsing the whole message.
+ * Value is trimmed from leading spaces, it is not null-terminated.
+ */
+bool find_raw_header(const char* head, size_t head_len, const char* name, const char** value, size_t* value_len);
+
+/**
+ * Remove every occurrence of header from raw message head in place.
+ * @return New length of head.
+ */
+size_t remove_raw_header(char* head, size_t head_len, const char* name);
+
+/**
+ * Case-insensitive check whether comma separated header value contains token,
+ * e.g. "keep-alive, Upgrade" contains "upgrade".
+ */
+bool header_value_has_token(const char* value, size_t value_len, const char* token);
+
+/**
+ * Check whether str is a non-empty token (RFC 9110 tchar), valid as header name or method.
+ */
+bool is_http_token(const char* str, size_t len);
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef _COMET_LOOPBACK_H
+#define _COMET_LOOPBACK_H
+
+#include "netctx.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * In-memory transport. Connections are scripted: each one "sends" given request bytes, and whatever
+ * the server writes back is captured. No kernel, no sockets - router throughput can be measured
+ * without TCP stack noise, and load tests run the same way every time.
+ *
+ * ```c
+ * NetLoopback* lb = net_loopback_new(NULL, NULL);
+ * net_loopback_push(lb, "GET / HTTP/1.1\r\n\r\n", 18, 100000);
+ *
+ * CometRouter* router = router_init_transport(&NET_LOOPBACK_TRANSPORT, lb, NULL);
+ * net_loopback_stop_when_done(lb, &router->running);
+ * router_start(router); // returns once all 100000 responses are in
+ * ```
+ */
+
+extern const NetTransport NET_LOOPBACK_TRANSPORT;
+
+typedef struct NetLoopback NetLoopback;
+
+/**
+ * Called with complete response of every connection as it is closed. Response is valid only during the call.
+ */
+typedef void (*loopback_response_func)(void*, size_t, const char*, size_t);
+
+/**
+ * @brief Create loopback transport.
+ * @param on_response Called for every closed connection, NULL to keep responses for net_loopback_response.
+ * @param ctx Passed to on_response.
+ */
+NetLoopback* net_loopback_new(loopback_response_func on_response, void* ctx);
+void net_loopback_free(NetLoopback* lb);
+
+/**
+ * @brief Script count connections, each sending request. Request is copied.
+ * @return Id of the first of them - ids are consecutive, in order of pushing, starting from 0.
+ */
+size_t net_loopback_push(NetLoopback* lb, const void* request, size_t len, size_t count);
+
+/**
+ * @brief Hand request bytes to server in pieces of at most read_size bytes, to exercise partial reads.
+ * 0 (default) gives everything at once.
+ */
+void net_loopback_set_read_size(NetLoopback* lb, size_t read_size);
+
+/**
+ * @brief Set *flag to false once every scripted connection was accepted and closed - pass &router->running.
+ */
+void net_loopback_stop_when_done(NetLoopback* lb, volatile bool* flag);
+
+/**
+ * @brief Number of connections closed so far.
+ */
+size_t net_loopback_completed(NetLoopback* lb);
+
+/**
+ * @brief Response captured on connection id. Only without on_response callback.
+ * @return Response bytes, NULL if connection isn't closed yet.
+ */
+const char* net_loopback_response(NetLoopback* lb, size_t id, size_t* len);
+
+#endif
@@ -0,0 +1,87 @@
+#ifndef _COMET_MEMSTATS_H
+#define _COMET_MEMSTATS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief What accounted memory is held for.
+ */
+typedef enum {
+    COMET_MEM_CONNECTIONS,      // per-connection state of the router
+    COMET_MEM_REQUEST_BUFFERS,  // raw request bytes as received
+    COMET_MEM_REQUESTS,         // parsed requests
+    COMET_MEM_PARAMS,           // url params of matched routes
+    COMET_MEM_RESPONSES,        // serialized response heads and in-memory bodies
+    COMET_MEM_CATEGORY_COUNT,
+} CometMemoryCategory;
+
+/**
+ * @brief A struct to hold memory budgets of the router.
+ */
+typedef struct {
+    size_t connection_budget;   // request head and body one connection may buffer, larger requests get 413. 0 for no limit
+    size_t global_budget;       // accounted bytes of all connections together, requests that would go over get 503. 0 for no limit
+} CometMemoryConfig;
+
+extern const CometMemoryConfig COMET_MEMORY_DEFAULT_CONFIG;
+
+/**
+ * @brief Accounted memory, by category. Sizes of parsed requests and params are close estimates -
+ * httpc allocates them itself.
+ */
+typedef struct {
+    size_t current[COMET_MEM_CATEGORY_COUNT];
+    size_t peak[COMET_MEM_CATEGORY_COUNT];
+    size_t total;
+    size_t peak_total;
+    size_t connections;             // open right now
+    uint64_t rejected_too_large;    // answered 413, over connection_budget
+    uint64_t rejected_over_budget;  // answered 503, over global_budget
+} CometMemoryStats;
+
+/**
+ * Memory accounting of one router. Everything here belongs to the network thread - call it from
+ * handlers and middleware, not from offloaded handlers or other threads.
+ */
+typedef struct {
+    CometMemoryConfig config;
+    CometMemoryStats stats;
+} CometMemory;
+
+/**
+ * @brief Bytes charged on behalf of one connection, all given back when it closes.
+ */
+typedef struct {
+    size_t bytes[COMET_MEM_CATEGORY_COUNT];
+} CometMemoryCharge;
+
+void comet_memory_init(CometMemory* mem, CometMemoryConfig config);
+
+/**
+ * @brief Check whether bytes more can be charged without going over global budget.
+ */
+bool comet_memory_fits(const CometMemory* mem, size_t bytes);
+
+/**
+ * @brief Account bytes of category to connection's charge.
+ */
+void comet_memory_charge(CometMemory* mem, CometMemoryCharge* charge, CometMemoryCategory category, size_t bytes);
+
+/**
+ * @brief Give back everything charged to charge, and reset it.
+ */
+void comet_memory_release(CometMemory* mem, CometMemoryCharge* charge);
+
+/**
+ * @brief Name of category, for logs.
+ */
+const char* comet_memory_category_name(CometMemoryCategory category);
+
+/**
+ * @brief Write current and peak usage of every category to the log.
+ */
+void comet_memory_log(const CometMemory* mem);
+
+#endif
@@ -5,36 +5,191 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#define NETADDR_UNIX_PATH_MAX 108
+
+/**
+ * @brief Address families a NetContext can listen on.
+ */
+typedef enum {
+    NETADDR_IPV4,
+    NETADDR_IPV6,
+    NETADDR_UNIX,
+} NetAddressFamily;
+
+/**
+ * @brief Family-agnostic socket address.
+ *
+ * `port` and `host.ip` are kept in network byte order, same as in sockaddr_in.
+ * `port` is ignored for NETADDR_UNIX addresses.
+ */
 typedef struct {
-    uint32_t ip;
+    NetAddressFamily family;
     uint16_t port;
-    uint16_t padding;
+    union {
+        uint32_t ip;
+        uint8_t ip6[16];
+        char path[NETADDR_UNIX_PATH_MAX];
+    } host;
 } NetAddress;
 
 #ifdef _WIN32
 #include <winsock2.h>
+#include <ws2tcpip.h>
 // #define SOCKET_ERROR INVALID_SOCKET
 typedef int ByteCount;
 typedef SOCKET NetSocket;
 #else
 #define SOCKET_ERROR -1
 #include <sys/types.h>
+#include <sys/socket.h>
 #include <netinet/in.h>
 typedef int NetSocket;
 typedef ssize_t ByteCount;
 #endif
 
-NetAddress netaddr_from_sockaddr(const struct sockaddr_in *addr);
-struct sockaddr_in netaddr_to_sockaddr(NetAddress addr);
+/**
+ * @brief One piece of data for scatter-gather sends.
+ */
+typedef struct {
+    const void *data;
+    size_t len;
+} NetBuffer;
+
+NetAddress netaddr_any_ipv4(uint16_t port);
+NetAddress netaddr_any_ipv6(uint16_t port);
+
+/**
+ * @brief Unix domain socket address.
+ *
+ * Path must be shorter than NETADDR_UNIX_PATH_MAX bytes. Longer one is not truncated - address gets
+ * an empty path instead, which netctx_init_addr refuses.
+ */
+NetAddress netaddr_unix(const char *path);
+
+/**
+ * @brief Parse textual address into NetAddress.
+ *
+ * Accepts IPv4 ("127.0.0.1"), IPv6 ("::1", "[::1]") and unix socket paths
+ * prefixed with "unix:" ("unix:/run/comet.sock").
+ *
+ * @param str Address to parse.
+ * @param port Port in host byte order, ignored for unix sockets.
+ * @param out Where to store parsed address.
+ * @return true on success, false if str is not a valid address.
+ */
+bool netaddr_parse(const char *str, uint16_t port, NetAddress *out);
 
+NetAddress netaddr_from_sockaddr(const struct sockaddr *addr, socklen_t addr_len);
+socklen_t netaddr_to_sockaddr(NetAddress addr, struct sockaddr_storage *out);
+
+/**
+ * @brief Format address for logging, e.g. "127.0.0.1:8080", "[::1]:8080" or "unix:/run/comet.sock".
+ */
+const char* netaddr_to_string(NetAddress addr, char *buf, size_t buf_len);
+
+/**
+ * @brief Listening and per-connection socket tuning.
+ * 
+ * Zero in any of the size-like fields means "leave system default". Zero (or negative) recv/send
+ * timeout means no timeout at all - connection waits for its peer forever, so keep them positive
+ * unless something else closes idle connections.
+ * TCP-only options are ignored when listening on unix domain socket.
+ */
 typedef struct {
-    NetAddress local_addr;
+    int backlog;                // listen() backlog
+    int accept_budget;          // max connections accepted in one go when queue is drained
+    int recv_timeout_ms;        // how long to wait for client data before giving up, 0 to wait forever
+    int send_timeout_ms;        // how long to wait for client to accept data before giving up, 0 to wait forever
+    bool tcp_nodelay;           // disable Nagle algorithm on accepted connections
+    int tcp_defer_accept_s;     // TCP_DEFER_ACCEPT - wake up only when data arrived (linux)
+    int tcp_fastopen_qlen;      // TCP_FASTOPEN queue length
+    bool reuseport;             // SO_REUSEPORT - allows several processes on the same port
+    int send_buffer_size;       // SO_SNDBUF
+    int recv_buffer_size;       // SO_RCVBUF
+} NetConfig;
+
+extern const NetConfig NET_DEFAULT_CONFIG;
+
+/**
+ * @brief Accepted client connection.
+ * 
+ * Socket is non-blocking, netconn_send/netconn_recv wait for it up to configured timeouts,
+ * suspending only the calling fiber when router runs in fiber mode.
+ */
+typedef struct {
+    NetSocket sockfd;           // SOCKET_ERROR for connections of transports without sockets
     NetAddress remote_addr;
-    NetSocket local_sockfd;
-    NetSocket remote_sockfd;
+    int recv_timeout_ms;
+    int send_timeout_ms;
+    void* tls;                  // OpenSSL SSL* once TLS handshake is done, NULL for plain connections
+    const struct NetTransport* transport;   // NULL means NET_SOCKET_TRANSPORT
+    void* transport_conn;       // transport's own per-connection state
+} NetConnection;
+
+/**
+ * @brief Where connections come from and how their bytes move.
+ *
+ * NetContext uses NET_SOCKET_TRANSPORT unless created with netctx_init_transport.
+ * Optional functions may be NULL, netconn_* then fall back to send.
+ */
+typedef struct NetTransport {
+    const char *name;
+    /** Hand out next connection, false if none is waiting. state is the one given to netctx_init_transport. */
+    bool (*accept)(void *state, NetConnection *out_conn);
+    /** Same contract as netconn_recv. */
+    ByteCount (*recv)(NetConnection *conn, void *buf, size_t len);
+    /** Send whole buffer, same contract as netconn_send. */
+    ByteCount (*send)(NetConnection *conn, const void *buf, size_t len);
+    ByteCount (*sendv)(NetConnection *conn, const NetBuffer *bufs, size_t count);                // optional
+    ByteCount (*try_send)(NetConnection *conn, const void *buf, size_t len);                     // optional
+    ByteCount (*sendfile)(NetConnection *conn, int file_fd, uint64_t offset, size_t len);        // optional
+    /** Same contract as netconn_peer_closed. Optional, connections are then assumed open. */
+    bool (*peer_closed)(NetConnection *conn);
+    void (*close)(NetConnection *conn);
+} NetTransport;
+
+/**
+ * @brief Non-blocking TCP and unix domain sockets.
+ */
+extern const NetTransport NET_SOCKET_TRANSPORT;
+
+struct CometTlsContext;
+
+typedef struct {
+    NetAddress local_addr;
+    NetSocket local_sockfd;     // SOCKET_ERROR when transport doesn't listen on a socket
+    NetConfig config;
+    NetConnection current;
+    NetConnection* pending;
+    size_t pending_head;
+    size_t pending_count;
+    struct CometTlsContext* tls;    // accepted connections speak TLS when set, see tls.h
+    const NetTransport* transport;
+    void* transport_state;
 } NetContext;
 
 bool netctx_init(NetContext **out_ctx, uint16_t port);
+bool netctx_init_addr(NetContext **out_ctx, NetAddress addr, NetConfig config);
+/**
+ * @brief Initialize context that takes connections from transport instead of listening socket.
+ *
+ * Only timeouts are used from config. Transport state stays owned by the caller and must outlive the context.
+ */
+bool netctx_init_transport(NetContext **out_ctx, const NetTransport *transport, void *transport_state, NetConfig config);
+/**
+ * @brief Take next connection from the accept queue.
+ * 
+ * When no connections are queued, listening socket is drained with up to
+ * config.accept_budget accepts, so bursts of clients are picked up in one pass.
+ * 
+ * @return false if there is no connection waiting.
+ */
+bool netctx_accept(NetContext *ctx, NetConnection *out_conn);
+
+/**
+ * @brief Make next connection the current one, see netctx_accept.
+ * @return Socket of the new current connection or SOCKET_ERROR if there is none.
+ */
 NetSocket netctx_get_next_connection(NetContext *ctx);
 void netctx_close_current_connection(NetContext *ctx);
 void netctx_deinit(NetContext *ctx);
@@ -44,4 +199,40 @@ bool netctx_config_timeout(NetSocket sockfd, int send_timeout_ms, int recv_timeo
 ByteCount netctx_send(NetContext *ctx, const void *buf, size_t len);
 ByteCount netctx_recv(NetContext *ctx, void *buf, size_t len);
 
+/**
+ * @brief Send whole buffer to the client.
+ * @return len on success, SOCKET_ERROR on error or timeout.
+ */
+ByteCount netconn_send(NetConnection *conn, const void *buf, size_t len);
+
+/**
+ * @brief Receive at most len bytes from the client.
+ * @return Bytes received, 0 when client closed connection, SOCKET_ERROR on error or timeout.
+ */
+ByteCount netconn_recv(NetConnection *conn, void *buf, size_t len);
+/**
+ * @brief Send several buffers with as few syscalls as possible, without joining them first.
+ * @return Total bytes sent, SOCKET_ERROR on error or timeout.
+ */
+ByteCount netconn_sendv(NetConnection *conn, const NetBuffer *bufs, size_t count);
+/**
+ * @brief Send as much of buffer as fits into socket buffer right now, without waiting.
+ * @return Bytes sent (possibly 0), SOCKET_ERROR on error.
+ */
+ByteCount netconn_try_send(NetConnection *conn, const void *buf, size_t len);
+/**
+ * @brief Send len bytes of file from offset. Zero-copy sendfile on plain connections,
+ * and on TLS connections when kernel TLS took over encryption.
+ * @return len on success, SOCKET_ERROR on error or timeout.
+ */
+ByteCount netconn_sendfile(NetConnection *conn, int file_fd, uint64_t offset, size_t len);
+/**
+ * @brief Check without waiting whether client closed the connection, for streams where it never sends anything.
+ *
+ * Whatever the client did send is read and discarded.
+ * @return true if client closed the connection or it broke, false if it is still open.
+ */
+bool netconn_peer_closed(NetConnection *conn);
+void netconn_close(NetConnection *conn);
+
 #endif
@@ -0,0 +1,62 @@
+#ifndef _COMET_NET_PLAT_H
+#define _COMET_NET_PLAT_H
+
+// Platform glue for socket code. Internal - not included by public headers.
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+
+#define COMET_ERROR_TIMEOUT WSAETIMEDOUT
+#define COMET_ERROR_CANCELLED WSAEINTR
+#define COMET_ERROR_WOULD_BLOCK WSAEWOULDBLOCK
+#define COMET_ERROR_AGAIN WSAEWOULDBLOCK
+#define COMET_ERROR_IN_PROGRESS WSAEWOULDBLOCK
+#define GET_ERROR_STR() strerror(WSAGetLastError())
+#define GET_ERROR_CODE() WSAGetLastError()
+#define SET_ERROR_CODE(e) WSASetLastError(e)
+#define CLOSE_SOCKET(s) closesocket(s)
+#define SHUTDOWN_SOCKET(s) shutdown(s, SD_BOTH)
+#define POLL_SOCKETS(fds, n, timeout) WSAPoll(fds, n, timeout)
+#define SEND_FLAGS 0
+
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <string.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+
+#define COMET_ERROR_TIMEOUT ETIMEDOUT
+#define COMET_ERROR_CANCELLED EINTR
+#define COMET_ERROR_WOULD_BLOCK EWOULDBLOCK
+#define COMET_ERROR_AGAIN EAGAIN
+#define COMET_ERROR_IN_PROGRESS EINPROGRESS
+#define GET_ERROR_STR() strerror(errno)
+#define GET_ERROR_CODE() errno
+#define SET_ERROR_CODE(e) (errno = (e))
+#define CLOSE_SOCKET(s) close(s)
+#define SHUTDOWN_SOCKET(s) shutdown(s, SHUT_RDWR)
+#define POLL_SOCKETS(fds, n, timeout) poll(fds, n, timeout)
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
+#endif
+
+#define IS_WOULD_BLOCK(err) ((err) == COMET_ERROR_WOULD_BLOCK || (err) == COMET_ERROR_AGAIN)
+
+#endif
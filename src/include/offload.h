@@ -0,0 +1,107 @@
+#ifndef _COMET_OFFLOAD_H
+#define _COMET_OFFLOAD_H
+
+#include "fiber.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief A struct to hold the configuration of offload pool.
+ */
+typedef struct {
+    size_t threads;         // worker threads, 0 for one per CPU
+    size_t max_queued;      // jobs waiting for a worker, more are rejected
+    int max_wait_ms;        // jobs that waited longer than this for a worker are dropped instead of run, negative for no limit
+} CometOffloadConfig;
+
+extern const CometOffloadConfig COMET_OFFLOAD_DEFAULT_CONFIG;
+
+/**
+ * @brief How an offloaded job ended.
+ */
+typedef enum {
+    COMET_OFFLOAD_DONE,
+    COMET_OFFLOAD_REJECTED,     // queue was full
+    COMET_OFFLOAD_EXPIRED,      // waited for a worker longer than max_wait_ms
+} CometOffloadStatus;
+
+/**
+ * @brief Snapshot of pool counters, see comet_offload_stats.
+ */
+typedef struct {
+    size_t threads;
+    size_t queued;              // jobs waiting for a worker right now
+    size_t running;             // jobs on a worker right now
+    uint64_t completed;
+    uint64_t rejected;
+    uint64_t expired;
+    uint64_t total_wait_ns;     // time jobs spent in queue, summed over completed and expired ones
+    uint64_t max_wait_ns;
+} CometOffloadStats;
+
+typedef void (*offload_func)(void*);
+
+/**
+ * Bounded pool of worker threads for CPU-heavy or blocking work, e.g. image thumbnailing,
+ * that would otherwise stall the single network thread.
+ *
+ * Fiber that offloads a job is suspended while the job runs, so the network thread keeps serving
+ * other connections. Every worker has its own queue, and idle workers steal from the others.
+ * Finished jobs are handed back to the network thread, which resumes their fibers.
+ */
+typedef struct CometOffloadPool CometOffloadPool;
+
+/**
+ * @brief Create pool and start its threads.
+ * @return A pointer to the new pool, NULL on error.
+ */
+CometOffloadPool* comet_offload_pool_new(CometOffloadConfig config);
+
+/**
+ * @brief Start threads of pool stopped with comet_offload_pool_stop again. Does nothing if pool is running.
+ *
+ * Jobs that were still queued when the pool stopped are dropped. Call from the thread that offloads jobs,
+ * while no fiber waits for one.
+ * @return true if pool is running, false on error (pool stays stopped).
+ */
+bool comet_offload_pool_start(CometOffloadPool* pool);
+
+/**
+ * @brief Stop pool and free it. Pools passed to router are freed by the router.
+ */
+void comet_offload_pool_free(CometOffloadPool* pool);
+
+/**
+ * @brief Wait for jobs already on workers to finish and stop threads. Queued jobs are never run.
+ *
+ * Called before fibers that could be waiting for jobs are destroyed, so that no worker touches their stacks afterwards.
+ * Jobs offloaded while pool is stopped are rejected, comet_offload_pool_start restarts it.
+ */
+void comet_offload_pool_stop(CometOffloadPool* pool);
+
+/**
+ * @brief Run fn(arg) on the pool and suspend calling fiber until it is done.
+ *
+ * Outside of fibers fn is simply called in place. fn runs on another thread, with no fiber scheduler:
+ * comet_sleep, comet_read, comet_write, comet_wait_fd and comet_connect block that thread, and offloading
+ * from fn calls the nested job in place. CometBuffer, comet_response_* functions and logging are safe there;
+ * SSE hubs, WebSockets, fiber_wake and router memory stats belong to the network thread and must not be touched.
+ * @return COMET_OFFLOAD_DONE if fn was called, otherwise why it wasn't.
+ */
+CometOffloadStatus comet_offload_run(CometOffloadPool* pool, offload_func fn, void* arg);
+
+/**
+ * @brief Resume fibers whose jobs are done, until *running goes false and no job is in flight.
+ *
+ * Runs on its own fiber, in the scheduler that offloading fibers belong to - router does this itself.
+ */
+void comet_offload_serve(CometOffloadPool* pool, volatile bool* running);
+
+/**
+ * @brief Current pool counters. Safe to call from any thread.
+ */
+CometOffloadStats comet_offload_stats(CometOffloadPool* pool);
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef _COMET_PROXY_H
+#define _COMET_PROXY_H
+
+#include "netctx.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * @brief How requests are spread between upstream servers.
+ */
+typedef enum {
+    COMET_BALANCE_ROUND_ROBIN,
+    COMET_BALANCE_LEAST_CONNECTIONS,
+} CometBalanceStrategy;
+
+/**
+ * @brief A struct to hold the configuration of upstream group.
+ */
+typedef struct {
+    CometBalanceStrategy strategy;
+    size_t max_idle_per_server;  // keep-alive connections kept open to each server
+    int connect_timeout_ms;
+    int io_timeout_ms;           // max wait for a single read or write on upstream connection
+} CometUpstreamConfig;
+
+extern const CometUpstreamConfig COMET_UPSTREAM_DEFAULT_CONFIG;
+
+typedef struct {
+    NetAddress addr;
+    NetSocket* idle;
+    size_t num_idle;
+    size_t num_active;
+} CometUpstreamServer;
+
+/**
+ * @brief Group of interchangeable backend servers with pooled keep-alive connections.
+ */
+typedef struct {
+    CometUpstreamConfig config;
+    CometUpstreamServer* servers;
+    size_t num_servers;
+    size_t next_server;
+} CometUpstream;
+
+/**
+ * @brief Create a new, empty upstream group.
+ *
+ * @param config Balancing and pooling settings, start from COMET_UPSTREAM_DEFAULT_CONFIG.
+ * @return A pointer to the new CometUpstream, NULL on error.
+ */
+CometUpstream* comet_upstream_new(CometUpstreamConfig config);
+
+/**
+ * @brief Add backend server to upstream group.
+ *
+ * @param upstream The upstream to add server to.
+ * @param addr Address of the server, see netaddr_parse.
+ * @return true on success, false on error.
+ */
+bool comet_upstream_add_server(CometUpstream* upstream, NetAddress addr);
+
+/**
+ * @brief Close pooled connections and free upstream group.
+ *
+ * Upstreams passed to router_add_proxy are freed by the router - don't call it for them.
+ */
+void comet_upstream_free(CometUpstream* upstream);
+
+/**
+ * @brief Forward raw request to upstream and stream the response back to the client.
+ *
+ * Used by the router for proxy routes. Request line is rewritten to use path, hop-by-hop headers
+ * (and headers the Connection header names) are dropped and X-Forwarded-For is added. Requests with
+ * Transfer-Encoding get 411 (chunked) or 501 - only Content-Length bodies are forwarded.
+ *
+ * @param upstream The upstream to forward to.
+ * @param client Connection to send response to.
+ * @param request Raw request - head followed by body.
+ * @param request_len Length of whole request.
+ * @param head_len Length of request head, including final empty line.
+ * @param path Path to request from upstream, including query string.
+ */
+void proxy_forward(CometUpstream* upstream, NetConnection* client, const char* request, size_t request_len, size_t head_len, const char* path);
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef _COMET_QUERY_H
+#define _COMET_QUERY_H
+
+#include <httpc.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Query string access for handlers.
+ *
+ * Routes are matched against the path only - query string is left in req->url and parsed
+ * only when these functions are called. Nothing here allocates: keys and values are slices
+ * of req->url, still percent-encoded, decode them with comet_query_decode when needed.
+ */
+
+/**
+ * @brief Piece of a longer string, not NUL-terminated.
+ */
+typedef struct {
+    const char* data;
+    size_t len;
+} CometSlice;
+
+/**
+ * @brief Iterator over key=value pairs of query string.
+ */
+typedef struct {
+    const char* pos;
+    const char* end;
+} CometQueryIter;
+
+/**
+ * @brief Length of path part of url - everything before '?'.
+ */
+size_t comet_url_path_len(const char* url);
+
+/**
+ * @brief Query string of request, without leading '?'. Empty slice if there is none.
+ */
+CometSlice comet_query_string(const HttpcRequest* req);
+
+void comet_query_iter_init(CometQueryIter* iter, const HttpcRequest* req);
+
+/**
+ * @brief Get next pair. Value of key without '=' is an empty slice.
+ * @return false when there are no more pairs.
+ */
+bool comet_query_next(CometQueryIter* iter, CometSlice* key, CometSlice* value);
+
+/**
+ * @brief Find first value of key. Key is compared after percent-decoding.
+ * @return true if key is present.
+ */
+bool comet_query_get(const HttpcRequest* req, const char* key, CometSlice* value);
+
+/**
+ * @brief Percent-decode slice into out ('+' becomes space), always NUL-terminating it.
+ *
+ * @param raw Encoded key or value.
+ * @param out Buffer for decoded string, decoded string is never longer than raw one.
+ * @param out_size Size of out.
+ * @return Length of decoded string, or -1 if it didn't fit into out.
+ */
+int comet_query_decode(CometSlice raw, char* out, size_t out_size);
+
+/**
+ * @brief Look up key and decode its value into out, see comet_query_decode.
+ * @return Length of decoded value, -1 if key is missing or value didn't fit.
+ */
+int comet_query_get_decoded(const HttpcRequest* req, const char* key, char* out, size_t out_size);
+
+/**
+ * @brief Compare slice with NUL-terminated string.
+ */
+bool comet_slice_equals(CometSlice slice, const char* str);
+
+#endif
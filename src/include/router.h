@@ -2,6 +2,15 @@
 #define _COMET_ROUTER_H
 
 #include "netctx.h"
+#include "fiber.h"
+#include "proxy.h"
+#include "websocket.h"
+#include "sse.h"
+#include "trace.h"
+#include "h2.h"
+#include "tls.h"
+#include "offload.h"
+#include "memstats.h"
 #include <httpc.h>
 
 #include <stdbool.h>
@@ -41,6 +50,16 @@ typedef struct {
 
 extern const CometCorsConfig COMET_CORS_DEFAULT_CONFIG;
 
+/**
+ * @brief What happens with requests matching a route.
+ */
+typedef enum {
+    COMET_ROUTE_HANDLER,
+    COMET_ROUTE_PROXY,
+    COMET_ROUTE_WEBSOCKET,
+    COMET_ROUTE_SSE,
+} CometRouteType;
+
 /**
  * @brief A struct to hold a route.
  */
@@ -50,18 +69,49 @@ typedef struct {
     handler_func handler;
     middleware_func* middleware_chain;
     size_t num_middleware;
+    CometRouteType type;
+    CometUpstream* upstream;
+    CometWebSocketConfig* websocket;
+    CometSseHub* sse;
+    bool enabled;               // disabled routes are skipped, see router_set_route_enabled
+    bool offload;               // handler runs on router's offload pool, see router_set_route_offload
 } CometRoute;
 
+/**
+ * @brief Immutable snapshot of all routes.
+ * 
+ * Every change builds a new snapshot next to the current one and publishes it with an atomic pointer swap.
+ * Request keeps the snapshot that was current when it was dispatched until it is done, and old snapshot
+ * is freed once the last such request finishes - so routes can change while the router is running
+ * without the request path ever waiting for a lock.
+ */
+typedef struct CometRouteTable {
+    CometRoute* routes;
+    size_t num_routes;
+    size_t refs;                            // requests in flight using it, touched only by the serving thread
+    struct CometRouteTable* next_retired;
+} CometRouteTable;
+
 /**
  * @brief A struct containing the router's state.
  */
 typedef struct {
     NetContext* ctx;
-    CometRoute* routes;
-    size_t num_routes;
+    CometRouteTable* volatile routes;       // current snapshot
+    CometRouteTable* volatile retired;      // replaced snapshots, waiting for serving thread to pick them up
+    CometRouteTable* draining;              // retired snapshots still used by requests in flight
+    volatile long routes_lock;              // serializes writers only
     volatile bool running;
     CometCorsConfig cors_config;
     void* state;
+    bool use_fibers;
+    CometFiberConfig fiber_config;
+    CometTraceConfig trace_config;
+    uint64_t trace_counter;
+    bool h2_enabled;
+    CometH2Config h2_config;
+    CometOffloadPool* offload;
+    CometMemory memory;
 } CometRouter;
 
 /**
@@ -78,6 +128,52 @@ typedef struct {
  */
 CometRouter* router_init(uint16_t port, void* state);
 
+/**
+ * @brief Initialize a new CometRouter listening on arbitrary address.
+ * 
+ * Works like router_init, but allows listening on IPv6 or on unix domain socket,
+ * which is the cheaper option when comet sits behind local reverse proxy:
+ * 
+ * `router_init_addr(netaddr_unix("/run/comet.sock"), state)`
+ * 
+ * @param addr The address to listen on, see netaddr_* functions.
+ * @param state A pointer to the state to pass to the handlers and middlewares.
+ * @return A pointer to the new CometRouter.
+ */
+CometRouter* router_init_addr(NetAddress addr, void* state);
+
+/**
+ * @brief Initialize a new CometRouter with custom socket configuration.
+ * 
+ * Start from NET_DEFAULT_CONFIG and change only what you need:
+ * 
+ * ```c
+ * NetConfig config = NET_DEFAULT_CONFIG;
+ * config.tcp_defer_accept_s = 5;
+ * config.reuseport = true;
+ * router = router_init_ex(netaddr_any_ipv4(8080), config, state);
+ * ```
+ * 
+ * @param addr The address to listen on, see netaddr_* functions.
+ * @param config Socket tuning, see NetConfig.
+ * @param state A pointer to the state to pass to the handlers and middlewares.
+ * @return A pointer to the new CometRouter.
+ */
+CometRouter* router_init_ex(NetAddress addr, NetConfig config, void* state);
+
+/**
+ * @brief Initialize a new router that takes connections from transport instead of listening socket.
+ * 
+ * With NET_LOOPBACK_TRANSPORT (see loopback.h) requests come from memory, which allows measuring
+ * parsing, routing, middleware, handlers and serialization without kernel in the way.
+ * 
+ * @param transport The transport to serve.
+ * @param transport_state Passed to transport's accept, must outlive the router.
+ * @param state The state to pass to the handlers.
+ * @return A pointer to the router on success, NULL on error.
+ */
+CometRouter* router_init_transport(const NetTransport* transport, void* transport_state, void* state);
+
 /**
  * @brief Add a new route to the router.
  * 
@@ -86,15 +182,110 @@ CometRouter* router_init(uint16_t port, void* state);
  * - dynamic parts, like "/hello/{name}" - `name` will then be available in UrlParams* parameter of the handler
  * - wildcard parts, like "/hello/*" - `*` will then be available in UrlParams* parameter of the handler under "wildcard" key.
  * 
+ * Routes and middleware can be added while the router is running, from handlers or from other threads -
+ * requests already dispatched finish with routes they started with. To put a route online together with
+ * its middleware, add it with router_add_route_disabled and enable it once middleware is in place.
+ * 
  * @param router The router to add the route to.
  * @param route The route to add.
  * @param method The method to listen for.
  * @param handler The handler to call when the route is hit.
- * @return 0 on success, -1 on error.
+ * @return index of the new route on success, -1 on error.
  * @warning wildcard part can't be followed by any other part - it consumes the rest of the requested route.
  */
 int router_add_route(CometRouter* router, const char* route, HttpcMethodType method, handler_func handler);
 
+/**
+ * @brief Same as router_add_route, but route doesn't match anything until router_set_route_enabled enables it.
+ */
+int router_add_route_disabled(CometRouter* router, const char* route, HttpcMethodType method, handler_func handler);
+
+/**
+ * @brief Switch route on or off, e.g. to toggle feature endpoints without restarting.
+ * 
+ * Disabled route is skipped when matching, as if it wasn't there. Takes effect for requests
+ * dispatched after the call.
+ * 
+ * @param router The router the route belongs to.
+ * @param route_index Index returned when the route was added.
+ * @param enabled Whether the route should match requests.
+ * @return true on success, false on error.
+ */
+bool router_set_route_enabled(CometRouter* router, int route_index, bool enabled);
+
+/**
+ * @brief Run route's handler on the offload pool instead of the network thread.
+ * 
+ * For handlers that compute or block for long, like thumbnailing or PDF rendering - other clients are
+ * served while they run. Middleware still runs on the network thread. When the pool queue is full,
+ * or the request waited for a worker longer than max_wait_ms, client gets 503 and the handler is not called.
+ * Offloaded handler runs on another thread, so it must synchronize access to shared state.
+ * 
+ * Offloaded handler may build its response with httpc, CometBuffer and comet_response_* functions, read
+ * the request with comet_query_* functions and log. comet_sleep, comet_read, comet_write, comet_wait_fd and
+ * comet_connect block the worker thread instead of suspending a fiber. It must not publish to SSE hubs,
+ * send on WebSockets, wake fibers or read router->memory - those belong to the network thread.
+ * 
+ * @param router The router the route belongs to, with router_enable_offload already called.
+ * @param route_index Index returned when the route was added.
+ * @param offload Whether handler should run on the pool.
+ * @return true on success, false on error.
+ */
+bool router_set_route_offload(CometRouter* router, int route_index, bool offload);
+
+/**
+ * @brief Add a route that forwards requests to upstream servers.
+ * 
+ * Requests of any method are forwarded. If route ends with wildcard, only the wildcard part
+ * is forwarded - proxy added on `/api/` followed by the `*` wildcard sends `/api/users/1` to upstream as `/users/1`.
+ * Otherwise whole path is forwarded as is.
+ * 
+ * Upstream connections are kept alive and reused between requests, response is streamed
+ * back to the client as it arrives. Slow upstream must not block other clients, so this switches
+ * router to fiber mode (see router_enable_fibers) if it is not enabled yet - which fails while the router runs.
+ * 
+ * Middleware added to proxy route is called before forwarding, but changes it makes to the request are not forwarded.
+ * 
+ * @param router The router to add the route to.
+ * @param route The route to add.
+ * @param upstream Servers to forward to. Router takes ownership of it, one upstream can back several routes.
+ * @return index of the new route on success, -1 on error.
+ */
+int router_add_proxy(CometRouter* router, const char* route, CometUpstream* upstream);
+
+/**
+ * @brief Add a route that accepts WebSocket connections.
+ * 
+ * Handshake, framing, fragmentation and ping/pong are handled by the router, callbacks
+ * from config only see whole messages. Requests without `Upgrade: websocket` get 426 Upgrade Required.
+ * 
+ * WebSocket connections stay open, so this switches router to fiber mode (see router_enable_fibers)
+ * if it is not enabled yet. Mode can't change while the router runs, route is not added then.
+ * 
+ * @param router The router to add the route to.
+ * @param route The route to add.
+ * @param config Callbacks and limits, start from COMET_WEBSOCKET_DEFAULT_CONFIG.
+ * @return index of the new route on success, -1 on error.
+ */
+int router_add_websocket(CometRouter* router, const char* route, CometWebSocketConfig config);
+
+/**
+ * @brief Add a route that streams Server-Sent Events published to hub.
+ * 
+ * Client subscribes to the topic given by `{topic}` url param if route has one,
+ * otherwise to the requested path - `router_add_sse(router, "/events/{topic}", hub)` lets
+ * `/events/news` receive `comet_sse_publish(hub, "news", ...)`.
+ * 
+ * Event streams stay open, so this switches router to fiber mode (see router_enable_fibers)
+ * if it is not enabled yet. Mode can't change while the router runs, route is not added then.
+ * 
+ * @param router The router to add the route to.
+ * @param route The route to add.
+ * @param hub Hub to subscribe clients to. Router takes ownership of it, one hub can back several routes.
+ * @return index of the new route on success, -1 on error.
+ */
+int router_add_sse(CometRouter* router, const char* route, CometSseHub* hub);
+
 /**
  * @brief Add a middleware to a route.
  * 
@@ -116,6 +307,103 @@ void router_add_middleware(CometRouter* router, int route_index, middleware_func
  */
 bool router_set_cors_policy(CometRouter* router, CometCorsConfig config);
 
+/**
+ * @brief Run every request on its own fiber.
+ * 
+ * Handlers can then use comet_sleep, comet_wait_fd, comet_connect, comet_read and comet_write
+ * to wait for databases or other services without blocking the server - waiting request is suspended
+ * and the event loop keeps serving other connections. Handlers that don't use them work unchanged.
+ * 
+ * Must be called before router_start.
+ * 
+ * @param router The router to configure.
+ * @param config Fiber stack size and limit of requests in flight, start from COMET_FIBER_DEFAULT_CONFIG.
+ * @return true on success, false on error.
+ * @warning Everything still runs on one thread - CPU-heavy or blocking calls in handlers stall all fibers.
+ */
+bool router_enable_fibers(CometRouter* router, CometFiberConfig config);
+
+/**
+ * @brief Measure how long each phase of request handling takes (see CometTracePhase).
+ * 
+ * Sampled requests are reported to config.on_trace, and those slower than slow_threshold_ms are
+ * written to slow_log as JSON lines:
+ * 
+ * `{"time":"...","method":"GET","url":"/users/1","status":200,"total_us":153210,"accept_us":12,"read_us":140, ...}`
+ * 
+ * Requests that aren't sampled cost a single branch per phase. WebSocket and SSE sessions are not traced.
+ * 
+ * @param router The router to configure.
+ * @param config Sampling and slow log settings, start from COMET_TRACE_DEFAULT_CONFIG.
+ * @return true on success, false on error.
+ */
+bool router_enable_tracing(CometRouter* router, CometTraceConfig config);
+
+/**
+ * @brief Serve HTTP/2 over cleartext (h2c) next to HTTP/1.1.
+ * 
+ * Clients that start with HTTP/2 preface (prior knowledge) and HTTP/1.1 clients that ask for
+ * `Upgrade: h2c` get HTTP/2 connection, with many requests in flight at once. Every request
+ * runs on its own fiber, so this switches router to fiber mode.
+ * 
+ * Handlers and middleware see the same HttpcRequest they would over HTTP/1.1. Proxy, WebSocket and SSE
+ * routes need the whole connection, over HTTP/2 they answer 501.
+ * 
+ * Must be called before router_start.
+ * 
+ * @param router The router to configure.
+ * @param config Stream and frame limits, start from COMET_H2_DEFAULT_CONFIG.
+ * @return true on success, false on error.
+ */
+bool router_enable_h2(CometRouter* router, CometH2Config config);
+
+/**
+ * @brief Serve HTTPS instead of plain HTTP.
+ * 
+ * Handshake runs on the connection's own turn (its fiber in fiber mode), so slow clients don't
+ * hold up accepting others. Sessions are resumed from cache or tickets, and with kernel TLS
+ * file bodies (comet_response_send_file) are still sent with sendfile. With HTTP/2 enabled
+ * it is offered in ALPN.
+ * 
+ * Must be called before router_start. Needs Comet built with -DCOMET_ENABLE_TLS=ON.
+ * 
+ * @param router The router to configure.
+ * @param config Certificate, key and session settings, start from COMET_TLS_DEFAULT_CONFIG.
+ * @return true on success, false on error (bad certificate or key, TLS not compiled in).
+ */
+bool router_enable_tls(CometRouter* router, CometTlsConfig config);
+
+/**
+ * @brief Start a pool of worker threads for routes marked with router_set_route_offload.
+ * 
+ * Requests of offloaded routes wait on their fiber for the pool, so this switches router to fiber mode.
+ * Pool counters - queue depth, wait times, rejected and expired jobs - are available
+ * through comet_offload_stats(router->offload).
+ * 
+ * Must be called before router_start.
+ * 
+ * @param router The router to configure.
+ * @param config Thread count and queue limits, start from COMET_OFFLOAD_DEFAULT_CONFIG.
+ * @return true on success, false on error.
+ */
+bool router_enable_offload(CometRouter* router, CometOffloadConfig config);
+
+/**
+ * @brief Set how much memory requests may hold.
+ * 
+ * Request larger than connection_budget gets 413 as soon as its head is in, without its body being read.
+ * Request that would take memory of all connections over global_budget gets 503. Budgets cover buffers of
+ * HTTP/1.1 requests; HTTP/2 streams are bounded by CometH2Config. Usage is in router->memory.stats, and
+ * comet_memory_log(&router->memory) writes it to the log.
+ * 
+ * Call before router_start, or from a handler.
+ * 
+ * @param router The router to configure.
+ * @param config Budgets, start from COMET_MEMORY_DEFAULT_CONFIG.
+ * @return true on success, false on error.
+ */
+bool router_set_memory_budget(CometRouter* router, CometMemoryConfig config);
+
 /**
  * @brief Start the router.
  * 
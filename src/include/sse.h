@@ -0,0 +1,106 @@
+#ifndef _COMET_SSE_H
+#define _COMET_SSE_H
+
+#include "netctx.h"
+#include "fiber.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * @brief What to do with subscriber that can't keep up with published events.
+ */
+typedef enum {
+    COMET_SSE_DROP_EVENTS,  // skip events that don't fit into its queue
+    COMET_SSE_DISCONNECT,   // close its connection, client is expected to reconnect
+} CometSseSlowPolicy;
+
+/**
+ * @brief A struct to hold the configuration of SSE hub.
+ */
+typedef struct {
+    size_t max_queued_events;       // events waiting for a slow subscriber before slow_policy kicks in
+    CometSseSlowPolicy slow_policy;
+    int keepalive_ms;               // comment line is sent after this much silence, so proxies keep connection open
+} CometSseConfig;
+
+extern const CometSseConfig COMET_SSE_DEFAULT_CONFIG;
+
+/**
+ * Serialized event, shared by every subscriber it is queued for.
+ */
+typedef struct {
+    size_t refcount;
+    size_t len;
+    char data[];
+} CometSseFrame;
+
+typedef struct {
+    NetConnection* conn;
+    CometFiber* fiber;
+    size_t topic_index;
+    size_t index;               // position in topic's subscriber list
+
+    CometSseFrame** queue;      // ring of max_queued_events frames
+    size_t queue_head;
+    size_t queue_len;
+    size_t sent_of_head;        // bytes of queue[queue_head] already written
+    bool writing;               // subscriber's fiber is suspended in send, publisher must not touch the socket
+    bool disconnect;
+} CometSseSubscriber;
+
+typedef struct {
+    char* name;
+    CometSseSubscriber** subscribers;
+    size_t num_subscribers;
+    size_t cap_subscribers;
+} CometSseTopic;
+
+/**
+ * @brief Set of topics that SSE clients subscribe to.
+ */
+typedef struct {
+    CometSseConfig config;
+    CometSseTopic* topics;
+    size_t num_topics;
+} CometSseHub;
+
+/**
+ * @brief Create a new SSE hub.
+ *
+ * @param config Back-pressure and keepalive settings, start from COMET_SSE_DEFAULT_CONFIG.
+ * @return A pointer to the new CometSseHub, NULL on error.
+ */
+CometSseHub* comet_sse_hub_new(CometSseConfig config);
+
+/**
+ * @brief Free hub. Hubs passed to router_add_sse are freed by the router - don't call it for them.
+ */
+void comet_sse_hub_free(CometSseHub* hub);
+
+/**
+ * @brief Send event to every subscriber of topic.
+ *
+ * Event is serialized once, and the same buffer is written to every subscriber. Subscribers
+ * whose socket buffer is full get it queued instead, and once their queue is full, hub's slow_policy applies.
+ * Has to be called from the thread running the router - a handler, or a fiber.
+ *
+ * @param hub The hub to publish to.
+ * @param topic Topic to publish to.
+ * @param event Event name, NULL for default "message" event. Must not contain CR or LF, event is not sent otherwise.
+ * @param data Event data, may span multiple lines - CRLF, LF and bare CR all break lines.
+ * @return Number of subscribers the event was sent or queued to.
+ */
+size_t comet_sse_publish(CometSseHub* hub, const char* topic, const char* event, const char* data);
+
+/**
+ * @brief Number of subscribers currently connected to topic.
+ */
+size_t comet_sse_subscriber_count(CometSseHub* hub, const char* topic);
+
+/**
+ * @brief Subscribe connection to topic and keep streaming events to it until it goes away. Used by the router.
+ */
+void sse_run_session(CometSseHub* hub, NetConnection* conn, const char* topic);
+
+#endif
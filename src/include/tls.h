@@ -0,0 +1,69 @@
+#ifndef _COMET_TLS_H
+#define _COMET_TLS_H
+
+#include "netctx.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * TLS termination with OpenSSL. Compiled in with -DCOMET_ENABLE_TLS=ON; without it
+ * router_enable_tls fails and everything else is plain TCP as before.
+ *
+ * Returning clients resume their sessions - from the server-side cache by session id, or statelessly
+ * from tickets - and skip the full handshake. Once the handshake is done, record encryption is handed
+ * to kernel TLS where kernel and OpenSSL support it, so netconn_sendfile stays zero-copy.
+ */
+
+/**
+ * @brief A struct to hold the TLS configuration.
+ */
+typedef struct {
+    const char* cert_file;      // PEM certificate, followed by the chain
+    const char* key_file;       // PEM private key
+    const char* ciphers;        // TLS 1.2 cipher list, NULL for OpenSSL defaults
+    int session_cache_size;     // sessions kept for resumption by id, 0 disables the cache
+    int session_timeout_s;      // how long cached sessions and tickets can be resumed
+    bool session_tickets;       // let clients resume from tickets, without server-side state
+    bool ktls;                  // use kernel TLS when available
+} CometTlsConfig;
+
+extern const CometTlsConfig COMET_TLS_DEFAULT_CONFIG;
+
+typedef struct CometTlsContext CometTlsContext;
+
+/**
+ * @brief Load certificate and key, and set up session resumption.
+ * @return New context, NULL on error or when built without TLS.
+ */
+CometTlsContext* tls_context_new(const CometTlsConfig* config);
+void tls_context_free(CometTlsContext* ctx);
+
+/**
+ * @brief Offer h2 in ALPN, next to http/1.1.
+ */
+void tls_context_set_h2(CometTlsContext* ctx, bool enabled);
+
+/**
+ * @brief Run server handshake on accepted connection. Waits up to conn->recv_timeout_ms for client.
+ * @return true if conn now speaks TLS, false on error (connection should be closed).
+ */
+bool tls_accept(CometTlsContext* ctx, NetConnection* conn);
+
+/**
+ * Counterparts of netconn_* functions for TLS connections, netconn_* call them for conn->tls != NULL.
+ */
+ByteCount tls_recv(NetConnection* conn, void* buf, size_t len);
+ByteCount tls_send(NetConnection* conn, const void* buf, size_t len);
+ByteCount tls_sendv(NetConnection* conn, const NetBuffer* bufs, size_t count);
+ByteCount tls_try_send(NetConnection* conn, const void* buf, size_t len);
+ByteCount tls_sendfile(NetConnection* conn, int file_fd, uint64_t offset, size_t len);
+bool tls_peer_closed(NetConnection* conn);
+
+/**
+ * @brief Send close_notify without waiting for it, and free connection's TLS state.
+ */
+void tls_close(NetConnection* conn);
+
+#endif
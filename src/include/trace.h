@@ -0,0 +1,107 @@
+#ifndef _COMET_TRACE_H
+#define _COMET_TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * Static tracepoints, compiled in with -DCOMET_ENABLE_USDT=ON (needs sys/sdt.h). They cost a single nop
+ * when nobody is attached, and fire for every request regardless of sampling:
+ *
+ * - comet:request__start(fd)
+ * - comet:phase(phase) - phase (CometTracePhase) has just ended
+ * - comet:request__done(status, url)
+ *
+ * `bpftrace -e 'usdt:./app:comet:phase { @[arg0] = count(); }'`
+ */
+#ifdef COMET_USDT
+#include <sys/sdt.h>
+#define COMET_PROBE1(name, a) DTRACE_PROBE1(comet, name, a)
+#define COMET_PROBE2(name, a, b) DTRACE_PROBE2(comet, name, a, b)
+#else
+#define COMET_PROBE1(name, a) ((void)0)
+#define COMET_PROBE2(name, a, b) ((void)0)
+#endif
+
+/**
+ * @brief Steps request goes through. Time of each is measured from the end of previous one.
+ */
+typedef enum {
+    COMET_TRACE_ACCEPT,     // accepted connection waiting for its turn (fiber to be scheduled), TLS handshake
+    COMET_TRACE_READ,       // receiving request from socket
+    COMET_TRACE_PARSE,      // httpc_request_from_string
+    COMET_TRACE_ROUTE,      // matching routes, adding default headers
+    COMET_TRACE_MIDDLEWARE,
+    COMET_TRACE_HANDLER,    // handler, or forwarding for proxy routes
+    COMET_TRACE_SERIALIZE,  // httpc_response_to_string
+    COMET_TRACE_SEND,       // sending response and closing connection
+    COMET_TRACE_PHASE_COUNT,
+} CometTracePhase;
+
+/**
+ * @brief Timing of one sampled request.
+ */
+typedef struct {
+    bool active;                                // request was sampled, fields below are valid
+    uint64_t start_ns;
+    uint64_t last_ns;
+    uint64_t total_ns;
+    uint64_t phase_ns[COMET_TRACE_PHASE_COUNT];
+
+    const char* method;                         // request line slices, not NUL-terminated
+    size_t method_len;
+    const char* url;                            // of the request as middleware left it, valid until the request is freed
+    int status;                                 // 0 if response didn't go through the router (proxy)
+} CometTrace;
+
+typedef void (*trace_func)(void*, const CometTrace*);
+
+/**
+ * @brief A struct to hold the tracing configuration.
+ */
+typedef struct {
+    uint32_t sample_rate;           // trace every n-th request, 1 traces all of them, 0 disables tracing
+    uint32_t slow_threshold_ms;     // sampled requests slower than this are written to slow_log, 0 writes none
+    FILE* slow_log;                 // one JSON object per line, NULL for stderr
+    trace_func on_trace;            // called with router state for every sampled request, may be NULL
+} CometTraceConfig;
+
+extern const CometTraceConfig COMET_TRACE_DEFAULT_CONFIG;
+
+/**
+ * @brief Cheap monotonic clock in nanoseconds (vDSO clock_gettime, QueryPerformanceCounter on Windows).
+ */
+uint64_t comet_now_ns(void);
+
+/**
+ * @brief Name of phase, as used in slow log.
+ */
+const char* comet_trace_phase_name(CometTracePhase phase);
+
+/**
+ * @brief Decide whether request is sampled and start its clock. Used by the router.
+ *
+ * @param accepted_ns When connection was accepted, 0 if unknown.
+ */
+void trace_begin(CometTrace* trace, const CometTraceConfig* config, uint64_t* counter, uint64_t accepted_ns);
+
+void trace_record(CometTrace* trace, CometTracePhase phase);
+
+/**
+ * @brief Attribute time since previous mark to phase. Only a branch when request isn't sampled.
+ */
+static inline void trace_mark(CometTrace* trace, CometTracePhase phase) {
+    COMET_PROBE1(phase, (int)phase);
+    if (trace->active) {
+        trace_record(trace, phase);
+    }
+}
+
+/**
+ * @brief Report finished request to on_trace and slow log. Used by the router.
+ */
+void trace_finish(CometTrace* trace, const CometTraceConfig* config, void* state);
+
+#endif
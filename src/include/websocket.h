@@ -0,0 +1,88 @@
+#ifndef _COMET_WEBSOCKET_H
+#define _COMET_WEBSOCKET_H
+
+#include "netctx.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define COMET_WS_CLOSE_NORMAL 1000
+#define COMET_WS_CLOSE_GOING_AWAY 1001
+#define COMET_WS_CLOSE_PROTOCOL_ERROR 1002
+#define COMET_WS_CLOSE_NO_STATUS 1005
+#define COMET_WS_CLOSE_ABNORMAL 1006
+#define COMET_WS_CLOSE_INVALID_DATA 1007
+#define COMET_WS_CLOSE_TOO_BIG 1009
+
+/**
+ * @brief A struct to hold an open WebSocket connection.
+ */
+typedef struct {
+    NetConnection* conn;
+    void* state;            // router state, same as passed to handlers
+    void* user_data;        // free for callbacks to use
+    bool close_sent;
+    bool write_busy;
+    uint16_t close_code;
+
+    uint8_t* read_buf;
+    size_t read_pos;
+    size_t read_len;
+} CometWebSocket;
+
+typedef void (*ws_open_func)(CometWebSocket*);
+typedef void (*ws_message_func)(CometWebSocket*, const uint8_t*, size_t, bool);
+typedef void (*ws_close_func)(CometWebSocket*, uint16_t);
+
+/**
+ * @brief A struct to hold the configuration of WebSocket route.
+ */
+typedef struct {
+    ws_open_func on_open;           // after handshake, may be NULL
+    ws_message_func on_message;     // for every complete (defragmented) text or binary message. Text is valid
+                                    // UTF-8 - other text closes connection with COMET_WS_CLOSE_INVALID_DATA
+    ws_close_func on_close;         // once, when connection ends - with close code sent by client or COMET_WS_CLOSE_ABNORMAL
+    size_t max_message_size;        // bigger messages close connection with COMET_WS_CLOSE_TOO_BIG
+    int idle_timeout_ms;            // ping is sent after this much silence, connection is dropped after twice that
+} CometWebSocketConfig;
+
+extern const CometWebSocketConfig COMET_WEBSOCKET_DEFAULT_CONFIG;
+
+/**
+ * @brief Send text message.
+ * @return true on success, false if connection is closing or broken.
+ */
+bool comet_ws_send_text(CometWebSocket* ws, const char* text, size_t len);
+
+/**
+ * @brief Send binary message.
+ * @return true on success, false if connection is closing or broken.
+ */
+bool comet_ws_send_binary(CometWebSocket* ws, const void* data, size_t len);
+
+/**
+ * @brief Start closing handshake. Connection ends once client confirms it.
+ */
+void comet_ws_close(CometWebSocket* ws, uint16_t code);
+
+/**
+ * @brief Check whether raw request head asks for WebSocket upgrade.
+ */
+bool ws_is_upgrade_request(const char* head, size_t head_len);
+
+/**
+ * @brief Complete handshake and run the session until it is closed. Used by the router.
+ *
+ * @param config The route configuration.
+ * @param conn Client connection, request has already been read from it.
+ * @param state Router state.
+ * @param head Raw request head.
+ * @param head_len Length of request head.
+ * @param extra Bytes client sent right after the head - already the first frames.
+ * @param extra_len Length of extra.
+ */
+void ws_run_session(const CometWebSocketConfig* config, NetConnection* conn, void* state,
+                    const char* head, size_t head_len, const char* extra, size_t extra_len);
+
+#endif
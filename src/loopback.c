@@ -0,0 +1,239 @@
+#include "include/loopback.h"
+#include "include/body.h"
+#include "include/netplat.h"
+#include "include/logger.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    char* data;
+    size_t len;
+    size_t first_id;
+    size_t count;
+    size_t accepted;
+} LoopbackScript;
+
+struct NetLoopback {
+    LoopbackScript* scripts;
+    size_t num_scripts;
+    size_t cap_scripts;
+    size_t current_script;      // first script with connections left to accept
+
+    size_t next_id;
+    size_t open;
+    size_t completed;
+    size_t read_size;
+
+    loopback_response_func on_response;
+    void* ctx;
+    CometBuffer** responses;    // by connection id, when there is no callback
+    size_t cap_responses;
+
+    volatile bool* stop_flag;
+};
+
+typedef struct {
+    NetLoopback* lb;
+    size_t id;
+    const char* request;        // owned by script
+    size_t request_len;
+    size_t read_pos;
+    CometBuffer* response;
+} LoopbackConn;
+
+NetLoopback* net_loopback_new(loopback_response_func on_response, void* ctx) {
+    NetLoopback* lb = calloc(1, sizeof(NetLoopback));
+    if (lb == NULL) {
+        log_message(LOG_ERROR, "Failed to allocate memory for loopback transport");
+        return NULL;
+    }
+
+    lb->on_response = on_response;
+    lb->ctx = ctx;
+    return lb;
+}
+
+void net_loopback_free(NetLoopback* lb) {
+    if (!lb) {
+        return;
+    }
+
+    for (size_t i = 0; i < lb->num_scripts; i++) {
+        free(lb->scripts[i].data);
+    }
+    free(lb->scripts);
+
+    for (size_t i = 0; i < lb->cap_responses; i++) {
+        comet_buffer_free(lb->responses[i]);
+    }
+    free(lb->responses);
+    free(lb);
+}
+
+size_t net_loopback_push(NetLoopback* lb, const void* request, size_t len, size_t count) {
+    if (lb->num_scripts == lb->cap_scripts) {
+        size_t new_cap = lb->cap_scripts ? lb->cap_scripts * 2 : 8;
+        LoopbackScript* scripts = realloc(lb->scripts, new_cap * sizeof(LoopbackScript));
+        if (scripts == NULL) {
+            log_message(LOG_ERROR, "Failed to allocate memory for loopback script");
+            return lb->next_id;
+        }
+        lb->scripts = scripts;
+        lb->cap_scripts = new_cap;
+    }
+
+    char* data = malloc(len ? len : 1);
+    if (data == NULL) {
+        log_message(LOG_ERROR, "Failed to allocate memory for loopback script");
+        return lb->next_id;
+    }
+    memcpy(data, request, len);
+
+    LoopbackScript* script = &lb->scripts[lb->num_scripts++];
+    script->data = data;
+    script->len = len;
+    script->first_id = lb->next_id;
+    script->count = count;
+    script->accepted = 0;
+
+    lb->next_id += count;
+    return script->first_id;
+}
+
+void net_loopback_set_read_size(NetLoopback* lb, size_t read_size) {
+    lb->read_size = read_size;
+}
+
+void net_loopback_stop_when_done(NetLoopback* lb, volatile bool* flag) {
+    lb->stop_flag = flag;
+}
+
+size_t net_loopback_completed(NetLoopback* lb) {
+    return lb->completed;
+}
+
+const char* net_loopback_response(NetLoopback* lb, size_t id, size_t* len) {
+    if (id >= lb->cap_responses || lb->responses[id] == NULL) {
+        return NULL;
+    }
+    *len = lb->responses[id]->len;
+    return lb->responses[id]->data;
+}
+
+static bool loopback_accept(void* state, NetConnection* out_conn) {
+    NetLoopback* lb = state;
+
+    while (lb->current_script < lb->num_scripts && lb->scripts[lb->current_script].accepted == lb->scripts[lb->current_script].count) {
+        lb->current_script++;
+    }
+    if (lb->current_script == lb->num_scripts) {
+        return false;
+    }
+
+    LoopbackConn* conn = malloc(sizeof(LoopbackConn));
+    if (conn == NULL) {
+        log_message(LOG_ERROR, "Failed to allocate memory for loopback connection");
+        return false;
+    }
+
+    LoopbackScript* script = &lb->scripts[lb->current_script];
+    conn->lb = lb;
+    conn->id = script->first_id + script->accepted++;
+    conn->request = script->data;
+    conn->request_len = script->len;
+    conn->read_pos = 0;
+    conn->response = NULL;
+    lb->open++;
+
+    out_conn->sockfd = SOCKET_ERROR;
+    out_conn->remote_addr = netaddr_unix("loopback");
+    out_conn->transport_conn = conn;
+    return true;
+}
+
+static ByteCount loopback_recv(NetConnection* nc, void* buf, size_t len) {
+    LoopbackConn* conn = nc->transport_conn;
+
+    // script is over - client has nothing more to say, same as if it shut down its side
+    size_t left = conn->request_len - conn->read_pos;
+    if (len > left) len = left;
+    if (conn->lb->read_size > 0 && len > conn->lb->read_size) len = conn->lb->read_size;
+
+    memcpy(buf, conn->request + conn->read_pos, len);
+    conn->read_pos += len;
+    return len;
+}
+
+static ByteCount loopback_send(NetConnection* nc, const void* buf, size_t len) {
+    LoopbackConn* conn = nc->transport_conn;
+
+    if (conn->response == NULL) {
+        conn->response = comet_buffer_new(len);
+    }
+    if (conn->response == NULL || !comet_buffer_append(conn->response, buf, len)) {
+        SET_ERROR_CODE(ENOMEM);
+        return SOCKET_ERROR;
+    }
+    return len;
+}
+
+// script is all the client ever says - once it is read, client has hung up
+static bool loopback_peer_closed(NetConnection* nc) {
+    LoopbackConn* conn = nc->transport_conn;
+    return conn->read_pos == conn->request_len;
+}
+
+static bool loopback_keep_response(NetLoopback* lb, size_t id, CometBuffer* response) {
+    if (id >= lb->cap_responses) {
+        size_t new_cap = lb->cap_responses ? lb->cap_responses : 64;
+        while (new_cap <= id) new_cap *= 2;
+        CometBuffer** responses = realloc(lb->responses, new_cap * sizeof(CometBuffer*));
+        if (responses == NULL) {
+            log_message(LOG_ERROR, "Failed to allocate memory for loopback response");
+            return false;
+        }
+        memset(responses + lb->cap_responses, 0, (new_cap - lb->cap_responses) * sizeof(CometBuffer*));
+        lb->responses = responses;
+        lb->cap_responses = new_cap;
+    }
+    lb->responses[id] = response;
+    return true;
+}
+
+static void loopback_close(NetConnection* nc) {
+    LoopbackConn* conn = nc->transport_conn;
+    NetLoopback* lb = conn->lb;
+
+    // closed connection without response still gets an (empty) entry
+    if (conn->response == NULL) {
+        conn->response = comet_buffer_new(0);
+    }
+
+    if (lb->on_response) {
+        lb->on_response(lb->ctx, conn->id, conn->response ? conn->response->data : NULL, conn->response ? conn->response->len : 0);
+        comet_buffer_free(conn->response);
+    } else if (conn->response && !loopback_keep_response(lb, conn->id, conn->response)) {
+        comet_buffer_free(conn->response);
+    }
+
+    lb->open--;
+    lb->completed++;
+    free(conn);
+
+    if (lb->stop_flag && lb->open == 0 && lb->completed == lb->next_id) {
+        *lb->stop_flag = false;
+    }
+}
+
+const NetTransport NET_LOOPBACK_TRANSPORT = {
+    .name = "loopback",
+    .accept = loopback_accept,
+    .recv = loopback_recv,
+    .send = loopback_send,
+    .sendv = NULL,
+    .try_send = NULL,
+    .sendfile = NULL,
+    .peer_closed = loopback_peer_closed,
+    .close = loopback_close,
+};
@@ -0,0 +1,60 @@
+#include "include/memstats.h"
+#include "include/logger.h"
+
+#include <string.h>
+
+const CometMemoryConfig COMET_MEMORY_DEFAULT_CONFIG = {
+    .connection_budget = 8 * 1024 * 1024,
+    .global_budget = 0,
+};
+
+static const char* CATEGORY_NAMES[COMET_MEM_CATEGORY_COUNT] = {
+    [COMET_MEM_CONNECTIONS] = "connections",
+    [COMET_MEM_REQUEST_BUFFERS] = "request buffers",
+    [COMET_MEM_REQUESTS] = "requests",
+    [COMET_MEM_PARAMS] = "params",
+    [COMET_MEM_RESPONSES] = "responses",
+};
+
+void comet_memory_init(CometMemory* mem, CometMemoryConfig config) {
+    memset(mem, 0, sizeof(CometMemory));
+    mem->config = config;
+}
+
+bool comet_memory_fits(const CometMemory* mem, size_t bytes) {
+    return mem->config.global_budget == 0 || mem->stats.total + bytes <= mem->config.global_budget;
+}
+
+void comet_memory_charge(CometMemory* mem, CometMemoryCharge* charge, CometMemoryCategory category, size_t bytes) {
+    CometMemoryStats* stats = &mem->stats;
+
+    charge->bytes[category] += bytes;
+    stats->current[category] += bytes;
+    stats->total += bytes;
+
+    if (stats->current[category] > stats->peak[category]) stats->peak[category] = stats->current[category];
+    if (stats->total > stats->peak_total) stats->peak_total = stats->total;
+}
+
+void comet_memory_release(CometMemory* mem, CometMemoryCharge* charge) {
+    for (int i = 0; i < COMET_MEM_CATEGORY_COUNT; i++) {
+        mem->stats.current[i] -= charge->bytes[i];
+        mem->stats.total -= charge->bytes[i];
+        charge->bytes[i] = 0;
+    }
+}
+
+const char* comet_memory_category_name(CometMemoryCategory category) {
+    return category < COMET_MEM_CATEGORY_COUNT ? CATEGORY_NAMES[category] : "unknown";
+}
+
+void comet_memory_log(const CometMemory* mem) {
+    const CometMemoryStats* stats = &mem->stats;
+
+    log_message(LOG_INFO, "Memory: %zu bytes held by %zu connections (peak %zu), rejected %llu too large, %llu over budget",
+                stats->total, stats->connections, stats->peak_total,
+                (unsigned long long)stats->rejected_too_large, (unsigned long long)stats->rejected_over_budget);
+    for (int i = 0; i < COMET_MEM_CATEGORY_COUNT; i++) {
+        log_message(LOG_INFO, "  %s: %zu bytes (peak %zu)", CATEGORY_NAMES[i], stats->current[i], stats->peak[i]);
+    }
+}
@@ -1,70 +1,314 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // accept4
+#endif
+
 #include "include/netctx.h"
+#include "include/fiber.h"
+#include "include/tls.h"
 #include "include/logger.h"
 
-#ifdef _WIN32
-#include <winsock2.h>
-#include <ws2tcpip.h>
-#include <windows.h>
-
-typedef SOCKET NetSocket;
-
-#define COMET_ERROR_TIMEOUT WSAETIMEDOUT
-#define COMET_ERROR_CANCELLED WSAEINTR
-#define COMET_ERROR_WOULD_BLOCK WSAEWOULDBLOCK
-#define COMET_ERROR_AGAIN WSAEWOULDBLOCK
-#define GET_ERROR_STR() strerror(WSAGetLastError())
-#define GET_ERROR_CODE() WSAGetLastError()
-#define CLOSE_SOCKET(s) closesocket(s)
-#define SHUTDOWN_SOCKET(s) shutdown(s, SD_BOTH)
+#include "include/netplat.h"
 
-#else
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <unistd.h>
-#include <netdb.h>
+#include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
-#include <sys/time.h>
-#include <arpa/inet.h>
-#include <fcntl.h>
-#include <errno.h>
-
-typedef int NetSocket;
-
-#define COMET_ERROR_TIMEOUT ETIMEDOUT
-#define COMET_ERROR_CANCELLED EINTR
-#define COMET_ERROR_WOULD_BLOCK EWOULDBLOCK
-#define COMET_ERROR_AGAIN EAGAIN
-#define GET_ERROR_STR() strerror(errno)
-#define GET_ERROR_CODE() errno
-#define CLOSE_SOCKET(s) close(s)
-#define SHUTDOWN_SOCKET(s) shutdown(s, SHUT_RDWR)
+#include <stddef.h>
 
-#endif
+const NetConfig NET_DEFAULT_CONFIG = {
+    .backlog = 128,
+    .accept_budget = 32,
+    .recv_timeout_ms = 5000,
+    .send_timeout_ms = 5000,
+    .tcp_nodelay = true,
+    .tcp_defer_accept_s = 0,
+    .tcp_fastopen_qlen = 0,
+    .reuseport = false,
+    .send_buffer_size = 0,
+    .recv_buffer_size = 0,
+};
 
-#include <stdlib.h>
+NetAddress netaddr_any_ipv4(uint16_t port) {
+    NetAddress ret;
+    memset(&ret, 0, sizeof(ret));
+    ret.family = NETADDR_IPV4;
+    ret.host.ip = htonl(INADDR_ANY);
+    ret.port = htons(port);
+    return ret;
+}
 
-NetAddress netaddr_from_sockaddr(const struct sockaddr_in *addr) {
+NetAddress netaddr_any_ipv6(uint16_t port) {
     NetAddress ret;
-    ret.ip = addr->sin_addr.s_addr;
-    ret.port = addr->sin_port;
+    memset(&ret, 0, sizeof(ret));
+    ret.family = NETADDR_IPV6;
+    memcpy(ret.host.ip6, &in6addr_any, sizeof(ret.host.ip6));
+    ret.port = htons(port);
     return ret;
 }
 
-struct sockaddr_in netaddr_to_sockaddr(NetAddress addr) {
-    struct sockaddr_in ret;
-    ret.sin_family = AF_INET;
-    ret.sin_addr.s_addr = addr.ip;
-    ret.sin_port = addr.port;
+NetAddress netaddr_unix(const char *path) {
+    NetAddress ret;
+    memset(&ret, 0, sizeof(ret));
+    ret.family = NETADDR_UNIX;
+    // truncated path would be a different socket - leave it empty, so that listening on it fails
+    if (path && strlen(path) < sizeof(ret.host.path)) {
+        strcpy(ret.host.path, path);
+    } else {
+        log_message(LOG_ERROR, "Unix socket path is too long (max %d bytes)", NETADDR_UNIX_PATH_MAX - 1);
+    }
+    return ret;
+}
+
+bool netaddr_parse(const char *str, uint16_t port, NetAddress *out) {
+    if (!str || !out) {
+        return false;
+    }
+
+    memset(out, 0, sizeof(*out));
+
+    if (strncmp(str, "unix:", 5) == 0) {
+        if (strlen(str + 5) == 0 || strlen(str + 5) >= sizeof(out->host.path)) {
+            return false;
+        }
+        *out = netaddr_unix(str + 5);
+        return true;
+    }
+
+    out->port = htons(port);
+
+    if (inet_pton(AF_INET, str, &out->host.ip) == 1) {
+        out->family = NETADDR_IPV4;
+        return true;
+    }
+
+    char ip6_str[INET6_ADDRSTRLEN] = {0};
+    size_t str_len = strlen(str);
+    if (str[0] == '[' && str_len > 2 && str[str_len - 1] == ']' && str_len - 2 < sizeof(ip6_str)) {
+        memcpy(ip6_str, str + 1, str_len - 2);
+    } else if (str_len < sizeof(ip6_str)) {
+        memcpy(ip6_str, str, str_len);
+    } else {
+        return false;
+    }
+
+    if (inet_pton(AF_INET6, ip6_str, out->host.ip6) == 1) {
+        out->family = NETADDR_IPV6;
+        return true;
+    }
+
+    return false;
+}
+
+NetAddress netaddr_from_sockaddr(const struct sockaddr *addr, socklen_t addr_len) {
+    NetAddress ret;
+    memset(&ret, 0, sizeof(ret));
+
+    switch (addr->sa_family) {
+    case AF_INET: {
+        const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+        ret.family = NETADDR_IPV4;
+        ret.host.ip = in->sin_addr.s_addr;
+        ret.port = in->sin_port;
+        break;
+    }
+    case AF_INET6: {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
+        ret.family = NETADDR_IPV6;
+        memcpy(ret.host.ip6, &in6->sin6_addr, sizeof(ret.host.ip6));
+        ret.port = in6->sin6_port;
+        break;
+    }
+#ifndef _WIN32
+    case AF_UNIX: {
+        const struct sockaddr_un *un = (const struct sockaddr_un *)addr;
+        ret.family = NETADDR_UNIX;
+        // peers connecting from unnamed sockets have no path at all
+        if (addr_len > offsetof(struct sockaddr_un, sun_path)) {
+            strncpy(ret.host.path, un->sun_path, sizeof(ret.host.path) - 1);
+        }
+        break;
+    }
+#endif
+    default:
+        log_message(LOG_WARN, "Unsupported address family: %d", addr->sa_family);
+        break;
+    }
+
     return ret;
 }
 
+socklen_t netaddr_to_sockaddr(NetAddress addr, struct sockaddr_storage *out) {
+    memset(out, 0, sizeof(*out));
+
+    switch (addr.family) {
+    case NETADDR_IPV4: {
+        struct sockaddr_in *in = (struct sockaddr_in *)out;
+        in->sin_family = AF_INET;
+        in->sin_addr.s_addr = addr.host.ip;
+        in->sin_port = addr.port;
+        return sizeof(struct sockaddr_in);
+    }
+    case NETADDR_IPV6: {
+        struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)out;
+        in6->sin6_family = AF_INET6;
+        memcpy(&in6->sin6_addr, addr.host.ip6, sizeof(addr.host.ip6));
+        in6->sin6_port = addr.port;
+        return sizeof(struct sockaddr_in6);
+    }
+#ifndef _WIN32
+    case NETADDR_UNIX: {
+        struct sockaddr_un *un = (struct sockaddr_un *)out;
+        un->sun_family = AF_UNIX;
+        strncpy(un->sun_path, addr.host.path, sizeof(un->sun_path) - 1);
+        return sizeof(struct sockaddr_un);
+    }
+#endif
+    default:
+        return 0;
+    }
+}
+
+const char* netaddr_to_string(NetAddress addr, char *buf, size_t buf_len) {
+    char ip_str[INET6_ADDRSTRLEN] = {0};
+
+    switch (addr.family) {
+    case NETADDR_IPV4:
+        inet_ntop(AF_INET, &addr.host.ip, ip_str, sizeof(ip_str));
+        snprintf(buf, buf_len, "%s:%d", ip_str, ntohs(addr.port));
+        break;
+    case NETADDR_IPV6:
+        inet_ntop(AF_INET6, addr.host.ip6, ip_str, sizeof(ip_str));
+        snprintf(buf, buf_len, "[%s]:%d", ip_str, ntohs(addr.port));
+        break;
+    case NETADDR_UNIX:
+        snprintf(buf, buf_len, "unix:%s", addr.host.path[0] != '\0' ? addr.host.path : "(unnamed)");
+        break;
+    default:
+        snprintf(buf, buf_len, "(unknown)");
+        break;
+    }
+
+    return buf;
+}
+
+static int netaddr_family_to_af(NetAddressFamily family) {
+    switch (family) {
+    case NETADDR_IPV4: return AF_INET;
+    case NETADDR_IPV6: return AF_INET6;
+#ifndef _WIN32
+    case NETADDR_UNIX: return AF_UNIX;
+#endif
+    default: return -1;
+    }
+}
+
+static bool netctx_set_nonblocking(NetSocket sockfd) {
+#ifdef _WIN32
+    u_long mode = 1;
+    if (ioctlsocket(sockfd, FIONBIO, &mode) == SOCKET_ERROR) {
+        log_message(LOG_ERROR, "Failed to set socket to non-blocking: %s", GET_ERROR_STR());
+        return false;
+    }
+#else
+    int flags = fcntl(sockfd, F_GETFL, 0);
+    if (flags == -1) {
+        log_message(LOG_ERROR, "Failed to get socket flags: %s", GET_ERROR_STR());
+        return false;
+    }
+    if (fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        log_message(LOG_ERROR, "Failed to set socket to non-blocking: %s", GET_ERROR_STR());
+        return false;
+    }
+#endif
+    return true;
+}
+
+static void netctx_set_int_option(NetSocket sockfd, int level, int option, int value, const char* option_name) {
+    if (setsockopt(sockfd, level, option, (const char *)&value, sizeof(value)) == SOCKET_ERROR) {
+        log_message(LOG_WARN, "Failed to set socket option %s: %s", option_name, GET_ERROR_STR());
+    }
+}
+
+// Options that have to be set before bind/listen. Buffer sizes are inherited by accepted sockets
+// and receive buffer has to be known before handshake for window scaling to pick it up.
+static void netctx_apply_listen_options(NetContext *ctx) {
+    NetConfig* config = &ctx->config;
+
+    if (config->send_buffer_size > 0) {
+        netctx_set_int_option(ctx->local_sockfd, SOL_SOCKET, SO_SNDBUF, config->send_buffer_size, "SO_SNDBUF");
+    }
+    if (config->recv_buffer_size > 0) {
+        netctx_set_int_option(ctx->local_sockfd, SOL_SOCKET, SO_RCVBUF, config->recv_buffer_size, "SO_RCVBUF");
+    }
+
+    if (ctx->local_addr.family == NETADDR_UNIX) {
+        return;
+    }
+
+    if (config->reuseport) {
+#ifdef SO_REUSEPORT
+        netctx_set_int_option(ctx->local_sockfd, SOL_SOCKET, SO_REUSEPORT, 1, "SO_REUSEPORT");
+#else
+        log_message(LOG_WARN, "SO_REUSEPORT is not supported on this platform");
+#endif
+    }
+    if (config->tcp_defer_accept_s > 0) {
+#ifdef TCP_DEFER_ACCEPT
+        netctx_set_int_option(ctx->local_sockfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, config->tcp_defer_accept_s, "TCP_DEFER_ACCEPT");
+#else
+        log_message(LOG_WARN, "TCP_DEFER_ACCEPT is not supported on this platform");
+#endif
+    }
+    if (config->tcp_fastopen_qlen > 0) {
+#ifdef TCP_FASTOPEN
+        netctx_set_int_option(ctx->local_sockfd, IPPROTO_TCP, TCP_FASTOPEN, config->tcp_fastopen_qlen, "TCP_FASTOPEN");
+#else
+        log_message(LOG_WARN, "TCP_FASTOPEN is not supported on this platform");
+#endif
+    }
+}
+
+static void netctx_apply_connection_options(NetContext *ctx, NetSocket sockfd) {
+    if (ctx->local_addr.family != NETADDR_UNIX && ctx->config.tcp_nodelay) {
+        netctx_set_int_option(sockfd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+    }
+}
+
 bool netctx_init(NetContext **out_ctx, uint16_t port) {
+    return netctx_init_addr(out_ctx, netaddr_any_ipv4(port), NET_DEFAULT_CONFIG);
+}
+
+#ifndef _WIN32
+static bool netctx_unix_socket_is_stale(NetAddress addr) {
+    NetSocket probe = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (probe == SOCKET_ERROR) {
+        return false;
+    }
+
+    struct sockaddr_storage sockaddr;
+    socklen_t sockaddr_len = netaddr_to_sockaddr(addr, &sockaddr);
+    bool stale = connect(probe, (struct sockaddr *)&sockaddr, sockaddr_len) == SOCKET_ERROR && GET_ERROR_CODE() == ECONNREFUSED;
+    CLOSE_SOCKET(probe);
+    return stale;
+}
+#endif
+
+bool netctx_init_addr(NetContext **out_ctx, NetAddress addr, NetConfig config) {
     if (!out_ctx || !*out_ctx) {
         log_message(LOG_ERROR, "Attempted to initialize NetContext with NULL output pointer");
         return false;
     }
 
+    int af = netaddr_family_to_af(addr.family);
+    if (af == -1) {
+        log_message(LOG_ERROR, "Address family is not supported on this platform");
+        return false;
+    }
+
+    if (addr.family == NETADDR_UNIX && addr.host.path[0] == '\0') {
+        log_message(LOG_ERROR, "Unix socket path is empty or too long");
+        return false;
+    }
+
 #ifdef _WIN32
     WSADATA wsa_data;
     if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0) {
@@ -74,73 +318,121 @@ bool netctx_init(NetContext **out_ctx, uint16_t port) {
 #endif
 
     NetContext* ctx = *out_ctx;
+    char addr_str[NETADDR_UNIX_PATH_MAX + 8];
 
-    ctx->local_addr.ip = INADDR_ANY;
-    ctx->local_addr.port = htons(port);
-    ctx->local_sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (ctx->local_sockfd == SOCKET_ERROR) {
-        log_message(LOG_ERROR, "Failed to create socket: %s", GET_ERROR_STR());
-        return false;
+    if (config.accept_budget < 1) {
+        config.accept_budget = 1;
     }
 
-    struct sockaddr_in local_sockaddr = netaddr_to_sockaddr(ctx->local_addr);
-    if (bind(ctx->local_sockfd, (struct sockaddr *)&local_sockaddr, sizeof(local_sockaddr)) == SOCKET_ERROR) {
-        log_message(LOG_ERROR, "Failed to bind socket: %s", GET_ERROR_STR());
+    ctx->local_addr = addr;
+    ctx->config = config;
+    ctx->current.sockfd = SOCKET_ERROR;
+    ctx->pending_head = 0;
+    ctx->pending_count = 0;
+    ctx->tls = NULL;
+    ctx->transport = &NET_SOCKET_TRANSPORT;
+    ctx->transport_state = ctx;
+    ctx->pending = malloc(config.accept_budget * sizeof(NetConnection));
+    if (ctx->pending == NULL) {
+        log_message(LOG_ERROR, "Failed to allocate memory for accept queue");
         return false;
     }
 
-#ifdef _WIN32
-    DWORD timeout = 1000;
-#else
-    struct timeval timeout = {1, 0};
-#endif
-    if (setsockopt(ctx->local_sockfd, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeout, sizeof(timeout)) == SOCKET_ERROR) {
-        log_message(LOG_ERROR, "Failed to set socket receive timeout: %s", GET_ERROR_STR());
-        goto error;
+    ctx->local_sockfd = socket(af, SOCK_STREAM, 0);
+    if (ctx->local_sockfd == SOCKET_ERROR) {
+        log_message(LOG_ERROR, "Failed to create socket: %s", GET_ERROR_STR());
+        free(ctx->pending);
+        return false;
     }
 
     int optval = 1;
-    if (setsockopt(ctx->local_sockfd, SOL_SOCKET, SO_REUSEADDR, (const char *)&optval, sizeof(optval)) == SOCKET_ERROR) {
-        log_message(LOG_ERROR, "Failed to set socket option SO_REUSEADDR: %s", GET_ERROR_STR());
-        goto error;
+    if (addr.family != NETADDR_UNIX) {
+        if (setsockopt(ctx->local_sockfd, SOL_SOCKET, SO_REUSEADDR, (const char *)&optval, sizeof(optval)) == SOCKET_ERROR) {
+            log_message(LOG_ERROR, "Failed to set socket option SO_REUSEADDR: %s", GET_ERROR_STR());
+            goto error;
+        }
     }
 
-#ifdef _WIN32
-    u_long mode = 1;
-    if (ioctlsocket(ctx->local_sockfd, FIONBIO, &mode) == SOCKET_ERROR) {
-        log_message(LOG_ERROR, "Failed to set socket to non-blocking: %s", GET_ERROR_STR());
-        goto error;
+    if (addr.family == NETADDR_IPV6) {
+        // serve IPv4-mapped clients on the same socket when bound to "::"
+        int v6only = 0;
+        if (setsockopt(ctx->local_sockfd, IPPROTO_IPV6, IPV6_V6ONLY, (const char *)&v6only, sizeof(v6only)) == SOCKET_ERROR) {
+            log_message(LOG_WARN, "Failed to disable IPV6_V6ONLY: %s", GET_ERROR_STR());
+        }
     }
-#else
-    int flags = fcntl(ctx->local_sockfd, F_GETFL, 0);
-    if (flags == -1) {
-        log_message(LOG_ERROR, "Failed to get socket flags: %s", GET_ERROR_STR());
+
+#ifndef _WIN32
+    if (addr.family == NETADDR_UNIX) {
+        // leftover socket file from previous run would make bind fail with EADDRINUSE - but only
+        // a socket nobody listens on is leftover, a live instance keeps its socket and bind fails
+        struct stat st;
+        if (stat(addr.host.path, &st) == 0 && S_ISSOCK(st.st_mode) && netctx_unix_socket_is_stale(addr)) {
+            unlink(addr.host.path);
+        }
+    }
+#endif
+
+    netctx_apply_listen_options(ctx);
+
+    struct sockaddr_storage local_sockaddr;
+    socklen_t local_sockaddr_len = netaddr_to_sockaddr(ctx->local_addr, &local_sockaddr);
+    if (bind(ctx->local_sockfd, (struct sockaddr *)&local_sockaddr, local_sockaddr_len) == SOCKET_ERROR) {
+        log_message(LOG_ERROR, "Failed to bind socket: %s", GET_ERROR_STR());
         goto error;
     }
-    if (fcntl(ctx->local_sockfd, F_SETFL, flags | O_NONBLOCK) == -1) {
-        log_message(LOG_ERROR, "Failed to set socket to non-blocking: %s", GET_ERROR_STR());
+
+    if (!netctx_set_nonblocking(ctx->local_sockfd)) {
         goto error;
     }
-#endif
 
-    if (listen(ctx->local_sockfd, 10) == SOCKET_ERROR) {
+    if (listen(ctx->local_sockfd, config.backlog > 0 ? config.backlog : SOMAXCONN) == SOCKET_ERROR) {
         log_message(LOG_ERROR, "Failed to listen on socket: %s", GET_ERROR_STR());
         goto error;
     }
 
-    log_message(LOG_INFO, "Listening on port %d", port);
+    log_message(LOG_INFO, "Listening on %s", netaddr_to_string(ctx->local_addr, addr_str, sizeof(addr_str)));
     
     return true;
 error:
     SHUTDOWN_SOCKET(ctx->local_sockfd);
     CLOSE_SOCKET(ctx->local_sockfd);
+    free(ctx->pending);
+    ctx->pending = NULL;
     return false;
 }
 
-NetSocket netctx_get_next_connection(NetContext *ctx) {
-    struct sockaddr_in remote_sockaddr;
+bool netctx_init_transport(NetContext **out_ctx, const NetTransport *transport, void *transport_state, NetConfig config) {
+    if (!out_ctx || !*out_ctx || !transport) {
+        log_message(LOG_ERROR, "Attempted to initialize NetContext with NULL output pointer or transport");
+        return false;
+    }
+
+    NetContext* ctx = *out_ctx;
+    memset(ctx, 0, sizeof(NetContext));
+    ctx->local_addr = netaddr_any_ipv4(0);
+    ctx->local_sockfd = SOCKET_ERROR;
+    ctx->config = config;
+    ctx->current.sockfd = SOCKET_ERROR;
+    ctx->transport = transport;
+    ctx->transport_state = transport_state;
+
+    log_message(LOG_INFO, "Serving connections from %s transport", transport->name);
+    return true;
+}
+
+static NetSocket netctx_accept_one(NetContext *ctx, NetAddress *out_addr) {
+    struct sockaddr_storage remote_sockaddr;
     socklen_t remote_sockaddr_len = sizeof(remote_sockaddr);
+#ifdef __linux__
+    NetSocket remote_sockfd = accept4(ctx->local_sockfd, (struct sockaddr *)&remote_sockaddr, &remote_sockaddr_len,
+                                      SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
     NetSocket remote_sockfd = accept(ctx->local_sockfd, (struct sockaddr *)&remote_sockaddr, &remote_sockaddr_len);
+    if (remote_sockfd != SOCKET_ERROR && !netctx_set_nonblocking(remote_sockfd)) {
+        CLOSE_SOCKET(remote_sockfd);
+        return SOCKET_ERROR;
+    }
+#endif
     if (remote_sockfd == SOCKET_ERROR) {
         int err = GET_ERROR_CODE();
 
@@ -152,22 +444,95 @@ NetSocket netctx_get_next_connection(NetContext *ctx) {
         return SOCKET_ERROR;
     }
 
-    ctx->remote_addr = netaddr_from_sockaddr(&remote_sockaddr);
-    ctx->remote_sockfd = remote_sockfd;
+    netctx_apply_connection_options(ctx, remote_sockfd);
+    *out_addr = netaddr_from_sockaddr((struct sockaddr *)&remote_sockaddr, remote_sockaddr_len);
+    return remote_sockfd;
+}
+
+static bool socket_accept(void *state, NetConnection *out_conn) {
+    NetContext* ctx = state;
+    size_t budget = (size_t)ctx->config.accept_budget;
+
+    if (ctx->pending_count == 0) {
+        ctx->pending_head = 0;
+        while (ctx->pending_count < budget) {
+            NetConnection* conn = &ctx->pending[ctx->pending_count];
+            conn->sockfd = netctx_accept_one(ctx, &conn->remote_addr);
+            if (conn->sockfd == SOCKET_ERROR) {
+                break;
+            }
+            ctx->pending_count++;
+        }
+    }
+
+    if (ctx->pending_count == 0) {
+        return false;
+    }
+
+    *out_conn = ctx->pending[ctx->pending_head];
+    ctx->pending_head = (ctx->pending_head + 1) % budget;
+    ctx->pending_count--;
+    out_conn->transport_conn = NULL;
+    return true;
+}
+
+bool netctx_accept(NetContext *ctx, NetConnection *out_conn) {
+    if (!ctx->transport->accept(ctx->transport_state, out_conn)) {
+        return false;
+    }
+
+    out_conn->recv_timeout_ms = ctx->config.recv_timeout_ms > 0 ? ctx->config.recv_timeout_ms : -1;
+    out_conn->send_timeout_ms = ctx->config.send_timeout_ms > 0 ? ctx->config.send_timeout_ms : -1;
+    out_conn->tls = NULL;
+    out_conn->transport = ctx->transport;
+
     if (verbose_output) {
-        log_message(LOG_INFO, "Accepted connection from %s:%d",
-                    inet_ntoa(remote_sockaddr.sin_addr), ntohs(remote_sockaddr.sin_port));
+        char addr_str[NETADDR_UNIX_PATH_MAX + 8];
+        log_message(LOG_INFO, "Accepted connection from %s", netaddr_to_string(out_conn->remote_addr, addr_str, sizeof(addr_str)));
     }
-    return remote_sockfd;
+    return true;
+}
+
+NetSocket netctx_get_next_connection(NetContext *ctx) {
+    if (!netctx_accept(ctx, &ctx->current)) {
+        return SOCKET_ERROR;
+    }
+    return ctx->current.sockfd;
 }
 
 void netctx_close_current_connection(NetContext *ctx) {
-    SHUTDOWN_SOCKET(ctx->remote_sockfd);
-    CLOSE_SOCKET(ctx->remote_sockfd);
+    netconn_close(&ctx->current);
+}
+
+static const NetTransport* netconn_transport(NetConnection *conn) {
+    return conn->transport ? conn->transport : &NET_SOCKET_TRANSPORT;
+}
+
+static void socket_close(NetConnection *conn) {
+    if (conn->sockfd == SOCKET_ERROR) {
+        return;
+    }
+
+    SHUTDOWN_SOCKET(conn->sockfd);
+    CLOSE_SOCKET(conn->sockfd);
+    conn->sockfd = SOCKET_ERROR;
+}
+
+void netconn_close(NetConnection *conn) {
+    if (conn->sockfd == SOCKET_ERROR && conn->transport_conn == NULL) {
+        return;
+    }
+
+    if (conn->tls) {
+        tls_close(conn);
+    }
+
+    netconn_transport(conn)->close(conn);
+    conn->sockfd = SOCKET_ERROR;
+    conn->transport_conn = NULL;
     if (verbose_output) {
-        log_message(LOG_INFO, "Closed connection from %s:%d",
-                    inet_ntoa(netaddr_to_sockaddr(ctx->remote_addr).sin_addr),
-                    ntohs(netaddr_to_sockaddr(ctx->remote_addr).sin_port));
+        char addr_str[NETADDR_UNIX_PATH_MAX + 8];
+        log_message(LOG_INFO, "Closed connection from %s", netaddr_to_string(conn->remote_addr, addr_str, sizeof(addr_str)));
     }
 }
 
@@ -177,26 +542,199 @@ void netctx_deinit(NetContext *ctx) {
         return;
     }
 
-    if (ctx->local_sockfd != SOCKET_ERROR) {
+    // contexts of other transports have no socket, and didn't initialize Winsock either
+    bool listening = ctx->local_sockfd != SOCKET_ERROR;
+    if (listening) {
         SHUTDOWN_SOCKET(ctx->local_sockfd);
         CLOSE_SOCKET(ctx->local_sockfd);
     }
+
+    for (; ctx->pending_count > 0; ctx->pending_count--) {
+        CLOSE_SOCKET(ctx->pending[ctx->pending_head].sockfd);
+        ctx->pending_head = (ctx->pending_head + 1) % ctx->config.accept_budget;
+    }
+    free(ctx->pending);
+    ctx->pending = NULL;
+    tls_context_free(ctx->tls);
+    ctx->tls = NULL;
+    if (!listening) {
+        return;
+    }
 #ifdef _WIN32
     WSACleanup();
+#else
+    if (ctx->local_addr.family == NETADDR_UNIX) {
+        unlink(ctx->local_addr.host.path);
+    }
 #endif
 }
 
 ByteCount netctx_send(NetContext *ctx, const void *buf, size_t len) {
-    ByteCount sent = send(ctx->remote_sockfd, buf, len, 0);
+    return netconn_send(&ctx->current, buf, len);
+}
+
+ByteCount netctx_recv(NetContext *ctx, void *buf, size_t len) {
+    return netconn_recv(&ctx->current, buf, len);
+}
+
+static ByteCount socket_recv(NetConnection *conn, void *buf, size_t len) {
+    return comet_read(conn->sockfd, buf, len, conn->recv_timeout_ms);
+}
+
+static ByteCount socket_send(NetConnection *conn, const void *buf, size_t len) {
+    return comet_write(conn->sockfd, buf, len, conn->send_timeout_ms);
+}
+
+static ByteCount socket_sendv(NetConnection *conn, const NetBuffer *bufs, size_t count) {
+    return comet_writev(conn->sockfd, bufs, count, conn->send_timeout_ms);
+}
+
+static ByteCount socket_try_send(NetConnection *conn, const void *buf, size_t len) {
+    for (;;) {
+        ByteCount sent = send(conn->sockfd, buf, len, SEND_FLAGS);
+        if (sent != SOCKET_ERROR) {
+            return sent;
+        }
+
+        int err = GET_ERROR_CODE();
+        if (err == COMET_ERROR_CANCELLED) {
+            continue;
+        }
+        if (IS_WOULD_BLOCK(err)) {
+            return 0;
+        }
+        return SOCKET_ERROR;
+    }
+}
+
+static ByteCount socket_sendfile(NetConnection *conn, int file_fd, uint64_t offset, size_t len) {
+    return comet_sendfile(conn->sockfd, file_fd, offset, len, conn->send_timeout_ms);
+}
+
+static bool socket_peer_closed(NetConnection *conn) {
+    char discard[256];
+    for (;;) {
+        ByteCount n = recv(conn->sockfd, discard, sizeof(discard), 0);
+        if (n != SOCKET_ERROR) {
+            return n == 0;
+        }
+
+        int err = GET_ERROR_CODE();
+        if (err != COMET_ERROR_CANCELLED) {
+            return !IS_WOULD_BLOCK(err);
+        }
+    }
+}
+
+const NetTransport NET_SOCKET_TRANSPORT = {
+    .name = "socket",
+    .accept = socket_accept,
+    .recv = socket_recv,
+    .send = socket_send,
+    .sendv = socket_sendv,
+    .try_send = socket_try_send,
+    .sendfile = socket_sendfile,
+    .peer_closed = socket_peer_closed,
+    .close = socket_close,
+};
+
+#define NETCONN_SENDFILE_CHUNK (64 * 1024)
+
+// sendfile for transports without their own - file goes through memory in chunks
+static ByteCount netconn_sendfile_chunked(NetConnection *conn, const NetTransport *transport, int file_fd, uint64_t offset, size_t len) {
+    char* chunk = malloc(NETCONN_SENDFILE_CHUNK);
+    if (chunk == NULL) {
+        return SOCKET_ERROR;
+    }
+
+    size_t total_sent = 0;
+    while (total_sent < len) {
+        size_t want = len - total_sent < NETCONN_SENDFILE_CHUNK ? len - total_sent : NETCONN_SENDFILE_CHUNK;
+        ByteCount n = comet_file_read(file_fd, chunk, want, offset + total_sent);
+        if (n <= 0 || transport->send(conn, chunk, n) == SOCKET_ERROR) {
+            free(chunk);
+            return SOCKET_ERROR;
+        }
+        total_sent += n;
+    }
+
+    free(chunk);
+    return total_sent;
+}
+
+ByteCount netconn_send(NetConnection *conn, const void *buf, size_t len) {
+    if (conn->tls) {
+        return tls_send(conn, buf, len);
+    }
+
+    ByteCount sent = netconn_transport(conn)->send(conn, buf, len);
     if (sent == SOCKET_ERROR) {
         log_message(LOG_ERROR, "Failed to send data: %s", GET_ERROR_STR());
     }
     return sent;
 }
 
-ByteCount netctx_recv(NetContext *ctx, void *buf, size_t len) {
-    ByteCount received = recv(ctx->remote_sockfd, buf, len, 0);
-    if (received == SOCKET_ERROR) {
+ByteCount netconn_sendv(NetConnection *conn, const NetBuffer *bufs, size_t count) {
+    if (conn->tls) {
+        return tls_sendv(conn, bufs, count);
+    }
+
+    const NetTransport* transport = netconn_transport(conn);
+    ByteCount sent = 0;
+    if (transport->sendv) {
+        sent = transport->sendv(conn, bufs, count);
+    } else {
+        for (size_t i = 0; i < count && sent != SOCKET_ERROR; i++) {
+            sent = transport->send(conn, bufs[i].data, bufs[i].len) == SOCKET_ERROR ? SOCKET_ERROR : sent + (ByteCount)bufs[i].len;
+        }
+    }
+    if (sent == SOCKET_ERROR) {
+        log_message(LOG_ERROR, "Failed to send data: %s", GET_ERROR_STR());
+    }
+    return sent;
+}
+
+ByteCount netconn_try_send(NetConnection *conn, const void *buf, size_t len) {
+    if (conn->tls) {
+        return tls_try_send(conn, buf, len);
+    }
+
+    const NetTransport* transport = netconn_transport(conn);
+    return transport->try_send ? transport->try_send(conn, buf, len) : transport->send(conn, buf, len);
+}
+
+ByteCount netconn_sendfile(NetConnection *conn, int file_fd, uint64_t offset, size_t len) {
+    if (conn->tls) {
+        return tls_sendfile(conn, file_fd, offset, len);
+    }
+
+    const NetTransport* transport = netconn_transport(conn);
+    ByteCount sent = transport->sendfile
+        ? transport->sendfile(conn, file_fd, offset, len)
+        : netconn_sendfile_chunked(conn, transport, file_fd, offset, len);
+    if (sent == SOCKET_ERROR) {
+        log_message(LOG_ERROR, "Failed to send file: %s", GET_ERROR_STR());
+    }
+    return sent;
+}
+
+bool netconn_peer_closed(NetConnection *conn) {
+    if (conn->tls) {
+        return tls_peer_closed(conn);
+    }
+
+    const NetTransport* transport = netconn_transport(conn);
+    return transport->peer_closed ? transport->peer_closed(conn) : false;
+}
+
+ByteCount netconn_recv(NetConnection *conn, void *buf, size_t len) {
+    if (conn->tls) {
+        return tls_recv(conn, buf, len);
+    }
+
+    ByteCount received = netconn_transport(conn)->recv(conn, buf, len);
+    // timeouts are routine for long-lived connections, callers decide if they are an error
+    if (received == SOCKET_ERROR && GET_ERROR_CODE() != COMET_ERROR_TIMEOUT) {
         log_message(LOG_ERROR, "Failed to receive data: %s", GET_ERROR_STR());
     }
     return received;
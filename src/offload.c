@@ -0,0 +1,459 @@
+#include "include/offload.h"
+#include "include/body.h"
+#include "include/trace.h"
+#include "include/netplat.h"
+#include "include/logger.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+typedef HANDLE OffloadThread;
+typedef CRITICAL_SECTION OffloadMutex;
+typedef CONDITION_VARIABLE OffloadCond;
+
+#define mutex_init(m) InitializeCriticalSection(m)
+#define mutex_destroy(m) DeleteCriticalSection(m)
+#define mutex_lock(m) EnterCriticalSection(m)
+#define mutex_unlock(m) LeaveCriticalSection(m)
+#define cond_init(c) InitializeConditionVariable(c)
+#define cond_destroy(c) ((void)0)
+#define cond_wait(c, m) SleepConditionVariableCS(c, m, INFINITE)
+#define cond_signal(c) WakeConditionVariable(c)
+#define cond_broadcast(c) WakeAllConditionVariable(c)
+#else
+#include <pthread.h>
+
+typedef pthread_t OffloadThread;
+typedef pthread_mutex_t OffloadMutex;
+typedef pthread_cond_t OffloadCond;
+
+#define mutex_init(m) pthread_mutex_init(m, NULL)
+#define mutex_destroy(m) pthread_mutex_destroy(m)
+#define mutex_lock(m) pthread_mutex_lock(m)
+#define mutex_unlock(m) pthread_mutex_unlock(m)
+#define cond_init(c) pthread_cond_init(c, NULL)
+#define cond_destroy(c) pthread_cond_destroy(c)
+#define cond_wait(c, m) pthread_cond_wait(c, m)
+#define cond_signal(c) pthread_cond_signal(c)
+#define cond_broadcast(c) pthread_cond_broadcast(c)
+#endif
+
+const CometOffloadConfig COMET_OFFLOAD_DEFAULT_CONFIG = {
+    .threads = 0,
+    .max_queued = 256,
+    .max_wait_ms = 10000,
+};
+
+typedef struct OffloadJob {
+    offload_func fn;
+    void* arg;
+    CometFiber* fiber;
+    uint64_t queued_ns;
+    CometOffloadStatus status;
+    bool done;                  // status was delivered, set by network thread
+    struct OffloadJob* next;    // on finished list
+} OffloadJob;
+
+typedef struct {
+    CometOffloadPool* pool;
+    size_t index;
+    OffloadThread thread;
+
+    OffloadMutex lock;
+    OffloadJob** ring;          // max_queued slots, that many jobs can't be queued in total
+    size_t head;
+    size_t len;
+} OffloadWorker;
+
+struct CometOffloadPool {
+    CometOffloadConfig config;
+    OffloadWorker* workers;
+    size_t num_workers;
+    size_t num_started;         // threads to join
+    size_t next_worker;         // where next job goes, network thread only
+    size_t in_flight;           // jobs submitted and not delivered yet, network thread only
+
+    OffloadMutex lock;          // guards everything below it up to finished_lock
+    OffloadCond work_ready;
+    size_t claimable;           // queued jobs no worker has claimed yet
+    bool stopping;
+    CometOffloadStats stats;
+
+    OffloadMutex finished_lock;
+    OffloadJob* finished;       // done jobs waiting for network thread
+    NetSocket wake_fds[2];      // pipe, written when finished list stops being empty
+};
+
+static size_t cpu_count(void) {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (size_t)n : 1;
+#endif
+}
+
+static OffloadJob* worker_take(OffloadWorker* self) {
+    CometOffloadPool* pool = self->pool;
+
+    // own queue first, then steal from the others - claimed job is in one of them
+    for (;;) {
+        for (size_t i = 0; i < pool->num_workers; i++) {
+            OffloadWorker* worker = &pool->workers[(self->index + i) % pool->num_workers];
+
+            mutex_lock(&worker->lock);
+            if (worker->len > 0) {
+                OffloadJob* job = worker->ring[worker->head];
+                worker->head = (worker->head + 1) % pool->config.max_queued;
+                worker->len--;
+                mutex_unlock(&worker->lock);
+                return job;
+            }
+            mutex_unlock(&worker->lock);
+        }
+    }
+}
+
+static void worker_finish(CometOffloadPool* pool, OffloadJob* job) {
+    mutex_lock(&pool->finished_lock);
+    bool was_empty = pool->finished == NULL;
+    job->next = pool->finished;
+    pool->finished = job;
+    mutex_unlock(&pool->finished_lock);
+
+#ifndef _WIN32
+    if (was_empty) {
+        // pipe being full already means network thread is about to look
+        ssize_t ignored = write(pool->wake_fds[1], "", 1);
+        (void)ignored;
+    }
+#else
+    (void)was_empty;
+#endif
+}
+
+#ifdef _WIN32
+static DWORD WINAPI worker_main(LPVOID arg) {
+#else
+static void* worker_main(void* arg) {
+#endif
+    OffloadWorker* self = arg;
+    CometOffloadPool* pool = self->pool;
+    uint64_t max_wait_ns = pool->config.max_wait_ms >= 0 ? (uint64_t)pool->config.max_wait_ms * 1000000 : UINT64_MAX;
+
+    for (;;) {
+        mutex_lock(&pool->lock);
+        while (pool->claimable == 0 && !pool->stopping) {
+            cond_wait(&pool->work_ready, &pool->lock);
+        }
+        if (pool->stopping) {
+            mutex_unlock(&pool->lock);
+            break;
+        }
+        pool->claimable--;
+        mutex_unlock(&pool->lock);
+
+        OffloadJob* job = worker_take(self);
+        uint64_t wait_ns = comet_now_ns() - job->queued_ns;
+        bool expired = wait_ns > max_wait_ns;
+
+        mutex_lock(&pool->lock);
+        pool->stats.queued--;
+        pool->stats.total_wait_ns += wait_ns;
+        if (wait_ns > pool->stats.max_wait_ns) pool->stats.max_wait_ns = wait_ns;
+        if (expired) {
+            pool->stats.expired++;
+        } else {
+            pool->stats.running++;
+        }
+        mutex_unlock(&pool->lock);
+
+        if (expired) {
+            job->status = COMET_OFFLOAD_EXPIRED;
+        } else {
+            job->fn(job->arg);
+            job->status = COMET_OFFLOAD_DONE;
+
+            mutex_lock(&pool->lock);
+            pool->stats.running--;
+            pool->stats.completed++;
+            mutex_unlock(&pool->lock);
+        }
+
+        worker_finish(pool, job);
+    }
+
+    buffer_pool_clear();
+    return 0;
+}
+
+static bool start_worker(OffloadWorker* worker) {
+#ifdef _WIN32
+    worker->thread = CreateThread(NULL, 0, worker_main, worker, 0, NULL);
+    return worker->thread != NULL;
+#else
+    return pthread_create(&worker->thread, NULL, worker_main, worker) == 0;
+#endif
+}
+
+static void join_worker(OffloadWorker* worker) {
+#ifdef _WIN32
+    WaitForSingleObject(worker->thread, INFINITE);
+    CloseHandle(worker->thread);
+#else
+    pthread_join(worker->thread, NULL);
+#endif
+}
+
+static bool open_wake_pipe(CometOffloadPool* pool) {
+#ifdef _WIN32
+    // WSAPoll can't wait on pipes - network thread checks finished list on a short timer instead
+    pool->wake_fds[0] = SOCKET_ERROR;
+    pool->wake_fds[1] = SOCKET_ERROR;
+    return true;
+#else
+    if (pipe(pool->wake_fds) != 0) {
+        return false;
+    }
+    for (int i = 0; i < 2; i++) {
+        fcntl(pool->wake_fds[i], F_SETFL, fcntl(pool->wake_fds[i], F_GETFL) | O_NONBLOCK);
+        fcntl(pool->wake_fds[i], F_SETFD, FD_CLOEXEC);
+    }
+    return true;
+#endif
+}
+
+static void close_wake_pipe(CometOffloadPool* pool) {
+#ifndef _WIN32
+    close(pool->wake_fds[0]);
+    close(pool->wake_fds[1]);
+#endif
+}
+
+static void drain_wake_pipe(CometOffloadPool* pool) {
+#ifndef _WIN32
+    char drain[64];
+    while (read(pool->wake_fds[0], drain, sizeof(drain)) > 0);
+#endif
+}
+
+CometOffloadPool* comet_offload_pool_new(CometOffloadConfig config) {
+    if (config.max_queued == 0) {
+        log_message(LOG_ERROR, "Offload pool needs room for at least one queued job");
+        return NULL;
+    }
+
+    size_t threads = config.threads > 0 ? config.threads : cpu_count();
+
+    CometOffloadPool* pool = calloc(1, sizeof(CometOffloadPool));
+    OffloadWorker* workers = calloc(threads, sizeof(OffloadWorker));
+    if (pool == NULL || workers == NULL) {
+        log_message(LOG_ERROR, "Failed to allocate memory for offload pool");
+        free(pool);
+        free(workers);
+        return NULL;
+    }
+
+    if (!open_wake_pipe(pool)) {
+        log_message(LOG_ERROR, "Failed to create offload wake pipe: %s", GET_ERROR_STR());
+        free(pool);
+        free(workers);
+        return NULL;
+    }
+
+    pool->config = config;
+    pool->workers = workers;
+    pool->stopping = true;      // until threads are started
+    mutex_init(&pool->lock);
+    mutex_init(&pool->finished_lock);
+    cond_init(&pool->work_ready);
+
+    for (size_t i = 0; i < threads; i++) {
+        OffloadWorker* worker = &workers[i];
+        worker->pool = pool;
+        worker->index = i;
+        worker->ring = malloc(config.max_queued * sizeof(OffloadJob*));
+        if (worker->ring == NULL) {
+            log_message(LOG_ERROR, "Failed to allocate memory for offload queue");
+            comet_offload_pool_free(pool);
+            return NULL;
+        }
+        mutex_init(&worker->lock);
+        pool->num_workers++;
+    }
+
+    if (!comet_offload_pool_start(pool)) {
+        comet_offload_pool_free(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+bool comet_offload_pool_start(CometOffloadPool* pool) {
+    if (!pool) {
+        return false;
+    }
+    if (!pool->stopping) {
+        return true;
+    }
+
+    // jobs left queued by the last run belong to fibers that are gone by now - drop them
+    for (size_t i = 0; i < pool->num_workers; i++) {
+        pool->workers[i].head = 0;
+        pool->workers[i].len = 0;
+    }
+    pool->claimable = 0;
+    pool->stats.queued = 0;
+    pool->stats.running = 0;
+    pool->finished = NULL;
+    pool->in_flight = 0;
+    drain_wake_pipe(pool);
+
+    pool->stopping = false;
+    pool->num_started = 0;
+    for (size_t i = 0; i < pool->num_workers; i++) {
+        if (!start_worker(&pool->workers[i])) {
+            log_message(LOG_ERROR, "Failed to start offload thread");
+            comet_offload_pool_stop(pool);
+            return false;
+        }
+        pool->num_started++;
+    }
+    pool->stats.threads = pool->num_started;
+
+    return true;
+}
+
+void comet_offload_pool_stop(CometOffloadPool* pool) {
+    if (!pool) {
+        return;
+    }
+
+    mutex_lock(&pool->lock);
+    bool stopped = pool->stopping;
+    pool->stopping = true;
+    cond_broadcast(&pool->work_ready);
+    mutex_unlock(&pool->lock);
+
+    if (stopped) {
+        return;
+    }
+
+    for (size_t i = 0; i < pool->num_started; i++) {
+        join_worker(&pool->workers[i]);
+    }
+}
+
+void comet_offload_pool_free(CometOffloadPool* pool) {
+    if (!pool) {
+        return;
+    }
+
+    comet_offload_pool_stop(pool);
+
+    for (size_t i = 0; i < pool->num_workers; i++) {
+        free(pool->workers[i].ring);
+        mutex_destroy(&pool->workers[i].lock);
+    }
+    free(pool->workers);
+
+    cond_destroy(&pool->work_ready);
+    mutex_destroy(&pool->finished_lock);
+    mutex_destroy(&pool->lock);
+    close_wake_pipe(pool);
+    free(pool);
+}
+
+static CometOffloadStatus offload_submit(CometOffloadPool* pool, OffloadJob* job) {
+    mutex_lock(&pool->lock);
+    if (pool->stopping || pool->stats.queued >= pool->config.max_queued) {
+        pool->stats.rejected++;
+        mutex_unlock(&pool->lock);
+        return COMET_OFFLOAD_REJECTED;
+    }
+    pool->stats.queued++;
+
+    OffloadWorker* worker = &pool->workers[pool->next_worker];
+    pool->next_worker = (pool->next_worker + 1) % pool->num_workers;
+
+    mutex_lock(&worker->lock);
+    worker->ring[(worker->head + worker->len) % pool->config.max_queued] = job;
+    worker->len++;
+    mutex_unlock(&worker->lock);
+
+    pool->claimable++;
+    cond_signal(&pool->work_ready);
+    mutex_unlock(&pool->lock);
+
+    return COMET_OFFLOAD_DONE;
+}
+
+CometOffloadStatus comet_offload_run(CometOffloadPool* pool, offload_func fn, void* arg) {
+    if (!pool || !comet_in_fiber()) {
+        fn(arg);
+        return COMET_OFFLOAD_DONE;
+    }
+
+    // job lives on the suspended fiber's stack - pool is stopped before fibers are destroyed
+    OffloadJob job = {
+        .fn = fn,
+        .arg = arg,
+        .fiber = fiber_self(),
+        .queued_ns = comet_now_ns(),
+        .status = COMET_OFFLOAD_DONE,
+        .done = false,
+        .next = NULL,
+    };
+
+    CometOffloadStatus status = offload_submit(pool, &job);
+    if (status != COMET_OFFLOAD_DONE) {
+        return status;
+    }
+
+    pool->in_flight++;
+    while (!job.done) {
+        comet_wait_fd(SOCKET_ERROR, 0, -1);
+    }
+    return job.status;
+}
+
+void comet_offload_serve(CometOffloadPool* pool, volatile bool* running) {
+    while (*running || pool->in_flight > 0) {
+#ifdef _WIN32
+        comet_wait_fd(SOCKET_ERROR, 0, 1);
+#else
+        if (comet_wait_fd(pool->wake_fds[0], POLLIN, 100) != 0) {
+            drain_wake_pipe(pool);
+        }
+#endif
+
+        mutex_lock(&pool->finished_lock);
+        OffloadJob* job = pool->finished;
+        pool->finished = NULL;
+        mutex_unlock(&pool->finished_lock);
+
+        while (job) {
+            OffloadJob* next = job->next;
+            job->done = true;
+            pool->in_flight--;
+            fiber_wake(job->fiber);
+            job = next;
+        }
+    }
+}
+
+CometOffloadStats comet_offload_stats(CometOffloadPool* pool) {
+    CometOffloadStats stats = {0};
+    if (!pool) {
+        return stats;
+    }
+
+    mutex_lock(&pool->lock);
+    stats = pool->stats;
+    mutex_unlock(&pool->lock);
+    return stats;
+}
@@ -0,0 +1,651 @@
+#include "include/proxy.h"
+#include "include/fiber.h"
+#include "include/netplat.h"
+#include "include/httputil.h"
+#include "include/logger.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#ifdef _WIN32
+#define strncasecmp _strnicmp
+#endif
+
+#define PROXY_BUFFER_SIZE (16 * 1024)
+
+const CometUpstreamConfig COMET_UPSTREAM_DEFAULT_CONFIG = {
+    .strategy = COMET_BALANCE_ROUND_ROBIN,
+    .max_idle_per_server = 32,
+    .connect_timeout_ms = 1000,
+    .io_timeout_ms = 30000,
+};
+
+static const char BAD_GATEWAY_RESPONSE[] =
+    "HTTP/1.1 502 Bad Gateway\r\n"
+    "Content-Type: text/plain\r\n"
+    "Content-Length: 15\r\n"
+    "Connection: close\r\n"
+    "\r\n"
+    "502 Bad Gateway";
+
+static const char LENGTH_REQUIRED_RESPONSE[] =
+    "HTTP/1.1 411 Length Required\r\n"
+    "Content-Type: text/plain\r\n"
+    "Content-Length: 19\r\n"
+    "Connection: close\r\n"
+    "\r\n"
+    "411 Length Required";
+
+static const char NOT_IMPLEMENTED_RESPONSE[] =
+    "HTTP/1.1 501 Not Implemented\r\n"
+    "Content-Type: text/plain\r\n"
+    "Content-Length: 19\r\n"
+    "Connection: close\r\n"
+    "\r\n"
+    "501 Not Implemented";
+
+static const char GATEWAY_TIMEOUT_RESPONSE[] =
+    "HTTP/1.1 504 Gateway Timeout\r\n"
+    "Content-Type: text/plain\r\n"
+    "Content-Length: 19\r\n"
+    "Connection: close\r\n"
+    "\r\n"
+    "504 Gateway Timeout";
+
+// Headers that describe the client<->comet hop only and must not be forwarded.
+static const char* HOP_BY_HOP_HEADERS[] = {
+    "Connection",
+    "Keep-Alive",
+    "Proxy-Connection",
+    "TE",
+    "Upgrade",
+};
+
+CometUpstream* comet_upstream_new(CometUpstreamConfig config) {
+    CometUpstream* upstream = calloc(1, sizeof(CometUpstream));
+    if (upstream == NULL) {
+        log_message(LOG_ERROR, "Failed to allocate memory for upstream");
+        return NULL;
+    }
+
+    upstream->config = config;
+    return upstream;
+}
+
+bool comet_upstream_add_server(CometUpstream* upstream, NetAddress addr) {
+    if (!upstream) {
+        log_message(LOG_ERROR, "Upstream is NULL");
+        return false;
+    }
+
+    CometUpstreamServer* new_servers = realloc(upstream->servers, (upstream->num_servers + 1) * sizeof(CometUpstreamServer));
+    if (new_servers == NULL) {
+        log_message(LOG_ERROR, "Failed to allocate memory for upstream server");
+        return false;
+    }
+    upstream->servers = new_servers;
+
+    CometUpstreamServer* server = &upstream->servers[upstream->num_servers];
+    server->addr = addr;
+    server->num_idle = 0;
+    server->num_active = 0;
+    server->idle = NULL;
+    if (upstream->config.max_idle_per_server > 0) {
+        server->idle = malloc(upstream->config.max_idle_per_server * sizeof(NetSocket));
+        if (server->idle == NULL) {
+            log_message(LOG_ERROR, "Failed to allocate memory for upstream connection pool");
+            return false;
+        }
+    }
+
+    upstream->num_servers++;
+    return true;
+}
+
+void comet_upstream_free(CometUpstream* upstream) {
+    if (!upstream) {
+        return;
+    }
+
+    for (size_t i = 0; i < upstream->num_servers; i++) {
+        for (size_t j = 0; j < upstream->servers[i].num_idle; j++) {
+            CLOSE_SOCKET(upstream->servers[i].idle[j]);
+        }
+        free(upstream->servers[i].idle);
+    }
+    free(upstream->servers);
+    free(upstream);
+}
+
+static CometUpstreamServer* upstream_pick_server(CometUpstream* upstream) {
+    size_t start = upstream->next_server % upstream->num_servers;
+    upstream->next_server = start + 1;
+
+    if (upstream->config.strategy == COMET_BALANCE_ROUND_ROBIN) {
+        return &upstream->servers[start];
+    }
+
+    // least connections, ties broken in round robin order
+    CometUpstreamServer* best = &upstream->servers[start];
+    for (size_t i = 1; i < upstream->num_servers; i++) {
+        CometUpstreamServer* server = &upstream->servers[(start + i) % upstream->num_servers];
+        if (server->num_active < best->num_active) {
+            best = server;
+        }
+    }
+    return best;
+}
+
+// Pooled connection is usable only if upstream did not close it or send anything unexpected meanwhile.
+static bool upstream_connection_alive(NetSocket fd) {
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    return POLL_SOCKETS(&pfd, 1, 0) == 0;
+}
+
+static NetSocket upstream_acquire(CometUpstream* upstream, CometUpstreamServer* server, bool* reused) {
+    while (server->num_idle > 0) {
+        NetSocket fd = server->idle[--server->num_idle];
+        if (upstream_connection_alive(fd)) {
+            *reused = true;
+            server->num_active++;
+            return fd;
+        }
+        CLOSE_SOCKET(fd);
+    }
+
+    *reused = false;
+    NetSocket fd = comet_connect(server->addr, upstream->config.connect_timeout_ms);
+    if (fd == SOCKET_ERROR) {
+        char addr_str[NETADDR_UNIX_PATH_MAX + 8];
+        log_message(LOG_ERROR, "Failed to connect to upstream %s: %s",
+                    netaddr_to_string(server->addr, addr_str, sizeof(addr_str)), GET_ERROR_STR());
+        return SOCKET_ERROR;
+    }
+
+    server->num_active++;
+    return fd;
+}
+
+static void upstream_release(CometUpstream* upstream, CometUpstreamServer* server, NetSocket fd, bool reusable) {
+    server->num_active--;
+
+    if (reusable && server->num_idle < upstream->config.max_idle_per_server) {
+        server->idle[server->num_idle++] = fd;
+    } else {
+        CLOSE_SOCKET(fd);
+    }
+}
+
+static bool is_header_line(const char* line, size_t line_len, const char* name) {
+    size_t name_len = strlen(name);
+    return line_len > name_len && line[name_len] == ':' && strncasecmp(line, name, name_len) == 0;
+}
+
+// Whether header of line is named in any Connection header of head - sender declared it hop-by-hop.
+static bool is_connection_option(const char* head, size_t head_len, const char* line, size_t line_len) {
+    const char* colon = memchr(line, ':', line_len);
+    char name[64];
+    size_t name_len = colon ? (size_t)(colon - line) : 0;
+    if (name_len == 0 || name_len >= sizeof(name)) {
+        return false;
+    }
+    memcpy(name, line, name_len);
+    name[name_len] = '\0';
+
+    const char* end = head + head_len;
+    const char* other = find_bytes(head, head_len, "\r\n", 2);
+    while (other != NULL && other + 2 < end) {
+        other += 2;
+        const char* other_end = find_bytes(other, end - other, "\r\n", 2);
+        if (other_end == NULL || other_end == other) {
+            break;
+        }
+        if (is_header_line(other, other_end - other, "Connection") &&
+            header_value_has_token(other + 11, other_end - (other + 11), name)) {
+            return true;
+        }
+        other = other_end;
+    }
+    return false;
+}
+
+static bool is_hop_by_hop_header(const char* head, size_t head_len, const char* line, size_t line_len) {
+    for (size_t i = 0; i < sizeof(HOP_BY_HOP_HEADERS) / sizeof(HOP_BY_HOP_HEADERS[0]); i++) {
+        if (is_header_line(line, line_len, HOP_BY_HOP_HEADERS[i])) {
+            return true;
+        }
+    }
+    return is_connection_option(head, head_len, line, line_len);
+}
+
+// Appends header lines of raw head except hop-by-hop ones - fixed ones and those its Connection header names -
+// and those named skip (if not NULL). Returns new length of out.
+static size_t copy_end_to_end_headers(char* out, size_t out_len, const char* head, size_t head_len, const char* skip) {
+    const char* end = head + head_len;
+    const char* line = find_bytes(head, head_len, "\r\n", 2);
+
+    while (line != NULL && line + 2 < end) {
+        line += 2;
+        const char* line_end = find_bytes(line, end - line, "\r\n", 2);
+        if (line_end == NULL || line_end == line) {
+            break;
+        }
+
+        if (!is_hop_by_hop_header(head, head_len, line, line_end - line) && (skip == NULL || !is_header_line(line, line_end - line, skip))) {
+            memcpy(out + out_len, line, line_end - line + 2);
+            out_len += line_end - line + 2;
+        }
+
+        line = line_end;
+    }
+
+    return out_len;
+}
+
+// Appends values of every header named name, joined with ", ". Returns new length of out.
+static size_t join_header_values(char* out, size_t out_len, const char* head, size_t head_len, const char* name) {
+    const char* end = head + head_len;
+    const char* line = find_bytes(head, head_len, "\r\n", 2);
+    size_t start_len = out_len;
+
+    while (line != NULL && line + 2 < end) {
+        line += 2;
+        const char* line_end = find_bytes(line, end - line, "\r\n", 2);
+        if (line_end == NULL || line_end == line) {
+            break;
+        }
+
+        if (is_header_line(line, line_end - line, name)) {
+            const char* value = line + strlen(name) + 1;
+            const char* value_end = line_end;
+            while (value < value_end && (*value == ' ' || *value == '\t')) value++;
+            while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t')) value_end--;
+
+            if (value < value_end) {
+                if (out_len > start_len) {
+                    memcpy(out + out_len, ", ", 2);
+                    out_len += 2;
+                }
+                memcpy(out + out_len, value, value_end - value);
+                out_len += value_end - value;
+            }
+        }
+
+        line = line_end;
+    }
+
+    return out_len;
+}
+
+static char* build_upstream_request_head(const char* head, size_t head_len, const char* path, NetConnection* client, size_t* out_len) {
+    const char* method_end = memchr(head, ' ', head_len);
+    if (method_end == NULL) {
+        return NULL;
+    }
+    size_t method_len = method_end - head;
+
+    char client_addr[NETADDR_UNIX_PATH_MAX + 8];
+    netaddr_to_string(client->remote_addr, client_addr, sizeof(client_addr));
+    // strip port - X-Forwarded-For carries bare address
+    if (client->remote_addr.family != NETADDR_UNIX) {
+        char* port_sep = strrchr(client_addr, ':');
+        if (port_sep) *port_sep = '\0';
+    }
+
+    size_t cap = head_len + strlen(path) + strlen(client_addr) + 64;
+    char* out = malloc(cap);
+    if (out == NULL) {
+        return NULL;
+    }
+
+    size_t len = 0;
+    memcpy(out, head, method_len);
+    len += method_len;
+    len += sprintf(out + len, " %s HTTP/1.1\r\n", path);
+    len = copy_end_to_end_headers(out, len, head, head_len, "X-Forwarded-For");
+
+    // addresses of proxies in front of us come first, client's one is appended to them
+    len += sprintf(out + len, "X-Forwarded-For: ");
+    size_t forwarded_start = len;
+    len = join_header_values(out, len, head, head_len, "X-Forwarded-For");
+    len += sprintf(out + len, "%s%s\r\nConnection: keep-alive\r\n\r\n", len > forwarded_start ? ", " : "", client_addr);
+
+    *out_len = len;
+    return out;
+}
+
+typedef enum {
+    CHUNK_SIZE,
+    CHUNK_EXTENSION,
+    CHUNK_SIZE_LF,
+    CHUNK_DATA,
+    CHUNK_DATA_CR,
+    CHUNK_DATA_LF,
+    CHUNK_TRAILER_START,
+    CHUNK_TRAILER_LINE,
+    CHUNK_FINAL_LF,
+    CHUNK_DONE,
+    CHUNK_INVALID,
+} ChunkState;
+
+typedef struct {
+    ChunkState state;
+    size_t remaining;
+} ChunkTracker;
+
+// Follows chunked framing just enough to know where the body ends, body is relayed untouched.
+// Returns number of bytes that belong to the body.
+static size_t chunk_tracker_feed(ChunkTracker* tracker, const char* data, size_t len) {
+    size_t i = 0;
+
+    while (i < len && tracker->state != CHUNK_DONE && tracker->state != CHUNK_INVALID) {
+        char c = data[i];
+
+        switch (tracker->state) {
+        case CHUNK_SIZE:
+            if (c >= '0' && c <= '9') tracker->remaining = tracker->remaining * 16 + (c - '0');
+            else if (c >= 'a' && c <= 'f') tracker->remaining = tracker->remaining * 16 + (c - 'a' + 10);
+            else if (c >= 'A' && c <= 'F') tracker->remaining = tracker->remaining * 16 + (c - 'A' + 10);
+            else if (c == ';' || c == ' ') tracker->state = CHUNK_EXTENSION;
+            else if (c == '\r') tracker->state = CHUNK_SIZE_LF;
+            else tracker->state = CHUNK_INVALID;
+            break;
+        case CHUNK_EXTENSION:
+            if (c == '\r') tracker->state = CHUNK_SIZE_LF;
+            break;
+        case CHUNK_SIZE_LF:
+            if (c != '\n') tracker->state = CHUNK_INVALID;
+            else tracker->state = tracker->remaining == 0 ? CHUNK_TRAILER_START : CHUNK_DATA;
+            break;
+        case CHUNK_DATA: {
+            size_t n = len - i < tracker->remaining ? len - i : tracker->remaining;
+            tracker->remaining -= n;
+            i += n;
+            if (tracker->remaining == 0) tracker->state = CHUNK_DATA_CR;
+            continue;
+        }
+        case CHUNK_DATA_CR:
+            tracker->state = c == '\r' ? CHUNK_DATA_LF : CHUNK_INVALID;
+            break;
+        case CHUNK_DATA_LF:
+            tracker->state = c == '\n' ? CHUNK_SIZE : CHUNK_INVALID;
+            break;
+        case CHUNK_TRAILER_START:
+            tracker->state = c == '\r' ? CHUNK_FINAL_LF : CHUNK_TRAILER_LINE;
+            break;
+        case CHUNK_TRAILER_LINE:
+            if (c == '\n') tracker->state = CHUNK_TRAILER_START;
+            break;
+        case CHUNK_FINAL_LF:
+            tracker->state = c == '\n' ? CHUNK_DONE : CHUNK_INVALID;
+            break;
+        default:
+            break;
+        }
+        i++;
+    }
+
+    return i;
+}
+
+// Status of "HTTP/1.x DDD ..." - exactly three digits after the version. Returns -1 if line doesn't look like that.
+static int parse_status(const char* head, size_t len) {
+    if (len < 13 || strncmp(head, "HTTP/1.", 7) != 0 || head[8] != ' ' || (head[12] != ' ' && head[12] != '\r')) {
+        return -1;
+    }
+
+    int status = 0;
+    for (size_t i = 9; i < 12; i++) {
+        if (head[i] < '0' || head[i] > '9') {
+            return -1;
+        }
+        status = status * 10 + (head[i] - '0');
+    }
+    return status;
+}
+
+typedef enum {
+    RELAY_OK,
+    RELAY_NO_RESPONSE,      // upstream failed before sending anything - idempotent request can be retried
+    RELAY_BAD_RESPONSE,     // upstream sent malformed or oversized head, or it could not be relayed - never retried
+    RELAY_TIMEOUT,          // upstream did not respond in time
+    RELAY_FAILED,           // response was (partially) sent to the client already
+} RelayResult;
+
+typedef enum {
+    BODY_NONE,
+    BODY_LENGTH,
+    BODY_CHUNKED,
+    BODY_UNTIL_CLOSE,
+} BodyFraming;
+
+static RelayResult relay_response(CometUpstream* upstream, NetSocket upstream_fd, NetConnection* client, bool head_request, bool* reusable) {
+    int timeout = upstream->config.io_timeout_ms > 0 ? upstream->config.io_timeout_ms : -1;
+    char* buffer = malloc(PROXY_BUFFER_SIZE);
+    if (buffer == NULL) {
+        log_message(LOG_ERROR, "Failed to allocate memory for proxy buffer");
+        return RELAY_BAD_RESPONSE;
+    }
+
+    RelayResult result = RELAY_FAILED;
+    size_t len = 0;
+    bool received = false;
+    size_t head_len = 0;
+    int status = 0;
+    *reusable = false;
+
+    // interim responses (100 Continue, 103 Early Hints) are dropped - client gets only the final one
+    for (;;) {
+        const char* head_end = find_bytes(buffer, len, "\r\n\r\n", 4);
+
+        while (head_end == NULL) {
+            if (len == PROXY_BUFFER_SIZE) {
+                log_message(LOG_ERROR, "Upstream response head is too large");
+                result = RELAY_BAD_RESPONSE;
+                goto cleanup;
+            }
+
+            ByteCount n = comet_read(upstream_fd, buffer + len, PROXY_BUFFER_SIZE - len, timeout);
+            if (n <= 0) {
+                if (n == SOCKET_ERROR && GET_ERROR_CODE() == COMET_ERROR_TIMEOUT) {
+                    result = RELAY_TIMEOUT;
+                } else {
+                    result = received ? RELAY_BAD_RESPONSE : RELAY_NO_RESPONSE;
+                }
+                goto cleanup;
+            }
+
+            size_t scan_from = len > 3 ? len - 3 : 0;
+            len += n;
+            received = true;
+            head_end = find_bytes(buffer + scan_from, len - scan_from, "\r\n\r\n", 4);
+        }
+
+        head_len = head_end - buffer + 4;
+        status = parse_status(buffer, head_len);
+        if (status < 100) {
+            log_message(LOG_ERROR, "Upstream sent malformed response");
+            result = RELAY_BAD_RESPONSE;
+            goto cleanup;
+        }
+
+        if (status >= 200 || status == 101) {
+            break;
+        }
+
+        memmove(buffer, buffer + head_len, len - head_len);
+        len -= head_len;
+    }
+
+    const char* value;
+    size_t value_len;
+    bool keep_alive = buffer[7] == '1';
+    if (find_raw_header(buffer, head_len, "Connection", &value, &value_len)) {
+        keep_alive = !header_value_has_token(value, value_len, "close");
+    }
+
+    BodyFraming framing = BODY_UNTIL_CLOSE;
+    size_t remaining = 0;
+    ChunkTracker chunks = {CHUNK_SIZE, 0};
+
+    if (head_request || status == 101 || status == 204 || status == 304) {
+        framing = BODY_NONE;
+    } else if (find_raw_header(buffer, head_len, "Transfer-Encoding", &value, &value_len) &&
+               header_value_has_token(value, value_len, "chunked")) {
+        framing = BODY_CHUNKED;
+    } else if (find_raw_header(buffer, head_len, "Content-Length", &value, &value_len)) {
+        framing = BODY_LENGTH;
+        remaining = strtoull(value, NULL, 10);
+    }
+
+    // the client connection is closed after every response, tell it so
+    char* client_head = malloc(head_len + 32);
+    if (client_head == NULL) {
+        log_message(LOG_ERROR, "Failed to allocate memory for response head");
+        result = RELAY_BAD_RESPONSE;
+        goto cleanup;
+    }
+    const char* status_line_end = find_bytes(buffer, head_len, "\r\n", 2);
+    size_t client_head_len = status_line_end - buffer + 2;
+    memcpy(client_head, buffer, client_head_len);
+    client_head_len = copy_end_to_end_headers(client_head, client_head_len, buffer, head_len, NULL);
+    memcpy(client_head + client_head_len, "Connection: close\r\n\r\n", 21);
+    client_head_len += 21;
+
+    ByteCount sent = netconn_send(client, client_head, client_head_len);
+    free(client_head);
+    if (sent == SOCKET_ERROR) {
+        goto cleanup;
+    }
+
+    // stream the body through the buffer, never holding more than one read of it
+    const char* body = buffer + head_len;
+    size_t body_len = len - head_len;
+    bool done = framing == BODY_NONE || (framing == BODY_LENGTH && remaining == 0);
+
+    while (!done) {
+        size_t forward = body_len;
+        if (framing == BODY_LENGTH) {
+            forward = body_len < remaining ? body_len : remaining;
+            remaining -= forward;
+            done = remaining == 0;
+        } else if (framing == BODY_CHUNKED) {
+            forward = chunk_tracker_feed(&chunks, body, body_len);
+            if (chunks.state == CHUNK_INVALID) {
+                log_message(LOG_ERROR, "Upstream sent malformed chunked body");
+                goto cleanup;
+            }
+            done = chunks.state == CHUNK_DONE;
+        }
+
+        if (forward > 0 && netconn_send(client, body, forward) == SOCKET_ERROR) {
+            goto cleanup;
+        }
+        if (done) {
+            // anything past the end of the body means the connection is out of sync
+            if (forward != body_len) keep_alive = false;
+            break;
+        }
+
+        ByteCount n = comet_read(upstream_fd, buffer, PROXY_BUFFER_SIZE, timeout);
+        if (n == 0 && framing == BODY_UNTIL_CLOSE) {
+            break;
+        }
+        if (n <= 0) {
+            log_message(LOG_ERROR, "Upstream connection broke in the middle of response");
+            goto cleanup;
+        }
+        body = buffer;
+        body_len = n;
+    }
+
+    *reusable = keep_alive && framing != BODY_UNTIL_CLOSE;
+    result = RELAY_OK;
+cleanup:
+    free(buffer);
+    return result;
+}
+
+static bool is_idempotent_method(const char* head, size_t head_len) {
+    static const char* IDEMPOTENT_METHODS[] = {"GET ", "HEAD ", "PUT ", "DELETE ", "OPTIONS ", "TRACE "};
+
+    for (size_t i = 0; i < sizeof(IDEMPOTENT_METHODS) / sizeof(IDEMPOTENT_METHODS[0]); i++) {
+        size_t len = strlen(IDEMPOTENT_METHODS[i]);
+        if (head_len > len && strncmp(head, IDEMPOTENT_METHODS[i], len) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void proxy_forward(CometUpstream* upstream, NetConnection* client, const char* request, size_t request_len, size_t head_len, const char* path) {
+    if (!upstream || upstream->num_servers == 0) {
+        log_message(LOG_ERROR, "Upstream has no servers");
+        netconn_send(client, BAD_GATEWAY_RESPONSE, sizeof(BAD_GATEWAY_RESPONSE) - 1);
+        return;
+    }
+
+    // router reads only Content-Length bodies, chunked ones can't be forwarded with their framing intact
+    const char* value;
+    size_t value_len;
+    if (find_raw_header(request, head_len, "Transfer-Encoding", &value, &value_len)) {
+        if (header_value_has_token(value, value_len, "chunked")) {
+            netconn_send(client, LENGTH_REQUIRED_RESPONSE, sizeof(LENGTH_REQUIRED_RESPONSE) - 1);
+        } else {
+            netconn_send(client, NOT_IMPLEMENTED_RESPONSE, sizeof(NOT_IMPLEMENTED_RESPONSE) - 1);
+        }
+        return;
+    }
+
+    size_t upstream_head_len = 0;
+    char* upstream_head = build_upstream_request_head(request, head_len, path, client, &upstream_head_len);
+    if (upstream_head == NULL) {
+        log_message(LOG_ERROR, "Failed to build upstream request");
+        netconn_send(client, BAD_GATEWAY_RESPONSE, sizeof(BAD_GATEWAY_RESPONSE) - 1);
+        return;
+    }
+
+    bool head_request = head_len > 5 && strncmp(request, "HEAD ", 5) == 0;
+    bool idempotent = is_idempotent_method(request, head_len);
+    int timeout = upstream->config.io_timeout_ms > 0 ? upstream->config.io_timeout_ms : -1;
+    RelayResult result = RELAY_NO_RESPONSE;
+
+    // pooled connection may have been closed by upstream right before we used it - then retry once on a fresh one.
+    // Only when upstream sent nothing back, and only methods that are safe to repeat - anything else may have
+    // been acted on already
+    for (int attempt = 0; attempt < 2 && result == RELAY_NO_RESPONSE; attempt++) {
+        CometUpstreamServer* server = upstream_pick_server(upstream);
+        bool reused = false;
+        NetSocket fd = upstream_acquire(upstream, server, &reused);
+        if (fd == SOCKET_ERROR) {
+            continue;
+        }
+
+        bool reusable = false;
+        if (comet_write(fd, upstream_head, upstream_head_len, timeout) == SOCKET_ERROR ||
+            comet_write(fd, request + head_len, request_len - head_len, timeout) == SOCKET_ERROR) {
+            result = RELAY_NO_RESPONSE;
+        } else {
+            result = relay_response(upstream, fd, client, head_request, &reusable);
+        }
+
+        upstream_release(upstream, server, fd, result == RELAY_OK && reusable);
+
+        if (result == RELAY_NO_RESPONSE && (!reused || !idempotent)) {
+            break;
+        }
+    }
+
+    if (result == RELAY_NO_RESPONSE || result == RELAY_BAD_RESPONSE) {
+        netconn_send(client, BAD_GATEWAY_RESPONSE, sizeof(BAD_GATEWAY_RESPONSE) - 1);
+    } else if (result == RELAY_TIMEOUT) {
+        netconn_send(client, GATEWAY_TIMEOUT_RESPONSE, sizeof(GATEWAY_TIMEOUT_RESPONSE) - 1);
+    }
+
+    free(upstream_head);
+}
@@ -0,0 +1,135 @@
+#include "include/query.h"
+
+#include <string.h>
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Decode one character at *pos, advancing it. Malformed escapes are taken literally.
+static char decode_char(const char** pos, const char* end) {
+    const char* p = *pos;
+    if (*p == '+') {
+        *pos = p + 1;
+        return ' ';
+    }
+    if (*p == '%' && end - p >= 3) {
+        int hi = hex_value(p[1]);
+        int lo = hex_value(p[2]);
+        if (hi >= 0 && lo >= 0) {
+            *pos = p + 3;
+            return (char)(hi << 4 | lo);
+        }
+    }
+    *pos = p + 1;
+    return *p;
+}
+
+size_t comet_url_path_len(const char* url) {
+    const char* query = strchr(url, '?');
+    return query ? (size_t)(query - url) : strlen(url);
+}
+
+CometSlice comet_query_string(const HttpcRequest* req) {
+    CometSlice slice = {"", 0};
+    const char* query = strchr(req->url, '?');
+    if (query) {
+        slice.data = query + 1;
+        slice.len = strlen(query + 1);
+    }
+    return slice;
+}
+
+void comet_query_iter_init(CometQueryIter* iter, const HttpcRequest* req) {
+    CometSlice query = comet_query_string(req);
+    iter->pos = query.data;
+    iter->end = query.data + query.len;
+}
+
+bool comet_query_next(CometQueryIter* iter, CometSlice* key, CometSlice* value) {
+    while (iter->pos < iter->end) {
+        const char* pair = iter->pos;
+        const char* pair_end = memchr(pair, '&', iter->end - pair);
+        if (pair_end == NULL) {
+            pair_end = iter->end;
+        }
+        iter->pos = pair_end < iter->end ? pair_end + 1 : iter->end;
+
+        // "a&&b" and trailing '&' have empty pairs, skip them
+        if (pair_end == pair) {
+            continue;
+        }
+
+        const char* eq = memchr(pair, '=', pair_end - pair);
+        key->data = pair;
+        key->len = (eq ? eq : pair_end) - pair;
+        value->data = eq ? eq + 1 : pair_end;
+        value->len = eq ? (size_t)(pair_end - eq - 1) : 0;
+        return true;
+    }
+
+    return false;
+}
+
+static bool encoded_equals(CometSlice raw, const char* str) {
+    const char* pos = raw.data;
+    const char* end = raw.data + raw.len;
+
+    while (pos < end) {
+        if (*str == '\0' || decode_char(&pos, end) != *str) {
+            return false;
+        }
+        str++;
+    }
+
+    return *str == '\0';
+}
+
+bool comet_query_get(const HttpcRequest* req, const char* key, CometSlice* value) {
+    CometQueryIter iter;
+    comet_query_iter_init(&iter, req);
+
+    CometSlice k, v;
+    while (comet_query_next(&iter, &k, &v)) {
+        if (encoded_equals(k, key)) {
+            *value = v;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+int comet_query_decode(CometSlice raw, char* out, size_t out_size) {
+    const char* pos = raw.data;
+    const char* end = raw.data + raw.len;
+    size_t len = 0;
+
+    while (pos < end) {
+        if (len + 1 >= out_size) {
+            return -1;
+        }
+        out[len++] = decode_char(&pos, end);
+    }
+
+    if (out_size == 0) {
+        return -1;
+    }
+    out[len] = '\0';
+    return (int)len;
+}
+
+int comet_query_get_decoded(const HttpcRequest* req, const char* key, char* out, size_t out_size) {
+    CometSlice value;
+    if (!comet_query_get(req, key, &value)) {
+        return -1;
+    }
+    return comet_query_decode(value, out, out_size);
+}
+
+bool comet_slice_equals(CometSlice slice, const char* str) {
+    return strlen(str) == slice.len && memcmp(slice.data, str, slice.len) == 0;
+}
@@ -1,10 +1,20 @@
 #include "include/router.h"
 #include "include/netctx.h"
+#include "include/netplat.h"
+#include "include/fiber.h"
+#include "include/httputil.h"
+#include "include/trace.h"
+#include "include/body.h"
+#include "include/query.h"
+#include "include/atomics.h"
 #include "include/logger.h"
 
 #include <signal.h>
 #include <unistd.h>
+#include <stdio.h>
 #include <string.h>
+#include <strings.h>
+#include <stdlib.h>
 
 void no_connection_timeout() {
 #ifndef _WIN32
@@ -16,6 +26,7 @@ void no_connection_timeout() {
 
 #ifdef _WIN32
 #define strndup(s, size) strdup(s)
+#define strncasecmp _strnicmp
 #endif
 
 const CometCorsConfig COMET_CORS_DEFAULT_CONFIG = {
@@ -70,6 +81,38 @@ HttpcResponse* default_not_allowed_handler(HttpcRequest* req) {
 }
 
 CometRouter* router_init(uint16_t port, void* state) {
+    return router_init_addr(netaddr_any_ipv4(port), state);
+}
+
+CometRouter* router_init_addr(NetAddress addr, void* state) {
+    return router_init_ex(addr, NET_DEFAULT_CONFIG, state);
+}
+
+static bool router_init_defaults(CometRouter* router, void* state) {
+    router->routes = calloc(1, sizeof(CometRouteTable));
+    if (router->routes == NULL) {
+        log_message(LOG_ERROR, "Failed to allocate memory for route table");
+        return false;
+    }
+    router->retired = NULL;
+    router->draining = NULL;
+    router->routes_lock = 0;
+    router->running = false;
+    router->cors_config = COMET_CORS_DEFAULT_CONFIG;
+    router->state = state;
+    router->use_fibers = false;
+    router->fiber_config = COMET_FIBER_DEFAULT_CONFIG;
+    router->trace_config = COMET_TRACE_DEFAULT_CONFIG;
+    router->trace_config.sample_rate = 0;
+    router->trace_counter = 0;
+    router->h2_enabled = false;
+    router->h2_config = COMET_H2_DEFAULT_CONFIG;
+    router->offload = NULL;
+    comet_memory_init(&router->memory, COMET_MEMORY_DEFAULT_CONFIG);
+    return true;
+}
+
+CometRouter* router_init_ex(NetAddress addr, NetConfig config, void* state) {
     CometRouter* router = malloc(sizeof(CometRouter));
     if (router == NULL) {
         log_message(LOG_ERROR, "Failed to allocate memory for router");
@@ -77,51 +120,323 @@ CometRouter* router_init(uint16_t port, void* state) {
     }
 
     router->ctx = malloc(sizeof(NetContext));
-    if (!netctx_init(&router->ctx, port) || router->ctx == NULL) {
+    if (!netctx_init_addr(&router->ctx, addr, config) || router->ctx == NULL) {
         log_message(LOG_ERROR, "Failed to initialize network context");
+        free(router->ctx);
         free(router);
         return NULL;
     }
 
-    router->num_routes = 0;
-    router->routes = NULL;
-    router->running = false;
-    router->cors_config = COMET_CORS_DEFAULT_CONFIG;
-    router->state = state;
+    if (!router_init_defaults(router, state)) {
+        netctx_deinit(router->ctx);
+        free(router->ctx);
+        free(router);
+        return NULL;
+    }
     
     log_message(LOG_INFO, "Router has been initialized");
 
     return router;
 }
 
-int router_add_route(CometRouter* router, const char* route, HttpcMethodType method, handler_func handler) {
-    CometRoute* new_routes = realloc(router->routes, (router->num_routes + 1) * sizeof(CometRoute));
-    if (new_routes == NULL) {
+CometRouter* router_init_transport(const NetTransport* transport, void* transport_state, void* state) {
+    CometRouter* router = malloc(sizeof(CometRouter));
+    if (router == NULL) {
+        log_message(LOG_ERROR, "Failed to allocate memory for router");
+        return NULL;
+    }
+
+    router->ctx = malloc(sizeof(NetContext));
+    if (!netctx_init_transport(&router->ctx, transport, transport_state, NET_DEFAULT_CONFIG) || router->ctx == NULL) {
+        log_message(LOG_ERROR, "Failed to initialize network context");
+        free(router->ctx);
+        free(router);
+        return NULL;
+    }
+
+    if (!router_init_defaults(router, state)) {
+        netctx_deinit(router->ctx);
+        free(router->ctx);
+        free(router);
+        return NULL;
+    }
+
+    log_message(LOG_INFO, "Router has been initialized");
+
+    return router;
+}
+
+static void route_table_free(CometRouteTable* table) {
+    if (!table) {
+        return;
+    }
+
+    for (size_t i = 0; i < table->num_routes; i++) {
+        free(table->routes[i].route);
+        free(table->routes[i].middleware_chain);
+    }
+    free(table->routes);
+    free(table);
+}
+
+/**
+ * Deep copy of table with room for extra more routes. Upstreams, WebSocket configs and SSE hubs are
+ * shared between snapshots - they are owned by the router and freed only with it.
+ */
+static CometRouteTable* route_table_copy(const CometRouteTable* table, size_t extra) {
+    CometRouteTable* copy = calloc(1, sizeof(CometRouteTable));
+    if (copy == NULL) {
+        return NULL;
+    }
+
+    size_t num_routes = table ? table->num_routes : 0;
+    if (num_routes + extra > 0) {
+        copy->routes = calloc(num_routes + extra, sizeof(CometRoute));
+        if (copy->routes == NULL) {
+            free(copy);
+            return NULL;
+        }
+    }
+
+    for (size_t i = 0; i < num_routes; i++) {
+        const CometRoute* src = &table->routes[i];
+        CometRoute* dst = &copy->routes[i];
+        *dst = *src;
+        dst->route = strdup(src->route);
+        dst->middleware_chain = NULL;
+        if (src->num_middleware > 0) {
+            dst->middleware_chain = malloc(src->num_middleware * sizeof(middleware_func));
+            if (dst->middleware_chain != NULL) {
+                memcpy(dst->middleware_chain, src->middleware_chain, src->num_middleware * sizeof(middleware_func));
+            }
+        }
+        copy->num_routes++;
+
+        if (dst->route == NULL || (src->num_middleware > 0 && dst->middleware_chain == NULL)) {
+            route_table_free(copy);
+            return NULL;
+        }
+    }
+
+    return copy;
+}
+
+static void routes_lock(CometRouter* router) {
+    while (comet_atomic_exchange_long(&router->routes_lock, 1) != 0) {
+        comet_thread_yield();
+    }
+}
+
+static void routes_unlock(CometRouter* router) {
+    comet_atomic_exchange_long(&router->routes_lock, 0);
+}
+
+/**
+ * Make table current and hand the replaced one over to the serving thread, which frees it
+ * once no request uses it anymore. Caller holds routes_lock.
+ */
+static void route_table_publish(CometRouter* router, CometRouteTable* table) {
+    CometRouteTable* old = comet_atomic_exchange_ptr((void* volatile*)&router->routes, table);
+    if (old == NULL) {
+        return;
+    }
+
+    CometRouteTable* head;
+    do {
+        head = comet_atomic_load_ptr((void* volatile*)&router->retired);
+        old->next_retired = head;
+    } while (!comet_atomic_cas_ptr((void* volatile*)&router->retired, head, old));
+}
+
+/**
+ * Current table for one request - must be paired with route_table_release. Serving thread only.
+ */
+static CometRouteTable* route_table_acquire(CometRouter* router) {
+    CometRouteTable* table = comet_atomic_load_ptr((void* volatile*)&router->routes);
+    table->refs++;
+    return table;
+}
+
+static void route_table_release(CometRouteTable* table) {
+    table->refs--;
+}
+
+/**
+ * Free replaced tables no request holds anymore. Called by the serving thread between connections.
+ */
+static void route_table_reclaim(CometRouter* router) {
+    if (comet_atomic_load_ptr((void* volatile*)&router->retired) != NULL) {
+        CometRouteTable* retired = comet_atomic_exchange_ptr((void* volatile*)&router->retired, NULL);
+        while (retired) {
+            CometRouteTable* next = retired->next_retired;
+            retired->next_retired = router->draining;
+            router->draining = retired;
+            retired = next;
+        }
+    }
+
+    CometRouteTable** link = &router->draining;
+    while (*link) {
+        CometRouteTable* table = *link;
+        if (table->refs == 0) {
+            *link = table->next_retired;
+            route_table_free(table);
+        } else {
+            link = &table->next_retired;
+        }
+    }
+}
+
+static int router_add_route_ex(CometRouter* router, CometRoute route) {
+    if (!router || !route.route) {
+        log_message(LOG_ERROR, "Router or route is NULL");
+        return -1;
+    }
+
+    routes_lock(router);
+
+    CometRouteTable* current = comet_atomic_load_ptr((void* volatile*)&router->routes);
+    CometRouteTable* table = route_table_copy(current, 1);
+    route.route = table ? strdup(route.route) : NULL;
+    if (route.route == NULL) {
+        routes_unlock(router);
+        route_table_free(table);
         log_message(LOG_ERROR, "Failed to allocate memory for new route");
         return -1;
     }
 
-    router->routes = new_routes;
-    router->routes[router->num_routes].route = strdup(route);
-    router->routes[router->num_routes].method = method;
-    router->routes[router->num_routes].handler = handler;
-    router->routes[router->num_routes].middleware_chain = NULL;
-    router->routes[router->num_routes].num_middleware = 0;
+    route.middleware_chain = NULL;
+    route.num_middleware = 0;
+    table->routes[table->num_routes] = route;
+    int index = (int)table->num_routes++;
+
+    route_table_publish(router, table);
+    routes_unlock(router);
+
+    return index;
+}
+
+int router_add_route(CometRouter* router, const char* route, HttpcMethodType method, handler_func handler) {
+    return router_add_route_ex(router, (CometRoute){
+        .route = (char*)route,
+        .method = method,
+        .handler = handler,
+        .type = COMET_ROUTE_HANDLER,
+        .enabled = true,
+    });
+}
+
+int router_add_route_disabled(CometRouter* router, const char* route, HttpcMethodType method, handler_func handler) {
+    return router_add_route_ex(router, (CometRoute){
+        .route = (char*)route,
+        .method = method,
+        .handler = handler,
+        .type = COMET_ROUTE_HANDLER,
+        .enabled = false,
+    });
+}
+
+int router_add_proxy(CometRouter* router, const char* route, CometUpstream* upstream) {
+    if (!router || !upstream) {
+        log_message(LOG_ERROR, "Router or upstream is NULL");
+        return -1;
+    }
+
+    // connecting to upstream and relaying its response would hold up every other client in sync mode
+    if (!router->use_fibers) {
+        log_message(LOG_INFO, "Proxy route added, switching router to fiber mode");
+        if (!router_enable_fibers(router, router->fiber_config)) {
+            return -1;
+        }
+    }
+
+    return router_add_route_ex(router, (CometRoute){
+        .route = (char*)route,
+        .method = HTTPC_GET,
+        .type = COMET_ROUTE_PROXY,
+        .upstream = upstream,
+        .enabled = true,
+    });
+}
+
+int router_add_websocket(CometRouter* router, const char* route, CometWebSocketConfig config) {
+    if (!router) {
+        log_message(LOG_ERROR, "Router is NULL");
+        return -1;
+    }
+
+    if (!router->use_fibers) {
+        log_message(LOG_INFO, "WebSocket route added, switching router to fiber mode");
+        if (!router_enable_fibers(router, router->fiber_config)) {
+            return -1;
+        }
+    }
+
+    CometWebSocketConfig* websocket = malloc(sizeof(CometWebSocketConfig));
+    if (websocket == NULL) {
+        log_message(LOG_ERROR, "Failed to allocate memory for WebSocket route");
+        return -1;
+    }
+    *websocket = config;
+
+    int index = router_add_route_ex(router, (CometRoute){
+        .route = (char*)route,
+        .method = HTTPC_GET,
+        .type = COMET_ROUTE_WEBSOCKET,
+        .websocket = websocket,
+        .enabled = true,
+    });
+    if (index < 0) {
+        free(websocket);
+        return -1;
+    }
+
+    return index;
+}
+
+int router_add_sse(CometRouter* router, const char* route, CometSseHub* hub) {
+    if (!router || !hub) {
+        log_message(LOG_ERROR, "Router or SSE hub is NULL");
+        return -1;
+    }
 
-    router->num_routes++;
+    if (!router->use_fibers) {
+        log_message(LOG_INFO, "SSE route added, switching router to fiber mode");
+        if (!router_enable_fibers(router, router->fiber_config)) {
+            return -1;
+        }
+    }
 
-    return router->num_routes - 1;
+    return router_add_route_ex(router, (CometRoute){
+        .route = (char*)route,
+        .method = HTTPC_GET,
+        .type = COMET_ROUTE_SSE,
+        .sse = hub,
+        .enabled = true,
+    });
 }
 
 void router_add_middleware(CometRouter* router, int route_index, middleware_func middleware) {
-    if (route_index < 0 || !router || (route_index >= router->num_routes && route_index != INT32_MAX)) {
+    if (!router) {
+        log_message(LOG_ERROR, "Router is NULL");
+        return;
+    }
+
+    routes_lock(router);
+
+    CometRouteTable* current = comet_atomic_load_ptr((void* volatile*)&router->routes);
+    if (route_index < 0 || (size_t)route_index >= current->num_routes) {
+        routes_unlock(router);
         log_message(LOG_ERROR, "Invalid route index");
         return;
     }
 
-    CometRoute* route = &router->routes[route_index];
-    middleware_func* new_chain = realloc(route->middleware_chain, (route->num_middleware + 1) * sizeof(middleware_func));
+    CometRouteTable* table = route_table_copy(current, 0);
+    CometRoute* route = table ? &table->routes[route_index] : NULL;
+    middleware_func* new_chain = route ? realloc(route->middleware_chain, (route->num_middleware + 1) * sizeof(middleware_func)) : NULL;
     if (new_chain == NULL) {
+        routes_unlock(router);
+        route_table_free(table);
         log_message(LOG_ERROR, "Failed to allocate memory for new middleware chain");
         return;
     }
@@ -129,63 +444,240 @@ void router_add_middleware(CometRouter* router, int route_index, middleware_func
     route->middleware_chain = new_chain;
     route->middleware_chain[route->num_middleware] = middleware;
     route->num_middleware++;
+
+    route_table_publish(router, table);
+    routes_unlock(router);
+}
+
+typedef enum {
+    ROUTE_FLAG_ENABLED,
+    ROUTE_FLAG_OFFLOAD,
+} RouteFlag;
+
+static bool* route_flag(CometRoute* route, RouteFlag flag) {
+    return flag == ROUTE_FLAG_ENABLED ? &route->enabled : &route->offload;
+}
+
+static bool router_set_route_flag(CometRouter* router, int route_index, RouteFlag flag, bool value) {
+    routes_lock(router);
+
+    CometRouteTable* current = comet_atomic_load_ptr((void* volatile*)&router->routes);
+    if (route_index < 0 || (size_t)route_index >= current->num_routes) {
+        routes_unlock(router);
+        log_message(LOG_ERROR, "Invalid route index");
+        return false;
+    }
+
+    if (*route_flag(&current->routes[route_index], flag) == value) {
+        routes_unlock(router);
+        return true;
+    }
+
+    CometRouteTable* table = route_table_copy(current, 0);
+    if (table == NULL) {
+        routes_unlock(router);
+        log_message(LOG_ERROR, "Failed to allocate memory for route table");
+        return false;
+    }
+
+    *route_flag(&table->routes[route_index], flag) = value;
+
+    route_table_publish(router, table);
+    routes_unlock(router);
+    return true;
 }
 
-HttpcRequest* router_read_next_request(CometRouter* router) {
+bool router_set_route_enabled(CometRouter* router, int route_index, bool enabled) {
     if (!router) {
         log_message(LOG_ERROR, "Router is NULL");
-        return NULL;
+        return false;
     }
 
-    NetSocket client_sock = netctx_get_next_connection(router->ctx);
-    if (client_sock == SOCKET_ERROR) {
-        return NULL;
+    return router_set_route_flag(router, route_index, ROUTE_FLAG_ENABLED, enabled);
+}
+
+bool router_set_route_offload(CometRouter* router, int route_index, bool offload) {
+    if (!router) {
+        log_message(LOG_ERROR, "Router is NULL");
+        return false;
+    }
+
+    if (offload && router->offload == NULL) {
+        log_message(LOG_ERROR, "Offload pool is not enabled, call router_enable_offload first");
+        return false;
+    }
+
+    return router_set_route_flag(router, route_index, ROUTE_FLAG_OFFLOAD, offload);
+}
+
+static const char PAYLOAD_TOO_LARGE_RESPONSE[] =
+    "HTTP/1.1 413 Payload Too Large\r\n"
+    "Content-Type: text/plain\r\n"
+    "Content-Length: 21\r\n"
+    "Connection: close\r\n"
+    "\r\n"
+    "413 Payload Too Large";
+
+static const char SERVICE_UNAVAILABLE_RESPONSE[] =
+    "HTTP/1.1 503 Service Unavailable\r\n"
+    "Content-Type: text/plain\r\n"
+    "Content-Length: 23\r\n"
+    "Retry-After: 1\r\n"
+    "Connection: close\r\n"
+    "\r\n"
+    "503 Service Unavailable";
+
+static void router_charge(CometRouter* router, CometMemoryCharge* charge, CometMemoryCategory category, size_t bytes) {
+    if (charge) {
+        comet_memory_charge(&router->memory, charge, category, bytes);
     }
+}
+
+static void router_reject_too_large(CometRouter* router, NetConnection* conn) {
+    router->memory.stats.rejected_too_large++;
+    netconn_send(conn, PAYLOAD_TOO_LARGE_RESPONSE, sizeof(PAYLOAD_TOO_LARGE_RESPONSE) - 1);
+}
+
+static void router_reject_over_budget(CometRouter* router, NetConnection* conn) {
+    router->memory.stats.rejected_over_budget++;
+    netconn_send(conn, SERVICE_UNAVAILABLE_RESPONSE, sizeof(SERVICE_UNAVAILABLE_RESPONSE) - 1);
+}
 
-    char* request = malloc(1024);
+/**
+ * Read head and Content-Length bytes of body into out_raw, without parsing them.
+ * 
+ * Requests over connection budget are answered with 413 as soon as their size is known, and those that
+ * would take global budget over with 503 - before their bytes are read. Buffer is charged to charge, if given.
+ */
+static bool router_read_raw_request(CometRouter* router, NetConnection* conn, RawHttpMessage* out_raw, CometMemoryCharge* charge) {
+    size_t budget = router->memory.config.connection_budget;
+    size_t request_cap = 1024;
     size_t request_len = 0;
+
+    if (charge && !comet_memory_fits(&router->memory, request_cap)) {
+        router_reject_over_budget(router, conn);
+        return false;
+    }
+
+    char* request = malloc(request_cap);
     if (request == NULL) {
         log_message(LOG_ERROR, "Failed to allocate memory for request");
-        return NULL;
+        return false;
     }
-    char buffer[1024];
-    ByteCount bytes_read = 0;
+    router_charge(router, charge, COMET_MEM_REQUEST_BUFFERS, request_cap);
+
+    // read straight into request buffer until head and Content-Length bytes of body are in
+    size_t head_len = 0;
+    size_t content_length = 0;
+
+    while (head_len == 0 || request_len < head_len + content_length) {
+        if (request_len == request_cap) {
+            // once Content-Length is known, buffer grows to fit the whole request at once
+            size_t new_cap = head_len ? head_len + content_length : request_cap * 2;
+            if (budget > 0 && new_cap > budget) {
+                new_cap = budget;
+            }
+            if (new_cap <= request_cap) {
+                router_reject_too_large(router, conn);
+                goto error;
+            }
+            if (charge && !comet_memory_fits(&router->memory, new_cap - request_cap)) {
+                router_reject_over_budget(router, conn);
+                goto error;
+            }
 
-    do {
-        bytes_read = netctx_recv(router->ctx, buffer, sizeof(buffer));
+            char* new_request = realloc(request, new_cap);
+            if (new_request == NULL) {
+                log_message(LOG_ERROR, "Failed to reallocate memory for request");
+                goto error;
+            }
+            router_charge(router, charge, COMET_MEM_REQUEST_BUFFERS, new_cap - request_cap);
+            request = new_request;
+            request_cap = new_cap;
+        }
+
+        ByteCount bytes_read = netconn_recv(conn, request + request_len, request_cap - request_len);
         if (bytes_read == SOCKET_ERROR) {
             log_message(LOG_ERROR, "Failed to read from socket");
-            free(request);
-            return NULL;
+            goto error;
         }
-
-        request = realloc(request, request_len + bytes_read);
-        if (request == NULL) {
-            log_message(LOG_ERROR, "Failed to reallocate memory for request");
-            return NULL;
+        if (bytes_read == 0) {
+            if (verbose_output) {
+                log_message(LOG_WARN, "Client closed connection before sending full request");
+            }
+            goto error;
         }
 
-        memcpy(request + request_len, buffer, bytes_read);
+        size_t scan_from = request_len > 3 ? request_len - 3 : 0;
         request_len += bytes_read;
-    } while (bytes_read == sizeof(buffer));
 
-    HttpcRequest* req = httpc_request_from_string(request, request_len);
+        if (head_len == 0) {
+            const char* head_end = find_bytes(request + scan_from, request_len - scan_from, "\r\n\r\n", 4);
+            if (head_end != NULL) {
+                head_len = head_end - request + 4;
+
+                const char* value;
+                size_t value_len;
+                if (find_raw_header(request, head_len, "Content-Length", &value, &value_len)) {
+                    content_length = strtoul(value, NULL, 10);
+                }
+
+                // declared size is enough to refuse, no need to read the body first
+                if (budget > 0 && (content_length > budget || head_len + content_length > budget)) {
+                    router_reject_too_large(router, conn);
+                    goto error;
+                }
+            }
+        }
+    }
+
+    out_raw->data = request;
+    out_raw->len = request_len;
+    out_raw->head_len = head_len;
+    return true;
+error:
+    free(request);
+    return false;
+}
+
+static HttpcRequest* router_parse_request(RawHttpMessage* raw, RawHttpMessage* out_raw, CometTrace* trace) {
+    trace_mark(trace, COMET_TRACE_READ);
+    HttpcRequest* req = httpc_request_from_string(raw->data, raw->len);
+    trace_mark(trace, COMET_TRACE_PARSE);
     if (req == NULL) {
         log_message(LOG_ERROR, "Failed to parse request");
-        free(request);
+        free(raw->data);
         return NULL;
     }
 
-    free(request);
-
+    if (out_raw) {
+        *out_raw = *raw;
+    } else {
+        free(raw->data);
+    }
     return req;
 }
 
-char** split_string_by_delim(const char* str, const char* delim, size_t* num_tokens) {
-    char* str_copy = strdup(str);
+HttpcRequest* router_read_next_request(CometRouter* router, NetConnection* conn, RawHttpMessage* out_raw, CometTrace* trace) {
+    if (!router) {
+        log_message(LOG_ERROR, "Router is NULL");
+        return NULL;
+    }
+
+    RawHttpMessage raw;
+    if (!router_read_raw_request(router, conn, &raw, NULL)) {
+        return NULL;
+    }
+    return router_parse_request(&raw, out_raw, trace);
+}
+
+char** split_string_by_delim(const char* str, size_t len, const char* delim, size_t* num_tokens) {
+    char* str_copy = malloc(len + 1);
     if (str_copy == NULL) {
         return NULL;
     }
+    memcpy(str_copy, str, len);
+    str_copy[len] = '\0';
 
     char** tokens = malloc(1 * sizeof(char*));
 
@@ -218,17 +710,17 @@ char** split_string_by_delim(const char* str, const char* delim, size_t* num_tok
     return tokens;
 }
 
-bool extract_url_params(const char *route_pattern_s, const char *actual_url_s, UrlParams *params) {
+bool extract_url_params(const char *route_pattern_s, const char *actual_url_s, size_t actual_url_len, UrlParams *params) {
     bool result = true;
     
     size_t num_route_tokens;
-    char** route_tokens = split_string_by_delim(route_pattern_s, "/", &num_route_tokens);
+    char** route_tokens = split_string_by_delim(route_pattern_s, strlen(route_pattern_s), "/", &num_route_tokens);
     if (route_tokens == NULL) {
         return false;
     }
 
     size_t num_url_tokens;
-    char** url_tokens = split_string_by_delim(actual_url_s, "/", &num_url_tokens);
+    char** url_tokens = split_string_by_delim(actual_url_s, actual_url_len, "/", &num_url_tokens);
     if (url_tokens == NULL) {
         free(route_tokens);
         return false;
@@ -310,90 +802,642 @@ cleanup:
     return result;
 }
 
-void router_start(CometRouter* router) {
-    if (!router) {
-        log_message(LOG_ERROR, "Router is NULL");
-        return;
+void free_url_params(UrlParams* params) {
+    for (size_t j = 0; j < params->num_params; j++) {
+        free(params->params[j].key);
+        free(params->params[j].value);
     }
+    if (params->params) free(params->params);
+    params->params = NULL;
+    params->num_params = 0;
+}
 
-    router->running = true;
+static size_t url_params_size(const UrlParams* params) {
+    size_t size = params->num_params * sizeof(Param);
+    for (size_t i = 0; i < params->num_params; i++) {
+        size += strlen(params->params[i].key) + strlen(params->params[i].value) + 2;
+    }
+    return size;
+}
 
-    while (router->running) {
-        HttpcResponse* res = NULL;
-        HttpcRequest* req = router_read_next_request(router);
-        if (req == NULL) {
-            no_connection_timeout();
+const char* find_url_param(UrlParams* params, const char* key) {
+    for (size_t i = 0; i < params->num_params; i++) {
+        if (strcmp(params->params[i].key, key) == 0) {
+            return params->params[i].value;
+        }
+    }
+    return NULL;
+}
+
+typedef struct {
+    handler_func handler;
+    void* state;
+    HttpcRequest* req;
+    UrlParams* params;
+    HttpcResponse* res;
+} OffloadedCall;
+
+static void router_offloaded_handler(void* arg) {
+    OffloadedCall* call = arg;
+    call->res = call->handler(call->state, call->req, call->params);
+}
+
+/**
+ * Call route's handler on the offload pool. Calling fiber is suspended until it returns, or answers 503
+ * right away if the pool can't take it.
+ */
+static HttpcResponse* router_call_offloaded(CometRouter* router, CometRoute* route, HttpcRequest* req, UrlParams* params) {
+    OffloadedCall call = {route->handler, router->state, req, params, NULL};
+
+    CometOffloadStatus status = comet_offload_run(router->offload, router_offloaded_handler, &call);
+    if (status != COMET_OFFLOAD_DONE) {
+        HttpcResponse* res = httpc_response_new("Service Unavailable", 503);
+        httpc_response_set_body(res, "503 Service Unavailable", 23);
+        httpc_add_header_v(&res->headers, "Retry-After", "1");
+        return res;
+    }
+    return call.res;
+}
+
+/**
+ * Find route for request and call its handler.
+ * 
+ * When the first route that matches is not a plain handler route (proxy, WebSocket), NULL is returned
+ * instead and the route with its url params is stored in out_route/out_params, for the caller to take over the connection.
+ * out_route points into table, caller keeps table acquired for as long as it uses the route.
+ * Params of the matched route are charged to charge, if given.
+ */
+HttpcResponse* router_dispatch(CometRouter* router, CometRouteTable* table, HttpcRequest** req_ptr, CometRoute** out_route, UrlParams* out_params,
+                               CometTrace* trace, CometMemoryCharge* charge) {
+    HttpcResponse* res = NULL;
+    HttpcRequest* req = *req_ptr;
+    bool found_route = false;
+
+    // query string is not part of the route, handlers get to it through comet_query_* functions
+    size_t path_len = comet_url_path_len(req->url);
+
+    for (size_t i = 0; i < table->num_routes && !found_route; i++) {
+        CometRoute* route = &table->routes[i];
+        if (!route->enabled) {
             continue;
         }
 
-        bool found_route = false;
+        UrlParams params = {0};
+        if (extract_url_params(route->route, req->url, path_len, &params)) {
+            trace_mark(trace, COMET_TRACE_ROUTE);
+            for (size_t j = 0; j < route->num_middleware; j++) {
+                req = route->middleware_chain[j](router->state, req, &params);
+            }
+            trace_mark(trace, COMET_TRACE_MIDDLEWARE);
 
-        for (size_t i = 0; i < router->num_routes && !found_route; i++) {
-            CometRoute* route = &router->routes[i];
-            
-            UrlParams params = {0};
-            if (extract_url_params(route->route, req->url, &params)) {
-                for (size_t j = 0; j < route->num_middleware; j++) {
-                    req = route->middleware_chain[j](router->state, req, &params);
+            if (route->type != COMET_ROUTE_HANDLER) {
+                if (res != NULL) {
+                    comet_response_free(res);
                 }
 
-                if (req->method == HTTPC_OPTIONS) {
-                    if (res != NULL) {
-                        httpc_response_free(res);
-                    }
+                router_charge(router, charge, COMET_MEM_PARAMS, url_params_size(&params));
+                *req_ptr = req;
+                *out_route = route;
+                *out_params = params;
+                return NULL;
+            } else if (req->method == HTTPC_OPTIONS) {
+                if (res != NULL) {
+                    comet_response_free(res);
+                }
 
-                    res = httpc_response_new("OK", 200);
+                res = httpc_response_new("OK", 200);
 
-                    found_route = true;
-                } else if (req->method != route->method) {
-                    if (res == NULL) res = default_not_allowed_handler(req);
-                    continue;
-                } else {
-                    if (res != NULL) {
-                        httpc_response_free(res);
-                    }
+                found_route = true;
+            } else if (req->method != route->method) {
+                if (res == NULL) res = default_not_allowed_handler(req);
+                free_url_params(&params);
+                continue;
+            } else {
+                if (res != NULL) {
+                    comet_response_free(res);
+                }
 
-                    res = route->handler(router->state, req, &params);
-                    if (res == NULL) {
-                        res = httpc_response_new("Internal Server Error", 500);
-                        httpc_response_set_body(res, "500 Internal Server Error", 26);
-                    }
+                router_charge(router, charge, COMET_MEM_PARAMS, url_params_size(&params));
 
-                    found_route = true;
+                if (route->offload) {
+                    res = router_call_offloaded(router, route, req, &params);
+                } else {
+                    res = route->handler(router->state, req, &params);
                 }
+                trace_mark(trace, COMET_TRACE_HANDLER);
+                if (res == NULL) {
+                    res = httpc_response_new("Internal Server Error", 500);
+                    httpc_response_set_body(res, "500 Internal Server Error", 26);
+                }
+
+                found_route = true;
             }
-            for (size_t j = 0; j < params.num_params; j++) {
-                free(params.params[j].key);
-                free(params.params[j].value);
-            }
-            if (params.params) free(params.params);
         }
+        free_url_params(&params);
+    }
+
+    if (res == NULL) {
+        res = default_not_found_handler(req);
+    }
+
+    res = add_cors_headers(res, &router->cors_config);
+    // this implementation does not work with connection: keep-alive, so we add:
+    httpc_add_header_v(&res->headers, "Connection", "close");
+    trace_mark(trace, COMET_TRACE_ROUTE);
+
+    *req_ptr = req;
+    return res;
+}
+
+static const char UPGRADE_REQUIRED_RESPONSE[] =
+    "HTTP/1.1 426 Upgrade Required\r\n"
+    "Upgrade: websocket\r\n"
+    "Content-Type: text/plain\r\n"
+    "Content-Length: 20\r\n"
+    "Connection: close\r\n"
+    "\r\n"
+    "426 Upgrade Required";
+
+static void router_forward_to_proxy(CometRoute* route, NetConnection* conn, HttpcRequest* req, RawHttpMessage* raw, UrlParams* params) {
+    const char* wildcard = NULL;
+    if (route->route[0] != '\0' && route->route[strlen(route->route) - 1] == '*') {
+        wildcard = find_url_param(params, "wildcard");
+        if (wildcard == NULL) wildcard = "";
+    }
+
+    if (wildcard == NULL) {
+        proxy_forward(route->upstream, conn, raw->data, raw->len, raw->head_len, req->url);
+        return;
+    }
+
+    // wildcard holds only the path, query goes to upstream unchanged
+    CometSlice query = comet_query_string(req);
+    char* path = malloc(strlen(wildcard) + query.len + 3);
+    if (path == NULL) {
+        log_message(LOG_ERROR, "Failed to allocate memory for proxy path");
+        return;
+    }
+    if (query.len > 0) {
+        sprintf(path, "/%s?%.*s", wildcard, (int)query.len, query.data);
+    } else {
+        sprintf(path, "/%s", wildcard);
+    }
+    proxy_forward(route->upstream, conn, raw->data, raw->len, raw->head_len, path);
+    free(path);
+}
+
+/**
+ * Serialize and send response. Body attached with comet_response_* functions is sent
+ * right after the head with a single vectored send, without copying it. File bodies go with sendfile.
+ */
+static void router_send_response(CometRouter* router, NetConnection* conn, HttpcResponse* res, CometTrace* trace, CometMemoryCharge* charge) {
+    ResponseBody body;
+    bool has_body = response_body_take(res, &body);
+
+    size_t response_len = 0;
+    char* response_str = httpc_response_to_string(res, &response_len);
+    trace_mark(trace, COMET_TRACE_SERIALIZE);
+    if (response_str == NULL) {
+        log_message(LOG_ERROR, "Failed to serialize response");
+        if (has_body) response_body_release(&body);
+        return;
+    }
+    // file bodies don't pass through memory
+    router_charge(router, charge, COMET_MEM_RESPONSES, sizeof(HttpcResponse) + response_len + (has_body && body.file_fd < 0 ? body.len : 0));
+
+    if (!has_body) {
+        if (netconn_send(conn, response_str, response_len) == SOCKET_ERROR) {
+            log_message(LOG_ERROR, "Failed to send response");
+        }
+        free(response_str);
+        return;
+    }
 
-        if (res == NULL) {
-            res = default_not_found_handler(req);
+    // head without its final empty line, then our own Content-Length
+    const char* head_end = find_bytes(response_str, response_len, "\r\n\r\n", 4);
+    size_t head_len = head_end ? (size_t)(head_end - response_str) + 2 : response_len;
+    head_len = remove_raw_header(response_str, head_len, "Content-Length");
+
+    char content_length[48];
+    int content_length_len = snprintf(content_length, sizeof(content_length), "Content-Length: %zu\r\n\r\n", body.len);
+
+    NetBuffer bufs[3] = {
+        {response_str, head_len},
+        {content_length, (size_t)content_length_len},
+        {body.data, body.len},
+    };
+    if (body.file_fd >= 0) {
+        if (netconn_sendv(conn, bufs, 2) == SOCKET_ERROR ||
+            netconn_sendfile(conn, body.file_fd, body.file_offset, body.len) == SOCKET_ERROR) {
+            log_message(LOG_ERROR, "Failed to send response");
         }
+    } else if (netconn_sendv(conn, bufs, 3) == SOCKET_ERROR) {
+        log_message(LOG_ERROR, "Failed to send response");
+    }
+
+    response_body_release(&body);
+    free(response_str);
+}
 
+/**
+ * Dispatch request that came over HTTP/2. Routes that take over the connection can't work
+ * on a stream, they get 501.
+ */
+static HttpcResponse* router_dispatch_h2(void* ctx, HttpcRequest** req_ptr) {
+    CometRouter* router = ctx;
+    CometTrace trace = {0};
+    CometRoute* route = NULL;
+    UrlParams params = {0};
+
+    CometRouteTable* table = route_table_acquire(router);
+    HttpcResponse* res = router_dispatch(router, table, req_ptr, &route, &params, &trace, NULL);
+    route_table_release(table);
+    if (res == NULL) {
+        free_url_params(&params);
+        res = httpc_response_new("Not Implemented", 501);
+        httpc_response_set_body(res, "501 Not Implemented", 19);
         res = add_cors_headers(res, &router->cors_config);
-        // this implementation does not work with connection: keep-alive, so we add:
-        httpc_add_header_v(&res->headers, "Connection", "close");
-
-        size_t response_len = 0;
-        char* response_str = httpc_response_to_string(res, &response_len);
-        if (response_str == NULL) {
-            log_message(LOG_ERROR, "Failed to serialize response");
-            httpc_response_free(res);
-            httpc_request_free(req);
-            continue;
+    }
+    return res;
+}
+
+static void router_serve_connection(CometRouter* router, NetConnection* conn, uint64_t accepted_ns, CometMemoryCharge* charge) {
+    CometTrace trace;
+    trace_begin(&trace, &router->trace_config, &router->trace_counter, accepted_ns);
+    COMET_PROBE1(request__start, (int)conn->sockfd);
+
+    if (router->ctx->tls) {
+        if (!tls_accept(router->ctx->tls, conn)) {
+            netconn_close(conn);
+            return;
         }
+        trace_mark(&trace, COMET_TRACE_ACCEPT);
+    }
 
-        ByteCount bytes_sent = netctx_send(router->ctx, response_str, response_len);
-        if (bytes_sent == SOCKET_ERROR) {
-            log_message(LOG_ERROR, "Failed to send response");
+    RawHttpMessage raw = {0};
+    if (!router_read_raw_request(router, conn, &raw, charge)) {
+        netconn_close(conn);
+        return;
+    }
+
+    // prior knowledge h2c - client preface instead of HTTP/1.1 request
+    if (router->h2_enabled && h2_is_preface(raw.data, raw.len)) {
+        h2_run_session(&router->h2_config, conn, router_dispatch_h2, router, raw.data, raw.len, NULL, NULL, 0);
+        netconn_close(conn);
+        trace.active = false;
+        trace_finish(&trace, &router->trace_config, router->state);
+        free(raw.data);
+        return;
+    }
+
+    HttpcRequest* req = router_parse_request(&raw, &raw, &trace);
+    if (req == NULL) {
+        netconn_close(conn);
+        return;
+    }
+    // httpc copies url, headers and body out of the raw request
+    router_charge(router, charge, COMET_MEM_REQUESTS, sizeof(HttpcRequest) + raw.len);
+
+    if (router->h2_enabled && h2_is_upgrade_request(raw.data, raw.head_len)) {
+        // session answers this request as stream 1, and takes ownership of it
+        size_t request_end = raw.head_len + req->body_size;
+        if (request_end > raw.len) request_end = raw.len;
+        h2_run_session(&router->h2_config, conn, router_dispatch_h2, router, raw.data + request_end, raw.len - request_end,
+                       req, raw.data, raw.head_len);
+        netconn_close(conn);
+        trace.active = false;
+        trace_finish(&trace, &router->trace_config, router->state);
+        free(raw.data);
+        return;
+    }
+
+    const char* method_end = memchr(raw.data, ' ', raw.head_len);
+    trace.method = raw.data;
+    trace.method_len = method_end ? (size_t)(method_end - raw.data) : 0;
+
+    CometRoute* route = NULL;
+    UrlParams params = {0};
+    CometRouteTable* table = route_table_acquire(router);
+    HttpcResponse* res = router_dispatch(router, table, &req, &route, &params, &trace, charge);
+    // middleware may have replaced (and freed) the request, only the final one lives until trace_finish
+    trace.url = req->url;
+    if (res == NULL) {
+        if (route->type == COMET_ROUTE_PROXY) {
+            router_forward_to_proxy(route, conn, req, &raw, &params);
+            trace_mark(&trace, COMET_TRACE_HANDLER);
+        } else if (route->type == COMET_ROUTE_WEBSOCKET) {
+            if (req->method == HTTPC_GET && ws_is_upgrade_request(raw.data, raw.head_len)) {
+                ws_run_session(route->websocket, conn, router->state, raw.data, raw.head_len,
+                               raw.data + raw.head_len, raw.len - raw.head_len);
+            } else {
+                netconn_send(conn, UPGRADE_REQUIRED_RESPONSE, sizeof(UPGRADE_REQUIRED_RESPONSE) - 1);
+            }
+        } else if (route->type == COMET_ROUTE_SSE) {
+            const char* topic = find_url_param(&params, "topic");
+            if (topic) {
+                sse_run_session(route->sse, conn, topic);
+            } else {
+                // path alone, so that cache-busting query doesn't make up a new topic
+                size_t path_len = comet_url_path_len(req->url);
+                char* path = malloc(path_len + 1);
+                if (path) {
+                    memcpy(path, req->url, path_len);
+                    path[path_len] = '\0';
+                    sse_run_session(route->sse, conn, path);
+                    free(path);
+                }
+            }
         }
+        netconn_close(conn);
 
-        free(response_str);
+        // sessions last as long as client wants, their timing says nothing about the server
+        if (route->type == COMET_ROUTE_PROXY) {
+            trace_mark(&trace, COMET_TRACE_SEND);
+        } else {
+            trace.active = false;
+        }
+        trace_finish(&trace, &router->trace_config, router->state);
+
+        free_url_params(&params);
+        route_table_release(table);
+        free(raw.data);
         httpc_request_free(req);
-        httpc_response_free(res);
+        return;
+    }
+    route_table_release(table);
+
+    router_send_response(router, conn, res, &trace, charge);
+    netconn_close(conn);
+    trace_mark(&trace, COMET_TRACE_SEND);
+
+    trace.status = res->status_code;
+    trace_finish(&trace, &router->trace_config, router->state);
+
+    free(raw.data);
+    httpc_request_free(req);
+    comet_response_free(res);
+}
+
+/**
+ * Serve single request from conn and close it.
+ * 
+ * accepted_ns is when conn came off the accept queue, 0 when tracing is off.
+ */
+void router_handle_connection(CometRouter* router, NetConnection* conn, uint64_t accepted_ns) {
+    CometMemoryCharge charge = {0};
+    router->memory.stats.connections++;
+    comet_memory_charge(&router->memory, &charge, COMET_MEM_CONNECTIONS, sizeof(NetConnection));
+
+    router_serve_connection(router, conn, accepted_ns, &charge);
+
+    comet_memory_release(&router->memory, &charge);
+    router->memory.stats.connections--;
+}
+
+bool router_enable_tracing(CometRouter* router, CometTraceConfig config) {
+    if (!router) {
+        log_message(LOG_ERROR, "Router is NULL");
+        return false;
+    }
+
+    router->trace_config = config;
+    router->trace_counter = 0;
+    return true;
+}
+
+bool router_enable_h2(CometRouter* router, CometH2Config config) {
+    if (!router) {
+        log_message(LOG_ERROR, "Router is NULL");
+        return false;
+    }
+
+    if (config.max_concurrent_streams == 0 || config.max_frame_size < 16384 || config.max_frame_size > 0xffffff
+        || config.initial_window_size > 0x7fffffff) {
+        log_message(LOG_ERROR, "Invalid HTTP/2 configuration");
+        return false;
+    }
+
+    // streams of one connection are served concurrently, each on its own fiber
+    if (!router->use_fibers) {
+        log_message(LOG_INFO, "HTTP/2 enabled, switching router to fiber mode");
+        if (!router_enable_fibers(router, router->fiber_config)) {
+            return false;
+        }
+    }
+
+    router->h2_enabled = true;
+    router->h2_config = config;
+    return true;
+}
+
+bool router_enable_tls(CometRouter* router, CometTlsConfig config) {
+    if (!router) {
+        log_message(LOG_ERROR, "Router is NULL");
+        return false;
+    }
+
+    if (router->running) {
+        log_message(LOG_ERROR, "TLS can't be enabled while router is running");
+        return false;
+    }
+
+    if (router->ctx->transport != &NET_SOCKET_TRANSPORT) {
+        log_message(LOG_ERROR, "TLS needs socket transport");
+        return false;
+    }
+
+    CometTlsContext* tls = tls_context_new(&config);
+    if (tls == NULL) {
+        return false;
+    }
+
+    tls_context_free(router->ctx->tls);
+    router->ctx->tls = tls;
+    return true;
+}
+
+bool router_set_memory_budget(CometRouter* router, CometMemoryConfig config) {
+    if (!router) {
+        log_message(LOG_ERROR, "Router is NULL");
+        return false;
+    }
+
+    router->memory.config = config;
+    return true;
+}
+
+bool router_enable_offload(CometRouter* router, CometOffloadConfig config) {
+    if (!router) {
+        log_message(LOG_ERROR, "Router is NULL");
+        return false;
+    }
+
+    if (router->running) {
+        log_message(LOG_ERROR, "Offload pool can't be enabled while router is running");
+        return false;
+    }
+
+    if (!router->use_fibers) {
+        log_message(LOG_INFO, "Offload pool enabled, switching router to fiber mode");
+        if (!router_enable_fibers(router, router->fiber_config)) {
+            return false;
+        }
+    }
+
+    CometOffloadPool* pool = comet_offload_pool_new(config);
+    if (pool == NULL) {
+        return false;
+    }
+
+    comet_offload_pool_free(router->offload);
+    router->offload = pool;
+    return true;
+}
+
+bool router_enable_fibers(CometRouter* router, CometFiberConfig config) {
+    if (!router) {
+        log_message(LOG_ERROR, "Router is NULL");
+        return false;
+    }
+
+    if (router->running) {
+        log_message(LOG_ERROR, "Execution mode can't be changed while router is running");
+        return false;
+    }
+
+    if (config.stack_size == 0 || config.max_fibers == 0) {
+        log_message(LOG_ERROR, "Invalid fiber configuration");
+        return false;
+    }
+
+    router->use_fibers = true;
+    router->fiber_config = config;
+    return true;
+}
+
+typedef struct {
+    CometRouter* router;
+    NetConnection conn;
+    uint64_t accepted_ns;
+} RouterConnectionTask;
+
+static void router_connection_fiber(void* arg) {
+    RouterConnectionTask* task = arg;
+    router_handle_connection(task->router, &task->conn, task->accepted_ns);
+    free(task);
+}
+
+// fibers of the router itself - acceptor, and offload pool's when it is enabled
+static size_t router_service_fibers(CometRouter* router) {
+    return router->offload ? 2 : 1;
+}
+
+static void router_offload_fiber(void* arg) {
+    CometRouter* router = arg;
+    comet_offload_serve(router->offload, &router->running);
+}
+
+static void router_accept_fiber(void* arg) {
+    CometRouter* router = arg;
+
+    while (router->running) {
+        route_table_reclaim(router);
+
+        if (fiber_active_count() >= router->fiber_config.max_fibers + router_service_fibers(router)) {
+            comet_sleep(1);
+            continue;
+        }
+
+        RouterConnectionTask* task = malloc(sizeof(RouterConnectionTask));
+        if (task == NULL) {
+            log_message(LOG_ERROR, "Failed to allocate memory for connection task");
+            comet_sleep(10);
+            continue;
+        }
+
+        if (!netctx_accept(router->ctx, &task->conn)) {
+            free(task);
+            // wake up now and then to notice router->running going false
+            comet_wait_fd(router->ctx->local_sockfd, POLLIN, 100);
+            continue;
+        }
+
+        task->router = router;
+        task->accepted_ns = router->trace_config.sample_rate != 0 ? comet_now_ns() : 0;
+        if (!fiber_spawn(router_connection_fiber, task)) {
+            log_message(LOG_ERROR, "Failed to spawn fiber for connection");
+            netconn_close(&task->conn);
+            free(task);
+        }
+    }
+}
+
+static void router_start_fibers(CometRouter* router) {
+    CometFiberConfig config = router->fiber_config;
+    config.max_fibers += router_service_fibers(router);
+
+    if (!fiber_scheduler_init(config)) {
+        log_message(LOG_ERROR, "Failed to initialize fiber scheduler");
+        return;
+    }
+
+    // pool may have been stopped at the end of a previous run
+    if (router->offload && (!comet_offload_pool_start(router->offload) || !fiber_spawn(router_offload_fiber, router))) {
+        log_message(LOG_ERROR, "Failed to start offload pool");
+        fiber_scheduler_deinit();
+        return;
+    }
+
+    if (!fiber_spawn(router_accept_fiber, router)) {
+        log_message(LOG_ERROR, "Failed to spawn acceptor fiber");
+        router->running = false;
+        fiber_scheduler_deinit();
+        return;
+    }
+
+    while (router->running) {
+        fiber_scheduler_run_once(100);
+    }
+
+    // after shutdown is requested let requests in flight finish, they are bounded by io timeouts -
+    // but long-lived WebSocket and SSE sessions are not, so they are abandoned after that grace period
+    int grace_ms = router->ctx->config.recv_timeout_ms > router->ctx->config.send_timeout_ms
+        ? router->ctx->config.recv_timeout_ms : router->ctx->config.send_timeout_ms;
+    uint64_t deadline = comet_now_ms() + (grace_ms > 0 ? grace_ms : 0);
+    while (fiber_active_count() > 0 && comet_now_ms() < deadline) {
+        fiber_scheduler_run_once(100);
+    }
+
+    // abandoned fibers may still be waiting for offloaded jobs, workers must be done with them before their stacks go
+    comet_offload_pool_stop(router->offload);
+    fiber_scheduler_deinit();
+}
+
+void router_start(CometRouter* router) {
+    if (!router) {
+        log_message(LOG_ERROR, "Router is NULL");
+        return;
+    }
+
+    router->running = true;
+
+    // TLS clients learn about HTTP/2 from ALPN instead of Upgrade
+    tls_context_set_h2(router->ctx->tls, router->h2_enabled);
+
+    if (router->use_fibers) {
+        router_start_fibers(router);
+    } else {
+        while (router->running) {
+            route_table_reclaim(router);
+
+            NetConnection conn;
+            if (!netctx_accept(router->ctx, &conn)) {
+                no_connection_timeout();
+                continue;
+            }
+
+            router_handle_connection(router, &conn, router->trace_config.sample_rate != 0 ? comet_now_ns() : 0);
+        }
     }
 
     router_deinit(router);
@@ -409,13 +1453,46 @@ void router_deinit(CometRouter* router) {
     netctx_deinit(router->ctx);
     free(router->ctx);
 
-    for (size_t i = 0; i < router->num_routes; i++) {
-        free(router->routes[i].route);
+    // routes are never removed, so the current snapshot references every shared resource
+    CometRouteTable* table = router->routes;
+    for (size_t i = 0; i < table->num_routes; i++) {
+        free(table->routes[i].websocket);
+    }
+    for (size_t i = 0; i < table->num_routes; i++) {
+        CometUpstream* upstream = table->routes[i].upstream;
+        if (upstream == NULL) {
+            continue;
+        }
+        // same upstream may back several routes - free it only at its last use
+        bool used_later = false;
+        for (size_t j = i + 1; j < table->num_routes && !used_later; j++) {
+            used_later = table->routes[j].upstream == upstream;
+        }
+        if (!used_later) {
+            comet_upstream_free(upstream);
+        }
+    }
+    for (size_t i = 0; i < table->num_routes; i++) {
+        CometSseHub* hub = table->routes[i].sse;
+        if (hub == NULL) {
+            continue;
+        }
+        bool used_later = false;
+        for (size_t j = i + 1; j < table->num_routes && !used_later; j++) {
+            used_later = table->routes[j].sse == hub;
+        }
+        if (!used_later) {
+            comet_sse_hub_free(hub);
+        }
     }
-    for (size_t i = 0; i < router->num_routes; i++) {
-        free(router->routes[i].middleware_chain);
+    route_table_reclaim(router);
+    while (router->draining) {
+        CometRouteTable* next = router->draining->next_retired;
+        route_table_free(router->draining);
+        router->draining = next;
     }
-    free(router->routes);
+    route_table_free(table);
+    comet_offload_pool_free(router->offload);
     free(router);
 
     log_message(LOG_INFO, "Router has been deinitialized");
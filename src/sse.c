@@ -0,0 +1,347 @@
+#include "include/sse.h"
+#include "include/netplat.h"
+#include "include/logger.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+const CometSseConfig COMET_SSE_DEFAULT_CONFIG = {
+    .max_queued_events = 64,
+    .slow_policy = COMET_SSE_DISCONNECT,
+    .keepalive_ms = 15000,
+};
+
+static const char SSE_RESPONSE_HEAD[] =
+    "HTTP/1.1 200 OK\r\n"
+    "Content-Type: text/event-stream\r\n"
+    "Cache-Control: no-cache\r\n"
+    "X-Accel-Buffering: no\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+
+static const char SSE_KEEPALIVE[] = ": keepalive\n\n";
+
+CometSseHub* comet_sse_hub_new(CometSseConfig config) {
+    if (config.max_queued_events == 0) {
+        log_message(LOG_ERROR, "SSE hub needs room for at least one queued event");
+        return NULL;
+    }
+
+    CometSseHub* hub = calloc(1, sizeof(CometSseHub));
+    if (hub == NULL) {
+        log_message(LOG_ERROR, "Failed to allocate memory for SSE hub");
+        return NULL;
+    }
+
+    hub->config = config;
+    return hub;
+}
+
+void comet_sse_hub_free(CometSseHub* hub) {
+    if (!hub) {
+        return;
+    }
+
+    for (size_t i = 0; i < hub->num_topics; i++) {
+        if (hub->topics[i].num_subscribers > 0) {
+            log_message(LOG_WARN, "Freeing SSE hub with subscribers still connected to \"%s\"", hub->topics[i].name);
+        }
+        free(hub->topics[i].name);
+        free(hub->topics[i].subscribers);
+    }
+    free(hub->topics);
+    free(hub);
+}
+
+static CometSseTopic* hub_find_topic(CometSseHub* hub, const char* name, size_t* out_index) {
+    for (size_t i = 0; i < hub->num_topics; i++) {
+        if (strcmp(hub->topics[i].name, name) == 0) {
+            if (out_index) *out_index = i;
+            return &hub->topics[i];
+        }
+    }
+    return NULL;
+}
+
+static CometSseTopic* hub_get_topic(CometSseHub* hub, const char* name, size_t* out_index) {
+    CometSseTopic* topic = hub_find_topic(hub, name, out_index);
+    if (topic) {
+        return topic;
+    }
+
+    CometSseTopic* new_topics = realloc(hub->topics, (hub->num_topics + 1) * sizeof(CometSseTopic));
+    if (new_topics == NULL) {
+        return NULL;
+    }
+    hub->topics = new_topics;
+
+    topic = &hub->topics[hub->num_topics];
+    topic->name = strdup(name);
+    if (topic->name == NULL) {
+        return NULL;
+    }
+    topic->subscribers = NULL;
+    topic->num_subscribers = 0;
+    topic->cap_subscribers = 0;
+
+    *out_index = hub->num_topics++;
+    return topic;
+}
+
+// Topics live only while someone listens - publishing to a topic without subscribers is a no-op anyway,
+// and clients choosing topic names must not grow the hub forever.
+static void hub_remove_topic(CometSseHub* hub, size_t index) {
+    free(hub->topics[index].name);
+    free(hub->topics[index].subscribers);
+
+    hub->num_topics--;
+    if (index != hub->num_topics) {
+        hub->topics[index] = hub->topics[hub->num_topics];
+        CometSseTopic* moved = &hub->topics[index];
+        for (size_t i = 0; i < moved->num_subscribers; i++) {
+            moved->subscribers[i]->topic_index = index;
+        }
+    }
+}
+
+static bool topic_add_subscriber(CometSseTopic* topic, CometSseSubscriber* sub) {
+    if (topic->num_subscribers == topic->cap_subscribers) {
+        size_t new_cap = topic->cap_subscribers ? topic->cap_subscribers * 2 : 16;
+        CometSseSubscriber** new_subs = realloc(topic->subscribers, new_cap * sizeof(CometSseSubscriber*));
+        if (new_subs == NULL) {
+            return false;
+        }
+        topic->subscribers = new_subs;
+        topic->cap_subscribers = new_cap;
+    }
+
+    sub->index = topic->num_subscribers;
+    topic->subscribers[topic->num_subscribers++] = sub;
+    return true;
+}
+
+static void topic_remove_subscriber(CometSseTopic* topic, CometSseSubscriber* sub) {
+    topic->num_subscribers--;
+    if (sub->index != topic->num_subscribers) {
+        topic->subscribers[sub->index] = topic->subscribers[topic->num_subscribers];
+        topic->subscribers[sub->index]->index = sub->index;
+    }
+}
+
+static void frame_unref(CometSseFrame* frame) {
+    if (--frame->refcount == 0) {
+        free(frame);
+    }
+}
+
+// Length of line starting at line, and where the next one starts - NULL if this is the last one.
+// CRLF, LF and bare CR all end a line, as they do for the client (SSE spec, 9.2.5).
+static const char* next_line(const char* line, size_t* line_len) {
+    size_t len = strcspn(line, "\r\n");
+    *line_len = len;
+    if (line[len] == '\0') {
+        return NULL;
+    }
+    return line + len + (line[len] == '\r' && line[len + 1] == '\n' ? 2 : 1);
+}
+
+static CometSseFrame* serialize_event(const char* event, const char* data) {
+    // every line of data gets its own "data: " prefix
+    size_t len = 1;
+    if (event) {
+        len += strlen("event: \n") + strlen(event);
+    }
+    const char* line = data;
+    while (line) {
+        size_t line_len;
+        const char* next = next_line(line, &line_len);
+        len += strlen("data: \n") + line_len;
+        line = next;
+    }
+
+    CometSseFrame* frame = malloc(sizeof(CometSseFrame) + len);
+    if (frame == NULL) {
+        return NULL;
+    }
+    frame->refcount = 1;
+
+    char* out = frame->data;
+    if (event) {
+        out += sprintf(out, "event: %s\n", event);
+    }
+    line = data;
+    while (line) {
+        size_t line_len;
+        const char* next = next_line(line, &line_len);
+        memcpy(out, "data: ", 6);
+        memcpy(out + 6, line, line_len);
+        out[6 + line_len] = '\n';
+        out += 7 + line_len;
+        line = next;
+    }
+    *out++ = '\n';
+
+    frame->len = out - frame->data;
+    return frame;
+}
+
+static bool subscriber_enqueue(CometSseHub* hub, CometSseSubscriber* sub, CometSseFrame* frame, size_t already_sent) {
+    if (sub->queue_len == hub->config.max_queued_events) {
+        if (hub->config.slow_policy == COMET_SSE_DISCONNECT) {
+            sub->disconnect = true;
+            fiber_wake(sub->fiber);
+        }
+        return false;
+    }
+
+    size_t tail = (sub->queue_head + sub->queue_len) % hub->config.max_queued_events;
+    sub->queue[tail] = frame;
+    frame->refcount++;
+    if (sub->queue_len == 0) {
+        sub->sent_of_head = already_sent;
+    }
+    sub->queue_len++;
+
+    // waking a fiber suspended in send would make it fail - it gets to the queue once send completes
+    if (!sub->writing) {
+        fiber_wake(sub->fiber);
+    }
+    return true;
+}
+
+size_t comet_sse_publish(CometSseHub* hub, const char* topic_name, const char* event, const char* data) {
+    if (!hub || !topic_name || !data) {
+        log_message(LOG_ERROR, "Invalid arguments to comet_sse_publish");
+        return 0;
+    }
+    // line break in event name would start fields of its own
+    if (event && event[strcspn(event, "\r\n")] != '\0') {
+        log_message(LOG_ERROR, "SSE event name must not contain line breaks");
+        return 0;
+    }
+
+    CometSseTopic* topic = hub_find_topic(hub, topic_name, NULL);
+    if (topic == NULL || topic->num_subscribers == 0) {
+        return 0;
+    }
+
+    CometSseFrame* frame = serialize_event(event, data);
+    if (frame == NULL) {
+        log_message(LOG_ERROR, "Failed to allocate memory for SSE event");
+        return 0;
+    }
+
+    size_t delivered = 0;
+    for (size_t i = 0; i < topic->num_subscribers; i++) {
+        CometSseSubscriber* sub = topic->subscribers[i];
+        if (sub->disconnect) {
+            continue;
+        }
+
+        // fast path - idle subscriber with room in socket buffer gets the shared frame written right away
+        if (sub->queue_len == 0 && !sub->writing) {
+            ByteCount sent = netconn_try_send(sub->conn, frame->data, frame->len);
+            if (sent == SOCKET_ERROR) {
+                sub->disconnect = true;
+                fiber_wake(sub->fiber);
+                continue;
+            }
+            if ((size_t)sent == frame->len) {
+                delivered++;
+                continue;
+            }
+            if (subscriber_enqueue(hub, sub, frame, sent)) {
+                delivered++;
+            }
+            continue;
+        }
+
+        if (subscriber_enqueue(hub, sub, frame, 0)) {
+            delivered++;
+        }
+    }
+
+    frame_unref(frame);
+    return delivered;
+}
+
+size_t comet_sse_subscriber_count(CometSseHub* hub, const char* topic_name) {
+    CometSseTopic* topic = hub ? hub_find_topic(hub, topic_name, NULL) : NULL;
+    return topic ? topic->num_subscribers : 0;
+}
+
+void sse_run_session(CometSseHub* hub, NetConnection* conn, const char* topic_name) {
+    CometSseSubscriber sub = {0};
+    sub.conn = conn;
+    sub.fiber = fiber_self();
+    sub.queue = malloc(hub->config.max_queued_events * sizeof(CometSseFrame*));
+    if (sub.queue == NULL) {
+        log_message(LOG_ERROR, "Failed to allocate memory for SSE subscriber");
+        return;
+    }
+
+    if (netconn_send(conn, SSE_RESPONSE_HEAD, sizeof(SSE_RESPONSE_HEAD) - 1) == SOCKET_ERROR) {
+        free(sub.queue);
+        return;
+    }
+
+    CometSseTopic* topic = hub_get_topic(hub, topic_name, &sub.topic_index);
+    if (topic == NULL || !topic_add_subscriber(topic, &sub)) {
+        log_message(LOG_ERROR, "Failed to subscribe to SSE topic");
+        if (topic != NULL && topic->num_subscribers == 0) {
+            hub_remove_topic(hub, sub.topic_index);
+        }
+        free(sub.queue);
+        return;
+    }
+
+    int keepalive = hub->config.keepalive_ms > 0 ? hub->config.keepalive_ms : -1;
+
+    while (!sub.disconnect) {
+        if (sub.queue_len > 0) {
+            // slow path - flush queued frames, suspending until client drains its socket
+            CometSseFrame* frame = sub.queue[sub.queue_head];
+            sub.writing = true;
+            ByteCount sent = netconn_send(conn, frame->data + sub.sent_of_head, frame->len - sub.sent_of_head);
+            sub.writing = false;
+            if (sent == SOCKET_ERROR) {
+                break;
+            }
+
+            sub.queue_head = (sub.queue_head + 1) % hub->config.max_queued_events;
+            sub.queue_len--;
+            sub.sent_of_head = 0;
+            frame_unref(frame);
+            continue;
+        }
+
+        // client never sends anything on event stream - readable connection means it went away.
+        // Connections without socket can't be polled, they are checked at every wake up instead
+        short revents = comet_wait_fd(conn->sockfd, POLLIN, keepalive);
+        if (revents != 0 || conn->sockfd == SOCKET_ERROR) {
+            if (netconn_peer_closed(conn)) break;
+        }
+        if (revents == 0 && !sub.disconnect && sub.queue_len == 0) {
+            // either keepalive timeout or wake up by publish - in the latter case queue isn't empty
+            sub.writing = true;
+            ByteCount sent = netconn_send(conn, SSE_KEEPALIVE, sizeof(SSE_KEEPALIVE) - 1);
+            sub.writing = false;
+            if (sent == SOCKET_ERROR) {
+                break;
+            }
+        }
+    }
+
+    topic = &hub->topics[sub.topic_index];
+    topic_remove_subscriber(topic, &sub);
+    if (topic->num_subscribers == 0) {
+        hub_remove_topic(hub, sub.topic_index);
+    }
+    while (sub.queue_len > 0) {
+        frame_unref(sub.queue[sub.queue_head]);
+        sub.queue_head = (sub.queue_head + 1) % hub->config.max_queued_events;
+        sub.queue_len--;
+    }
+    free(sub.queue);
+}
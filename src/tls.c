@@ -0,0 +1,486 @@
+#include "include/tls.h"
+#include "include/fiber.h"
+#include "include/netplat.h"
+#include "include/logger.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+const CometTlsConfig COMET_TLS_DEFAULT_CONFIG = {
+    .cert_file = NULL,
+    .key_file = NULL,
+    .ciphers = NULL,
+    .session_cache_size = 20 * 1024,
+    .session_timeout_s = 300,
+    .session_tickets = true,
+    .ktls = true,
+};
+
+#ifdef COMET_TLS
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#include <limits.h>
+#ifndef _WIN32
+#include <signal.h>
+#endif
+
+// small buffers of one sendv are joined into a single record - head and short body in one packet
+#define TLS_COALESCE_MAX 4096
+#define TLS_SENDFILE_CHUNK (16 * 1024)
+
+struct CometTlsContext {
+    SSL_CTX* ssl_ctx;
+    bool h2;
+};
+
+static void log_ssl_error(const char* what) {
+    unsigned long err = ERR_get_error();
+    if (err != 0) {
+        char buf[256];
+        ERR_error_string_n(err, buf, sizeof(buf));
+        log_message(LOG_ERROR, "%s: %s", what, buf);
+    } else {
+        log_message(LOG_ERROR, "%s: %s", what, GET_ERROR_CODE() != 0 ? GET_ERROR_STR() : "connection closed");
+    }
+    ERR_clear_error();
+}
+
+// Failed SSL_* call. errno must not keep stale COMET_ERROR_TIMEOUT, callers treat it as idle connection.
+static void fail_io(const char* what, int ssl_err) {
+    if (ssl_err == SSL_ERROR_SYSCALL && GET_ERROR_CODE() != 0) {
+        log_message(LOG_ERROR, "%s: %s", what, GET_ERROR_STR());
+        ERR_clear_error();
+        return;
+    }
+    log_ssl_error(what);
+    SET_ERROR_CODE(ssl_err == SSL_ERROR_SYSCALL ? ECONNRESET : EIO);
+}
+
+/**
+ * Suspend until socket is ready for what OpenSSL asked for.
+ * @return 1 to retry, 0 on timeout, -1 if ssl_err is not a retry at all.
+ */
+static int wait_for_ssl(NetConnection* conn, int ssl_err, int timeout_ms) {
+    short events;
+    if (ssl_err == SSL_ERROR_WANT_READ) {
+        events = POLLIN;
+    } else if (ssl_err == SSL_ERROR_WANT_WRITE) {
+        events = POLLOUT;
+    } else {
+        return -1;
+    }
+
+    if (comet_wait_fd(conn->sockfd, events, timeout_ms) == 0) {
+        SET_ERROR_CODE(COMET_ERROR_TIMEOUT);
+        return 0;
+    }
+    return 1;
+}
+
+static int select_alpn(SSL* ssl, const unsigned char** out, unsigned char* out_len,
+                       const unsigned char* in, unsigned int in_len, void* arg) {
+    static const unsigned char PROTOS_H2[] = "\x02h2\x08http/1.1";
+    static const unsigned char PROTOS_HTTP1[] = "\x08http/1.1";
+    CometTlsContext* ctx = arg;
+
+    const unsigned char* protos = ctx->h2 ? PROTOS_H2 : PROTOS_HTTP1;
+    unsigned int protos_len = ctx->h2 ? sizeof(PROTOS_H2) - 1 : sizeof(PROTOS_HTTP1) - 1;
+    if (SSL_select_next_proto((unsigned char**)out, out_len, protos, protos_len, in, in_len) != OPENSSL_NPN_NEGOTIATED) {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    return SSL_TLSEXT_ERR_OK;
+}
+
+CometTlsContext* tls_context_new(const CometTlsConfig* config) {
+    if (!config || !config->cert_file || !config->key_file) {
+        log_message(LOG_ERROR, "TLS needs certificate and key file");
+        return NULL;
+    }
+
+    CometTlsContext* ctx = calloc(1, sizeof(CometTlsContext));
+    if (ctx == NULL) {
+        log_message(LOG_ERROR, "Failed to allocate memory for TLS context");
+        return NULL;
+    }
+
+    ctx->ssl_ctx = SSL_CTX_new(TLS_server_method());
+    if (ctx->ssl_ctx == NULL) {
+        log_ssl_error("Failed to create TLS context");
+        free(ctx);
+        return NULL;
+    }
+    SSL_CTX* ssl_ctx = ctx->ssl_ctx;
+
+    SSL_CTX_set_min_proto_version(ssl_ctx, TLS1_2_VERSION);
+
+    uint64_t options = SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE;
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+    // clients rarely send close_notify, treat plain close as end of stream
+    options |= SSL_OP_IGNORE_UNEXPECTED_EOF;
+#endif
+#ifdef SSL_OP_ENABLE_KTLS
+    if (config->ktls) {
+        options |= SSL_OP_ENABLE_KTLS;
+    }
+#endif
+    if (!config->session_tickets) {
+        options |= SSL_OP_NO_TICKET;
+    }
+    SSL_CTX_set_options(ssl_ctx, options);
+
+    // partial writes let netconn_try_send hand out whatever fits, idle connections give their buffers back
+    SSL_CTX_set_mode(ssl_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+
+    if (config->session_cache_size > 0) {
+        static const unsigned char SESSION_ID_CONTEXT[] = "comet";
+        SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_SERVER);
+        SSL_CTX_sess_set_cache_size(ssl_ctx, config->session_cache_size);
+        SSL_CTX_set_session_id_context(ssl_ctx, SESSION_ID_CONTEXT, sizeof(SESSION_ID_CONTEXT) - 1);
+    } else {
+        SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_OFF);
+    }
+    if (config->session_timeout_s > 0) {
+        SSL_CTX_set_timeout(ssl_ctx, config->session_timeout_s);
+    }
+
+    if (config->ciphers && SSL_CTX_set_cipher_list(ssl_ctx, config->ciphers) != 1) {
+        log_ssl_error("Invalid TLS cipher list");
+        goto error;
+    }
+    if (SSL_CTX_use_certificate_chain_file(ssl_ctx, config->cert_file) != 1) {
+        log_ssl_error("Failed to load TLS certificate");
+        goto error;
+    }
+    if (SSL_CTX_use_PrivateKey_file(ssl_ctx, config->key_file, SSL_FILETYPE_PEM) != 1) {
+        log_ssl_error("Failed to load TLS private key");
+        goto error;
+    }
+    if (SSL_CTX_check_private_key(ssl_ctx) != 1) {
+        log_ssl_error("TLS private key doesn't match certificate");
+        goto error;
+    }
+
+    SSL_CTX_set_alpn_select_cb(ssl_ctx, select_alpn, ctx);
+
+#ifndef _WIN32
+    // OpenSSL writes to socket without MSG_NOSIGNAL, client going away mid-write would kill the process
+    struct sigaction sa;
+    if (sigaction(SIGPIPE, NULL, &sa) == 0 && sa.sa_handler == SIG_DFL) {
+        signal(SIGPIPE, SIG_IGN);
+    }
+#endif
+
+    return ctx;
+error:
+    SSL_CTX_free(ssl_ctx);
+    free(ctx);
+    return NULL;
+}
+
+void tls_context_free(CometTlsContext* ctx) {
+    if (!ctx) {
+        return;
+    }
+    SSL_CTX_free(ctx->ssl_ctx);
+    free(ctx);
+}
+
+void tls_context_set_h2(CometTlsContext* ctx, bool enabled) {
+    if (ctx) {
+        ctx->h2 = enabled;
+    }
+}
+
+bool tls_accept(CometTlsContext* ctx, NetConnection* conn) {
+    SSL* ssl = SSL_new(ctx->ssl_ctx);
+    if (ssl == NULL || SSL_set_fd(ssl, (int)conn->sockfd) != 1) {
+        log_ssl_error("Failed to set up TLS connection");
+        SSL_free(ssl);
+        return false;
+    }
+
+    for (;;) {
+        ERR_clear_error();
+        int ret = SSL_accept(ssl);
+        if (ret == 1) {
+            break;
+        }
+
+        int ssl_err = SSL_get_error(ssl, ret);
+        int waited = wait_for_ssl(conn, ssl_err, conn->recv_timeout_ms);
+        if (waited == 1) {
+            continue;
+        }
+        if (waited == 0) {
+            log_message(LOG_ERROR, "TLS handshake timed out");
+        } else {
+            log_ssl_error("TLS handshake failed");
+        }
+        SSL_free(ssl);
+        return false;
+    }
+
+    conn->tls = ssl;
+
+    if (verbose_output) {
+        log_message(LOG_INFO, "TLS handshake done: %s, %s session%s", SSL_get_version(ssl),
+                    SSL_session_reused(ssl) ? "resumed" : "new",
+                    BIO_get_ktls_send(SSL_get_wbio(ssl)) ? ", kernel TLS" : "");
+    }
+    return true;
+}
+
+ByteCount tls_recv(NetConnection* conn, void* buf, size_t len) {
+    SSL* ssl = conn->tls;
+    int want = len > INT_MAX ? INT_MAX : (int)len;
+
+    for (;;) {
+        ERR_clear_error();
+        int received = SSL_read(ssl, buf, want);
+        if (received > 0) {
+            return received;
+        }
+
+        int ssl_err = SSL_get_error(ssl, received);
+        if (ssl_err == SSL_ERROR_ZERO_RETURN) {
+            return 0;
+        }
+
+        int waited = wait_for_ssl(conn, ssl_err, conn->recv_timeout_ms);
+        if (waited == 1) {
+            continue;
+        }
+        // timeouts are routine for long-lived connections, callers decide if they are an error
+        if (waited == -1) {
+            fail_io("Failed to receive data", ssl_err);
+        }
+        return SOCKET_ERROR;
+    }
+}
+
+ByteCount tls_send(NetConnection* conn, const void* buf, size_t len) {
+    SSL* ssl = conn->tls;
+    size_t total_sent = 0;
+
+    while (total_sent < len) {
+        size_t left = len - total_sent;
+        ERR_clear_error();
+        int sent = SSL_write(ssl, (const char*)buf + total_sent, left > INT_MAX ? INT_MAX : (int)left);
+        if (sent > 0) {
+            total_sent += sent;
+            continue;
+        }
+
+        int ssl_err = SSL_get_error(ssl, sent);
+        int waited = wait_for_ssl(conn, ssl_err, conn->send_timeout_ms);
+        if (waited == 1) {
+            continue;
+        }
+        if (waited == 0) {
+            log_message(LOG_ERROR, "Failed to send data: %s", GET_ERROR_STR());
+        } else {
+            fail_io("Failed to send data", ssl_err);
+        }
+        return SOCKET_ERROR;
+    }
+
+    return total_sent;
+}
+
+ByteCount tls_sendv(NetConnection* conn, const NetBuffer* bufs, size_t count) {
+    char staging[TLS_COALESCE_MAX];
+    size_t staged = 0;
+    size_t total_sent = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        if (staged + bufs[i].len <= sizeof(staging)) {
+            memcpy(staging + staged, bufs[i].data, bufs[i].len);
+            staged += bufs[i].len;
+            continue;
+        }
+
+        if (staged > 0) {
+            if (tls_send(conn, staging, staged) == SOCKET_ERROR) {
+                return SOCKET_ERROR;
+            }
+            total_sent += staged;
+            staged = 0;
+        }
+
+        if (bufs[i].len <= sizeof(staging)) {
+            memcpy(staging, bufs[i].data, bufs[i].len);
+            staged = bufs[i].len;
+        } else {
+            if (tls_send(conn, bufs[i].data, bufs[i].len) == SOCKET_ERROR) {
+                return SOCKET_ERROR;
+            }
+            total_sent += bufs[i].len;
+        }
+    }
+
+    if (staged > 0) {
+        if (tls_send(conn, staging, staged) == SOCKET_ERROR) {
+            return SOCKET_ERROR;
+        }
+        total_sent += staged;
+    }
+    return total_sent;
+}
+
+ByteCount tls_try_send(NetConnection* conn, const void* buf, size_t len) {
+    SSL* ssl = conn->tls;
+
+    ERR_clear_error();
+    int sent = SSL_write(ssl, buf, len > INT_MAX ? INT_MAX : (int)len);
+    if (sent > 0) {
+        return sent;
+    }
+
+    // record that didn't fit stays buffered in OpenSSL, caller retries with the same data
+    int ssl_err = SSL_get_error(ssl, sent);
+    if (ssl_err == SSL_ERROR_WANT_WRITE || ssl_err == SSL_ERROR_WANT_READ) {
+        return 0;
+    }
+    fail_io("Failed to send data", ssl_err);
+    return SOCKET_ERROR;
+}
+
+ByteCount tls_sendfile(NetConnection* conn, int file_fd, uint64_t offset, size_t len) {
+    SSL* ssl = conn->tls;
+    size_t total_sent = 0;
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L && !defined(OPENSSL_NO_KTLS)
+    if (BIO_get_ktls_send(SSL_get_wbio(ssl))) {
+        // kernel encrypts, file data never reaches user space
+        while (total_sent < len) {
+            ERR_clear_error();
+            ossl_ssize_t sent = SSL_sendfile(ssl, file_fd, (off_t)(offset + total_sent), len - total_sent, 0);
+            if (sent > 0) {
+                total_sent += sent;
+                continue;
+            }
+
+            int ssl_err = SSL_get_error(ssl, (int)sent);
+            int waited = wait_for_ssl(conn, ssl_err, conn->send_timeout_ms);
+            if (waited == 1) {
+                continue;
+            }
+            if (waited == 0) {
+                log_message(LOG_ERROR, "Failed to send file: %s", GET_ERROR_STR());
+            } else {
+                fail_io("Failed to send file", ssl_err);
+            }
+            return SOCKET_ERROR;
+        }
+        return total_sent;
+    }
+#endif
+
+    char* chunk = malloc(TLS_SENDFILE_CHUNK);
+    if (chunk == NULL) {
+        log_message(LOG_ERROR, "Failed to allocate memory for file chunk");
+        return SOCKET_ERROR;
+    }
+
+    while (total_sent < len) {
+        size_t want = len - total_sent < TLS_SENDFILE_CHUNK ? len - total_sent : TLS_SENDFILE_CHUNK;
+        ByteCount n = comet_file_read(file_fd, chunk, want, offset + total_sent);
+        if (n <= 0) {
+            log_message(LOG_ERROR, "Failed to read file: %s", n == 0 ? "file is shorter than expected" : GET_ERROR_STR());
+            free(chunk);
+            return SOCKET_ERROR;
+        }
+        if (tls_send(conn, chunk, n) == SOCKET_ERROR) {
+            free(chunk);
+            return SOCKET_ERROR;
+        }
+        total_sent += n;
+    }
+
+    free(chunk);
+    return total_sent;
+}
+
+bool tls_peer_closed(NetConnection* conn) {
+    SSL* ssl = conn->tls;
+    char discard[256];
+
+    // reads records, not the raw socket - close_notify and partial records are handled by OpenSSL
+    for (;;) {
+        ERR_clear_error();
+        int received = SSL_read(ssl, discard, sizeof(discard));
+        if (received > 0) {
+            continue;
+        }
+
+        int ssl_err = SSL_get_error(ssl, received);
+        if (ssl_err == SSL_ERROR_WANT_READ || ssl_err == SSL_ERROR_WANT_WRITE) {
+            return false;
+        }
+        ERR_clear_error();
+        return true;
+    }
+}
+
+void tls_close(NetConnection* conn) {
+    SSL* ssl = conn->tls;
+    if (!ssl) {
+        return;
+    }
+
+    // one attempt at close_notify, socket is being closed anyway
+    ERR_clear_error();
+    SSL_shutdown(ssl);
+    ERR_clear_error();
+    SSL_free(ssl);
+    conn->tls = NULL;
+}
+
+#else
+
+CometTlsContext* tls_context_new(const CometTlsConfig* config) {
+    log_message(LOG_ERROR, "Comet was built without TLS support, configure with -DCOMET_ENABLE_TLS=ON");
+    return NULL;
+}
+
+void tls_context_free(CometTlsContext* ctx) {
+}
+
+void tls_context_set_h2(CometTlsContext* ctx, bool enabled) {
+}
+
+bool tls_accept(CometTlsContext* ctx, NetConnection* conn) {
+    return false;
+}
+
+ByteCount tls_recv(NetConnection* conn, void* buf, size_t len) {
+    return SOCKET_ERROR;
+}
+
+ByteCount tls_send(NetConnection* conn, const void* buf, size_t len) {
+    return SOCKET_ERROR;
+}
+
+ByteCount tls_sendv(NetConnection* conn, const NetBuffer* bufs, size_t count) {
+    return SOCKET_ERROR;
+}
+
+ByteCount tls_try_send(NetConnection* conn, const void* buf, size_t len) {
+    return SOCKET_ERROR;
+}
+
+ByteCount tls_sendfile(NetConnection* conn, int file_fd, uint64_t offset, size_t len) {
+    return SOCKET_ERROR;
+}
+
+bool tls_peer_closed(NetConnection* conn) {
+    return true;
+}
+
+void tls_close(NetConnection* conn) {
+    conn->tls = NULL;
+}
+
+#endif
@@ -0,0 +1,119 @@
+#include "include/trace.h"
+#include "include/logger.h"
+
+#include <string.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+const CometTraceConfig COMET_TRACE_DEFAULT_CONFIG = {
+    .sample_rate = 1,
+    .slow_threshold_ms = 100,
+    .slow_log = NULL,
+    .on_trace = NULL,
+};
+
+static const char* PHASE_NAMES[COMET_TRACE_PHASE_COUNT] = {
+    "accept", "read", "parse", "route", "middleware", "handler", "serialize", "send",
+};
+
+uint64_t comet_now_ns(void) {
+#ifdef _WIN32
+    static LARGE_INTEGER frequency = {0};
+    if (frequency.QuadPart == 0) {
+        QueryPerformanceFrequency(&frequency);
+    }
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    return (uint64_t)(counter.QuadPart / frequency.QuadPart) * 1000000000ull
+        + (uint64_t)(counter.QuadPart % frequency.QuadPart) * 1000000000ull / frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+const char* comet_trace_phase_name(CometTracePhase phase) {
+    return phase < COMET_TRACE_PHASE_COUNT ? PHASE_NAMES[phase] : "unknown";
+}
+
+void trace_begin(CometTrace* trace, const CometTraceConfig* config, uint64_t* counter, uint64_t accepted_ns) {
+    trace->active = false;
+    trace->method = NULL;
+    trace->method_len = 0;
+    trace->url = NULL;
+    trace->status = 0;
+
+    if (config->sample_rate == 0 || (*counter)++ % config->sample_rate != 0) {
+        return;
+    }
+
+    trace->active = true;
+    trace->start_ns = comet_now_ns();
+    trace->last_ns = trace->start_ns;
+    memset(trace->phase_ns, 0, sizeof(trace->phase_ns));
+
+    if (accepted_ns != 0 && accepted_ns < trace->start_ns) {
+        trace->phase_ns[COMET_TRACE_ACCEPT] = trace->start_ns - accepted_ns;
+        trace->start_ns = accepted_ns;
+    }
+}
+
+void trace_record(CometTrace* trace, CometTracePhase phase) {
+    uint64_t now = comet_now_ns();
+    trace->phase_ns[phase] += now - trace->last_ns;
+    trace->last_ns = now;
+}
+
+static void write_json_string(FILE* out, const char* str, size_t len) {
+    fputc('"', out);
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = str[i];
+        if (c == '"' || c == '\\') {
+            fputc('\\', out);
+            fputc(c, out);
+        } else if (c < 0x20) {
+            fprintf(out, "\\u%04x", c);
+        } else {
+            fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+static void write_slow_log(const CometTrace* trace, FILE* out) {
+    char timestamp[32];
+    time_t now = time(NULL);
+    strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+
+    fprintf(out, "{\"time\":\"%s\",\"method\":", timestamp);
+    write_json_string(out, trace->method ? trace->method : "", trace->method_len);
+    fputs(",\"url\":", out);
+    write_json_string(out, trace->url ? trace->url : "", trace->url ? strlen(trace->url) : 0);
+    fprintf(out, ",\"status\":%d,\"total_us\":%llu", trace->status, (unsigned long long)(trace->total_ns / 1000));
+    for (int i = 0; i < COMET_TRACE_PHASE_COUNT; i++) {
+        fprintf(out, ",\"%s_us\":%llu", PHASE_NAMES[i], (unsigned long long)(trace->phase_ns[i] / 1000));
+    }
+    fputs("}\n", out);
+    fflush(out);
+}
+
+void trace_finish(CometTrace* trace, const CometTraceConfig* config, void* state) {
+    COMET_PROBE2(request__done, trace->status, trace->url);
+    if (!trace->active) {
+        return;
+    }
+
+    trace->total_ns = trace->last_ns - trace->start_ns;
+
+    if (config->on_trace) {
+        config->on_trace(state, trace);
+    }
+
+    if (config->slow_threshold_ms > 0 && trace->total_ns >= (uint64_t)config->slow_threshold_ms * 1000000) {
+        write_slow_log(trace, config->slow_log ? config->slow_log : stderr);
+    }
+}
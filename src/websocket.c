@@ -0,0 +1,492 @@
+#include "include/websocket.h"
+#include "include/fiber.h"
+#include "include/netplat.h"
+#include "include/httputil.h"
+#include "include/logger.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WS_READ_BUFFER_SIZE 4096
+#define WS_SMALL_FRAME_SIZE 4096
+
+#define WS_OP_CONTINUATION 0x0
+#define WS_OP_TEXT 0x1
+#define WS_OP_BINARY 0x2
+#define WS_OP_CLOSE 0x8
+#define WS_OP_PING 0x9
+#define WS_OP_PONG 0xA
+
+const CometWebSocketConfig COMET_WEBSOCKET_DEFAULT_CONFIG = {
+    .on_open = NULL,
+    .on_message = NULL,
+    .on_close = NULL,
+    .max_message_size = 1024 * 1024,
+    .idle_timeout_ms = 30000,
+};
+
+static uint32_t rol32(uint32_t x, int n) {
+    return (x << n) | (x >> (32 - n));
+}
+
+// SHA-1 is needed for Sec-WebSocket-Accept only, so a compact one-shot version will do.
+static void sha1(const uint8_t* data, size_t len, uint8_t out[20]) {
+    uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    size_t padded_len = ((len + 8) / 64 + 1) * 64;
+    uint8_t block[64];
+
+    for (size_t offset = 0; offset < padded_len; offset += 64) {
+        for (size_t i = 0; i < 64; i++) {
+            size_t pos = offset + i;
+            if (pos < len) block[i] = data[pos];
+            else if (pos == len) block[i] = 0x80;
+            else if (pos >= padded_len - 8) block[i] = (uint8_t)(((uint64_t)len * 8) >> ((padded_len - 1 - pos) * 8));
+            else block[i] = 0;
+        }
+
+        uint32_t w[80];
+        for (int i = 0; i < 16; i++) {
+            w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16 | (uint32_t)block[i * 4 + 2] << 8 | block[i * 4 + 3];
+        }
+        for (int i = 16; i < 80; i++) {
+            w[i] = rol32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+        }
+
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; i++) {
+            uint32_t f, k;
+            if (i < 20) { f = (b & c) | (~b & d); k = 0x5A827999; }
+            else if (i < 40) { f = b ^ c ^ d; k = 0x6ED9EBA1; }
+            else if (i < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8F1BBCDC; }
+            else { f = b ^ c ^ d; k = 0xCA62C1D6; }
+
+            uint32_t temp = rol32(a, 5) + f + e + k + w[i];
+            e = d; d = c; c = rol32(b, 30); b = a; a = temp;
+        }
+
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+    }
+
+    for (int i = 0; i < 5; i++) {
+        out[i * 4] = h[i] >> 24;
+        out[i * 4 + 1] = h[i] >> 16;
+        out[i * 4 + 2] = h[i] >> 8;
+        out[i * 4 + 3] = h[i];
+    }
+}
+
+static size_t base64_encode(const uint8_t* data, size_t len, char* out) {
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    size_t out_len = 0;
+
+    for (size_t i = 0; i < len; i += 3) {
+        uint32_t triple = (uint32_t)data[i] << 16;
+        if (i + 1 < len) triple |= (uint32_t)data[i + 1] << 8;
+        if (i + 2 < len) triple |= data[i + 2];
+
+        out[out_len++] = alphabet[(triple >> 18) & 0x3F];
+        out[out_len++] = alphabet[(triple >> 12) & 0x3F];
+        out[out_len++] = i + 1 < len ? alphabet[(triple >> 6) & 0x3F] : '=';
+        out[out_len++] = i + 2 < len ? alphabet[triple & 0x3F] : '=';
+    }
+
+    out[out_len] = '\0';
+    return out_len;
+}
+
+/**
+ * XOR payload with the 4 byte masking key. Client frames are always masked, so this runs over every
+ * received byte - process 16 (SSE2) or 8 bytes at a time instead of byte by byte.
+ */
+static void ws_unmask(uint8_t* data, size_t len, const uint8_t mask[4]) {
+    uint32_t mask32;
+    memcpy(&mask32, mask, 4);
+    uint64_t mask64 = ((uint64_t)mask32 << 32) | mask32;
+    size_t i = 0;
+
+#ifdef __SSE2__
+    __m128i mask128 = _mm_set1_epi32((int)mask32);
+    for (; i + 16 <= len; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)(data + i));
+        _mm_storeu_si128((__m128i*)(data + i), _mm_xor_si128(chunk, mask128));
+    }
+#endif
+    for (; i + 8 <= len; i += 8) {
+        uint64_t chunk;
+        memcpy(&chunk, data + i, 8);
+        chunk ^= mask64;
+        memcpy(data + i, &chunk, 8);
+    }
+    // i is a multiple of 4 here, so mask lines up again
+    for (; i < len; i++) {
+        data[i] ^= mask[i & 3];
+    }
+}
+
+bool ws_is_upgrade_request(const char* head, size_t head_len) {
+    const char* value;
+    size_t value_len;
+
+    return find_raw_header(head, head_len, "Upgrade", &value, &value_len) &&
+           header_value_has_token(value, value_len, "websocket") &&
+           find_raw_header(head, head_len, "Connection", &value, &value_len) &&
+           header_value_has_token(value, value_len, "upgrade");
+}
+
+/**
+ * Whether data is well-formed UTF-8 (RFC 3629) - no overlong forms, surrogates or code points past U+10FFFF.
+ * Text messages are mostly ASCII, which is skipped 8 bytes at a time.
+ */
+static bool ws_is_valid_utf8(const uint8_t* data, size_t len) {
+    size_t i = 0;
+    while (i < len) {
+        if (i + 8 <= len) {
+            uint64_t chunk;
+            memcpy(&chunk, data + i, 8);
+            if ((chunk & 0x8080808080808080ULL) == 0) {
+                i += 8;
+                continue;
+            }
+        }
+
+        uint8_t c = data[i];
+        if (c < 0x80) {
+            i++;
+            continue;
+        }
+
+        // number of continuation bytes, and allowed range of the first one
+        size_t n;
+        uint8_t lo = 0x80, hi = 0xBF;
+        if (c >= 0xC2 && c <= 0xDF) {
+            n = 1;
+        } else if (c >= 0xE0 && c <= 0xEF) {
+            n = 2;
+            if (c == 0xE0) lo = 0xA0;       // overlong
+            if (c == 0xED) hi = 0x9F;       // surrogates
+        } else if (c >= 0xF0 && c <= 0xF4) {
+            n = 3;
+            if (c == 0xF0) lo = 0x90;       // overlong
+            if (c == 0xF4) hi = 0x8F;       // past U+10FFFF
+        } else {
+            return false;
+        }
+
+        if (len - i <= n || data[i + 1] < lo || data[i + 1] > hi) {
+            return false;
+        }
+        for (size_t k = 2; k <= n; k++) {
+            if ((data[i + k] & 0xC0) != 0x80) return false;
+        }
+        i += n + 1;
+    }
+    return true;
+}
+
+static bool ws_handshake(NetConnection* conn, const char* head, size_t head_len) {
+    static const char bad_request[] =
+        "HTTP/1.1 400 Bad Request\r\n"
+        "Sec-WebSocket-Version: 13\r\n"
+        "Content-Length: 0\r\n"
+        "Connection: close\r\n"
+        "\r\n";
+
+    const char* key;
+    size_t key_len;
+    const char* version;
+    size_t version_len;
+
+    if (!find_raw_header(head, head_len, "Sec-WebSocket-Key", &key, &key_len) || key_len == 0 || key_len > 64 ||
+        !find_raw_header(head, head_len, "Sec-WebSocket-Version", &version, &version_len) ||
+        version_len != 2 || strncmp(version, "13", 2) != 0) {
+        log_message(LOG_WARN, "Rejected malformed WebSocket handshake");
+        netconn_send(conn, bad_request, sizeof(bad_request) - 1);
+        return false;
+    }
+
+    char accept_src[64 + sizeof(WS_GUID)];
+    memcpy(accept_src, key, key_len);
+    memcpy(accept_src + key_len, WS_GUID, sizeof(WS_GUID) - 1);
+
+    uint8_t digest[20];
+    sha1((const uint8_t*)accept_src, key_len + sizeof(WS_GUID) - 1, digest);
+
+    char accept[32];
+    base64_encode(digest, sizeof(digest), accept);
+
+    char response[256];
+    int response_len = snprintf(response, sizeof(response),
+        "HTTP/1.1 101 Switching Protocols\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Accept: %s\r\n"
+        "\r\n", accept);
+
+    return netconn_send(conn, response, response_len) != SOCKET_ERROR;
+}
+
+static bool ws_send_frame(CometWebSocket* ws, uint8_t opcode, const void* data, size_t len) {
+    uint8_t header[10];
+    size_t header_len = 2;
+
+    header[0] = 0x80 | opcode;
+    if (len < 126) {
+        header[1] = (uint8_t)len;
+    } else if (len <= 0xFFFF) {
+        header[1] = 126;
+        header[2] = (uint8_t)(len >> 8);
+        header[3] = (uint8_t)len;
+        header_len = 4;
+    } else {
+        header[1] = 127;
+        for (int i = 0; i < 8; i++) {
+            header[2 + i] = (uint8_t)((uint64_t)len >> (56 - i * 8));
+        }
+        header_len = 10;
+    }
+
+    // messages can be sent from other fibers too - don't let their frames interleave
+    while (ws->write_busy) {
+        comet_sleep(1);
+    }
+    ws->write_busy = true;
+
+    bool ok;
+    if (header_len + len <= WS_SMALL_FRAME_SIZE) {
+        uint8_t frame[WS_SMALL_FRAME_SIZE];
+        memcpy(frame, header, header_len);
+        if (len > 0) memcpy(frame + header_len, data, len);
+        ok = netconn_send(ws->conn, frame, header_len + len) != SOCKET_ERROR;
+    } else {
+        ok = netconn_send(ws->conn, header, header_len) != SOCKET_ERROR &&
+             netconn_send(ws->conn, data, len) != SOCKET_ERROR;
+    }
+
+    ws->write_busy = false;
+    return ok;
+}
+
+bool comet_ws_send_text(CometWebSocket* ws, const char* text, size_t len) {
+    if (!ws || ws->close_sent) {
+        return false;
+    }
+    return ws_send_frame(ws, WS_OP_TEXT, text, len);
+}
+
+bool comet_ws_send_binary(CometWebSocket* ws, const void* data, size_t len) {
+    if (!ws || ws->close_sent) {
+        return false;
+    }
+    return ws_send_frame(ws, WS_OP_BINARY, data, len);
+}
+
+void comet_ws_close(CometWebSocket* ws, uint16_t code) {
+    if (!ws || ws->close_sent) {
+        return;
+    }
+
+    uint8_t payload[2] = {(uint8_t)(code >> 8), (uint8_t)code};
+    ws->close_sent = true;
+    ws_send_frame(ws, WS_OP_CLOSE, payload, sizeof(payload));
+}
+
+typedef enum {
+    WS_READ_OK,
+    WS_READ_TIMEOUT,
+    WS_READ_CLOSED,
+} WsReadResult;
+
+// Read exactly len bytes, serving them from the read buffer first.
+static WsReadResult ws_read_exact(CometWebSocket* ws, uint8_t* out, size_t len) {
+    while (len > 0) {
+        if (ws->read_pos == ws->read_len) {
+            // large payloads go straight to their destination
+            uint8_t* target = len >= WS_READ_BUFFER_SIZE ? out : ws->read_buf;
+            size_t target_len = len >= WS_READ_BUFFER_SIZE ? len : WS_READ_BUFFER_SIZE;
+
+            ByteCount n = netconn_recv(ws->conn, target, target_len);
+            if (n == SOCKET_ERROR && GET_ERROR_CODE() == COMET_ERROR_TIMEOUT) {
+                return WS_READ_TIMEOUT;
+            }
+            if (n <= 0) {
+                return WS_READ_CLOSED;
+            }
+
+            if (target == out) {
+                out += n;
+                len -= n;
+                continue;
+            }
+            ws->read_pos = 0;
+            ws->read_len = n;
+        }
+
+        size_t available = ws->read_len - ws->read_pos;
+        size_t n = available < len ? available : len;
+        memcpy(out, ws->read_buf + ws->read_pos, n);
+        ws->read_pos += n;
+        out += n;
+        len -= n;
+    }
+
+    return WS_READ_OK;
+}
+
+static void ws_session_loop(CometWebSocket* ws, const CometWebSocketConfig* config) {
+    uint8_t* message = NULL;
+    size_t message_len = 0;
+    uint8_t message_opcode = 0;
+    bool ping_sent = false;
+    uint16_t close_code = COMET_WS_CLOSE_ABNORMAL;
+
+    for (;;) {
+        uint8_t header[2];
+        WsReadResult rr = ws_read_exact(ws, header, 2);
+        if (rr == WS_READ_TIMEOUT && !ping_sent && !ws->close_sent) {
+            // quiet connection - check client is still there
+            ping_sent = ws_send_frame(ws, WS_OP_PING, NULL, 0);
+            if (ping_sent) continue;
+        }
+        if (rr != WS_READ_OK) {
+            break;
+        }
+        ping_sent = false;
+
+        bool fin = header[0] & 0x80;
+        uint8_t opcode = header[0] & 0x0F;
+        bool masked = header[1] & 0x80;
+        uint64_t payload_len = header[1] & 0x7F;
+
+        if ((header[0] & 0x70) != 0 || !masked) {
+            comet_ws_close(ws, COMET_WS_CLOSE_PROTOCOL_ERROR);
+            break;
+        }
+
+        if (payload_len >= 126) {
+            uint8_t ext[8];
+            size_t ext_len = payload_len == 126 ? 2 : 8;
+            if (ws_read_exact(ws, ext, ext_len) != WS_READ_OK) break;
+            payload_len = 0;
+            for (size_t i = 0; i < ext_len; i++) {
+                payload_len = (payload_len << 8) | ext[i];
+            }
+            // most significant bit of 64-bit length must be 0 (RFC 6455, 5.2)
+            if (payload_len >> 63) {
+                comet_ws_close(ws, COMET_WS_CLOSE_PROTOCOL_ERROR);
+                break;
+            }
+        }
+
+        uint8_t mask[4];
+        if (ws_read_exact(ws, mask, 4) != WS_READ_OK) break;
+
+        bool is_control = opcode & 0x08;
+        if (is_control) {
+            if (!fin || payload_len > 125) {
+                comet_ws_close(ws, COMET_WS_CLOSE_PROTOCOL_ERROR);
+                break;
+            }
+
+            uint8_t control[125];
+            if (ws_read_exact(ws, control, (size_t)payload_len) != WS_READ_OK) break;
+            ws_unmask(control, (size_t)payload_len, mask);
+
+            if (opcode == WS_OP_PING) {
+                ws_send_frame(ws, WS_OP_PONG, control, (size_t)payload_len);
+            } else if (opcode == WS_OP_CLOSE) {
+                close_code = payload_len >= 2 ? (uint16_t)(control[0] << 8 | control[1]) : COMET_WS_CLOSE_NO_STATUS;
+                // echo the close unless it is the reply to ours
+                comet_ws_close(ws, close_code == COMET_WS_CLOSE_NO_STATUS ? COMET_WS_CLOSE_NORMAL : close_code);
+                break;
+            } else if (opcode != WS_OP_PONG) {
+                comet_ws_close(ws, COMET_WS_CLOSE_PROTOCOL_ERROR);
+                break;
+            }
+            continue;
+        }
+
+        if ((opcode == WS_OP_CONTINUATION) != (message_opcode != 0) ||
+            (opcode != WS_OP_CONTINUATION && opcode != WS_OP_TEXT && opcode != WS_OP_BINARY)) {
+            comet_ws_close(ws, COMET_WS_CLOSE_PROTOCOL_ERROR);
+            break;
+        }
+        // message_len never exceeds max_message_size, so this can't wrap around the way a sum could
+        if (payload_len > config->max_message_size - message_len) {
+            comet_ws_close(ws, COMET_WS_CLOSE_TOO_BIG);
+            break;
+        }
+
+        uint8_t* new_message = realloc(message, message_len + (size_t)payload_len + 1);
+        if (new_message == NULL) {
+            log_message(LOG_ERROR, "Failed to allocate memory for WebSocket message");
+            comet_ws_close(ws, COMET_WS_CLOSE_TOO_BIG);
+            break;
+        }
+        message = new_message;
+
+        if (ws_read_exact(ws, message + message_len, (size_t)payload_len) != WS_READ_OK) break;
+        ws_unmask(message + message_len, (size_t)payload_len, mask);
+        message_len += (size_t)payload_len;
+        if (opcode != WS_OP_CONTINUATION) {
+            message_opcode = opcode;
+        }
+
+        if (fin) {
+            // fragments may split a character, so only the whole message can be checked
+            if (message_opcode == WS_OP_TEXT && !ws_is_valid_utf8(message, message_len)) {
+                comet_ws_close(ws, COMET_WS_CLOSE_INVALID_DATA);
+                break;
+            }
+            // null-terminate, so text messages can be used as C strings
+            message[message_len] = '\0';
+            if (config->on_message && !ws->close_sent) {
+                config->on_message(ws, message, message_len, message_opcode == WS_OP_TEXT);
+            }
+            message_len = 0;
+            message_opcode = 0;
+        }
+    }
+
+    free(message);
+    ws->close_code = close_code;
+}
+
+void ws_run_session(const CometWebSocketConfig* config, NetConnection* conn, void* state,
+                    const char* head, size_t head_len, const char* extra, size_t extra_len) {
+    if (!ws_handshake(conn, head, head_len)) {
+        return;
+    }
+
+    CometWebSocket ws = {0};
+    ws.conn = conn;
+    ws.state = state;
+    ws.read_buf = malloc(extra_len > WS_READ_BUFFER_SIZE ? extra_len : WS_READ_BUFFER_SIZE);
+    if (ws.read_buf == NULL) {
+        log_message(LOG_ERROR, "Failed to allocate memory for WebSocket read buffer");
+        return;
+    }
+    memcpy(ws.read_buf, extra, extra_len);
+    ws.read_len = extra_len;
+
+    int saved_recv_timeout = conn->recv_timeout_ms;
+    conn->recv_timeout_ms = config->idle_timeout_ms > 0 ? config->idle_timeout_ms : -1;
+
+    if (config->on_open) {
+        config->on_open(&ws);
+    }
+
+    ws_session_loop(&ws, config);
+
+    if (config->on_close) {
+        config->on_close(&ws, ws.close_code);
+    }
+
+    conn->recv_timeout_ms = saved_recv_timeout;
+    free(ws.read_buf);
+}
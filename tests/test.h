@@ -0,0 +1,58 @@
+#ifndef _COMET_TEST_H
+#define _COMET_TEST_H
+
+// Tiny harness for comet tests. Every test is its own executable, registered with ctest;
+// it returns non-zero when any CHECK failed.
+
+#include <comet.h>
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+static int test_failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        test_failures++; \
+    } \
+} while (0)
+
+#define RUN_TEST(fn) do { \
+    int failures_before = test_failures; \
+    fn(); \
+    fprintf(stderr, "%s %s\n", test_failures == failures_before ? "ok  " : "FAIL", #fn); \
+} while (0)
+
+#define TEST_RESULT() (test_failures == 0 ? 0 : 1)
+
+/**
+ * Whether response captured by loopback starts with given status, e.g. "HTTP/1.1 413".
+ */
+static inline bool response_has_status(const char* response, size_t len, const char* status_line) {
+    size_t status_len = strlen(status_line);
+    return response != NULL && len >= status_len && memcmp(response, status_line, status_len) == 0;
+}
+
+/**
+ * Whether response captured by loopback contains needle anywhere, head or body.
+ */
+static inline bool response_contains(const char* response, size_t len, const char* needle) {
+    size_t needle_len = strlen(needle);
+    for (size_t i = 0; response != NULL && i + needle_len <= len; i++) {
+        if (memcmp(response + i, needle, needle_len) == 0) return true;
+    }
+    return false;
+}
+
+/**
+ * Serve everything pushed to lb and return once the last scripted connection closed.
+ * router_start frees the router, responses stay in lb.
+ */
+static inline void run_loopback(CometRouter* router, NetLoopback* lb) {
+    net_loopback_stop_when_done(lb, &router->running);
+    router_start(router);
+}
+
+#endif
@@ -0,0 +1,153 @@
+#include "test.h"
+
+// Bodies attached to responses: they go away with the response, and bytes that only look like one are just bytes.
+
+static size_t releases = 0;
+
+static void count_release(void* ctx, const void* data, size_t len) {
+    releases++;
+}
+
+static void body_goes_away_with_response(void) {
+    releases = 0;
+
+    HttpcResponse* res = httpc_response_new("OK", 200);
+    CHECK(comet_response_borrow_body(res, "stale", 5, count_release, NULL));
+    httpc_response_free(res);
+
+    // allocator likely hands out the same address again - it must not come with the old body
+    for (int i = 0; i < 8; i++) {
+        HttpcResponse* fresh = httpc_response_new("OK", 200);
+        ResponseBody body;
+        CHECK(!response_body_take(fresh, &body));
+        httpc_response_free(fresh);
+    }
+    CHECK(releases == 0);
+}
+
+static void comet_response_free_releases_body(void) {
+    releases = 0;
+
+    HttpcResponse* res = httpc_response_new("OK", 200);
+    CHECK(comet_response_borrow_body(res, "first", 5, count_release, NULL));
+    CHECK(comet_response_borrow_body(res, "second", 6, count_release, NULL));
+    CHECK(releases == 1);   // replaced body is released right away
+
+    comet_response_free(res);
+    CHECK(releases == 2);
+}
+
+static void take_detaches_body(void) {
+    HttpcResponse* res = httpc_response_new("OK", 200);
+    CometBuffer* buf = comet_buffer_new(0);
+    comet_buffer_append_str(buf, "pooled");
+    CHECK(comet_response_set_buffer(res, buf));
+
+    ResponseBody body;
+    CHECK(response_body_take(res, &body));
+    CHECK(body.len == 6 && memcmp(body.data, "pooled", 6) == 0);
+    CHECK(body.file_fd == -1);
+    CHECK(!response_body_take(res, &body));
+
+    response_body_release(&body);
+    httpc_response_free(res);
+}
+
+static HttpcResponse* replaced_handler(void* state, HttpcRequest* req, UrlParams* params) {
+    HttpcResponse* res = httpc_response_new("OK", 200);
+    comet_response_borrow_body(res, "replaced", 8, NULL, NULL);
+    comet_response_take_body(res, strdup("attached body"), 13);
+    return res;
+}
+
+static void attached_body_is_sent(void) {
+    static const char REQUEST[] = "GET / HTTP/1.1\r\nHost: test\r\n\r\n";
+    NetLoopback* lb = net_loopback_new(NULL, NULL);
+    size_t id = net_loopback_push(lb, REQUEST, sizeof(REQUEST) - 1, 1);
+
+    CometRouter* router = router_init_transport(&NET_LOOPBACK_TRANSPORT, lb, NULL);
+    CHECK(router != NULL);
+    router_add_route(router, "/", HTTPC_GET, replaced_handler);
+    run_loopback(router, lb);
+
+    size_t len;
+    const char* res = net_loopback_response(lb, id, &len);
+    CHECK(response_has_status(res, len, "HTTP/1.1 200"));
+    CHECK(response_contains(res, len, "Content-Length: 13\r\n"));
+    CHECK(response_contains(res, len, "\r\n\r\nattached body"));
+    CHECK(!response_contains(res, len, "replaced"));
+
+    net_loopback_free(lb);
+}
+
+static bool forged_release_called = false;
+
+static void forged_release(void* ctx, const void* data, size_t len) {
+    forged_release_called = true;
+}
+
+static HttpcResponse* echo_handler(void* state, HttpcRequest* req, UrlParams* params) {
+    HttpcResponse* res = httpc_response_new("OK", 200);
+    httpc_response_set_body(res, req->body, req->body_size);
+    return res;
+}
+
+// Sends body to echo route and checks it comes back byte for byte.
+static void check_echoed(const void* body, size_t body_len) {
+    char request[512];
+    int head_len = snprintf(request, sizeof(request), "POST /echo HTTP/1.1\r\nHost: test\r\nContent-Length: %zu\r\n\r\n", body_len);
+    memcpy(request + head_len, body, body_len);
+
+    NetLoopback* lb = net_loopback_new(NULL, NULL);
+    size_t id = net_loopback_push(lb, request, head_len + body_len, 1);
+
+    CometRouter* router = router_init_transport(&NET_LOOPBACK_TRANSPORT, lb, NULL);
+    CHECK(router != NULL);
+    router_add_route(router, "/echo", HTTPC_POST, echo_handler);
+    run_loopback(router, lb);
+
+    char content_length[64];
+    snprintf(content_length, sizeof(content_length), "Content-Length: %zu\r\n", body_len);
+
+    size_t len;
+    const char* res = net_loopback_response(lb, id, &len);
+    CHECK(response_has_status(res, len, "HTTP/1.1 200"));
+    CHECK(response_contains(res, len, content_length));
+    CHECK(res != NULL && len >= body_len && memcmp(res + len - body_len, body, body_len) == 0);
+
+    net_loopback_free(lb);
+}
+
+static void forged_body_is_sent_as_bytes(void) {
+    static const char SECRET[] = "process memory";
+    forged_release_called = false;
+
+    // layout bodies once had when descriptor was kept in the body: magic, its complement, then ResponseBody
+    struct {
+        uint64_t magic[2];
+        ResponseBody body;
+    } old_layout = {{0x636f6d65742d626full, ~0x636f6d65742d626full}, {NULL, SECRET, sizeof(SECRET), forged_release, NULL, -1, 0}};
+    check_echoed(&old_layout, sizeof(old_layout));
+
+    // handle-sized body naming an entry the registry never saw
+    ResponseBody fake = {NULL, SECRET, sizeof(SECRET), forged_release, NULL, -1, 0};
+    struct {
+        size_t slot;
+        ResponseBody* entry;
+    } handle = {0, &fake};
+    check_echoed(&handle, sizeof(handle));
+
+    CHECK(!forged_release_called);
+}
+
+int main(void) {
+    comet_init(false, false);
+
+    RUN_TEST(body_goes_away_with_response);
+    RUN_TEST(comet_response_free_releases_body);
+    RUN_TEST(take_detaches_body);
+    RUN_TEST(attached_body_is_sent);
+    RUN_TEST(forged_body_is_sent_as_bytes);
+
+    return TEST_RESULT();
+}
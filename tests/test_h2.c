@@ -0,0 +1,499 @@
+#include "test.h"
+#include "../src/include/hpack.h"
+
+#include <pthread.h>
+#include <stdint.h>
+
+// HTTP/2 over loopback: client preface, SETTINGS exchange, flow control in both directions and malformed requests.
+// Client frames are handcrafted, header blocks use only HPACK static table entries and literals.
+
+#define FRAME_DATA 0x0
+#define FRAME_HEADERS 0x1
+#define FRAME_RST_STREAM 0x3
+#define FRAME_SETTINGS 0x4
+#define FRAME_PING 0x6
+#define FRAME_GOAWAY 0x7
+#define FRAME_WINDOW_UPDATE 0x8
+
+#define FLAG_END_STREAM 0x1
+#define FLAG_ACK 0x1
+#define FLAG_END_HEADERS 0x4
+
+#define SETTINGS_INITIAL_WINDOW_SIZE 0x4
+
+#define BIG_BODY_LEN 100
+
+static const char PREFACE[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+static size_t hello_calls;
+
+static HttpcResponse* hello_handler(void* state, HttpcRequest* req, UrlParams* params) {
+    hello_calls++;
+    HttpcResponse* res = httpc_response_new("OK", 200);
+    httpc_response_set_body(res, "hello", 5);
+    return res;
+}
+
+static HttpcResponse* big_handler(void* state, HttpcRequest* req, UrlParams* params) {
+    char body[BIG_BODY_LEN];
+    memset(body, 'b', sizeof(body));
+    HttpcResponse* res = httpc_response_new("OK", 200);
+    httpc_response_set_body(res, body, sizeof(body));
+    return res;
+}
+
+static HttpcResponse* upload_handler(void* state, HttpcRequest* req, UrlParams* params) {
+    HttpcResponse* res = httpc_response_new("OK", 200);
+    CometBuffer* body = comet_buffer_new(0);
+    comet_buffer_appendf(body, "got %zu", req->body_size);
+    comet_response_set_buffer(res, body);
+    return res;
+}
+
+typedef struct {
+    uint8_t data[8192];
+    size_t len;
+} Script;
+
+static void put_u32(uint8_t* p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static uint32_t get_u32(const uint8_t* p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static void script_init(Script* script) {
+    memcpy(script->data, PREFACE, sizeof(PREFACE) - 1);
+    script->len = sizeof(PREFACE) - 1;
+}
+
+static void script_frame(Script* script, uint8_t type, uint8_t flags, uint32_t stream_id, const void* payload, size_t len) {
+    uint8_t* p = script->data + script->len;
+    p[0] = len >> 16;
+    p[1] = len >> 8;
+    p[2] = len;
+    p[3] = type;
+    p[4] = flags;
+    put_u32(p + 5, stream_id);
+    if (len > 0) memcpy(p + 9, payload, len);
+    script->len += 9 + len;
+}
+
+static void script_settings(Script* script, uint16_t id, uint32_t value) {
+    uint8_t payload[6] = {id >> 8, id & 0xff};
+    put_u32(payload + 2, value);
+    script_frame(script, FRAME_SETTINGS, 0, 0, payload, sizeof(payload));
+}
+
+static void script_window_update(Script* script, uint32_t stream_id, uint32_t increment) {
+    uint8_t payload[4];
+    put_u32(payload, increment);
+    script_frame(script, FRAME_WINDOW_UPDATE, 0, stream_id, payload, sizeof(payload));
+}
+
+// literal header field without indexing, new name - name and value as given, no Huffman
+static size_t put_literal(uint8_t* block, const char* name, const char* value) {
+    size_t name_len = strlen(name);
+    size_t value_len = strlen(value);
+    size_t len = 0;
+
+    block[len++] = 0x00;
+    block[len++] = (uint8_t)name_len;
+    memcpy(block + len, name, name_len);
+    len += name_len;
+    block[len++] = (uint8_t)value_len;
+    memcpy(block + len, value, value_len);
+    return len + value_len;
+}
+
+// request headers: :scheme http, :authority test and given method and path, as literals where not in static table,
+// then extra_name: extra_value if extra_name isn't NULL
+static void script_request_with(Script* script, uint32_t stream_id, const char* method, const char* path,
+                                const char* extra_name, const char* extra_value, bool end_stream) {
+    uint8_t block[256];
+    size_t len = 0;
+    size_t method_len = strlen(method);
+    size_t path_len = strlen(path);
+
+    block[len++] = 0x00 | 2;    // literal without indexing, :method name from static table
+    block[len++] = (uint8_t)method_len;
+    memcpy(block + len, method, method_len);
+    len += method_len;
+    block[len++] = 0x00 | 4;    // :path
+    block[len++] = (uint8_t)path_len;
+    memcpy(block + len, path, path_len);
+    len += path_len;
+    block[len++] = 0x80 | 6;    // :scheme http
+    block[len++] = 0x00 | 1;    // :authority
+    block[len++] = 4;
+    memcpy(block + len, "test", 4);
+    len += 4;
+    if (extra_name) {
+        len += put_literal(block + len, extra_name, extra_value);
+    }
+
+    script_frame(script, FRAME_HEADERS, FLAG_END_HEADERS | (end_stream ? FLAG_END_STREAM : 0), stream_id, block, len);
+}
+
+static void script_request(Script* script, uint32_t stream_id, const char* method, const char* path, bool end_stream) {
+    script_request_with(script, stream_id, method, path, NULL, NULL, end_stream);
+}
+
+typedef struct {
+    uint8_t type;
+    uint8_t flags;
+    uint32_t stream_id;
+    const uint8_t* payload;
+    size_t len;
+} Frame;
+
+// Splits what server sent into frames, returns how many fit in frames.
+static size_t parse_frames(const char* response, size_t len, Frame* frames, size_t max_frames) {
+    const uint8_t* p = (const uint8_t*)response;
+    size_t count = 0;
+    size_t pos = 0;
+
+    while (response != NULL && pos + 9 <= len && count < max_frames) {
+        size_t frame_len = (size_t)p[pos] << 16 | (size_t)p[pos + 1] << 8 | p[pos + 2];
+        if (pos + 9 + frame_len > len) break;
+
+        frames[count].type = p[pos + 3];
+        frames[count].flags = p[pos + 4];
+        frames[count].stream_id = get_u32(p + pos + 5) & 0x7fffffff;
+        frames[count].payload = p + pos + 9;
+        frames[count].len = frame_len;
+        count++;
+        pos += 9 + frame_len;
+    }
+    return count;
+}
+
+static const Frame* find_frame(const Frame* frames, size_t count, uint8_t type, uint32_t stream_id) {
+    for (size_t i = 0; i < count; i++) {
+        if (frames[i].type == type && frames[i].stream_id == stream_id) return &frames[i];
+    }
+    return NULL;
+}
+
+// DATA bytes server sent on stream, and whether the last DATA frame ended it
+static size_t data_sent(const Frame* frames, size_t count, uint32_t stream_id, bool* ended) {
+    size_t total = 0;
+    *ended = false;
+    for (size_t i = 0; i < count; i++) {
+        if (frames[i].type == FRAME_DATA && frames[i].stream_id == stream_id) {
+            total += frames[i].len;
+            *ended = frames[i].flags & FLAG_END_STREAM;
+        }
+    }
+    return total;
+}
+
+// Runs script against an h2 router and returns what server sent back, kept in lb.
+static const char* h2_run(NetLoopback* lb, const Script* script, CometH2Config config, size_t* len) {
+    size_t id = net_loopback_push(lb, script->data, script->len, 1);
+
+    CometRouter* router = router_init_transport(&NET_LOOPBACK_TRANSPORT, lb, NULL);
+    CHECK(router != NULL);
+    CHECK(router_enable_h2(router, config));
+    router_add_route(router, "/hello", HTTPC_GET, hello_handler);
+    router_add_route(router, "/big", HTTPC_GET, big_handler);
+    router_add_route(router, "/upload", HTTPC_POST, upload_handler);
+    run_loopback(router, lb);
+
+    return net_loopback_response(lb, id, len);
+}
+
+static void settings_are_exchanged(void) {
+    static const uint8_t PING[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+    Script script;
+    script_init(&script);
+    script_frame(&script, FRAME_SETTINGS, 0, 0, NULL, 0);
+    script_frame(&script, FRAME_PING, 0, 0, PING, sizeof(PING));
+
+    NetLoopback* lb = net_loopback_new(NULL, NULL);
+    size_t len;
+    const char* res = h2_run(lb, &script, COMET_H2_DEFAULT_CONFIG, &len);
+
+    Frame frames[16];
+    size_t count = parse_frames(res, len, frames, 16);
+    CHECK(count >= 4);
+
+    // server speaks first with its own SETTINGS, advertising its receive window
+    CHECK(count > 0 && frames[0].type == FRAME_SETTINGS && frames[0].flags == 0 && frames[0].stream_id == 0);
+    bool window_advertised = false;
+    for (size_t i = 0; count > 0 && i + 6 <= frames[0].len; i += 6) {
+        uint16_t id = (uint16_t)(frames[0].payload[i] << 8 | frames[0].payload[i + 1]);
+        if (id == SETTINGS_INITIAL_WINDOW_SIZE) {
+            window_advertised = get_u32(frames[0].payload + i + 2) == COMET_H2_DEFAULT_CONFIG.initial_window_size;
+        }
+    }
+    CHECK(window_advertised);
+
+    // connection window can only grow past 65535 with WINDOW_UPDATE
+    const Frame* update = find_frame(frames, count, FRAME_WINDOW_UPDATE, 0);
+    CHECK(update != NULL && update->len == 4 && get_u32(update->payload) == COMET_H2_DEFAULT_CONFIG.initial_window_size - 65535);
+
+    bool acked = false;
+    bool ponged = false;
+    for (size_t i = 1; i < count; i++) {
+        if (frames[i].type == FRAME_SETTINGS && frames[i].flags == FLAG_ACK && frames[i].len == 0) acked = true;
+        if (frames[i].type == FRAME_PING && frames[i].flags == FLAG_ACK) ponged = memcmp(frames[i].payload, PING, 8) == 0;
+    }
+    CHECK(acked);
+    CHECK(ponged);
+
+    const Frame* goaway = find_frame(frames, count, FRAME_GOAWAY, 0);
+    CHECK(goaway != NULL && goaway->len == 8 && get_u32(goaway->payload + 4) == 0);
+
+    net_loopback_free(lb);
+}
+
+static void request_is_answered(void) {
+    Script script;
+    script_init(&script);
+    script_frame(&script, FRAME_SETTINGS, 0, 0, NULL, 0);
+    script_request(&script, 1, "GET", "/hello", true);
+
+    NetLoopback* lb = net_loopback_new(NULL, NULL);
+    size_t len;
+    const char* res = h2_run(lb, &script, COMET_H2_DEFAULT_CONFIG, &len);
+
+    Frame frames[16];
+    size_t count = parse_frames(res, len, frames, 16);
+    const Frame* headers = find_frame(frames, count, FRAME_HEADERS, 1);
+    CHECK(headers != NULL && headers->len > 0 && headers->payload[0] == 0x88);   // :status 200 from static table
+
+    const Frame* data = find_frame(frames, count, FRAME_DATA, 1);
+    CHECK(data != NULL && data->len == 5 && memcmp(data->payload, "hello", 5) == 0);
+    CHECK(data != NULL && (data->flags & FLAG_END_STREAM));
+
+    net_loopback_free(lb);
+}
+
+static void data_stays_within_send_window(void) {
+    // client lets server send 16 bytes per stream and never opens the window further
+    Script script;
+    script_init(&script);
+    script_settings(&script, SETTINGS_INITIAL_WINDOW_SIZE, 16);
+    script_request(&script, 1, "GET", "/big", true);
+
+    NetLoopback* lb = net_loopback_new(NULL, NULL);
+    size_t len;
+    const char* res = h2_run(lb, &script, COMET_H2_DEFAULT_CONFIG, &len);
+
+    Frame frames[16];
+    size_t count = parse_frames(res, len, frames, 16);
+    bool ended;
+    CHECK(data_sent(frames, count, 1, &ended) == 16);
+    CHECK(!ended);
+
+    const Frame* reset = find_frame(frames, count, FRAME_RST_STREAM, 1);
+    CHECK(reset != NULL && reset->len == 4 && get_u32(reset->payload) == 0x8);     // CANCEL
+
+    net_loopback_free(lb);
+}
+
+static void window_update_releases_data(void) {
+    Script script;
+    script_init(&script);
+    script_settings(&script, SETTINGS_INITIAL_WINDOW_SIZE, 16);
+    script_request(&script, 1, "GET", "/big", true);
+    script_window_update(&script, 1, BIG_BODY_LEN - 16);
+
+    NetLoopback* lb = net_loopback_new(NULL, NULL);
+    size_t len;
+    const char* res = h2_run(lb, &script, COMET_H2_DEFAULT_CONFIG, &len);
+
+    Frame frames[16];
+    size_t count = parse_frames(res, len, frames, 16);
+    bool ended;
+    CHECK(data_sent(frames, count, 1, &ended) == BIG_BODY_LEN);
+    CHECK(ended);
+    CHECK(find_frame(frames, count, FRAME_RST_STREAM, 1) == NULL);
+
+    net_loopback_free(lb);
+}
+
+static void request_body_opens_receive_window(void) {
+    uint8_t chunk[600];
+    memset(chunk, 'u', sizeof(chunk));
+
+    CometH2Config config = COMET_H2_DEFAULT_CONFIG;
+    config.initial_window_size = 1024;
+
+    // more than half of the window used - server gives it back before the body is complete
+    Script script;
+    script_init(&script);
+    script_frame(&script, FRAME_SETTINGS, 0, 0, NULL, 0);
+    script_request(&script, 1, "POST", "/upload", false);
+    script_frame(&script, FRAME_DATA, 0, 1, chunk, sizeof(chunk));
+    script_frame(&script, FRAME_DATA, FLAG_END_STREAM, 1, chunk, 10);
+
+    NetLoopback* lb = net_loopback_new(NULL, NULL);
+    size_t len;
+    const char* res = h2_run(lb, &script, config, &len);
+
+    Frame frames[16];
+    size_t count = parse_frames(res, len, frames, 16);
+    const Frame* update = find_frame(frames, count, FRAME_WINDOW_UPDATE, 1);
+    CHECK(update != NULL && update->len == 4 && get_u32(update->payload) == sizeof(chunk));
+
+    const Frame* data = find_frame(frames, count, FRAME_DATA, 1);
+    CHECK(data != NULL && data->len == 7 && memcmp(data->payload, "got 610", 7) == 0);
+
+    net_loopback_free(lb);
+}
+
+static void request_body_over_window_is_refused(void) {
+    uint8_t chunk[2048];
+    memset(chunk, 'u', sizeof(chunk));
+
+    CometH2Config config = COMET_H2_DEFAULT_CONFIG;
+    config.initial_window_size = 1024;
+
+    Script script;
+    script_init(&script);
+    script_frame(&script, FRAME_SETTINGS, 0, 0, NULL, 0);
+    script_request(&script, 1, "POST", "/upload", false);
+    script_frame(&script, FRAME_DATA, FLAG_END_STREAM, 1, chunk, sizeof(chunk));
+
+    NetLoopback* lb = net_loopback_new(NULL, NULL);
+    size_t len;
+    const char* res = h2_run(lb, &script, config, &len);
+
+    Frame frames[16];
+    size_t count = parse_frames(res, len, frames, 16);
+    const Frame* reset = find_frame(frames, count, FRAME_RST_STREAM, 1);
+    CHECK(reset != NULL && reset->len == 4 && get_u32(reset->payload) == 0x3);     // FLOW_CONTROL_ERROR
+    CHECK(find_frame(frames, count, FRAME_HEADERS, 1) == NULL);
+
+    net_loopback_free(lb);
+}
+
+// :status of the response on stream, 0 if there is none. Status codes here are all in HPACK static table.
+static int response_status(const Frame* frames, size_t count, uint32_t stream_id) {
+    const Frame* headers = find_frame(frames, count, FRAME_HEADERS, stream_id);
+    if (headers == NULL || headers->len == 0) return 0;
+    switch (headers->payload[0]) {
+        case 0x88: return 200;
+        case 0x8c: return 400;
+        default: return -1;
+    }
+}
+
+static void malformed_headers_are_refused(void) {
+    static const struct {
+        const char* method;
+        const char* path;
+        const char* name;
+        const char* value;
+    } CASES[] = {
+        {"GET", "/hello", "x-test", "a\r\nhost: evil"},        // CRLF in value would add a header
+        {"GET", "/hello", "x-test", "a\nb"},
+        {"GET", "/hello", "x-test", " padded"},
+        {"GET", "/hello", "x test", "a"},                        // not a token
+        {"GET", "/hello", "x:test", "a"},
+        {"GET", "/hello HTTP/1.1\r\nx-admin: 1\r\nx-pad: ", NULL, NULL},   // would rewrite request line
+        {"GET", "/hello x", NULL, NULL},
+        {"GET", "hello", NULL, NULL},                            // neither origin form nor *
+        {"GET /x", "/hello", NULL, NULL},
+    };
+
+    for (size_t i = 0; i < sizeof(CASES) / sizeof(CASES[0]); i++) {
+        Script script;
+        script_init(&script);
+        script_frame(&script, FRAME_SETTINGS, 0, 0, NULL, 0);
+        script_request_with(&script, 1, CASES[i].method, CASES[i].path, CASES[i].name, CASES[i].value, true);
+
+        hello_calls = 0;
+        NetLoopback* lb = net_loopback_new(NULL, NULL);
+        size_t len;
+        const char* res = h2_run(lb, &script, COMET_H2_DEFAULT_CONFIG, &len);
+
+        Frame frames[16];
+        size_t count = parse_frames(res, len, frames, 16);
+        if (response_status(frames, count, 1) != 400 || hello_calls != 0) {
+            fprintf(stderr, "case %zu was not refused\n", i);
+            CHECK(false);
+        }
+
+        net_loopback_free(lb);
+    }
+
+    // well-formed extra header still goes through
+    Script script;
+    script_init(&script);
+    script_frame(&script, FRAME_SETTINGS, 0, 0, NULL, 0);
+    script_request_with(&script, 1, "GET", "/hello?x=1", "x-test", "a b", true);
+
+    hello_calls = 0;
+    NetLoopback* lb = net_loopback_new(NULL, NULL);
+    size_t len;
+    const char* res = h2_run(lb, &script, COMET_H2_DEFAULT_CONFIG, &len);
+    Frame frames[16];
+    size_t count = parse_frames(res, len, frames, 16);
+    CHECK(response_status(frames, count, 1) == 200);
+    CHECK(hello_calls == 1);
+
+    net_loopback_free(lb);
+}
+
+typedef struct {
+    pthread_t thread;
+    bool decoded;
+    bool authority_ok;
+} HuffmanRun;
+
+static bool on_authority(void* ctx, const char* name, size_t name_len, const char* value, size_t value_len) {
+    HuffmanRun* run = ctx;
+    if (name_len == 10 && memcmp(name, ":authority", 10) == 0) {
+        run->authority_ok = value_len == 15 && memcmp(value, "www.example.com", 15) == 0;
+    }
+    return true;
+}
+
+static void* huffman_decode_thread(void* arg) {
+    // RFC 7541 C.4.1, :authority value is Huffman coded
+    static const uint8_t BLOCK[] = {
+        0x82, 0x86, 0x84, 0x41, 0x8c, 0xf1, 0xe3, 0xc2, 0xe5, 0xf2, 0x3a, 0x6b, 0xa0, 0xab, 0x90, 0xf4, 0xff,
+    };
+    HuffmanRun* run = arg;
+    HpackDecoder decoder;
+    hpack_decoder_init(&decoder, HPACK_DEFAULT_TABLE_SIZE);
+    run->decoded = hpack_decode(&decoder, BLOCK, sizeof(BLOCK), on_authority, run);
+    hpack_decoder_free(&decoder);
+    return NULL;
+}
+
+static void huffman_is_decoded_on_many_threads(void) {
+    // must be the first Huffman decoding in the process - decoding tree is built on first use
+    HuffmanRun runs[8] = {0};
+    for (size_t i = 0; i < 8; i++) {
+        CHECK(pthread_create(&runs[i].thread, NULL, huffman_decode_thread, &runs[i]) == 0);
+    }
+    for (size_t i = 0; i < 8; i++) {
+        pthread_join(runs[i].thread, NULL);
+        CHECK(runs[i].decoded);
+        CHECK(runs[i].authority_ok);
+    }
+}
+
+int main(void) {
+    comet_init(false, false);
+
+    RUN_TEST(huffman_is_decoded_on_many_threads);
+
+    RUN_TEST(settings_are_exchanged);
+    RUN_TEST(request_is_answered);
+    RUN_TEST(data_stays_within_send_window);
+    RUN_TEST(window_update_releases_data);
+    RUN_TEST(request_body_opens_receive_window);
+    RUN_TEST(request_body_over_window_is_refused);
+    RUN_TEST(malformed_headers_are_refused);
+
+    return TEST_RESULT();
+}
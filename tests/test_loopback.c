@@ -0,0 +1,73 @@
+#include "test.h"
+
+// Routing, middleware and partial reads end to end, with requests served from memory.
+
+static HttpcResponse* hello_handler(void* state, HttpcRequest* req, UrlParams* params) {
+    HttpcResponse* res = httpc_response_new("OK", 200);
+    comet_response_borrow_body(res, "Hello, world!", 13, NULL, NULL);
+    return res;
+}
+
+static HttpcResponse* user_handler(void* state, HttpcRequest* req, UrlParams* params) {
+    HttpcResponse* res = httpc_response_new("OK", 200);
+    CometBuffer* body = comet_buffer_new(0);
+    comet_buffer_appendf(body, "user %s", params->params[0].value);
+    comet_response_set_buffer(res, body);
+    return res;
+}
+
+static void routes(void) {
+    NetLoopback* lb = net_loopback_new(NULL, NULL);
+    size_t hello = net_loopback_push(lb, "GET / HTTP/1.1\r\nHost: test\r\n\r\n", 30, 1);
+    size_t user = net_loopback_push(lb, "GET /users/42 HTTP/1.1\r\nHost: test\r\n\r\n", 38, 1);
+    size_t missing = net_loopback_push(lb, "GET /nope HTTP/1.1\r\nHost: test\r\n\r\n", 34, 1);
+
+    CometRouter* router = router_init_transport(&NET_LOOPBACK_TRANSPORT, lb, NULL);
+    CHECK(router != NULL);
+    router_add_route(router, "/", HTTPC_GET, hello_handler);
+    router_add_route(router, "/users/{id}", HTTPC_GET, user_handler);
+    run_loopback(router, lb);
+
+    size_t len;
+    const char* res = net_loopback_response(lb, hello, &len);
+    CHECK(response_has_status(res, len, "HTTP/1.1 200"));
+    CHECK(response_contains(res, len, "Hello, world!"));
+
+    res = net_loopback_response(lb, user, &len);
+    CHECK(response_has_status(res, len, "HTTP/1.1 200"));
+    CHECK(response_contains(res, len, "user 42"));
+
+    res = net_loopback_response(lb, missing, &len);
+    CHECK(response_has_status(res, len, "HTTP/1.1 404"));
+
+    net_loopback_free(lb);
+}
+
+static void partial_reads(void) {
+    static const char REQUEST[] = "POST /users/7 HTTP/1.1\r\nHost: test\r\nContent-Length: 11\r\n\r\nhello world";
+
+    NetLoopback* lb = net_loopback_new(NULL, NULL);
+    net_loopback_set_read_size(lb, 3);
+    size_t id = net_loopback_push(lb, REQUEST, sizeof(REQUEST) - 1, 1);
+
+    CometRouter* router = router_init_transport(&NET_LOOPBACK_TRANSPORT, lb, NULL);
+    CHECK(router != NULL);
+    router_add_route(router, "/users/{id}", HTTPC_POST, user_handler);
+    run_loopback(router, lb);
+
+    size_t len;
+    const char* res = net_loopback_response(lb, id, &len);
+    CHECK(response_has_status(res, len, "HTTP/1.1 200"));
+    CHECK(response_contains(res, len, "user 7"));
+
+    net_loopback_free(lb);
+}
+
+int main(void) {
+    comet_init(false, false);
+
+    RUN_TEST(routes);
+    RUN_TEST(partial_reads);
+
+    return TEST_RESULT();
+}
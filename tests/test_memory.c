@@ -0,0 +1,129 @@
+#include "test.h"
+
+// Memory budgets over loopback: 413 over connection_budget, 503 over global_budget.
+
+static CometRouter* router;
+static size_t handled = 0;
+
+static HttpcResponse* ok_handler(void* state, HttpcRequest* req, UrlParams* params) {
+    handled++;
+    return httpc_response_new("OK", 200);
+}
+
+// reports rejections counted so far, connections are served in the order they were pushed
+static HttpcResponse* stats_handler(void* state, HttpcRequest* req, UrlParams* params) {
+    HttpcResponse* res = httpc_response_new("OK", 200);
+    CometBuffer* body = comet_buffer_new(0);
+    comet_buffer_appendf(body, "too large %llu, over budget %llu",
+                         (unsigned long long)router->memory.stats.rejected_too_large,
+                         (unsigned long long)router->memory.stats.rejected_over_budget);
+    comet_response_set_buffer(res, body);
+    return res;
+}
+
+static void start_router(NetLoopback* lb, CometMemoryConfig memory) {
+    router = router_init_transport(&NET_LOOPBACK_TRANSPORT, lb, NULL);
+    CHECK(router != NULL);
+    CHECK(router_set_memory_budget(router, memory));
+    router_add_route(router, "/upload", HTTPC_POST, ok_handler);
+    router_add_route(router, "/ok", HTTPC_GET, ok_handler);
+    router_add_route(router, "/stats", HTTPC_GET, stats_handler);
+}
+
+static void declared_body_over_budget_gets_413(void) {
+    // only the head is sent - 413 must come without waiting for the body
+    static const char UPLOAD[] = "POST /upload HTTP/1.1\r\nHost: test\r\nContent-Length: 100000\r\n\r\n";
+    static const char STATS[] = "GET /stats HTTP/1.1\r\nHost: test\r\nConnection: close\r\n\r\n";
+    NetLoopback* lb = net_loopback_new(NULL, NULL);
+    size_t upload = net_loopback_push(lb, UPLOAD, sizeof(UPLOAD) - 1, 1);
+    size_t stats = net_loopback_push(lb, STATS, sizeof(STATS) - 1, 1);
+
+    CometMemoryConfig memory = COMET_MEMORY_DEFAULT_CONFIG;
+    memory.connection_budget = 4096;
+    handled = 0;
+    start_router(lb, memory);
+    run_loopback(router, lb);
+
+    size_t len;
+    const char* res = net_loopback_response(lb, upload, &len);
+    CHECK(response_has_status(res, len, "HTTP/1.1 413"));
+    CHECK(handled == 0);
+
+    res = net_loopback_response(lb, stats, &len);
+    CHECK(response_has_status(res, len, "HTTP/1.1 200"));
+    CHECK(response_contains(res, len, "too large 1, over budget 0"));
+
+    net_loopback_free(lb);
+}
+
+static void head_over_budget_gets_413(void) {
+    char request[8192];
+    int len = snprintf(request, sizeof(request), "GET /ok HTTP/1.1\r\nHost: test\r\nX-Padding: %06000d\r\n\r\n", 0);
+    NetLoopback* lb = net_loopback_new(NULL, NULL);
+    size_t id = net_loopback_push(lb, request, (size_t)len, 1);
+
+    CometMemoryConfig memory = COMET_MEMORY_DEFAULT_CONFIG;
+    memory.connection_budget = 4096;
+    handled = 0;
+    start_router(lb, memory);
+    run_loopback(router, lb);
+
+    size_t res_len;
+    const char* res = net_loopback_response(lb, id, &res_len);
+    CHECK(response_has_status(res, res_len, "HTTP/1.1 413"));
+    CHECK(handled == 0);
+
+    net_loopback_free(lb);
+}
+
+static void body_within_budget_is_served(void) {
+    static const char UPLOAD[] = "POST /upload HTTP/1.1\r\nHost: test\r\nContent-Length: 5\r\nConnection: close\r\n\r\nhello";
+    NetLoopback* lb = net_loopback_new(NULL, NULL);
+    size_t id = net_loopback_push(lb, UPLOAD, sizeof(UPLOAD) - 1, 1);
+
+    CometMemoryConfig memory = COMET_MEMORY_DEFAULT_CONFIG;
+    memory.connection_budget = 4096;
+    memory.global_budget = 1024 * 1024;
+    handled = 0;
+    start_router(lb, memory);
+    run_loopback(router, lb);
+
+    size_t len;
+    const char* res = net_loopback_response(lb, id, &len);
+    CHECK(response_has_status(res, len, "HTTP/1.1 200"));
+    CHECK(handled == 1);
+
+    net_loopback_free(lb);
+}
+
+static void over_global_budget_gets_503(void) {
+    static const char REQUEST[] = "GET /ok HTTP/1.1\r\nHost: test\r\nConnection: close\r\n\r\n";
+    NetLoopback* lb = net_loopback_new(NULL, NULL);
+    size_t id = net_loopback_push(lb, REQUEST, sizeof(REQUEST) - 1, 1);
+
+    // less than one request buffer
+    CometMemoryConfig memory = COMET_MEMORY_DEFAULT_CONFIG;
+    memory.global_budget = 512;
+    handled = 0;
+    start_router(lb, memory);
+    run_loopback(router, lb);
+
+    size_t len;
+    const char* res = net_loopback_response(lb, id, &len);
+    CHECK(response_has_status(res, len, "HTTP/1.1 503"));
+    CHECK(response_contains(res, len, "Retry-After: 1"));
+    CHECK(handled == 0);
+
+    net_loopback_free(lb);
+}
+
+int main(void) {
+    comet_init(false, false);
+
+    RUN_TEST(declared_body_over_budget_gets_413);
+    RUN_TEST(head_over_budget_gets_413);
+    RUN_TEST(body_within_budget_is_served);
+    RUN_TEST(over_global_budget_gets_503);
+
+    return TEST_RESULT();
+}
@@ -0,0 +1,114 @@
+#include "test.h"
+
+// Offload pool: handlers on worker threads, and a pool that is stopped and started again.
+
+static HttpcResponse* offloaded_handler(void* state, HttpcRequest* req, UrlParams* params) {
+    comet_sleep(5);     // no fiber on the worker, blocks it
+
+    HttpcResponse* res = httpc_response_new("OK", 200);
+    CometBuffer* body = comet_buffer_new(0);
+    comet_buffer_appendf(body, "worked on %s", req->url);
+    comet_response_set_buffer(res, body);
+    return res;
+}
+
+static void handler_runs_on_pool(void) {
+    static const char REQUEST[] = "GET /work HTTP/1.1\r\nHost: test\r\nConnection: close\r\n\r\n";
+    NetLoopback* lb = net_loopback_new(NULL, NULL);
+    size_t first = net_loopback_push(lb, REQUEST, sizeof(REQUEST) - 1, 8);
+
+    CometRouter* router = router_init_transport(&NET_LOOPBACK_TRANSPORT, lb, NULL);
+    CHECK(router != NULL);
+    CometOffloadConfig offload = COMET_OFFLOAD_DEFAULT_CONFIG;
+    offload.threads = 2;
+    CHECK(router_enable_offload(router, offload));
+    int route = router_add_route(router, "/work", HTTPC_GET, offloaded_handler);
+    CHECK(router_set_route_offload(router, route, true));
+    run_loopback(router, lb);
+
+    for (size_t i = 0; i < 8; i++) {
+        size_t len;
+        const char* res = net_loopback_response(lb, first + i, &len);
+        CHECK(response_has_status(res, len, "HTTP/1.1 200"));
+        CHECK(response_contains(res, len, "worked on /work"));
+    }
+
+    net_loopback_free(lb);
+}
+
+typedef struct {
+    CometOffloadPool* pool;
+    size_t remaining;
+    size_t done;
+    size_t rejected;
+    bool running;
+} JobRun;
+
+static void count_job(void* arg) {
+    (void)arg;
+}
+
+static void job_fiber(void* arg) {
+    JobRun* run = arg;
+    CometOffloadStatus status = comet_offload_run(run->pool, count_job, NULL);
+    if (status == COMET_OFFLOAD_DONE) run->done++;
+    if (status == COMET_OFFLOAD_REJECTED) run->rejected++;
+    if (--run->remaining == 0) run->running = false;
+}
+
+static void serve_fiber(void* arg) {
+    JobRun* run = arg;
+    comet_offload_serve(run->pool, &run->running);
+}
+
+// offload jobs from fibers, the way router does it, and wait for all of them
+static JobRun run_jobs(CometOffloadPool* pool, size_t jobs) {
+    JobRun run = {pool, jobs, 0, 0, true};
+
+    CHECK(fiber_scheduler_init(COMET_FIBER_DEFAULT_CONFIG));
+    CHECK(fiber_spawn(serve_fiber, &run));
+    for (size_t i = 0; i < jobs; i++) {
+        CHECK(fiber_spawn(job_fiber, &run));
+    }
+    while (fiber_active_count() > 0) {
+        fiber_scheduler_run_once(10);
+    }
+    fiber_scheduler_deinit();
+
+    return run;
+}
+
+static void pool_restarts(void) {
+    CometOffloadConfig config = COMET_OFFLOAD_DEFAULT_CONFIG;
+    config.threads = 2;
+    CometOffloadPool* pool = comet_offload_pool_new(config);
+    CHECK(pool != NULL);
+
+    JobRun run = run_jobs(pool, 4);
+    CHECK(run.done == 4);
+
+    comet_offload_pool_stop(pool);
+    run = run_jobs(pool, 2);
+    CHECK(run.rejected == 2);
+
+    CHECK(comet_offload_pool_start(pool));
+    CHECK(comet_offload_pool_start(pool));     // already running
+    run = run_jobs(pool, 4);
+    CHECK(run.done == 4);
+
+    CometOffloadStats stats = comet_offload_stats(pool);
+    CHECK(stats.threads == 2);
+    CHECK(stats.completed == 8);
+    CHECK(stats.queued == 0);
+
+    comet_offload_pool_free(pool);
+}
+
+int main(void) {
+    comet_init(false, false);
+
+    RUN_TEST(handler_runs_on_pool);
+    RUN_TEST(pool_restarts);
+
+    return TEST_RESULT();
+}
@@ -0,0 +1,325 @@
+#define _GNU_SOURCE // strcasestr
+
+#include "test.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Proxy routes against a scripted backend on a local socket: interim responses, X-Forwarded-For,
+// hop-by-hop headers, request bodies that can't be forwarded, and which failures are retried on a fresh connection.
+
+typedef enum {
+    BACKEND_RESPOND,    // answer with response, close if it says "Connection: close"
+    BACKEND_CLOSE,      // read request, close without answering
+} BackendAction;
+
+typedef struct {
+    BackendAction action;
+    const char* response;
+} BackendStep;
+
+typedef struct {
+    int listen_fd;
+    uint16_t port;
+    const BackendStep* steps;
+    size_t num_steps;
+    size_t connections;
+    size_t requests;
+    char last_head[4096];
+    pthread_t thread;
+} Backend;
+
+static const char KEEP_ALIVE_OK[] = "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok";
+
+// Reads one request, head and Content-Length body. Returns false if client closed.
+static bool backend_read_request(Backend* backend, int fd) {
+    size_t len = 0;
+    char* head_end = NULL;
+
+    while (head_end == NULL) {
+        if (len == sizeof(backend->last_head) - 1) return false;
+        ssize_t n = recv(fd, backend->last_head + len, sizeof(backend->last_head) - 1 - len, 0);
+        if (n <= 0) return false;
+        len += n;
+        backend->last_head[len] = '\0';
+        head_end = strstr(backend->last_head, "\r\n\r\n");
+    }
+
+    size_t body_len = 0;
+    const char* cl = strcasestr(backend->last_head, "Content-Length:");
+    if (cl != NULL && cl < head_end) body_len = strtoul(cl + 15, NULL, 10);
+    size_t have = len - (head_end + 4 - backend->last_head);
+    head_end[4] = '\0';
+
+    char drain[256];
+    while (have < body_len) {
+        ssize_t n = recv(fd, drain, sizeof(drain), 0);
+        if (n <= 0) return false;
+        have += n;
+    }
+    return true;
+}
+
+static void* backend_serve(void* arg) {
+    Backend* backend = arg;
+    int fd = -1;
+
+    for (size_t step = 0; step < backend->num_steps; step++) {
+        if (fd < 0) {
+            fd = accept(backend->listen_fd, NULL, NULL);
+            if (fd < 0) break;
+            backend->connections++;
+        }
+
+        if (!backend_read_request(backend, fd)) {
+            close(fd);
+            fd = -1;
+            step--;
+            continue;
+        }
+        backend->requests++;
+
+        const BackendStep* s = &backend->steps[step];
+        if (s->action == BACKEND_RESPOND) {
+            send(fd, s->response, strlen(s->response), MSG_NOSIGNAL);
+        }
+        if (s->action == BACKEND_CLOSE || strstr(s->response, "Connection: close") != NULL) {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    if (fd >= 0) close(fd);
+    return NULL;
+}
+
+static void backend_start(Backend* backend, const BackendStep* steps, size_t num_steps) {
+    memset(backend, 0, sizeof(Backend));
+    backend->steps = steps;
+    backend->num_steps = num_steps;
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addr_len = sizeof(addr);
+
+    backend->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    CHECK(bind(backend->listen_fd, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+    CHECK(listen(backend->listen_fd, 8) == 0);
+    getsockname(backend->listen_fd, (struct sockaddr*)&addr, &addr_len);
+    backend->port = ntohs(addr.sin_port);
+
+    pthread_create(&backend->thread, NULL, backend_serve, backend);
+}
+
+static void backend_stop(Backend* backend) {
+    shutdown(backend->listen_fd, SHUT_RDWR);
+    pthread_join(backend->thread, NULL);
+    close(backend->listen_fd);
+}
+
+// Pushes requests, proxies "/api/*" to backend and serves them one after another, each on its fiber.
+static NetLoopback* proxy_run(Backend* backend, const char** requests, size_t num_requests) {
+    NetLoopback* lb = net_loopback_new(NULL, NULL);
+    for (size_t i = 0; i < num_requests; i++) {
+        net_loopback_push(lb, requests[i], strlen(requests[i]), 1);
+    }
+
+    CometUpstreamConfig config = COMET_UPSTREAM_DEFAULT_CONFIG;
+    config.io_timeout_ms = 2000;
+    CometUpstream* upstream = comet_upstream_new(config);
+    NetAddress addr;
+    netaddr_parse("127.0.0.1", backend->port, &addr);
+    comet_upstream_add_server(upstream, addr);
+
+    CometRouter* router = router_init_transport(&NET_LOOPBACK_TRANSPORT, lb, NULL);
+    CHECK(router != NULL);
+    CHECK(router_add_proxy(router, "/api/*", upstream) >= 0); // router owns upstream from now on
+    CHECK(router->use_fibers);
+
+    // one request at a time, so that they meet backend steps in order
+    CometFiberConfig fibers = COMET_FIBER_DEFAULT_CONFIG;
+    fibers.max_fibers = 1;
+    router_enable_fibers(router, fibers);
+    run_loopback(router, lb);
+
+    backend_stop(backend);
+    return lb;
+}
+
+static void interim_responses_are_skipped(void) {
+    static const BackendStep steps[] = {
+        {BACKEND_RESPOND, "HTTP/1.1 100 Continue\r\n\r\n"
+                          "HTTP/1.1 103 Early Hints\r\nLink: </style.css>; rel=preload\r\n\r\n"
+                          "HTTP/1.1 201 Created\r\nContent-Length: 4\r\nConnection: close\r\n\r\ndone"},
+    };
+    const char* requests[] = {"POST /api/items HTTP/1.1\r\nExpect: 100-continue\r\nContent-Length: 4\r\n\r\nitem"};
+
+    Backend backend;
+    backend_start(&backend, steps, 1);
+    NetLoopback* lb = proxy_run(&backend, requests, 1);
+
+    size_t len;
+    const char* res = net_loopback_response(lb, 0, &len);
+    CHECK(response_has_status(res, len, "HTTP/1.1 201"));
+    CHECK(response_contains(res, len, "\r\n\r\ndone"));
+    CHECK(!response_contains(res, len, "100 Continue"));
+    CHECK(!response_contains(res, len, "Early Hints"));
+
+    net_loopback_free(lb);
+}
+
+static void forwarded_for_is_merged(void) {
+    static const BackendStep steps[] = {{BACKEND_RESPOND, KEEP_ALIVE_OK}};
+    const char* requests[] = {"GET /api/x HTTP/1.1\r\nX-Forwarded-For: 10.0.0.1\r\nx-forwarded-for: 10.0.0.2 \r\n\r\n"};
+
+    Backend backend;
+    backend_start(&backend, steps, 1);
+    NetLoopback* lb = proxy_run(&backend, requests, 1);
+
+    CHECK(strstr(backend.last_head, "\r\nX-Forwarded-For: 10.0.0.1, 10.0.0.2, unix:loopback\r\n") != NULL);
+    CHECK(strcasestr(strcasestr(backend.last_head, "forwarded-for") + 1, "forwarded-for") == NULL);
+
+    net_loopback_free(lb);
+}
+
+static void idempotent_request_is_retried(void) {
+    // second request finds pooled connection dead, and gets a fresh one
+    static const BackendStep steps[] = {
+        {BACKEND_RESPOND, KEEP_ALIVE_OK},
+        {BACKEND_CLOSE, NULL},
+        {BACKEND_RESPOND, KEEP_ALIVE_OK},
+    };
+    const char* requests[] = {"GET /api/a HTTP/1.1\r\n\r\n", "GET /api/b HTTP/1.1\r\n\r\n"};
+
+    Backend backend;
+    backend_start(&backend, steps, 3);
+    NetLoopback* lb = proxy_run(&backend, requests, 2);
+
+    size_t len;
+    const char* res = net_loopback_response(lb, 1, &len);
+    CHECK(response_has_status(res, len, "HTTP/1.1 200"));
+    CHECK(backend.connections == 2);
+    CHECK(backend.requests == 3);
+
+    net_loopback_free(lb);
+}
+
+static void non_idempotent_request_is_not_retried(void) {
+    static const BackendStep steps[] = {
+        {BACKEND_RESPOND, KEEP_ALIVE_OK},
+        {BACKEND_CLOSE, NULL},
+    };
+    const char* requests[] = {"GET /api/a HTTP/1.1\r\n\r\n", "POST /api/orders HTTP/1.1\r\nContent-Length: 2\r\n\r\n{}"};
+
+    Backend backend;
+    backend_start(&backend, steps, 2);
+    NetLoopback* lb = proxy_run(&backend, requests, 2);
+
+    size_t len;
+    const char* res = net_loopback_response(lb, 1, &len);
+    CHECK(response_has_status(res, len, "HTTP/1.1 502"));
+    CHECK(backend.requests == 2);
+
+    net_loopback_free(lb);
+}
+
+static void malformed_response_is_not_retried(void) {
+    static const BackendStep steps[] = {
+        {BACKEND_RESPOND, KEEP_ALIVE_OK},
+        {BACKEND_RESPOND, "garbage\r\n\r\n"},
+    };
+    const char* requests[] = {"GET /api/a HTTP/1.1\r\n\r\n", "GET /api/b HTTP/1.1\r\n\r\n"};
+
+    Backend backend;
+    backend_start(&backend, steps, 2);
+    NetLoopback* lb = proxy_run(&backend, requests, 2);
+
+    size_t len;
+    const char* res = net_loopback_response(lb, 1, &len);
+    CHECK(response_has_status(res, len, "HTTP/1.1 502"));
+    CHECK(backend.requests == 2);
+    CHECK(backend.connections == 1);
+
+    net_loopback_free(lb);
+}
+
+static void malformed_status_is_rejected(void) {
+    // each would once parse as some status - a sign, leading space, or digits past the line
+    static const BackendStep steps[] = {
+        {BACKEND_RESPOND, "HTTP/1.1 -20 Bad\r\nContent-Length: 0\r\n\r\n"},
+        {BACKEND_RESPOND, "HTTP/1.1  20 Bad\r\nContent-Length: 0\r\n\r\n"},
+        {BACKEND_RESPOND, "HTTP/1.1 2\r\n\r\n"},
+        {BACKEND_RESPOND, "HTTP/1.1 2000 Big\r\nContent-Length: 0\r\n\r\n"},
+    };
+    const char* requests[] = {"GET /api/a HTTP/1.1\r\n\r\n", "GET /api/b HTTP/1.1\r\n\r\n",
+                              "GET /api/c HTTP/1.1\r\n\r\n", "GET /api/d HTTP/1.1\r\n\r\n"};
+
+    Backend backend;
+    backend_start(&backend, steps, 4);
+    NetLoopback* lb = proxy_run(&backend, requests, 4);
+
+    for (size_t i = 0; i < 4; i++) {
+        size_t len;
+        const char* res = net_loopback_response(lb, i, &len);
+        CHECK(response_has_status(res, len, "HTTP/1.1 502"));
+    }
+
+    net_loopback_free(lb);
+}
+
+static void chunked_request_is_refused(void) {
+    // body would never reach backend in the framing its head promises
+    const char* requests[] = {
+        "POST /api/upload HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n4\r\ndata\r\n0\r\n\r\n",
+        "POST /api/upload HTTP/1.1\r\nTransfer-Encoding: gzip\r\nContent-Length: 4\r\n\r\ndata",
+    };
+
+    Backend backend;
+    backend_start(&backend, NULL, 0);
+    NetLoopback* lb = proxy_run(&backend, requests, 2);
+
+    size_t len;
+    const char* res = net_loopback_response(lb, 0, &len);
+    CHECK(response_has_status(res, len, "HTTP/1.1 411"));
+    res = net_loopback_response(lb, 1, &len);
+    CHECK(response_has_status(res, len, "HTTP/1.1 501"));
+    CHECK(backend.requests == 0);
+
+    net_loopback_free(lb);
+}
+
+static void connection_options_are_dropped(void) {
+    static const BackendStep steps[] = {{BACKEND_RESPOND, KEEP_ALIVE_OK}};
+    const char* requests[] = {"GET /api/x HTTP/1.1\r\nConnection: keep-alive, X-Hop\r\nX-Hop: secret\r\nX-Kept: 1\r\n\r\n"};
+
+    Backend backend;
+    backend_start(&backend, steps, 1);
+    NetLoopback* lb = proxy_run(&backend, requests, 1);
+
+    CHECK(strcasestr(backend.last_head, "X-Hop") == NULL);
+    CHECK(strstr(backend.last_head, "\r\nX-Kept: 1\r\n") != NULL);
+
+    net_loopback_free(lb);
+}
+
+int main(void) {
+    comet_init(false, false);
+
+    RUN_TEST(interim_responses_are_skipped);
+    RUN_TEST(forwarded_for_is_merged);
+    RUN_TEST(idempotent_request_is_retried);
+    RUN_TEST(non_idempotent_request_is_not_retried);
+    RUN_TEST(malformed_response_is_not_retried);
+    RUN_TEST(malformed_status_is_rejected);
+    RUN_TEST(chunked_request_is_refused);
+    RUN_TEST(connection_options_are_dropped);
+
+    return TEST_RESULT();
+}
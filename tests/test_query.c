@@ -0,0 +1,114 @@
+#include "test.h"
+
+// Query strings: routes match on the path only, query is parsed lazily by comet_query_* functions.
+
+static HttpcResponse* hello_handler(void* state, HttpcRequest* req, UrlParams* params) {
+    char x[16];
+    int x_len = comet_query_get_decoded(req, "x", x, sizeof(x));
+
+    HttpcResponse* res = httpc_response_new("OK", 200);
+    CometBuffer* body = comet_buffer_new(0);
+    comet_buffer_appendf(body, "name %s x %s", params->params[0].value, x_len >= 0 ? x : "-");
+    comet_response_set_buffer(res, body);
+    return res;
+}
+
+static HttpcResponse* root_handler(void* state, HttpcRequest* req, UrlParams* params) {
+    char a[16];
+    int a_len = comet_query_get_decoded(req, "a", a, sizeof(a));
+
+    HttpcResponse* res = httpc_response_new("OK", 200);
+    CometBuffer* body = comet_buffer_new(0);
+    comet_buffer_appendf(body, "root a %s", a_len >= 0 ? a : "-");
+    comet_response_set_buffer(res, body);
+    return res;
+}
+
+static void routes_match_path_only(void) {
+    static const char HELLO[] = "GET /hello/bob?x=1 HTTP/1.1\r\nHost: test\r\nConnection: close\r\n\r\n";
+    static const char ROOT[] = "GET /?a=b HTTP/1.1\r\nHost: test\r\nConnection: close\r\n\r\n";
+    NetLoopback* lb = net_loopback_new(NULL, NULL);
+    size_t hello = net_loopback_push(lb, HELLO, sizeof(HELLO) - 1, 1);
+    size_t root = net_loopback_push(lb, ROOT, sizeof(ROOT) - 1, 1);
+
+    CometRouter* router = router_init_transport(&NET_LOOPBACK_TRANSPORT, lb, NULL);
+    CHECK(router != NULL);
+    router_add_route(router, "/hello/{name}", HTTPC_GET, hello_handler);
+    router_add_route(router, "/", HTTPC_GET, root_handler);
+    run_loopback(router, lb);
+
+    size_t len;
+    const char* res = net_loopback_response(lb, hello, &len);
+    CHECK(response_has_status(res, len, "HTTP/1.1 200"));
+    CHECK(response_contains(res, len, "name bob x 1"));
+
+    res = net_loopback_response(lb, root, &len);
+    CHECK(response_has_status(res, len, "HTTP/1.1 200"));
+    CHECK(response_contains(res, len, "root a b"));
+
+    net_loopback_free(lb);
+}
+
+static CometSlice slice(const char* str) {
+    CometSlice s = {str, strlen(str)};
+    return s;
+}
+
+static void values_are_decoded(void) {
+    char out[32];
+    CHECK(comet_query_decode(slice("a%20b+c%2fd%2F"), out, sizeof(out)) == 8);
+    CHECK(strcmp(out, "a b c/d/") == 0);
+
+    // malformed escapes are taken literally
+    CHECK(comet_query_decode(slice("100%+%zz%4"), out, sizeof(out)) == 10);
+    CHECK(strcmp(out, "100% %zz%4") == 0);
+
+    // room for terminating NUL is needed too
+    CHECK(comet_query_decode(slice("abc"), out, 3) == -1);
+    CHECK(comet_query_decode(slice("abc"), out, 4) == 3);
+    CHECK(comet_query_decode(slice(""), out, 0) == -1);
+
+    HttpcRequest req = {0};
+    req.url = "/search?q=hello+w%6Frld&a%20b=c";
+    CHECK(comet_query_get_decoded(&req, "q", out, sizeof(out)) == 11);
+    CHECK(strcmp(out, "hello world") == 0);
+    // keys are compared decoded
+    CHECK(comet_query_get_decoded(&req, "a b", out, sizeof(out)) == 1);
+    CHECK(strcmp(out, "c") == 0);
+}
+
+static void missing_and_empty_values(void) {
+    HttpcRequest req = {0};
+    req.url = "/search?empty=&flag&&q=1&";
+    char out[16];
+    CometSlice value;
+
+    CHECK(!comet_query_get(&req, "missing", &value));
+    CHECK(comet_query_get_decoded(&req, "missing", out, sizeof(out)) == -1);
+    CHECK(!comet_query_get(&req, "", &value));
+
+    CHECK(comet_query_get(&req, "empty", &value));
+    CHECK(value.len == 0);
+    CHECK(comet_query_get_decoded(&req, "empty", out, sizeof(out)) == 0);
+    CHECK(strcmp(out, "") == 0);
+
+    CHECK(comet_query_get(&req, "flag", &value));
+    CHECK(value.len == 0);
+    CHECK(comet_query_get_decoded(&req, "q", out, sizeof(out)) == 1);
+
+    // without '?' there is no query at all
+    req.url = "/search";
+    CHECK(comet_query_string(&req).len == 0);
+    CHECK(!comet_query_get(&req, "q", &value));
+    CHECK(comet_url_path_len(req.url) == 7);
+}
+
+int main(void) {
+    comet_init(false, false);
+
+    RUN_TEST(routes_match_path_only);
+    RUN_TEST(values_are_decoded);
+    RUN_TEST(missing_and_empty_values);
+
+    return TEST_RESULT();
+}
@@ -0,0 +1,107 @@
+#include "test.h"
+
+// Route table snapshots: routes switched and added while the router runs, in-flight requests keep their snapshot.
+
+static const char FEATURE[] = "GET /feature HTTP/1.1\r\nHost: test\r\nConnection: close\r\n\r\n";
+static const char TOGGLE[] = "GET /toggle HTTP/1.1\r\nHost: test\r\nConnection: close\r\n\r\n";
+
+static CometRouter* router;
+static int feature_route = -1;
+static bool feature_enabled = false;
+
+static HttpcResponse* feature_handler(void* state, HttpcRequest* req, UrlParams* params) {
+    return httpc_response_new("OK", 200);
+}
+
+static HttpcResponse* toggle_handler(void* state, HttpcRequest* req, UrlParams* params) {
+    feature_enabled = !feature_enabled;
+    CHECK(router_set_route_enabled(router, feature_route, feature_enabled));
+    return httpc_response_new("OK", 200);
+}
+
+static void route_is_toggled_between_requests(void) {
+    // sync router serves connections in the order they were pushed
+    NetLoopback* lb = net_loopback_new(NULL, NULL);
+    size_t ids[3];
+    ids[0] = net_loopback_push(lb, FEATURE, sizeof(FEATURE) - 1, 1);
+    net_loopback_push(lb, TOGGLE, sizeof(TOGGLE) - 1, 1);
+    ids[1] = net_loopback_push(lb, FEATURE, sizeof(FEATURE) - 1, 1);
+    net_loopback_push(lb, TOGGLE, sizeof(TOGGLE) - 1, 1);
+    ids[2] = net_loopback_push(lb, FEATURE, sizeof(FEATURE) - 1, 1);
+
+    router = router_init_transport(&NET_LOOPBACK_TRANSPORT, lb, NULL);
+    CHECK(router != NULL);
+    feature_enabled = false;
+    feature_route = router_add_route_disabled(router, "/feature", HTTPC_GET, feature_handler);
+    CHECK(feature_route >= 0);
+    router_add_route(router, "/toggle", HTTPC_GET, toggle_handler);
+    run_loopback(router, lb);
+
+    size_t len;
+    const char* res = net_loopback_response(lb, ids[0], &len);
+    CHECK(response_has_status(res, len, "HTTP/1.1 404"));
+    res = net_loopback_response(lb, ids[1], &len);
+    CHECK(response_has_status(res, len, "HTTP/1.1 200"));
+    res = net_loopback_response(lb, ids[2], &len);
+    CHECK(response_has_status(res, len, "HTTP/1.1 404"));
+
+    net_loopback_free(lb);
+}
+
+static CometRouteTable* old_table = NULL;
+static bool late_served = false;
+
+static HttpcResponse* late_handler(void* state, HttpcRequest* req, UrlParams* params) {
+    late_served = true;
+    return httpc_response_new("OK", 200);
+}
+
+static HttpcRequest* add_route_middleware(void* state, HttpcRequest* req, UrlParams* params) {
+    old_table = router->routes;
+    CHECK(router_add_route(router, "/late", HTTPC_GET, late_handler) >= 0);
+    CHECK(router->routes != old_table);
+
+    // other connections are served meanwhile, this one still holds the table it was dispatched with.
+    // Idle accept loop wakes up every 100ms to reclaim replaced tables, sleep through one such wake up
+    comet_sleep(150);
+    return req;
+}
+
+static HttpcResponse* slow_handler(void* state, HttpcRequest* req, UrlParams* params) {
+    CHECK(late_served);
+    CHECK(old_table->refs == 1);
+    return httpc_response_new("OK", 200);
+}
+
+static void in_flight_request_keeps_old_table(void) {
+    static const char SLOW[] = "GET /slow HTTP/1.1\r\nHost: test\r\nConnection: close\r\n\r\n";
+    static const char LATE[] = "GET /late HTTP/1.1\r\nHost: test\r\nConnection: close\r\n\r\n";
+    NetLoopback* lb = net_loopback_new(NULL, NULL);
+    size_t slow = net_loopback_push(lb, SLOW, sizeof(SLOW) - 1, 1);
+    size_t late = net_loopback_push(lb, LATE, sizeof(LATE) - 1, 1);
+
+    router = router_init_transport(&NET_LOOPBACK_TRANSPORT, lb, NULL);
+    CHECK(router != NULL);
+    CHECK(router_enable_fibers(router, COMET_FIBER_DEFAULT_CONFIG));
+    int route = router_add_route(router, "/slow", HTTPC_GET, slow_handler);
+    router_add_middleware(router, route, add_route_middleware);
+    late_served = false;
+    run_loopback(router, lb);
+
+    size_t len;
+    const char* res = net_loopback_response(lb, slow, &len);
+    CHECK(response_has_status(res, len, "HTTP/1.1 200"));
+    res = net_loopback_response(lb, late, &len);
+    CHECK(response_has_status(res, len, "HTTP/1.1 200"));
+
+    net_loopback_free(lb);
+}
+
+int main(void) {
+    comet_init(false, false);
+
+    RUN_TEST(route_is_toggled_between_requests);
+    RUN_TEST(in_flight_request_keeps_old_table);
+
+    return TEST_RESULT();
+}
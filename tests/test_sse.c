@@ -0,0 +1,149 @@
+#include "test.h"
+
+// Event streams over loopback: client that hung up is noticed through the transport, and its topic goes away with it.
+
+static const char SUBSCRIBE[] = "GET /events/news HTTP/1.1\r\nHost: test\r\nAccept: text/event-stream\r\n\r\n";
+
+static void stream_ends_when_client_leaves(void) {
+    NetLoopback* lb = net_loopback_new(NULL, NULL);
+    size_t id = net_loopback_push(lb, SUBSCRIBE, sizeof(SUBSCRIBE) - 1, 1);
+
+    CometSseConfig config = COMET_SSE_DEFAULT_CONFIG;
+    config.keepalive_ms = 10;
+    CometRouter* router = router_init_transport(&NET_LOOPBACK_TRANSPORT, lb, NULL);
+    CHECK(router != NULL);
+    router_add_sse(router, "/events/{topic}", comet_sse_hub_new(config));
+    run_loopback(router, lb);
+
+    size_t len;
+    const char* res = net_loopback_response(lb, id, &len);
+    CHECK(response_has_status(res, len, "HTTP/1.1 200"));
+    CHECK(response_contains(res, len, "Content-Type: text/event-stream"));
+
+    net_loopback_free(lb);
+}
+
+static void topic_is_freed_with_last_subscriber(void) {
+    CometSseConfig config = COMET_SSE_DEFAULT_CONFIG;
+    config.keepalive_ms = 10;
+    CometSseHub* hub = comet_sse_hub_new(config);
+
+    NetLoopback* lb = net_loopback_new(NULL, NULL);
+    net_loopback_push(lb, SUBSCRIBE, sizeof(SUBSCRIBE) - 1, 3);
+
+    const char* topics[] = {"news", "sport", "news"};
+    for (size_t i = 0; i < 3; i++) {
+        NetConnection conn = {0};
+        conn.transport = &NET_LOOPBACK_TRANSPORT;
+        CHECK(NET_LOOPBACK_TRANSPORT.accept(lb, &conn));
+
+        char request[sizeof(SUBSCRIBE)];
+        while (netconn_recv(&conn, request, sizeof(request)) > 0) {}
+
+        sse_run_session(hub, &conn, topics[i]);
+        CHECK(hub->num_topics == 0);
+        CHECK(comet_sse_subscriber_count(hub, topics[i]) == 0);
+        netconn_close(&conn);
+    }
+
+    comet_sse_hub_free(hub);
+    net_loopback_free(lb);
+}
+
+typedef struct {
+    CometSseHub* hub;
+    NetConnection* conn;
+    size_t delivered;
+    size_t rejected;
+} Publish;
+
+static void session_fiber(void* arg) {
+    Publish* pub = arg;
+    sse_run_session(pub->hub, pub->conn, "news");
+}
+
+static void publish_fiber(void* arg) {
+    Publish* pub = arg;
+    pub->delivered = comet_sse_publish(pub->hub, "news", NULL, "a\rretry: 1\r\nb\nc");
+    pub->rejected = comet_sse_publish(pub->hub, "news", "x\nid: 1", "d");
+
+    // reading the rest of the script hangs up the client
+    char request[sizeof(SUBSCRIBE)];
+    while (netconn_recv(pub->conn, request, sizeof(request)) > 0) {}
+}
+
+static void line_breaks_do_not_inject_fields(void) {
+    CometSseConfig config = COMET_SSE_DEFAULT_CONFIG;
+    config.keepalive_ms = 10;
+    CometSseHub* hub = comet_sse_hub_new(config);
+
+    NetLoopback* lb = net_loopback_new(NULL, NULL);
+    size_t id = net_loopback_push(lb, SUBSCRIBE, sizeof(SUBSCRIBE) - 1, 1);
+    NetConnection conn = {0};
+    conn.transport = &NET_LOOPBACK_TRANSPORT;
+    CHECK(NET_LOOPBACK_TRANSPORT.accept(lb, &conn));
+
+    Publish pub = {hub, &conn, 0, 0};
+    CHECK(fiber_scheduler_init(COMET_FIBER_DEFAULT_CONFIG));
+    CHECK(fiber_spawn(session_fiber, &pub));
+    CHECK(fiber_spawn(publish_fiber, &pub));
+    while (fiber_active_count() > 0) {
+        fiber_scheduler_run_once(10);
+    }
+    fiber_scheduler_deinit();
+    netconn_close(&conn);
+
+    CHECK(pub.delivered == 1);
+    CHECK(pub.rejected == 0);
+    size_t len;
+    const char* res = net_loopback_response(lb, id, &len);
+    // CR, CRLF and LF each start a new data line
+    CHECK(response_contains(res, len, "\ndata: a\ndata: retry: 1\ndata: b\ndata: c\n\n"));
+    CHECK(!response_contains(res, len, "\rretry"));
+    CHECK(!response_contains(res, len, "\nid: 1"));
+
+    comet_sse_hub_free(hub);
+    net_loopback_free(lb);
+}
+
+static CometRouter* running_router;
+static CometSseHub* late_hub;
+static int late_route = 0;
+
+static HttpcResponse* add_late_route(void* state, HttpcRequest* req, UrlParams* params) {
+    late_route = router_add_sse(running_router, "/events/{topic}", late_hub);
+    return httpc_response_new("OK", 200);
+}
+
+static void route_is_not_added_to_running_sync_router(void) {
+    // event streams on the sync loop would hold up every other client
+    static const char ADD[] = "GET /add HTTP/1.1\r\nHost: test\r\nConnection: close\r\n\r\n";
+    NetLoopback* lb = net_loopback_new(NULL, NULL);
+    net_loopback_push(lb, ADD, sizeof(ADD) - 1, 1);
+    size_t late = net_loopback_push(lb, SUBSCRIBE, sizeof(SUBSCRIBE) - 1, 1);
+
+    late_hub = comet_sse_hub_new(COMET_SSE_DEFAULT_CONFIG);
+    running_router = router_init_transport(&NET_LOOPBACK_TRANSPORT, lb, NULL);
+    CHECK(running_router != NULL);
+    router_add_route(running_router, "/add", HTTPC_GET, add_late_route);
+    run_loopback(running_router, lb);
+
+    CHECK(late_route == -1);
+    size_t len;
+    const char* res = net_loopback_response(lb, late, &len);
+    CHECK(!response_contains(res, len, "text/event-stream"));
+
+    comet_sse_hub_free(late_hub);     // not taken by the router
+    net_loopback_free(lb);
+}
+
+int main(void) {
+    comet_init(false, false);
+
+    RUN_TEST(stream_ends_when_client_leaves);
+    RUN_TEST(topic_is_freed_with_last_subscriber);
+    RUN_TEST(route_is_not_added_to_running_sync_router);
+    RUN_TEST(line_breaks_do_not_inject_fields);
+
+    return TEST_RESULT();
+}
@@ -0,0 +1,57 @@
+#include "test.h"
+
+// Tracing over loopback: phases and the url that ends up in the trace.
+
+static char traced_url[64];
+static int traced_status = 0;
+static size_t traces = 0;
+
+static void on_trace(void* state, const CometTrace* trace) {
+    traces++;
+    traced_status = trace->status;
+    snprintf(traced_url, sizeof(traced_url), "%s", trace->url ? trace->url : "");
+}
+
+static HttpcResponse* ok_handler(void* state, HttpcRequest* req, UrlParams* params) {
+    return httpc_response_new("OK", 200);
+}
+
+// replaces request with a rewritten one and frees the original, as middleware is allowed to
+static HttpcRequest* rewrite_middleware(void* state, HttpcRequest* req, UrlParams* params) {
+    static const char REWRITTEN[] = "GET /rewritten HTTP/1.1\r\nHost: test\r\n\r\n";
+    HttpcRequest* new_req = httpc_request_from_string(REWRITTEN, sizeof(REWRITTEN) - 1);
+    httpc_request_free(req);
+    return new_req;
+}
+
+static void url_survives_replaced_request(void) {
+    static const char REQUEST[] = "GET /original HTTP/1.1\r\nHost: test\r\n\r\n";
+    NetLoopback* lb = net_loopback_new(NULL, NULL);
+    net_loopback_push(lb, REQUEST, sizeof(REQUEST) - 1, 1);
+
+    CometRouter* router = router_init_transport(&NET_LOOPBACK_TRANSPORT, lb, NULL);
+    CHECK(router != NULL);
+    CometTraceConfig tracing = COMET_TRACE_DEFAULT_CONFIG;
+    tracing.sample_rate = 1;
+    tracing.slow_threshold_ms = 0;
+    tracing.on_trace = on_trace;
+    router_enable_tracing(router, tracing);
+
+    int route = router_add_route(router, "/original", HTTPC_GET, ok_handler);
+    router_add_middleware(router, route, rewrite_middleware);
+    run_loopback(router, lb);
+
+    CHECK(traces == 1);
+    CHECK(traced_status == 200);
+    CHECK(strcmp(traced_url, "/rewritten") == 0);
+
+    net_loopback_free(lb);
+}
+
+int main(void) {
+    comet_init(false, false);
+
+    RUN_TEST(url_survives_replaced_request);
+
+    return TEST_RESULT();
+}
@@ -0,0 +1,250 @@
+#include "test.h"
+
+#include <stdint.h>
+
+// WebSocket framing limits over loopback: handshake, then client frames with crafted lengths.
+
+#define MAX_MESSAGE_SIZE 64
+
+static const char HANDSHAKE[] =
+    "GET /ws HTTP/1.1\r\n"
+    "Host: test\r\n"
+    "Upgrade: websocket\r\n"
+    "Connection: Upgrade\r\n"
+    "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+    "Sec-WebSocket-Version: 13\r\n"
+    "\r\n";
+
+static size_t messages = 0;
+static size_t last_message_len = 0;
+
+static void on_message(CometWebSocket* ws, const uint8_t* data, size_t len, bool is_text) {
+    messages++;
+    last_message_len = len;
+}
+
+typedef struct {
+    uint8_t data[512];
+    size_t len;
+} Script;
+
+static void script_init(Script* script) {
+    memcpy(script->data, HANDSHAKE, sizeof(HANDSHAKE) - 1);
+    script->len = sizeof(HANDSHAKE) - 1;
+}
+
+// Appends client frame with all-zero mask. Length is written as given, payload only up to payload_len.
+static void script_frame(Script* script, uint8_t first_byte, uint64_t declared_len, size_t payload_len) {
+    uint8_t* p = script->data + script->len;
+    *p++ = first_byte;
+
+    if (declared_len < 126) {
+        *p++ = 0x80 | (uint8_t)declared_len;
+    } else if (declared_len <= 0xFFFF) {
+        *p++ = 0x80 | 126;
+        *p++ = (uint8_t)(declared_len >> 8);
+        *p++ = (uint8_t)declared_len;
+    } else {
+        *p++ = 0x80 | 127;
+        for (int i = 7; i >= 0; i--) *p++ = (uint8_t)(declared_len >> (i * 8));
+    }
+
+    memset(p, 0, 4);
+    p += 4;
+    memset(p, 'a', payload_len);
+    p += payload_len;
+
+    script->len = p - script->data;
+}
+
+// Same as script_frame, with given payload.
+static void script_payload(Script* script, uint8_t first_byte, const char* payload, size_t len) {
+    script_frame(script, first_byte, len, len);
+    memcpy(script->data + script->len - len, payload, len);
+}
+
+// Runs script on a websocket route and returns what server sent back, kept in lb.
+static const char* ws_run(NetLoopback* lb, const Script* script, size_t* len) {
+    messages = 0;
+    last_message_len = 0;
+    size_t id = net_loopback_push(lb, script->data, script->len, 1);
+
+    CometRouter* router = router_init_transport(&NET_LOOPBACK_TRANSPORT, lb, NULL);
+    CHECK(router != NULL);
+    CometWebSocketConfig config = COMET_WEBSOCKET_DEFAULT_CONFIG;
+    config.on_message = on_message;
+    config.max_message_size = MAX_MESSAGE_SIZE;
+    router_add_websocket(router, "/ws", config);
+    run_loopback(router, lb);
+
+    return net_loopback_response(lb, id, len);
+}
+
+// Whether server sent close frame with code.
+static bool sent_close(const char* response, size_t len, uint16_t code) {
+    char frame[4] = {(char)0x88, 2, (char)(code >> 8), (char)(code & 0xFF)};
+    for (size_t i = 0; response != NULL && i + 4 <= len; i++) {
+        if (memcmp(response + i, frame, 4) == 0) return true;
+    }
+    return false;
+}
+
+static void fragments_within_limit_are_delivered(void) {
+    Script script;
+    script_init(&script);
+    script_frame(&script, 0x01, 40, 40);            // text, not final
+    script_frame(&script, 0x80, 24, 24);            // final continuation, exactly at the limit
+
+    NetLoopback* lb = net_loopback_new(NULL, NULL);
+    size_t len;
+    const char* res = ws_run(lb, &script, &len);
+    CHECK(response_has_status(res, len, "HTTP/1.1 101"));
+    CHECK(messages == 1);
+    CHECK(last_message_len == MAX_MESSAGE_SIZE);
+    net_loopback_free(lb);
+}
+
+static void oversized_frame_is_rejected(void) {
+    Script script;
+    script_init(&script);
+    script_frame(&script, 0x81, MAX_MESSAGE_SIZE + 1, MAX_MESSAGE_SIZE + 1);
+
+    NetLoopback* lb = net_loopback_new(NULL, NULL);
+    size_t len;
+    const char* res = ws_run(lb, &script, &len);
+    CHECK(sent_close(res, len, COMET_WS_CLOSE_TOO_BIG));
+    CHECK(messages == 0);
+    net_loopback_free(lb);
+}
+
+static void oversized_continuation_is_rejected(void) {
+    Script script;
+    script_init(&script);
+    script_frame(&script, 0x01, 40, 40);
+    script_frame(&script, 0x80, 25, 25);            // one byte over the limit in total
+
+    NetLoopback* lb = net_loopback_new(NULL, NULL);
+    size_t len;
+    const char* res = ws_run(lb, &script, &len);
+    CHECK(sent_close(res, len, COMET_WS_CLOSE_TOO_BIG));
+    CHECK(messages == 0);
+    net_loopback_free(lb);
+}
+
+static void wrapping_continuation_is_rejected(void) {
+    // message_len + payload_len wraps around to 2 - must not reach realloc
+    Script script;
+    script_init(&script);
+    script_frame(&script, 0x01, 10, 10);
+    script_frame(&script, 0x80, UINT64_MAX - 7, 0);
+
+    NetLoopback* lb = net_loopback_new(NULL, NULL);
+    size_t len;
+    const char* res = ws_run(lb, &script, &len);
+    CHECK(sent_close(res, len, COMET_WS_CLOSE_PROTOCOL_ERROR));
+    CHECK(messages == 0);
+    net_loopback_free(lb);
+}
+
+static void huge_length_is_rejected(void) {
+    // most significant bit clear, but far over the limit
+    Script script;
+    script_init(&script);
+    script_frame(&script, 0x01, 10, 10);
+    script_frame(&script, 0x80, INT64_MAX, 0);
+
+    NetLoopback* lb = net_loopback_new(NULL, NULL);
+    size_t len;
+    const char* res = ws_run(lb, &script, &len);
+    CHECK(sent_close(res, len, COMET_WS_CLOSE_TOO_BIG));
+    CHECK(messages == 0);
+    net_loopback_free(lb);
+}
+
+static void invalid_utf8_text_is_rejected(void) {
+    static const char* CASES[] = {
+        "\xff",
+        "\xc0\xaf",                   // overlong '/'
+        "\xed\xa0\x80",               // surrogate
+        "\xf4\x90\x80\x80",           // past U+10FFFF
+        "abcdefgh\xe2\x82",           // cut short after a run of ASCII
+    };
+
+    for (size_t i = 0; i < sizeof(CASES) / sizeof(CASES[0]); i++) {
+        Script script;
+        script_init(&script);
+        script_payload(&script, 0x81, CASES[i], strlen(CASES[i]));
+
+        NetLoopback* lb = net_loopback_new(NULL, NULL);
+        size_t len;
+        const char* res = ws_run(lb, &script, &len);
+        if (!sent_close(res, len, COMET_WS_CLOSE_INVALID_DATA) || messages != 0) {
+            fprintf(stderr, "case %zu was not rejected\n", i);
+            CHECK(false);
+        }
+        net_loopback_free(lb);
+    }
+}
+
+static void character_split_across_fragments_is_delivered(void) {
+    Script script;
+    script_init(&script);
+    script_payload(&script, 0x01, "\xe2\x82", 2);     // euro sign, split between fragments
+    script_payload(&script, 0x80, "\xac", 1);
+    script_payload(&script, 0x82, "\xff", 1);          // binary isn't checked
+
+    NetLoopback* lb = net_loopback_new(NULL, NULL);
+    size_t len;
+    const char* res = ws_run(lb, &script, &len);
+    CHECK(!sent_close(res, len, COMET_WS_CLOSE_INVALID_DATA));
+    CHECK(messages == 2);
+    net_loopback_free(lb);
+}
+
+static CometRouter* running_router;
+static int late_route = 0;
+
+static HttpcResponse* add_late_route(void* state, HttpcRequest* req, UrlParams* params) {
+    CometWebSocketConfig config = COMET_WEBSOCKET_DEFAULT_CONFIG;
+    config.on_message = on_message;
+    late_route = router_add_websocket(running_router, "/late", config);
+    return httpc_response_new("OK", 200);
+}
+
+static void route_is_not_added_to_running_sync_router(void) {
+    // WebSocket sessions on the sync loop would hold up every other client
+    static const char ADD[] = "GET /add HTTP/1.1\r\nHost: test\r\nConnection: close\r\n\r\n";
+    NetLoopback* lb = net_loopback_new(NULL, NULL);
+    net_loopback_push(lb, ADD, sizeof(ADD) - 1, 1);
+    // same handshake, on the route that should not exist
+    static const char LATE[] = "GET /late HTTP/1.1\r\nHost: test\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                               "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n";
+    size_t late = net_loopback_push(lb, LATE, sizeof(LATE) - 1, 1);
+
+    running_router = router_init_transport(&NET_LOOPBACK_TRANSPORT, lb, NULL);
+    CHECK(running_router != NULL);
+    router_add_route(running_router, "/add", HTTPC_GET, add_late_route);
+    run_loopback(running_router, lb);
+
+    CHECK(late_route == -1);
+    size_t len;
+    const char* res = net_loopback_response(lb, late, &len);
+    CHECK(!response_has_status(res, len, "HTTP/1.1 101"));
+
+    net_loopback_free(lb);
+}
+
+int main(void) {
+    comet_init(false, false);
+
+    RUN_TEST(fragments_within_limit_are_delivered);
+    RUN_TEST(oversized_frame_is_rejected);
+    RUN_TEST(oversized_continuation_is_rejected);
+    RUN_TEST(wrapping_continuation_is_rejected);
+    RUN_TEST(huge_length_is_rejected);
+    RUN_TEST(invalid_utf8_text_is_rejected);
+    RUN_TEST(character_split_across_fragments_is_delivered);
+    RUN_TEST(route_is_not_added_to_running_sync_router);
+
+    return TEST_RESULT();
+}